@@ -40,7 +40,11 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <chrono>
 #include <limits>
+#include <tuple>
+#include <type_traits>
 #include <vector>
 
 #if (__cplusplus >= 201703L) && !(defined LBVH_NO_THREADS)
@@ -48,6 +52,10 @@
 #endif
 
 #ifndef LBVH_NO_THREADS
+#include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <thread>
 #endif
 
@@ -55,6 +63,12 @@
 #include <intrin.h>
 #endif
 
+#ifdef LBVH_ENABLE_PERF_COUNTERS
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #include <cmath>
 #include <cstdint>
 
@@ -77,17 +91,122 @@ struct work_division final {
   size_type max;
 };
 
+//! \brief Accumulates how long each worker
+//! of a scheduler spends working on tasks.
+//!
+//! A scheduler that is given an instance of this class
+//! times every worker of every task it runs. A worker is
+//! considered idle from the moment it finishes its part of a
+//! task until the slowest worker of that task finishes.
+class load_stats final {
+  //! The number of seconds each worker spent working.
+  std::vector<double> busy;
+  //! The number of seconds from the start to the end of each task, summed.
+  double wall = 0;
+public:
+  //! Clears all measurements.
+  void reset() noexcept {
+    std::fill(busy.begin(), busy.end(), 0.0);
+    wall = 0;
+  }
+  //! Makes room for a certain number of workers.
+  //! This is called by the scheduler before a task is started.
+  //!
+  //! \param workers The number of workers the scheduler runs a task on.
+  void reserve_workers(size_type workers) {
+    if (busy.size() < workers) {
+      busy.resize(workers, 0.0);
+    }
+  }
+  //! Adds to the time a worker spent on a task.
+  //! Each worker may call this concurrently,
+  //! since they each use their own entry.
+  //!
+  //! \param worker The index of the worker, as given in its @ref work_division.
+  //!
+  //! \param seconds The number of seconds the worker spent on the task.
+  inline void add_busy(size_type worker, double seconds) noexcept {
+    busy[worker] += seconds;
+  }
+  //! Adds to the total time spent on tasks.
+  //!
+  //! \param seconds The number of seconds from the start
+  //! of a task to the moment all of its workers finished.
+  inline void add_wall(double seconds) noexcept {
+    wall += seconds;
+  }
+  //! Indicates the number of workers that have been measured.
+  inline size_type worker_count() const noexcept {
+    return busy.size();
+  }
+  //! Indicates the number of seconds spent in tasks, from start to end.
+  inline double wall_time() const noexcept {
+    return wall;
+  }
+  //! Indicates how long a worker was busy.
+  inline double busy_time(size_type worker) const noexcept {
+    return busy[worker];
+  }
+  //! Indicates how long a worker was waiting for other workers to finish.
+  inline double idle_time(size_type worker) const noexcept {
+    return std::max(wall - busy[worker], 0.0);
+  }
+  //! Indicates the busy time of the slowest worker.
+  double max_busy_time() const noexcept {
+    return busy.empty() ? 0.0 : *std::max_element(busy.begin(), busy.end());
+  }
+  //! Indicates the busy time of the average worker.
+  double mean_busy_time() const noexcept {
+
+    if (busy.empty()) {
+      return 0.0;
+    }
+
+    double sum = 0;
+
+    for (auto b : busy) {
+      sum += b;
+    }
+
+    return sum / double(busy.size());
+  }
+};
+
 //! \brief This is a task scheduler that schedules
 //! only the current thread for work. It's
 //! a placeholder if the user doesn't specifier
 //! their own thread pool library.
 class single_thread_scheduler final {
+  //! If not null, receives the time spent on each task.
+  load_stats* stats = nullptr;
 public:
   //! Issues a new task to be performed.
   //! In this class, the task immediately is called in the current thread.
   template <typename task_type, typename... arg_types>
   inline void operator () (task_type task, arg_types... args) noexcept {
+
+    if (!stats) {
+      task(work_division { 0, 1 }, args...);
+      return;
+    }
+
+    stats->reserve_workers(1);
+
+    auto start = std::chrono::steady_clock::now();
+
     task(work_division { 0, 1 }, args...);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    stats->add_busy(0, elapsed.count());
+    stats->add_wall(elapsed.count());
+  }
+  //! Measures the time spent on each task.
+  //!
+  //! \param s The object to accumulate the measurements into.
+  //! This may be null, in which case tasks are not measured.
+  inline void set_load_stats(load_stats* s) noexcept {
+    stats = s;
   }
   //! Indicates the maximum number of threads
   //! to be invoked at a time.
@@ -112,6 +231,8 @@ public:
 class naive_thread_scheduler final {
   //! The maximum number of threads to run.
   size_type max_thread_count;
+  //! If not null, receives the time each thread spends on a task.
+  load_stats* stats = nullptr;
 public:
   //! Constructs a new fake task scheduler.
   //! \param max_threads_ The maximum number of threads to run.
@@ -123,6 +244,52 @@ public:
   template <typename task_type, typename... arg_types>
   void operator () (task_type task, arg_types... args) {
 
+    if (!stats) {
+      run_task(task, args...);
+      return;
+    }
+
+    stats->reserve_workers(max_thread_count);
+
+    auto start = std::chrono::steady_clock::now();
+
+    auto timed_task = [task, s = stats](const work_division& div, arg_types... a) mutable {
+
+      auto task_start = std::chrono::steady_clock::now();
+
+      task(div, a...);
+
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - task_start;
+
+      s->add_busy(div.idx, elapsed.count());
+    };
+
+    run_task(timed_task, args...);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    stats->add_wall(elapsed.count());
+  }
+  //! Measures the time each thread spends on each task.
+  //!
+  //! \param s The object to accumulate the measurements into.
+  //! This may be null, in which case tasks are not measured.
+  inline void set_load_stats(load_stats* s) noexcept {
+    stats = s;
+  }
+  //! Indicates to the library the maximum number of threads
+  //! that may be invoked at a time. This is useful for determining
+  //! how much memory to allocate for some functions.
+  //!
+  //! \return The max number of threads that may be invoked at a time.
+  inline size_type max_threads() const noexcept {
+    return max_thread_count;
+  }
+protected:
+  //! Runs a task on all threads and waits for them to finish.
+  template <typename task_type, typename... arg_types>
+  void run_task(task_type& task, arg_types&... args) {
+
     std::vector<std::thread> threads;
 
     for (size_type i = 0; i < max_thread_count - 1; i++) {
@@ -138,14 +305,6 @@ public:
       th.join();
     }
   }
-  //! Indicates to the library the maximum number of threads
-  //! that may be invoked at a time. This is useful for determining
-  //! how much memory to allocate for some functions.
-  //!
-  //! \return The max number of threads that may be invoked at a time.
-  inline size_type max_threads() const noexcept {
-    return max_thread_count;
-  }
 };
 
 //! A type definition that uses the
@@ -202,6 +361,17 @@ struct aabb final {
   vec3<scalar_type> max;
 };
 
+//! Represents a single axis-aligned bounding rectangle.
+//! This is the box type of a 2D BVH.
+//! \tparam scalar_type The scalar type used for vector values.
+template <typename scalar_type>
+struct aabb2 final {
+  //! The minimum points of the rectangle.
+  vec2<scalar_type> min;
+  //! The maximum points of the rectangle.
+  vec2<scalar_type> max;
+};
+
 //! An internal node within the BVH.
 //! Points to two other nodes, which
 //! may either be leaf nodes or other internal nodes.
@@ -240,13 +410,52 @@ struct alignas(sizeof(scalar_type) * 8) node final {
   }
 };
 
+//! An internal node within a 2D BVH.
+//! It has the same layout as @ref node, but with a 2D box,
+//! so it takes two thirds of the space of a 3D node.
+//!
+//! \tparam scalar_type The type used for the bounding
+//! rectangle vectors of the node.
+template <typename scalar_type>
+struct node2 final {
+  //! The type definition for a node index.
+  using index_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+  //! The rectangle that contains the node.
+  aabb2<scalar_type> box;
+  //! The index to the left node.
+  //! The highest bit may be set to
+  //! one if this is suppose to point to a leaf.
+  index_type left;
+  //! The index to the right node.
+  //! The highest bit may be set to
+  //! one if this is suppose to point to a leaf.
+  index_type right;
+  //! Accesses the left index as a leaf index.
+  inline constexpr index_type left_leaf_index() const noexcept {
+    return left & (highest_bit<index_type>() - 1);
+  }
+  //! Accesses the right index as a leaf index.
+  inline constexpr index_type right_leaf_index() const noexcept {
+    return right & (highest_bit<index_type>() - 1);
+  }
+  //! Indicates if the left index points to a leaf.
+  inline constexpr bool left_is_leaf() const noexcept {
+    return left & highest_bit<index_type>();
+  }
+  //! Indicates if the right index points to a leaf.
+  inline constexpr bool right_is_leaf() const noexcept {
+    return right & highest_bit<index_type>();
+  }
+};
+
 //! This is the structure for the LBVH.
 //! \tparam float_type The floating point type used for box vectors.
-template <typename float_type>
+//! \tparam bvh_node The type of the internal nodes.
+template <typename float_type, typename bvh_node = node<float_type>>
 class bvh final {
 public:
   //! A type definition for BVH nodes.
-  using node_type = node<float_type>;
+  using node_type = bvh_node;
   //! A type definition for a BVH node vector.
   using node_vec = std::vector<node_type>;
   //! Constructs a BVH from prebuilt internal nodes.
@@ -276,1593 +485,8595 @@ public:
   inline const node_type& operator [] (size_type index) const noexcept {
     return nodes[index];
   }
+  //! Accesses a pointer to the node array.
+  //! This is used to refit the boxes of the BVH.
+  inline node_type* data() noexcept {
+    return nodes.data();
+  }
+  //! Accesses a pointer to the node array.
+  inline const node_type* data() const noexcept {
+    return nodes.data();
+  }
 private:
   //! The internal nodes of the BVH.
   node_vec nodes;
 };
 
-//! \brief This class is used for the constructing of BVHs.
-//! It is meant to be the first class declared by anyone using the library.
-//! It takes a set of primitives, as well as a function object to calculate their bounding boxes,
-//! and generates an LBVH from them. The only function required to be implemented is the function
-//! object that converts primitives to bounding boxes.
+//! A BVH over planar primitives, built by @ref builder2.
+//! \tparam scalar_type The scalar type used for rectangle vectors.
+template <typename scalar_type>
+using bvh2 = bvh<scalar_type, node2<scalar_type>>;
+
+//! \brief Enumerates the phases of a BVH build,
+//! in the order that they are run by @ref builder.
+enum class build_phase : size_type {
+  //! The union of all primitive centroids is computed.
+  centroid_bounds,
+  //! The Morton code of each primitive is computed.
+  morton_curve,
+  //! The Morton curve is sorted.
+  sort,
+  //! The internal nodes are linked together.
+  hierarchy,
+  //! The node boxes are fit to their primitives.
+  fit_boxes
+};
+
+//! Indicates the number of phases in a BVH build.
+inline constexpr size_type build_phase_count() noexcept {
+  return 5;
+}
+
+//! Gets a human readable name of a build phase.
 //!
-//! \tparam scalar_type The scalar type to use for the box vectors.
+//! \return A null-terminated name of @p phase.
+inline constexpr const char* to_string(build_phase phase) noexcept {
+  switch (phase) {
+    case build_phase::centroid_bounds: return "centroid bounds";
+    case build_phase::morton_curve: return "morton curve";
+    case build_phase::sort: return "sort";
+    case build_phase::hierarchy: return "hierarchy";
+    case build_phase::fit_boxes: return "fit boxes";
+  }
+  return "";
+}
+
+//! \brief A build observer that ignores all build phases.
+//! This is used by the builder when the caller doesn't pass an observer.
 //!
-//! \tparam task_scheduler The scheduler type to use for construction tasks.
-//! By default, this is the type of scheduler provided by the library.
-template <typename scalar_type, typename task_scheduler = default_scheduler>
-class builder final {
-  //! Is passed the various work items during BVH construction.
-  task_scheduler scheduler;
+//! An observer is any object with the same two functions as
+//! this class. They are called by the builder around each phase.
+class null_build_observer final {
 public:
-  //! A type definition for a BVH.
-  using bvh_type = bvh<scalar_type>;
-  //! A type definition for a BVH node.
-  using node_type = node<scalar_type>;
-  //! A type definition for a node vector.
-  using node_vec = std::vector<node_type>;
-  //! Constructs a new BVH builder.
-  //! \param scheduler_ The task scheduler to distribute the work with.
-  builder(task_scheduler scheduler_ = task_scheduler())
-    : scheduler(scheduler_) {}
-  //! Builds a BVH from an array of primitives.
-  //!
-  //! \param primitives The array of primitives to build the BVH for.
-  //!
-  //! \param count The number of primitives in the primitive array.
-  //!
-  //! \param converter The primitive to bounding box converter.
-  //! This should be implemented by the caller as a function object
-  //! that takes a single primitive and returns an instance of @ref aabb
-  //! that represents the bounding box for that primitive.
-  //!
-  //! \return A BVH built for the specified primitives.
-  template <typename primitive, typename aabb_converter>
-  bvh_type operator () (const primitive* primitives, size_type count, const aabb_converter& converter);
-protected:
-  //! Fits BVH nodes with their appropriate boxes.
-  template <typename primitive, typename aabb_converter>
-  void fit_boxes(node_vec& nodes, const primitive* primitives, const aabb_converter& converter);
+  //! Called before a build phase is started.
+  inline void begin(build_phase) noexcept {}
+  //! Called after a build phase is completed.
+  inline void end(build_phase) noexcept {}
 };
 
-//! \brief This structure contains basic information
-//! regarding a ray intersection with a BVH. It's not
-//! required to be used. Other intersection structures
-//! can be used as long as they implement the '<' comparison
-//! operator (based on distance) and boolean operator (indicates
-//! whether or not a hit occurred.
-template <typename scalar_type>
-struct intersection final {
-  //! A type definition for an index, used for tracking the intersected primitive.
-  using index = typename associated_types<sizeof(scalar_type)>::uint_type;
-  //! The distance factor between the ray and primitive.
-  scalar_type distance = std::numeric_limits<scalar_type>::infinity();
-  //! The normal at the point of intersection.
-  vec3<scalar_type> normal {};
-  //! The UV coordinates at the point of intersection.
-  vec2<scalar_type> uv {};
-  //! The index of the primitive that the intersection was made with.
-  index primitive = highest_bit<index>();
-  //! Indicates whether or not an intersection was made.
-  //!
-  //! \return True if this intersection has valid intersection data.
-  //! False if it does not and no intersection was made.
-  operator bool () const noexcept {
-    return distance < std::numeric_limits<scalar_type>::infinity();
-  }
-  //! Compares two intersection instances.
-  //!
-  //! \return True if @p a has a distance factor less than @p b.
-  bool operator < (const intersection<scalar_type>& other) const noexcept {
-    return (distance < other.distance);
+//! \brief Contains the hardware event counts
+//! of a measured region of code.
+struct perf_counts final {
+  //! The number of CPU cycles.
+  std::uint64_t cycles = 0;
+  //! The number of retired instructions.
+  std::uint64_t instructions = 0;
+  //! The number of last level cache misses.
+  std::uint64_t llc_misses = 0;
+  //! The number of mispredicted branches.
+  std::uint64_t branch_misses = 0;
+  //! The number of data TLB misses.
+  std::uint64_t dtlb_misses = 0;
+  //! Whether or not the counts were measured.
+  //! This is false if hardware counters are disabled
+  //! or not supported by the system.
+  bool available = false;
+  //! Calculates the number of instructions per cycle.
+  inline double ipc() const noexcept {
+    return cycles ? double(instructions) / double(cycles) : 0.0;
   }
-  //! Compares the intersection distance with another distance.
-  //!
-  //! \return True if this intersection is less than @p t.
-  bool operator < (scalar_type t) const noexcept {
-    return distance < t;
+  //! Accumulates the counts of another measurement.
+  perf_counts& operator += (const perf_counts& other) noexcept {
+    cycles += other.cycles;
+    instructions += other.instructions;
+    llc_misses += other.llc_misses;
+    branch_misses += other.branch_misses;
+    dtlb_misses += other.dtlb_misses;
+    available |= other.available;
+    return *this;
   }
 };
 
-//! \brief Contains data for a single ray.
-//!
-//! \tparam scalar_type The type used for the vector components.
-template <typename scalar_type>
-struct ray final {
-  //! A type definition for vectors used by the ray class.
-  using vec_type = vec3<scalar_type>;
-  //! The starting position of the ray.
-  vec_type pos;
-  //! The direction at which the ray is pointing at.
-  //! Usually, this is not normalized.
-  vec_type dir;
-};
+#ifdef LBVH_ENABLE_PERF_COUNTERS
 
-//! \brief Represents a single ray with
-//! precomputed acceleration data.
+//! \brief Measures hardware events with the Linux
+//! `perf_event_open` interface.
 //!
-//! \tparam scalar_type The scalar type of the vector components.
-template <typename scalar_type>
-struct accel_ray final {
-  //! A type definition for the ray used by this structure.
-  using ray_type = ray<scalar_type>;
-  //! A type definition for vector types used by this structure.
-  using vec3_type = vec3<scalar_type>;
-  //! The type to use for octant indices.
-  using index_type = typename associated_types<sizeof(scalar_type)>::uint_type;
-  //! The original ray from which the acceleration
-  //! data was computed.
-  ray_type r;
-  //! The reciprocal direction vector.
-  vec3_type rcp_dir;
-  //! The inverse position vector.
-  vec3_type inv_pos;
-  //! The indices for the octant that the ray falls into.
-  index_type octants[3];
-  //! The inverse octant indices.
-  index_type inv_octants[3];
-};
+//! The events are opened for the calling thread and are inherited
+//! by every thread it creates afterwards, which includes the workers
+//! spawned by @ref naive_thread_scheduler. Counts of worker threads are
+//! included once the workers have exited. Threads that already existed
+//! before the counters were opened, such as a thread pool used by the
+//! parallel sort, are not measured.
+class perf_counters final {
+  //! The number of events being measured.
+  static constexpr size_type event_count = 5;
+  //! The file descriptors of the events.
+  //! If an event couldn't be opened, its descriptor is negative.
+  int fds[event_count];
+  //! The counts at the start of the current measurement.
+  perf_counts start_counts;
+public:
+  //! Opens the hardware events for the calling thread.
+  perf_counters() noexcept {
 
-//! \brief A packet of 3D vectors,
-//! arranged for decent alignment.
-//!
-//! \tparam scalar_type The type of the vector components.
-//!
-//! \tparam dimensions The number of dimensions in the vector.
-//!
-//! \tparam count The number of elements per dimension.
-template <typename scalar_type,
-          size_type dimensions,
-          size_type count>
-struct vec_packet final {
-  //! Indicates the total number of scalars in this vector packet.
-  static inline constexpr size_type value_count() noexcept {
-    return dimensions * count;
+    using config_type = decltype(perf_event_attr::config);
+
+    struct event_config final {
+      std::uint32_t type;
+      config_type config;
+    };
+
+    constexpr config_type dtlb_read_miss = PERF_COUNT_HW_CACHE_DTLB
+                                         | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                                         | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+    const event_config configs[event_count] {
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+      { PERF_TYPE_HW_CACHE, dtlb_read_miss }
+    };
+
+    for (size_type i = 0; i < event_count; i++) {
+
+      perf_event_attr attr {};
+      attr.size = sizeof(attr);
+      attr.type = configs[i].type;
+      attr.config = configs[i].config;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+
+      fds[i] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
   }
-  //! Indicates the number of scalars per dimension.
-  static inline constexpr size_type size() noexcept {
-    return count;
+  //! Closes the events.
+  ~perf_counters() {
+    for (auto fd : fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
   }
-  //! Accesses a pointer to a dimension within the vector packet.
-  //!
-  //! \param d The index of the dimension to get the values of.
+  //! Indicates whether or not any event could be opened.
+  bool available() const noexcept {
+    for (auto fd : fds) {
+      if (fd >= 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+  //! Begins a new measurement.
+  void start() noexcept {
+    start_counts = read_all();
+  }
+  //! Ends the current measurement.
   //!
-  //! \return A pointer to the start of the dimension values.
-  inline auto* operator [] (size_type d) noexcept {
-    return &values[d * count];
+  //! \return The number of events since @ref start was called.
+  perf_counts stop() noexcept {
+
+    auto stop_counts = read_all();
+
+    perf_counts out;
+    out.cycles = stop_counts.cycles - start_counts.cycles;
+    out.instructions = stop_counts.instructions - start_counts.instructions;
+    out.llc_misses = stop_counts.llc_misses - start_counts.llc_misses;
+    out.branch_misses = stop_counts.branch_misses - start_counts.branch_misses;
+    out.dtlb_misses = stop_counts.dtlb_misses - start_counts.dtlb_misses;
+    out.available = stop_counts.available;
+    return out;
   }
-  //! Accesses a pointer to a dimension within the vector packet.
+
+  perf_counters(const perf_counters&) = delete;
+  perf_counters& operator = (const perf_counters&) = delete;
+protected:
+  //! Reads the current value of all events.
+  //! The values of inherited events are read along with them.
+  perf_counts read_all() const noexcept {
+
+    std::uint64_t values[event_count] {};
+
+    for (size_type i = 0; i < event_count; i++) {
+      if (fds[i] >= 0) {
+        if (read(fds[i], &values[i], sizeof(values[i])) != sizeof(values[i])) {
+          values[i] = 0;
+        }
+      }
+    }
+
+    perf_counts out;
+    out.cycles = values[0];
+    out.instructions = values[1];
+    out.llc_misses = values[2];
+    out.branch_misses = values[3];
+    out.dtlb_misses = values[4];
+    out.available = available();
+    return out;
+  }
+};
+
+#endif // LBVH_ENABLE_PERF_COUNTERS
+
+//! \brief Contains measurements of each phase of a BVH build.
+struct build_report final {
+  //! Contains the measurements of a single build phase.
+  struct phase_entry final {
+    //! The number of seconds the phase took.
+    double seconds = 0;
+    //! The hardware event counts of the phase.
+    //! These are only available if `LBVH_ENABLE_PERF_COUNTERS`
+    //! is defined and the system supports hardware counters.
+    perf_counts counts;
+    //! The busy time of the slowest scheduler worker.
+    //! This is only measured if the profiler is given a @ref load_stats
+    //! instance that is also used by the scheduler of the builder.
+    double max_busy = 0;
+    //! The busy time of the average scheduler worker.
+    double mean_busy = 0;
+    //! The idle time of the average scheduler worker.
+    double mean_idle = 0;
+    //! Calculates the ratio between the slowest and the average worker.
+    //! A ratio of one means that the work was perfectly balanced.
+    //!
+    //! \return The load imbalance of the phase, or zero if the
+    //! phase didn't run on the scheduler.
+    inline double imbalance() const noexcept {
+      return (mean_busy > 0) ? (max_busy / mean_busy) : 0.0;
+    }
+  };
+  //! The measurements, indexed by build phase.
+  phase_entry phases[build_phase_count()];
+  //! Accesses the measurements of a build phase.
+  inline phase_entry& operator [] (build_phase phase) noexcept {
+    return phases[size_type(phase)];
+  }
+  //! Accesses the measurements of a build phase.
+  inline const phase_entry& operator [] (build_phase phase) const noexcept {
+    return phases[size_type(phase)];
+  }
+};
+
+//! \brief A build observer that measures each phase of a build.
+//! The measurements are accumulated into a @ref build_report, so that
+//! one report can be used to measure several builds.
+class build_profiler final {
+  //! The clock used to time the phases.
+  using clock_type = std::chrono::steady_clock;
+  //! The report to put the measurements into.
+  build_report& report;
+  //! The scheduler measurements, which may be null.
+  load_stats* stats;
+  //! The time at which the current phase started.
+  clock_type::time_point phase_start;
+#ifdef LBVH_ENABLE_PERF_COUNTERS
+  //! The hardware counters used to measure each phase.
+  perf_counters counters;
+#endif
+public:
+  //! Constructs a new build profiler.
   //!
-  //! \param d The index of the dimension to get the values of.
+  //! \param r The report to put the measurements into.
   //!
-  //! \return A pointer to the start of the dimension values.
-  inline const auto* operator [] (size_type d) const noexcept {
-    return &values[d * count];
+  //! \param s If not null, the load balance of each phase is taken from
+  //! this object. It should be passed to the builder's scheduler as well,
+  //! with the scheduler's `set_load_stats` function.
+  build_profiler(build_report& r, load_stats* s = nullptr) noexcept
+    : report(r), stats(s) {}
+  //! Starts measuring a build phase.
+  void begin(build_phase) noexcept {
+    if (stats) {
+      stats->reset();
+    }
+#ifdef LBVH_ENABLE_PERF_COUNTERS
+    counters.start();
+#endif
+    phase_start = clock_type::now();
   }
-  //! The values of the vector packet.
-  //! Dimensions are non-interleaved in this array.
-  scalar_type values[value_count()] {};
-};
+  //! Stops measuring a build phase.
+  void end(build_phase phase) noexcept {
 
-//! This class is used to store a packet of rays.
-//! A packet of rays can be traversed faster than
-//! one ray at a time because it leads to better
-//! caching, auto-vectorization, and better coherency.
-//!
-//! \tparam scalar_type The type to use for vector components.
-//!
-//! \tparam count The maximum number of rays to put into the packet.
-template <typename scalar_type, size_type count>
-struct ray_packet final {
-  //! A type definition for ray indices.
-  using index_type = typename associated_types<sizeof(scalar_type)>::uint_type;
-  //! The position vectors of the rays.
-  vec_packet<scalar_type, 3, count> pos;
-  //! The direction vectors of the rays.
-  vec_packet<scalar_type, 3, count> dir;
-  //! The reciprocal direction vectors.
-  vec_packet<scalar_type, 3, count> rcp_dir;
-  //! These are the indices that each ray corresponds to.
-  //! Since a ray packet may be sorted multiple times
-  //! throughout a BVH traversal, tracking their original
-  //! indices allows them to be reordered after a BVH
-  //! node is exited.
-  index_type indices[count];
+    auto phase_stop = clock_type::now();
+
+    report[phase].seconds += std::chrono::duration<double>(phase_stop - phase_start).count();
+
+    if (stats) {
+
+      auto workers = stats->worker_count();
+
+      double idle = 0;
+
+      for (size_type i = 0; i < workers; i++) {
+        idle += stats->idle_time(i);
+      }
+
+      report[phase].max_busy += stats->max_busy_time();
+      report[phase].mean_busy += stats->mean_busy_time();
+      report[phase].mean_idle += workers ? (idle / double(workers)) : 0.0;
+    }
+
+#ifdef LBVH_ENABLE_PERF_COUNTERS
+    report[phase].counts += counters.stop();
+#endif
+  }
 };
 
-//! \brief This class is used for traversing a BVH.
+//! \brief Lets a build be cancelled part of the way through,
+//! and reports how far along the build is.
 //!
-//! \tparam scalar_type The floating point type to use for vector components.
-//!
-//! \tparam primitive_type The type of the primitive being checked for intersection.
+//! The token is checked between build phases, and between chunks of
+//! work within the phases that run on the scheduler. Once cancelled,
+//! a build stops at the next check and returns an empty BVH. The token
+//! may be cancelled and its progress read from any thread, including
+//! from the build observer or the bounding box converter.
 //!
-//! \tparam intersection_type The type used for indicating intersections.
-template <typename scalar_type,
-          typename primitive_type,
-          typename intersection_type = intersection<scalar_type>>
-class traverser final {
-  //! A reference to the BVH being traversed.
-  const bvh<scalar_type>& bvh_;
-  //! The primitives to check for intersection.
-  const primitive_type* primitives;
+//! Nothing of a cancelled build is kept, so the builder can be used
+//! again right away. The token itself is reused by calling @ref reset.
+//! See the cancellable overloads of @ref builder::operator().
+class build_token final {
 public:
-  //! A type definition for a ray.
-  using ray_type = ray<scalar_type>;
-  //! Constructs a new traverser instance.
-  //! \param b The BVH to be traversed.
-  //! \param p The primitives to check for intersection in each box.
-  constexpr traverser(const bvh<scalar_type>& b, const primitive_type* p) noexcept
-    : bvh_(b), primitives(p) {}
-  //! \brief Traverses the BVH, returning the closest intersection that was made.
-  //!
-  //! \tparam intersector_type Defined by the caller as a function object that
-  //! takes a primitive and a ray and returns an instance of @ref intersection_type
-  //! that indicates whether or not a hit was made.
-  template <typename intersector_type>
-  intersection_type operator () (const ray_type& ray, const intersector_type& intersector) const noexcept;
-};
+  //! Asks the build to stop.
+  inline void cancel() noexcept {
+    cancel_flag = true;
+  }
+  //! Indicates whether or not the build was asked to stop.
+  inline bool cancelled() const noexcept {
+    return cancel_flag;
+  }
+  //! Clears the cancellation and progress, so
+  //! that the token can be used for another build.
+  void reset() noexcept {
+    cancel_flag = false;
+    phases_done = 0;
+    chunks_done = 0;
+    chunk_total = 0;
+  }
+  //! Estimates how much of the build is done, from zero to one.
+  //! Each phase counts equally, and the phases that run in chunks
+  //! count the chunks that are done. The progress stops where
+  //! the build was when it was cancelled.
+  double progress() const noexcept {
 
-//! \brief Contains the associated types for 32-bit sizes.
-template <>
-struct associated_types<4> final {
-  //! The unsigned integer type to use for 32-bit types.
-  using uint_type = std::uint32_t;
-  //! The signed integer type to use for 32-bit types.
-  using int_type = std::int32_t;
-  //! The floating point type to use for 32-bit types.
-  using float_type = float;
-};
+    double phase_part = 0;
 
-//! \brief Contains the associated types for 64-bit sizes.
-template <>
-struct associated_types<8> final {
-  //! The unsigned integer type to use for 64-bit types.
-  using uint_type = std::uint64_t;
-  //! The signed integer type to use for 64-bit types.
-  using int_type = std::int64_t;
-  //! The floating point type to use for 64-bit types.
-  using float_type = double;
-};
+    size_type total = chunk_total;
 
-//! \brief This namespace contains various math routines
-//! for scalar and vector types. It may be useful to the
-//! user when writing intersection functions or primitive
-//! to box conversions.
-namespace math {
+    if (total) {
+      phase_part = std::min(double(chunks_done) / double(total), 1.0);
+    }
 
-//! \brief Calculates the minimum of two scalar values.
-template <typename scalar_type>
-inline constexpr scalar_type min(scalar_type a, scalar_type b) noexcept {
-  return (a < b) ? a : b;
-}
+    return (double(phases_done) + phase_part) / double(phase_count);
+  }
+  //! Called by the build before a phase is started.
+  inline void begin(build_phase) noexcept {
+    if (!cancel_flag) {
+      chunks_done = 0;
+      chunk_total = 0;
+    }
+  }
+  //! Called by the build after a phase is completed.
+  inline void end(build_phase) noexcept {
+    if (!cancel_flag) {
+      chunk_total = 0;
+      chunks_done = 0;
+      phases_done++;
+    }
+  }
+  //! Called by the build before a phase is divided into chunks.
+  //! \param total The number of chunks in the phase.
+  inline void begin_chunks(size_type total) noexcept {
+    chunks_done = 0;
+    chunk_total = total;
+  }
+  //! Called by the build after each chunk of a phase is done.
+  //! This may be called from several threads at once.
+  inline void end_chunk() noexcept {
+    chunks_done++;
+  }
+private:
+  //! The number of phases in a build.
+  static constexpr size_type phase_count = size_type(build_phase::fit_boxes) + 1;
+#ifndef LBVH_NO_THREADS
+  //! Whether or not the build was asked to stop.
+  std::atomic<bool> cancel_flag { false };
+  //! The number of phases that are done.
+  std::atomic<size_type> phases_done { 0 };
+  //! The number of chunks of the current phase that are done.
+  std::atomic<size_type> chunks_done { 0 };
+  //! The number of chunks in the current phase.
+  std::atomic<size_type> chunk_total { 0 };
+#else
+  //! Whether or not the build was asked to stop.
+  bool cancel_flag = false;
+  //! The number of phases that are done.
+  size_type phases_done = 0;
+  //! The number of chunks of the current phase that are done.
+  size_type chunks_done = 0;
+  //! The number of chunks in the current phase.
+  size_type chunk_total = 0;
+#endif
+};
 
-//! \brief Calculates the maximum of two scalar values.
+//! \brief Keeps information from one build that can be reused
+//! by the next build of the same primitives, which is usually the
+//! next frame of an animation. See @ref builder::rebuild.
+//!
+//! \tparam scalar_type The scalar type used by the BVH boxes.
 template <typename scalar_type>
-inline constexpr scalar_type max(scalar_type a, scalar_type b) noexcept {
-  return (a > b) ? a : b;
-}
+struct rebuild_cache final {
+  //! A type definition for a primitive index.
+  using index_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+  //! The centroid bounds that the Morton codes were last computed with.
+  aabb<scalar_type> centroid_bounds {};
+  //! The primitive indices, in the order of the last sorted Morton curve.
+  std::vector<index_type> order;
+  //! The fraction of the centroid bounds size added to each side of the
+  //! bounds when they're recomputed. This lets the bounds be reused while
+  //! the primitives move a little, at the cost of some Morton precision.
+  scalar_type bounds_margin = scalar_type(1) / 64;
+  //! Whether or not the last rebuild reused the previous centroid bounds.
+  bool reused_bounds = false;
+  //! Whether or not the last rebuild started from the previous order.
+  bool reused_order = false;
+};
 
-//! \brief Calculates the Hadamard quotient of two vectors.
+//! \brief Links the nodes of a BVH to their parents, so that
+//! parts of the BVH can be rebuilt without visiting the whole BVH.
+//! See @ref builder::rebuild_subtrees.
 //!
-//! \tparam scalar_type The scalar type of the vector components.
+//! The links are made on the first call for a BVH. If the BVH is
+//! built again, then the cache has to be cleared with @ref clear.
 //!
-//! \return The Hadamard quotient of the two vectors.
+//! \tparam scalar_type The scalar type used by the BVH boxes.
 template <typename scalar_type>
-auto hadamard_div(const vec3<scalar_type>& a,
-                  const vec3<scalar_type>& b) noexcept {
-  return vec3<scalar_type> {
-    a.x / b.x,
-    a.y / b.y,
-    a.z / b.z
-  };
-}
+struct subtree_cache final {
+  //! A type definition for a node or primitive index.
+  using index_type = typename node<scalar_type>::index_type;
+  //! The parent of each internal node.
+  //! The root node is its own parent.
+  std::vector<index_type> parents;
+  //! The parent of each leaf, indexed by primitive.
+  std::vector<index_type> leaf_parents;
+  //! The number of leaves under each internal node.
+  std::vector<index_type> leaf_counts;
+  //! The number of changed primitives under each internal node.
+  //! This is only used during a rebuild and is zero between rebuilds.
+  std::vector<index_type> dirty_counts;
+  //! A subtree is rebuilt if it has at most this many
+  //! leaves for each changed primitive it contains. Larger
+  //! values rebuild fewer, larger subtrees.
+  size_type max_spread = 4;
+  //! The number of subtrees rebuilt by the last call.
+  size_type rebuilt_subtrees = 0;
+  //! The number of primitives in the subtrees rebuilt by the last call.
+  size_type rebuilt_primitives = 0;
+  //! Removes the links of the last BVH.
+  void clear() noexcept {
+    parents.clear();
+    leaf_parents.clear();
+    leaf_counts.clear();
+    dirty_counts.clear();
+  }
+};
 
-//! \brief Calculates the Hadamard product of two vectors.
+//! \brief A single point along a space filling curve.
 //!
-//! \tparam scalar_type The scalar type of the vector components.
+//! \tparam code_type The type of the curve codes.
+template <typename code_type>
+struct curve_entry final {
+  //! Let's make the code and the primitive index the same size
+  //! by using this type definition.
+  using index_type = typename associated_types<sizeof(code_type)>::uint_type;
+  //! The code at this point along the curve.
+  code_type code;
+  //! The index to the primitive associated with this point.
+  index_type primitive;
+};
+
+//! \brief A sorted Morton curve that is kept from a build,
+//! so that the BVH can later be merged with other BVHs.
+//! See @ref builder::build_mergeable.
 //!
-//! \return The Hadamard product of the two vectors.
+//! \tparam scalar_type The scalar type used by the BVH boxes.
 template <typename scalar_type>
-auto hadamard_mul(const vec3<scalar_type>& a,
-                  const vec3<scalar_type>& b) noexcept {
-  return vec3<scalar_type> {
-    a.x * b.x,
-    a.y * b.y,
-    a.z * b.z
-  };
-}
+struct morton_curve final {
+  //! A type definition for a Morton code.
+  using code_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+  //! A type definition for a curve entry.
+  using entry = curve_entry<code_type>;
+  //! The bounds that the centroids were quantized in.
+  //! Two curves can only be merged well if they have the same domain.
+  aabb<scalar_type> domain {};
+  //! The entries of the curve, sorted by code.
+  std::vector<entry> entries;
+};
 
-//! \brief Calculates the cross product between two 3D vectors.
+//! \brief A range of primitives to build a BVH for.
+//! See @ref builder::build_batch.
 //!
-//! \return The cross product of @p a and @p b.
-template <typename scalar_type>
-inline constexpr vec3<scalar_type> cross(const vec3<scalar_type>& a,
-                                         const vec3<scalar_type>& b) noexcept {
-  return vec3<scalar_type> {
-    (a.y * b.z) - (a.z * b.y),
-    (a.z * b.x) - (a.x * b.z),
-    (a.x * b.y) - (a.y * b.x)
-  };
-}
+//! \tparam primitive The type of primitive in the range.
+template <typename primitive>
+struct build_range final {
+  //! The first primitive of the range.
+  const primitive* primitives = nullptr;
+  //! The number of primitives in the range.
+  size_type count = 0;
+};
 
-//! \brief Calculates the dot product of two 3D vectors.
+//! \brief A reference to one primitive of a scene with several primitive types.
+//! A BVH over mixed primitives is built for an array of these.
+//! See @ref primitive_set.
 //!
-//! \return The dot product of @p a and @p b.
-template <typename scalar_type>
-inline constexpr scalar_type dot(const vec3<scalar_type>& a,
-                                 const vec3<scalar_type>& b) noexcept {
-  scalar_type out = 0;
-  out += a.x * b.x;
-  out += a.y * b.y;
-  out += a.z * b.z;
-  return out;
-}
+//! \tparam index_type The type of the type tag and primitive index.
+template <typename index_type>
+struct tagged_primitive final {
+  //! The position of the primitive type in the type list of the set.
+  index_type type;
+  //! The index of the primitive within the array of its type.
+  index_type index;
+};
 
-//! \brief Calculates the minimum between two vectors.
-//! This is used frequently in bounding box calculations.
+//! \brief The primitive arrays of a scene with several primitive types,
+//! such as triangles, spheres and curves.
 //!
-//! \tparam scalar_type The scalar type of the vector components.
+//! The types are a compile-time list, so a primitive is reached from its
+//! @ref tagged_primitive by comparing the tag against each position in
+//! the list, with no virtual calls. A BVH is built for the references
+//! from @ref references, using a converter from @ref tagged_converter,
+//! and traced with a @ref tagged_traverser, so that one traversal per
+//! ray covers all of the primitive types.
 //!
-//! \return A vector containing the minimum components between @p a and @p b.
-template <typename scalar_type>
-auto min(const vec3<scalar_type>& a,
-         const vec3<scalar_type>& b) noexcept {
+//! \tparam primitive_types The types of primitives in the scene.
+template <typename... primitive_types>
+class primitive_set final {
+  //! The primitive array of each type.
+  std::tuple<build_range<primitive_types>...> ranges;
+public:
+  //! Constructs a new primitive set.
+  //! \param r The primitive array of each type, in the order of the type list.
+  constexpr primitive_set(const build_range<primitive_types>&... r) noexcept
+    : ranges(r...) {}
+  //! Makes a reference to every primitive in the set.
+  //! The references of each type are contiguous, in the order of the type list.
+  //!
+  //! \tparam index_type The index type of the references to make.
+  //! This should be the index type of the BVH nodes.
+  template <typename index_type>
+  std::vector<tagged_primitive<index_type>> references() const {
+    std::vector<tagged_primitive<index_type>> refs;
+    append_references<0>(refs, std::integral_constant<bool, (sizeof...(primitive_types) == 1)>());
+    return refs;
+  }
+  //! Passes the primitive of a reference to a function object.
+  //!
+  //! \param ref The reference to the primitive.
+  //!
+  //! \param f A function object with an overload for each primitive type.
+  //! The overloads have to return the same type.
+  //!
+  //! \return The value returned by @p f.
+  template <typename index_type, typename function>
+  decltype(auto) visit(const tagged_primitive<index_type>& ref, const function& f) const {
+    return visit_at<0>(ref, f, std::integral_constant<bool, (sizeof...(primitive_types) == 1)>());
+  }
+  //! Makes a converter for the references of the set.
+  //!
+  //! \param converter A primitive to bounding box converter
+  //! with an overload for each primitive type. This has to
+  //! stay alive for as long as the returned converter is used.
+  //!
+  //! \return A function object that gets the bounding box of a reference.
+  template <typename aabb_converter>
+  auto tagged_converter(const aabb_converter& converter) const noexcept {
+    return [this, &converter](const auto& ref) {
+      return visit(ref, converter);
+    };
+  }
+private:
+  //! Appends the references of one type and the types after it.
+  template <size_type type, typename index_type>
+  void append_references(std::vector<tagged_primitive<index_type>>& refs, std::false_type) const {
 
-  return vec3<scalar_type> {
-    std::min(a.x, b.x),
-    std::min(a.y, b.y),
-    std::min(a.z, b.z)
-  };
-}
+    for (size_type i = 0; i < std::get<type>(ranges).count; i++) {
+      refs.push_back(tagged_primitive<index_type> { index_type(type), index_type(i) });
+    }
 
-//! \brief Calculates the maximum between two vectors.
-//! This is used frequently in bounding box calculations.
+    append_references<type + 1>(refs, std::integral_constant<bool, ((type + 2) == sizeof...(primitive_types))>());
+  }
+  //! Ends the recursion of @ref append_references after the last type.
+  template <size_type type, typename index_type>
+  void append_references(std::vector<tagged_primitive<index_type>>& refs, std::true_type) const {
+    for (size_type i = 0; i < std::get<type>(ranges).count; i++) {
+      refs.push_back(tagged_primitive<index_type> { index_type(type), index_type(i) });
+    }
+  }
+  //! Checks a reference against one type of the list,
+  //! and otherwise against the types after it.
+  template <size_type type, typename index_type, typename function>
+  decltype(auto) visit_at(const tagged_primitive<index_type>& ref, const function& f, std::false_type) const {
+
+    if (ref.type == type) {
+      return f(std::get<type>(ranges).primitives[ref.index]);
+    }
+
+    return visit_at<type + 1>(ref, f, std::integral_constant<bool, ((type + 2) == sizeof...(primitive_types))>());
+  }
+  //! Passes a reference to the last type of the list.
+  //! Its tag isn't checked, since no other type is left.
+  template <size_type type, typename index_type, typename function>
+  decltype(auto) visit_at(const tagged_primitive<index_type>& ref, const function& f, std::true_type) const {
+    return f(std::get<type>(ranges).primitives[ref.index]);
+  }
+};
+
+//! \brief Enumerates the ways that centroids are mapped to Morton cells.
+//! Both are independent of the scale of the scene.
+enum class morton_quantization {
+  //! The cells are cubes. The longest axis of the centroid bounds
+  //! spans the whole Morton domain, and shorter axes span less of it.
+  cube,
+  //! Each axis of the centroid bounds spans the whole Morton domain,
+  //! so the cells are stretched along the longer axes. This separates
+  //! more centroids in flat scenes, but gives less square splits.
+  per_axis
+};
+
+//! Gets a human readable name of a Morton quantization.
 //!
-//! \tparam scalar_type The scalar type of the vector components.
+//! \return A null-terminated name of @p quantization.
+inline constexpr const char* to_string(morton_quantization quantization) noexcept {
+  switch (quantization) {
+    case morton_quantization::cube: return "cube";
+    case morton_quantization::per_axis: return "per axis";
+  }
+  return "";
+}
+
+//! \brief Lists the primitives in each leaf of a BVH
+//! with multi-primitive leaves. See @ref builder::build_clustered.
 //!
-//! \return A vector containing the maximum components between @p a and @p b.
+//! \tparam scalar_type The scalar type used by the BVH boxes.
 template <typename scalar_type>
-auto max(const vec3<scalar_type>& a,
-         const vec3<scalar_type>& b) noexcept {
+struct leaf_table final {
+  //! A type definition for a leaf or primitive index.
+  using index_type = typename node<scalar_type>::index_type;
+  //! Where the primitives of each leaf start in @ref primitives.
+  //! There is one more offset than there are leaves, so the primitives
+  //! of leaf i are from offsets[i] up to, but not including, offsets[i + 1].
+  std::vector<index_type> offsets;
+  //! The primitive indices, grouped by leaf.
+  std::vector<index_type> primitives;
+};
 
-  return vec3<scalar_type> {
-    std::max(a.x, b.x),
-    std::max(a.y, b.y),
+//! \brief Limits how much work is spent optimizing a BVH.
+//! See @ref builder::optimize.
+struct optimize_budget final {
+  //! The maximum number of passes over the tree.
+  size_type passes = 16;
+  //! The maximum time to spend, in seconds. The pass that
+  //! is running when this runs out is still finished.
+  //! If this is zero, there is no time limit.
+  double seconds = 0;
+  //! The fraction of the internal nodes that
+  //! are picked for reinsertion in each pass.
+  double batch_fraction = 0.01;
+};
+
+//! \brief Decides which primitives are split before a build,
+//! and into how many pieces. See @ref builder::build_split.
+struct split_options final {
+  //! A primitive is split while the area of its box, or of its pieces,
+  //! is more than this many times the mean area of the primitive boxes.
+  double area_factor = 16;
+  //! The maximum number of references that a primitive is split into.
+  size_type max_references = 8;
+};
+
+//! \brief Describes what an optimization did to a BVH.
+struct optimize_report final {
+  //! The number of passes that were run.
+  size_type passes = 0;
+  //! The number of subtrees that were moved.
+  size_type reinsertions = 0;
+};
+
+template <typename scalar_type, typename primitive, typename aabb_converter>
+class lazy_bvh;
+
+//! \brief This class is used for the constructing of BVHs.
+//! It is meant to be the first class declared by anyone using the library.
+//! It takes a set of primitives, as well as a function object to calculate their bounding boxes,
+//! and generates an LBVH from them. The only function required to be implemented is the function
+//! object that converts primitives to bounding boxes.
+//!
+//! \tparam scalar_type The scalar type to use for the box vectors.
+//!
+//! \tparam task_scheduler The scheduler type to use for construction tasks.
+//! By default, this is the type of scheduler provided by the library.
+template <typename scalar_type, typename task_scheduler = default_scheduler>
+class builder final {
+  //! Is passed the various work items during BVH construction.
+  task_scheduler scheduler;
+  //! How centroids are mapped to Morton cells.
+  morton_quantization quantization = morton_quantization::cube;
+public:
+  //! A type definition for a BVH.
+  using bvh_type = bvh<scalar_type>;
+  //! A type definition for a BVH node.
+  using node_type = node<scalar_type>;
+  //! A type definition for a node vector.
+  using node_vec = std::vector<node_type>;
+  //! Constructs a new BVH builder.
+  //! \param scheduler_ The task scheduler to distribute the work with.
+  builder(task_scheduler scheduler_ = task_scheduler())
+    : scheduler(scheduler_) {}
+  //! Sets how centroids are mapped to Morton cells in later builds.
+  //! \param q The quantization to use. The default is cubic cells.
+  void set_quantization(morton_quantization q) noexcept {
+    quantization = q;
+  }
+  //! Builds a BVH from an array of primitives.
+  //!
+  //! \param primitives The array of primitives to build the BVH for.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //! This should be implemented by the caller as a function object
+  //! that takes a single primitive and returns an instance of @ref aabb
+  //! that represents the bounding box for that primitive.
+  //!
+  //! \return A BVH built for the specified primitives.
+  template <typename primitive, typename aabb_converter>
+  bvh_type operator () (const primitive* primitives, size_type count, const aabb_converter& converter);
+  //! Builds a BVH from an array of primitives,
+  //! notifying an observer of each build phase.
+  //!
+  //! \param primitives The array of primitives to build the BVH for.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \param observer Called before and after each phase of the build.
+  //! See @ref null_build_observer for the functions it has to implement.
+  //!
+  //! \return A BVH built for the specified primitives.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  bvh_type operator () (const primitive* primitives, size_type count, const aabb_converter& converter, build_observer& observer);
+  //! Builds a BVH from an array of primitives, stopping early if the
+  //! build is cancelled. The token is checked between the phases, and
+  //! between chunks of the centroid bounds, Morton curve, hierarchy and
+  //! box fitting phases. The sort is only checked before and after.
+  //!
+  //! \param token The token to check for cancellation and to report progress to.
+  //!
+  //! \return A BVH built for the specified primitives, or an empty BVH
+  //! if the build was cancelled.
+  template <typename primitive, typename aabb_converter>
+  bvh_type operator () (const primitive* primitives, size_type count, const aabb_converter& converter, build_token& token);
+  //! Builds a BVH from an array of primitives, stopping early if the
+  //! build is cancelled, and notifying an observer of each build phase.
+  //!
+  //! \param token The token to check for cancellation and to report progress to.
+  //!
+  //! \param observer Called before and after each phase of the build.
+  //!
+  //! \return A BVH built for the specified primitives, or an empty BVH
+  //! if the build was cancelled.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  bvh_type operator () (const primitive* primitives,
+                        size_type count,
+                        const aabb_converter& converter,
+                        build_token& token,
+                        build_observer& observer);
+  //! Builds a BVH over a subset of an array of primitives.
+  //! The primitives are not copied. The leaves of the BVH refer to the
+  //! primitives by their index in @p primitives, so the BVH can be
+  //! traversed with the whole primitive array.
+  //!
+  //! \param primitives The whole array of primitives.
+  //!
+  //! \param indices The indices of the primitives to build the BVH for.
+  //!
+  //! \param count The number of indices in @p indices.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \return A BVH built for the indexed primitives.
+  template <typename primitive, typename index_type, typename aabb_converter>
+  bvh_type operator () (const primitive* primitives, const index_type* indices, size_type count, const aabb_converter& converter);
+  //! Builds a BVH from a range of primitives given by random access iterators.
+  //! This allows a BVH to be built for a container that isn't an array, or
+  //! for a view of an array, without copying the primitives. The leaves
+  //! of the BVH refer to the primitives by their offset from @p first.
+  //!
+  //! \param first The iterator to the first primitive.
+  //!
+  //! \param last The iterator to one past the last primitive.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \return A BVH built for the primitives in the range.
+  template <typename primitive_iterator, typename aabb_converter>
+  bvh_type operator () (primitive_iterator first, primitive_iterator last, const aabb_converter& converter);
+  //! Rebuilds a BVH for primitives that have moved since the last build.
+  //!
+  //! The Morton curve starts out in the order it was sorted in by the
+  //! last build, so that it only has to be partially sorted again. The
+  //! previous centroid bounds are kept if all centroids still fit in them,
+  //! which skips the centroid bounds pass. If the primitive count changed,
+  //! a full build is done.
+  //!
+  //! \param primitives The array of primitives to build the BVH for.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \param cache Contains the results of the last build. This is
+  //! updated for the next call. It may be empty for the first build.
+  //!
+  //! \return A BVH built for the specified primitives.
+  template <typename primitive, typename aabb_converter>
+  bvh_type rebuild(const primitive* primitives, size_type count, const aabb_converter& converter, rebuild_cache<scalar_type>& cache);
+  //! Rebuilds a BVH for primitives that have moved since the last build,
+  //! notifying an observer of each build phase.
+  //!
+  //! \param observer Called before and after each phase of the build.
+  //!
+  //! \return A BVH built for the specified primitives.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  bvh_type rebuild(const primitive* primitives,
+                   size_type count,
+                   const aabb_converter& converter,
+                   rebuild_cache<scalar_type>& cache,
+                   build_observer& observer);
+  //! Builds a hybrid BVH, with binned SAH splits at the top of the tree.
+  //!
+  //! The primitives are sorted along a Morton curve as they are in a regular
+  //! build. Primitives that share the top @p sah_bits bits of their Morton
+  //! codes form a cluster, and the LBVH hierarchy is kept within each cluster.
+  //! The nodes above the clusters are replaced with a tree that is built with
+  //! binned SAH splits over the cluster boxes, since those are the splits that
+  //! cost the most traversal time.
+  //!
+  //! \param primitives The array of primitives to build the BVH for.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \param sah_bits The number of Morton code bits that form the clusters.
+  //! There are at most two to the power of this many clusters. If this is
+  //! zero, the result is the same as a regular build.
+  //!
+  //! \return A BVH built for the specified primitives.
+  template <typename primitive, typename aabb_converter>
+  bvh_type build_hlbvh(const primitive* primitives, size_type count, const aabb_converter& converter, size_type sah_bits = 15);
+  //! Builds a hybrid BVH, notifying an observer of each build phase.
+  //! The SAH splits at the top of the tree are part of the hierarchy phase,
+  //! and so are the boxes of the clusters below them. There is no separate
+  //! fit boxes phase unless @p sah_bits is zero.
+  //!
+  //! \param observer Called before and after each phase of the build.
+  //!
+  //! \return A BVH built for the specified primitives.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  bvh_type build_hlbvh(const primitive* primitives,
+                       size_type count,
+                       const aabb_converter& converter,
+                       size_type sah_bits,
+                       build_observer& observer);
+  //! Builds a BVH top down with binned SAH splits over all of the primitives.
+  //!
+  //! This is slower than a regular build, but gives trees that are cheaper
+  //! to traverse. It's meant as a reference for how good the Morton based
+  //! builds are, and for scenes that are built once and traced many times.
+  //! The result has the same layout as any other BVH.
+  //!
+  //! \param primitives The array of primitives to build the BVH for.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \return A BVH built for the specified primitives.
+  template <typename primitive, typename aabb_converter>
+  bvh_type build_sah(const primitive* primitives, size_type count, const aabb_converter& converter);
+  //! Builds a BVH with binned SAH splits, notifying an observer of each
+  //! build phase. Getting the primitive boxes is the centroid bounds phase,
+  //! and the splits are the hierarchy phase.
+  //!
+  //! \param observer Called before and after each phase of the build.
+  //!
+  //! \return A BVH built for the specified primitives.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  bvh_type build_sah(const primitive* primitives,
+                     size_type count,
+                     const aabb_converter& converter,
+                     build_observer& observer);
+  //! Builds a BVH where oversized primitives are split into several
+  //! references with tighter boxes, which are then built like any other
+  //! primitives. This is early split clipping, which helps with long
+  //! diagonal primitives whose boxes overlap large parts of the scene.
+  //!
+  //! The leaves of the BVH are reference indices. To trace it, pass
+  //! @p references to the @ref traverser, which maps each leaf to its
+  //! primitive and skips primitives that a ray has already been tested
+  //! against. To refit it, rebuild it instead, since the reference boxes
+  //! don't come from the converter.
+  //!
+  //! \param primitives The array of primitives to build the BVH for.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \param clipper A function object that takes a primitive and a box,
+  //! and returns the box of the part of the primitive that's within it.
+  //! If the primitive isn't within the box, the returned box should have
+  //! a minimum that's greater than its maximum.
+  //!
+  //! \param references Receives the primitive index of each reference.
+  //!
+  //! \param options Decides which primitives are split.
+  //!
+  //! \return A BVH built for the primitive references.
+  template <typename primitive, typename aabb_converter, typename primitive_clipper>
+  bvh_type build_split(const primitive* primitives,
+                       size_type count,
+                       const aabb_converter& converter,
+                       const primitive_clipper& clipper,
+                       std::vector<typename node_type::index_type>& references,
+                       const split_options& options = split_options());
+  //! Builds a BVH with oversized primitives split by only their boxes.
+  //! The pieces are tighter than a whole box along the split axes, but
+  //! not as tight as the pieces from a clipper that knows the primitive.
+  //!
+  //! \return A BVH built for the primitive references.
+  template <typename primitive, typename aabb_converter>
+  bvh_type build_split(const primitive* primitives,
+                       size_type count,
+                       const aabb_converter& converter,
+                       std::vector<typename node_type::index_type>& references,
+                       const split_options& options = split_options());
+  //! Builds a BVH where primitives with the same Morton code share a leaf.
+  //!
+  //! Primitives whose centroids fall in the same Morton cell can't be told
+  //! apart by their codes, so a regular build puts an arbitrary balanced
+  //! subtree over them. Here, each run of equal codes in the sorted curve
+  //! is cut into leaves of up to @p max_leaf_size primitives instead. This
+  //! helps most with point clouds and instanced geometry.
+  //!
+  //! The leaves of the BVH are leaf indices. To trace it, pass @p leaves
+  //! to the @ref traverser, which tests every primitive of a leaf.
+  //!
+  //! \param primitives The array of primitives to build the BVH for.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \param leaves Receives the primitives of each leaf.
+  //!
+  //! \param max_leaf_size The maximum number of primitives in a leaf.
+  //! Longer runs of equal codes are cut into several leaves.
+  //!
+  //! \return A BVH built for the leaves.
+  template <typename primitive, typename aabb_converter>
+  bvh_type build_clustered(const primitive* primitives,
+                           size_type count,
+                           const aabb_converter& converter,
+                           leaf_table<scalar_type>& leaves,
+                           size_type max_leaf_size = 4);
+  //! Builds a BVH with clustered leaves, notifying an observer of each
+  //! build phase. Finding the runs of equal codes is part of the sort phase.
+  //!
+  //! \param observer Called before and after each phase of the build.
+  //!
+  //! \return A BVH built for the leaves.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  bvh_type build_clustered(const primitive* primitives,
+                           size_type count,
+                           const aabb_converter& converter,
+                           leaf_table<scalar_type>& leaves,
+                           size_type max_leaf_size,
+                           build_observer& observer);
+  //! Builds a BVH with the Morton codes refined in dense regions.
+  //!
+  //! A Morton code has ten bits per axis in single precision, which
+  //! isn't enough to tell apart the primitives of finely detailed
+  //! regions. After the curve is sorted, each run of primitives that
+  //! share the top @p segment_bits bits of their codes is encoded again
+  //! relative to the centroid bounds of the run, and sorted again. The
+  //! runs are refined in parallel, and the hierarchy is built from the
+  //! shared bits followed by the refined bits. Unlike a build with
+  //! 64-bit codes, the first sort still works on the short codes.
+  //!
+  //! \param primitives The array of primitives to build the BVH for.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \param segment_bits The number of top code bits shared within a run.
+  //! At most 34 bits are used.
+  //!
+  //! \return A BVH built for the primitives.
+  template <typename primitive, typename aabb_converter>
+  bvh_type build_refined(const primitive* primitives,
+                         size_type count,
+                         const aabb_converter& converter,
+                         size_type segment_bits = 12);
+  //! Builds a BVH with refined Morton codes, notifying an observer
+  //! of each build phase. The refinement is part of the sort phase.
+  //!
+  //! \param observer Called before and after each phase of the build.
+  //!
+  //! \return A BVH built for the primitives.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  bvh_type build_refined(const primitive* primitives,
+                         size_type count,
+                         const aabb_converter& converter,
+                         size_type segment_bits,
+                         build_observer& observer);
+  //! Builds the top levels of a BVH, leaving the subtrees below them
+  //! to be built the first time that a traversal reaches them.
+  //!
+  //! The primitives are grouped by the top bits of their Morton codes
+  //! with a counting sort, so the curve is never fully sorted. The
+  //! tree built here has one leaf for each group that isn't empty.
+  //! See @ref lazy_bvh and @ref lazy_traverser.
+  //!
+  //! \param primitives The primitives to build the BVH for. These
+  //! have to stay alive for as long as the lazy BVH is used.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //! A copy of it is kept to build the subtrees with.
+  //!
+  //! \param top_bits The number of top code bits that each group shares.
+  //! At most 16 bits are used.
+  //!
+  //! \return A BVH with only its top levels built.
+  template <typename primitive, typename aabb_converter>
+  lazy_bvh<scalar_type, primitive, aabb_converter> build_lazy(const primitive* primitives,
+                                                              size_type count,
+                                                              const aabb_converter& converter,
+                                                              size_type top_bits = 12);
+  //! Builds the top levels of a BVH, notifying an observer of each
+  //! build phase. Grouping the primitives is part of the sort phase.
+  //!
+  //! \param observer Called before and after each phase of the build.
+  //!
+  //! \return A BVH with only its top levels built.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  lazy_bvh<scalar_type, primitive, aabb_converter> build_lazy(const primitive* primitives,
+                                                              size_type count,
+                                                              const aabb_converter& converter,
+                                                              size_type top_bits,
+                                                              build_observer& observer);
+  //! Lowers the SAH cost of a BVH by moving its worst subtrees.
+  //!
+  //! Each pass picks the internal nodes whose boxes are largest compared
+  //! to the boxes of their children. One child of each is removed from
+  //! the tree, which also removes the node, and is reinserted as the
+  //! sibling of whichever node increases the SAH cost the least. The
+  //! searches run in parallel. The moves are then applied one at a time,
+  //! and only if they lower the cost.
+  //!
+  //! The result is no longer sorted along a Morton curve, so it can be
+  //! refit, but not passed to @ref rebuild_subtrees or @ref merge.
+  //!
+  //! \param b The BVH to optimize.
+  //!
+  //! \param primitives The primitives that the BVH was built for.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \param budget Limits the number of passes and the time spent.
+  //!
+  //! \return A report of how many passes and moves were done.
+  template <typename primitive, typename aabb_converter>
+  optimize_report optimize(bvh_type& b,
+                           const primitive* primitives,
+                           const aabb_converter& converter,
+                           const optimize_budget& budget = optimize_budget());
+  //! Builds one BVH for each of many primitive ranges, such as one per mesh.
+  //!
+  //! Ranges that are small compared to the rest of the batch are each
+  //! built entirely by one thread, and all of them are built with a
+  //! single scheduler call. Each thread reuses its scratch memory between
+  //! builds. Ranges that are larger than the share of one thread are
+  //! built one at a time, split across all threads.
+  //!
+  //! \param ranges The primitive ranges to build BVHs for.
+  //!
+  //! \param range_count The number of ranges in @p ranges.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \return One BVH for each range, in the same order as the ranges.
+  template <typename primitive, typename aabb_converter>
+  std::vector<bvh_type> build_batch(const build_range<primitive>* ranges, size_type range_count, const aabb_converter& converter);
+  //! Builds a BVH that can later be merged with other BVHs.
+  //! The centroids are quantized in a fixed domain instead of their own
+  //! bounds, and the sorted Morton curve is kept. Centroids outside
+  //! of the domain are clamped to it.
+  //!
+  //! \param primitives The array of primitives to build the BVH for.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \param domain The bounds to quantize the centroids in. This
+  //! is usually the bounds of the whole world that is being streamed.
+  //!
+  //! \param curve Receives the sorted Morton curve of the BVH.
+  //!
+  //! \return A BVH built for the specified primitives.
+  template <typename primitive, typename aabb_converter>
+  bvh_type build_mergeable(const primitive* primitives,
+                           size_type count,
+                           const aabb_converter& converter,
+                           const aabb<scalar_type>& domain,
+                           morton_curve<scalar_type>& curve);
+  //! Builds a mergeable BVH, notifying an observer of each build phase.
+  //! There is no centroid bounds phase, since the domain is given.
+  //!
+  //! \param observer Called before and after each phase of the build.
+  //!
+  //! \return A BVH built for the specified primitives.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  bvh_type build_mergeable(const primitive* primitives,
+                           size_type count,
+                           const aabb_converter& converter,
+                           const aabb<scalar_type>& domain,
+                           morton_curve<scalar_type>& curve,
+                           build_observer& observer);
+  //! Merges two BVHs by merging their sorted Morton curves.
+  //! Nothing is encoded or sorted again. Only the hierarchy
+  //! is generated and the boxes are fit.
+  //!
+  //! \param primitives The primitives of both BVHs. The primitives of
+  //! @p a come first, followed by the primitives of @p b.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \param a The curve of the first BVH.
+  //!
+  //! \param b The curve of the second BVH. It should have
+  //! the same domain as @p a.
+  //!
+  //! \param merged Receives the merged curve, which can be merged
+  //! again later. It may be the same object as @p a or @p b.
+  //!
+  //! \return A BVH for the primitives of both curves. If there are less
+  //! than two primitives, the BVH has no nodes and traversing it misses.
+  template <typename primitive, typename aabb_converter>
+  bvh_type merge(const primitive* primitives,
+                 const aabb_converter& converter,
+                 const morton_curve<scalar_type>& a,
+                 const morton_curve<scalar_type>& b,
+                 morton_curve<scalar_type>& merged);
+  //! Merges two BVHs, notifying an observer of each build phase.
+  //! Merging the curves is the sort phase.
+  //!
+  //! \param observer Called before and after each phase of the merge.
+  //!
+  //! \return A BVH for the primitives of both curves.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  bvh_type merge(const primitive* primitives,
+                 const aabb_converter& converter,
+                 const morton_curve<scalar_type>& a,
+                 const morton_curve<scalar_type>& b,
+                 morton_curve<scalar_type>& merged,
+                 build_observer& observer);
+  //! Removes a range of primitives from a merged BVH, such as when a tile unloads.
+  //! The remaining entries are still sorted, so only the hierarchy is generated.
+  //!
+  //! \param primitives The primitives that remain, with the removed
+  //! range taken out and the primitives after it moved down.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \param curve The curve of the BVH to remove the primitives from.
+  //!
+  //! \param first The index of the first primitive to remove.
+  //!
+  //! \param count The number of primitives to remove.
+  //!
+  //! \param remaining Receives the curve of the remaining primitives.
+  //! It may be the same object as @p curve.
+  //!
+  //! \return A BVH for the remaining primitives. If less than two
+  //! primitives remain, the BVH has no nodes and traversing it misses.
+  template <typename primitive, typename aabb_converter>
+  bvh_type erase(const primitive* primitives,
+                 const aabb_converter& converter,
+                 const morton_curve<scalar_type>& curve,
+                 size_type first,
+                 size_type count,
+                 morton_curve<scalar_type>& remaining);
+  //! Removes a range of primitives from a merged BVH, notifying an observer
+  //! of each build phase. Removing the entries from the curve is the sort phase.
+  //!
+  //! \param observer Called before and after each phase of the build.
+  //!
+  //! \return A BVH for the remaining primitives.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  bvh_type erase(const primitive* primitives,
+                 const aabb_converter& converter,
+                 const morton_curve<scalar_type>& curve,
+                 size_type first,
+                 size_type count,
+                 morton_curve<scalar_type>& remaining,
+                 build_observer& observer);
+  //! Rebuilds only the parts of a BVH that contain primitives that have moved.
+  //!
+  //! The smallest subtrees that are mostly made up of changed primitives are
+  //! rebuilt in place, reusing their node slots, and their ancestors are refit.
+  //! Changed primitives that aren't in a rebuilt subtree only get refit. Apart
+  //! from the first call, which links the nodes of the BVH, the cost depends on
+  //! the size of the changed region instead of the size of the scene.
+  //!
+  //! \param b The BVH to update.
+  //!
+  //! \param primitives The array of primitives that @p b was built for.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \param dirty The indices of the primitives that have changed.
+  //!
+  //! \param dirty_count The number of indices in @p dirty.
+  //!
+  //! \param cache Links the nodes of @p b and receives the rebuild statistics.
+  template <typename primitive, typename aabb_converter>
+  void rebuild_subtrees(bvh_type& b,
+                        const primitive* primitives,
+                        const aabb_converter& converter,
+                        const typename subtree_cache<scalar_type>::index_type* dirty,
+                        size_type dirty_count,
+                        subtree_cache<scalar_type>& cache);
+  //! Refits the boxes of a BVH to primitives that have moved.
+  //! The hierarchy isn't changed, so the quality of the BVH drops
+  //! as the primitives move away from where the BVH was built.
+  //!
+  //! \param b The BVH to refit. It must have been built for the same
+  //! number of primitives as there are in @p primitives.
+  //!
+  //! \param primitives The array of primitives to fit the boxes to.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  template <typename primitive, typename aabb_converter>
+  void refit(bvh_type& b, const primitive* primitives, const aabb_converter& converter);
+  //! Refits the boxes of a BVH, notifying an observer of the box fitting phase.
+  //!
+  //! \param observer Called before and after the box fitting.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  void refit(bvh_type& b, const primitive* primitives, const aabb_converter& converter, build_observer& observer);
+protected:
+  //! Builds the BVH nodes from a sorted curve.
+  template <typename curve_type, typename primitive, typename aabb_converter, typename build_observer>
+  bvh_type build_nodes(const curve_type& curve,
+                       const primitive* primitives,
+                       const aabb_converter& converter,
+                       build_observer& observer);
+  //! Fits BVH nodes with their appropriate boxes.
+  template <typename primitive, typename aabb_converter>
+  void fit_boxes(node_type* nodes, size_type node_count, const primitive* primitives, const aabb_converter& converter);
+  //! Links the nodes of a BVH to their parents.
+  static void link_nodes(const bvh_type& b, subtree_cache<scalar_type>& cache);
+  //! Rebuilds the subtree of a BVH starting at a certain node.
+  template <typename primitive, typename aabb_converter>
+  void rebuild_subtree(bvh_type& b,
+                       size_type root,
+                       const primitive* primitives,
+                       const aabb_converter& converter,
+                       subtree_cache<scalar_type>& cache);
+};
+
+//! \brief Builds BVHs over planar primitives, such as map features
+//! or the widgets of a user interface.
+//!
+//! This is the same build as @ref builder, with 2D Morton codes and
+//! 2D boxes. The codes have half the bits of the scalar type per axis,
+//! so single precision gets 16 bits per axis instead of 10, and the
+//! nodes have no space spent on a third axis. The converter returns
+//! an instance of @ref aabb2 for each primitive.
+//!
+//! \tparam scalar_type The scalar type to use for the rectangle vectors.
+//!
+//! \tparam task_scheduler The scheduler type to use for construction tasks.
+template <typename scalar_type, typename task_scheduler = default_scheduler>
+class builder2 final {
+  //! Is passed the various work items during BVH construction.
+  task_scheduler scheduler;
+public:
+  //! A type definition for a 2D BVH.
+  using bvh_type = bvh2<scalar_type>;
+  //! A type definition for a 2D BVH node.
+  using node_type = node2<scalar_type>;
+  //! Constructs a new 2D BVH builder.
+  //! \param scheduler_ The task scheduler to distribute the work with.
+  builder2(task_scheduler scheduler_ = task_scheduler())
+    : scheduler(scheduler_) {}
+  //! Builds a 2D BVH from an array of primitives.
+  //!
+  //! \param primitives The array of primitives to build the BVH for.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding rectangle converter.
+  //!
+  //! \return A BVH built for the specified primitives.
+  template <typename primitive, typename aabb_converter>
+  bvh_type operator () (const primitive* primitives, size_type count, const aabb_converter& converter);
+  //! Builds a 2D BVH, notifying an observer of each build phase.
+  //!
+  //! \param observer Called before and after each phase of the build.
+  //!
+  //! \return A BVH built for the specified primitives.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  bvh_type operator () (const primitive* primitives,
+                        size_type count,
+                        const aabb_converter& converter,
+                        build_observer& observer);
+};
+
+//! \brief Calculates the surface area heuristic cost of a BVH.
+//! This is an estimate of how expensive the BVH is to trace rays
+//! through, which is used to tell how much a refit has degraded it.
+//!
+//! \param b The BVH to get the cost of.
+//!
+//! \param primitives The primitives that the BVH was built for.
+//!
+//! \param converter The primitive to bounding box converter.
+//!
+//! \param scheduler The scheduler to distribute the work with.
+//!
+//! \return The SAH cost of @p b, relative to the area of the root box.
+//! If the BVH is empty, then zero is returned.
+template <typename scalar_type, typename primitive, typename aabb_converter, typename task_scheduler = default_scheduler>
+double sah_cost(const bvh<scalar_type>& b,
+                const primitive* primitives,
+                const aabb_converter& converter,
+                task_scheduler scheduler = task_scheduler());
+
+//! \brief Builds the nodes of a BVH in a constant expression, so that the
+//! BVH of a small, fixed scene can be made at compile time into a static array.
+//!
+//! The build is serial and follows the same steps as @ref builder, with
+//! cubic Morton cells, a heap sort and no allocations. It is meant for
+//! scenes of up to about a thousand primitives, since compilers limit
+//! the number of steps taken in a constant expression. The nodes are traced
+//! without copying them by constructing a @ref traverser from their array.
+//!
+//! \param primitives The primitives to build the BVH for.
+//!
+//! \param converter The primitive to bounding box converter.
+//! For a build at compile time, this has to be usable in a
+//! constant expression, which lambdas are by default.
+//!
+//! \return The internal nodes of the BVH, with the root first.
+template <typename scalar_type, typename primitive, size_type count, typename aabb_converter>
+constexpr std::array<node<scalar_type>, count - 1> build_static(const std::array<primitive, count>& primitives,
+                                                                const aabb_converter& converter) noexcept;
+
+//! \brief Decides when a refit BVH has degraded
+//! enough that it should be rebuilt instead.
+struct rebuild_policy final {
+  //! The BVH is rebuilt once its SAH cost is this many
+  //! times the cost it had right after it was last built.
+  double max_sah_ratio = 1.5;
+  //! Whether or not to rebuild once the extra trace time caused
+  //! by refitting is more than a rebuild would have cost. This only
+  //! has an effect if trace times are reported to the BVH.
+  bool use_break_even = true;
+};
+
+//! \brief Enumerates what was done to a dynamic BVH by an update.
+enum class update_decision {
+  //! The BVH was built for the first time, or for a new primitive count.
+  initial_build,
+  //! The boxes of the BVH were refit.
+  refit,
+  //! The BVH was rebuilt because its SAH cost got too high.
+  rebuild_sah_ratio,
+  //! The BVH was rebuilt because the extra trace time
+  //! of the refit BVH got higher than the cost of a rebuild.
+  rebuild_break_even
+};
+
+//! Gets a human readable name of an update decision.
+//!
+//! \return A null-terminated name of @p decision.
+inline constexpr const char* to_string(update_decision decision) noexcept {
+  switch (decision) {
+    case update_decision::initial_build: return "initial build";
+    case update_decision::refit: return "refit";
+    case update_decision::rebuild_sah_ratio: return "rebuild (SAH ratio)";
+    case update_decision::rebuild_break_even: return "rebuild (break even)";
+  }
+  return "";
+}
+
+//! \brief Describes the last update of a dynamic BVH.
+struct update_report final {
+  //! What was done to the BVH.
+  update_decision decision = update_decision::initial_build;
+  //! The SAH cost of the refit BVH, divided by the cost
+  //! it had after it was last built. If the BVH was rebuilt,
+  //! this is the ratio that caused the rebuild.
+  double sah_ratio = 1;
+  //! The time, in seconds, of the last refit.
+  double refit_seconds = 0;
+  //! The time, in seconds, of the last rebuild.
+  double rebuild_seconds = 0;
+  //! The estimated trace time, in seconds, lost
+  //! to refitting since the BVH was last built.
+  double excess_seconds = 0;
+  //! The number of refits done since the BVH was last built.
+  size_type refit_count = 0;
+  //! The number of times the BVH has been built.
+  size_type rebuild_count = 0;
+};
+
+//! \brief A BVH for primitives that move between frames.
+//!
+//! Each update refits the boxes of the BVH, which is cheap but makes
+//! the BVH slower to trace as the primitives move. The SAH cost of the
+//! refit BVH is compared to the cost it had when it was built, and the
+//! BVH is rebuilt once the ratio goes past the limit of the policy. If
+//! trace times are reported, the BVH is also rebuilt once the trace time
+//! lost to refitting adds up to more than a rebuild costs.
+//!
+//! Rebuilds are done synchronously. To rebuild in the background,
+//! see @ref async_builder.
+//!
+//! \tparam scalar_type The scalar type to use for the box vectors.
+//!
+//! \tparam task_scheduler The scheduler type to use for the builds and refits.
+template <typename scalar_type, typename task_scheduler = default_scheduler>
+class dynamic_bvh final {
+public:
+  //! A type definition for a BVH.
+  using bvh_type = bvh<scalar_type>;
+  //! Constructs a new dynamic BVH.
+  //! The BVH is empty until the first update.
+  //!
+  //! \param policy_ Decides when the BVH is rebuilt.
+  //!
+  //! \param scheduler_ The scheduler to distribute the work with.
+  dynamic_bvh(rebuild_policy policy_ = rebuild_policy(), task_scheduler scheduler_ = task_scheduler())
+    : scheduler(scheduler_), bvh_builder(scheduler_), policy(policy_) {}
+  //! Updates the BVH for primitives that may have moved.
+  //!
+  //! \param primitives The array of primitives to update the BVH for.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \return What was done to the BVH.
+  template <typename primitive, typename aabb_converter>
+  update_decision update(const primitive* primitives, size_type count, const aabb_converter& converter);
+  //! Updates the BVH, notifying an observer of each build phase.
+  //!
+  //! \param observer Called before and after each phase of a rebuild or refit.
+  //!
+  //! \return What was done to the BVH.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  update_decision update(const primitive* primitives, size_type count, const aabb_converter& converter, build_observer& observer);
+  //! Reports how long the current BVH took to trace a frame.
+  //! This is used to tell when the trace time lost to
+  //! refitting is more than the cost of a rebuild.
+  //!
+  //! \param seconds The time spent tracing rays through the BVH.
+  void report_trace_time(double seconds) noexcept;
+  //! Accesses the current BVH.
+  inline const bvh_type& get() const noexcept { return tree; }
+  //! Accesses a description of the last update.
+  inline const update_report& report() const noexcept { return last_report; }
+  //! Accesses the rebuild policy.
+  inline rebuild_policy& get_policy() noexcept { return policy; }
+protected:
+  //! Rebuilds the BVH and resets the refit statistics.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  void rebuild(const primitive* primitives, size_type count, const aabb_converter& converter, build_observer& observer);
+private:
+  //! Used to distribute the SAH work.
+  task_scheduler scheduler;
+  //! Builds and refits the BVH.
+  builder<scalar_type, task_scheduler> bvh_builder;
+  //! The current BVH.
+  bvh_type tree { typename bvh_type::node_vec() };
+  //! Keeps the curve order between rebuilds.
+  rebuild_cache<scalar_type> cache;
+  //! Decides when the BVH is rebuilt.
+  rebuild_policy policy;
+  //! The SAH cost of the BVH right after it was built.
+  double built_sah = 0;
+  //! The SAH ratio of the last refit, used to
+  //! estimate the trace time lost to refitting.
+  double current_ratio = 1;
+  //! The number of primitives that the BVH was built for.
+  size_type primitive_count = 0;
+  //! Describes the last update.
+  update_report last_report;
+};
+
+//! \brief A BVH that only has its top levels built up front.
+//!
+//! The primitives are grouped by the top bits of their Morton codes,
+//! and the top levels are a tree over the groups. The subtree of a
+//! group is built by @ref subtree the first time it's asked for, which
+//! a @ref lazy_traverser does when a ray reaches the box of the group.
+//! Groups that no ray reaches are never built, so the build cost
+//! follows the part of the scene that is actually visited.
+//!
+//! Subtrees may be requested from several threads at once.
+//! Each one is built exactly once, by the first thread to ask.
+//! See @ref builder::build_lazy.
+//!
+//! \tparam scalar_type The scalar type of the BVH boxes.
+//!
+//! \tparam primitive The type of primitive that the BVH is built for.
+//!
+//! \tparam aabb_converter The primitive to bounding box converter.
+template <typename scalar_type, typename primitive, typename aabb_converter>
+class lazy_bvh final {
+public:
+  //! A type definition for a node of the BVH.
+  using node_type = node<scalar_type>;
+  //! A type definition for a primitive index.
+  using index_type = typename node_type::index_type;
+  //! A type definition for a bounding box.
+  using box_type = aabb<scalar_type>;
+  //! A type definition for a Morton code.
+  using code_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+  //! A type definition for a point on the Morton curve.
+  using entry = curve_entry<code_type>;
+  //! Constructs a lazy BVH. This is called by @ref builder::build_lazy.
+  //!
+  //! \param p The primitives that the BVH is built for.
+  //!
+  //! \param c The converter to build the subtrees with.
+  //!
+  //! \param e The Morton curve, with the entries of each group together.
+  //!
+  //! \param offsets The first entry of each group, followed by the entry count.
+  //!
+  //! \param boxes The bounding box of each group.
+  //!
+  //! \param t The tree over the groups, with a leaf for each group.
+  lazy_bvh(const primitive* p,
+           const aabb_converter& c,
+           std::vector<entry>&& e,
+           const std::vector<size_type>& offsets,
+           const std::vector<box_type>& boxes,
+           bvh<scalar_type>&& t);
+  //! Accesses the tree over the groups. Its leaves are group indices.
+  //! There are no nodes if there are less than two groups.
+  inline const bvh<scalar_type>& top() const noexcept {
+    return top_tree;
+  }
+  //! Indicates the number of groups in the BVH.
+  inline size_type cluster_count() const noexcept {
+    return clusters.size();
+  }
+  //! Accesses the bounding box of a group.
+  //! \param c The index of the group.
+  inline const box_type& cluster_box(size_type c) const noexcept {
+    return clusters[c].box;
+  }
+  //! Indicates the number of primitives in a group.
+  //! \param c The index of the group.
+  inline size_type cluster_size(size_type c) const noexcept {
+    return clusters[c].count;
+  }
+  //! Gets the primitive index of an entry in a group.
+  //! The entries of a group aren't sorted until its subtree is built.
+  //!
+  //! \param c The index of the group.
+  //!
+  //! \param i The index of the entry within the group.
+  inline index_type cluster_primitive(size_type c, size_type i) const noexcept {
+    return entries[clusters[c].first + i].primitive;
+  }
+  //! Accesses the primitives that the BVH was built for.
+  inline const primitive* primitive_data() const noexcept {
+    return primitives;
+  }
+  //! Gets the subtree of a group, building it if this is the first
+  //! time it's been asked for. The leaves are primitive indices.
+  //! A group with one primitive has no nodes.
+  //!
+  //! \param c The index of the group.
+  //!
+  //! \return The nodes of the subtree, with the root first.
+  const std::vector<node_type>& subtree(size_type c) const;
+  //! Indicates how many subtrees have been built so far.
+  size_type built_count() const noexcept;
+private:
+  //! \brief A group of primitives that share their top code bits.
+  struct cluster final {
+    //! The bounding box of the primitives in the group.
+    box_type box;
+    //! The first entry of the group.
+    size_type first = 0;
+    //! The number of entries in the group.
+    size_type count = 0;
+    //! The nodes of the subtree, once it's built.
+    std::vector<node_type> nodes;
+#ifndef LBVH_NO_THREADS
+    //! Makes sure that the subtree is built by one thread.
+    std::once_flag once;
+    //! Indicates whether or not the subtree has been built.
+    std::atomic<bool> built { false };
+#else
+    //! Indicates whether or not the subtree has been built.
+    bool built = false;
+#endif
+  };
+  //! Builds the subtree of a group.
+  //! \param c The group to build the subtree of.
+  void build_subtree(cluster& c) const;
+  //! The primitives that the BVH is built for.
+  const primitive* primitives;
+  //! The converter that the subtrees are built with.
+  aabb_converter converter;
+  //! The Morton curve, with the entries of each group together.
+  std::vector<entry> entries;
+  //! The groups of the BVH. The subtrees are built when
+  //! the BVH is traversed, which is a const operation.
+  mutable std::vector<cluster> clusters;
+  //! The tree over the groups.
+  bvh<scalar_type> top_tree;
+};
+
+//! \brief Builds a BVH a slice at a time, so that a build
+//! can be spread over the frames of an interactive application.
+//!
+//! The build goes through the same phases as a @ref builder build,
+//! but on the calling thread. Each phase is split into slices of a
+//! fixed number of primitives, and @ref run works through slices until
+//! its time budget is used up. The previous BVH can be traced between
+//! calls, and the new one is taken with @ref release once it's done.
+//!
+//! The curve is sorted with a radix sort, since each of its passes
+//! can be stopped after any slice. The radix sort is stable and starts
+//! in primitive order, so entries with equal codes end up in the order
+//! of @ref detail::curve_less, and the BVH is the same as a @ref builder
+//! with the same quantization would make. The primitives may not be
+//! changed until the build is done.
+//!
+//! \tparam scalar_type The scalar type of the BVH boxes.
+//!
+//! \tparam primitive The type of primitive that the BVH is built for.
+//!
+//! \tparam aabb_converter The primitive to bounding box converter.
+template <typename scalar_type, typename primitive, typename aabb_converter>
+class incremental_builder final {
+public:
+  //! A type definition for the BVH being built.
+  using bvh_type = bvh<scalar_type>;
+  //! A type definition for a node of the BVH.
+  using node_type = node<scalar_type>;
+  //! Starts a new build. No work is done until @ref run or @ref step is called.
+  //!
+  //! \param p The primitives to build the BVH for.
+  //!
+  //! \param c The number of primitives in the primitive array.
+  //!
+  //! \param cvt The primitive to bounding box converter.
+  //!
+  //! \param s The number of primitives to process in each slice.
+  //!
+  //! \param q How centroids are mapped to Morton cells.
+  incremental_builder(const primitive* p,
+                      size_type c,
+                      const aabb_converter& cvt,
+                      size_type s = 4096,
+                      morton_quantization q = morton_quantization::cube);
+  //! Works on the build until it's done or the time budget is used up.
+  //! At least one slice is done per call, so the build always makes progress.
+  //!
+  //! \param budget The time to spend on the build.
+  //!
+  //! \return True if the build is done.
+  bool run(std::chrono::microseconds budget);
+  //! Does the next slice of the build.
+  //!
+  //! \return True if the build is done.
+  bool step();
+  //! Indicates whether or not the build is done.
+  inline bool done() const noexcept {
+    return finished;
+  }
+  //! Indicates the phase that the next slice belongs to.
+  inline build_phase phase() const noexcept {
+    return current_phase;
+  }
+  //! Indicates the number of slices done so far.
+  inline size_type slices_done() const noexcept {
+    return slice_total;
+  }
+  //! Moves the BVH out of the builder. This should
+  //! only be called once the build is done.
+  bvh_type release() noexcept {
+    return bvh_type(std::move(nodes));
+  }
+private:
+  //! A type definition for a Morton code.
+  using code_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+  //! A type definition for a point on the Morton curve.
+  using entry = curve_entry<code_type>;
+  //! The number of code bits sorted by each radix sort pass.
+  static constexpr size_type radix_bits = 8;
+  //! Moves on to a phase, starting from its first slice.
+  //! \param p The phase to move on to.
+  void begin(build_phase p);
+  //! Does a slice of a radix sort pass. The codes are counted in the
+  //! first half of the pass and moved into place in the second half.
+  void sort_slice();
+  //! Does a slice of the box fitting. The nodes are put into breadth
+  //! first order in the first half, and fit in reverse in the second.
+  void fit_slice();
+  //! The primitives that the BVH is built for.
+  const primitive* primitives;
+  //! The number of primitives in the primitive array.
+  size_type count;
+  //! The primitive to bounding box converter.
+  aabb_converter converter;
+  //! How centroids are mapped to Morton cells.
+  morton_quantization quantization;
+  //! The number of slices that a pass over the primitives is divided into.
+  size_type slice_count;
+  //! The number of code bits to sort.
+  size_type code_bits = 0;
+  //! The phase that the next slice belongs to.
+  build_phase current_phase = build_phase::centroid_bounds;
+  //! The next slice of the current phase, or of the current
+  //! half of a sort pass or the box fitting.
+  size_type slice = 0;
+  //! The number of slices done so far.
+  size_type slice_total = 0;
+  //! Indicates whether or not the build is done.
+  bool finished = false;
+  //! The centroid bounds of each slice of the primitives.
+  std::vector<aabb<scalar_type>> slice_boxes;
+  //! The bounds of all primitive centroids.
+  aabb<scalar_type> centroid_bounds {};
+  //! The Morton curve.
+  std::vector<entry> entries;
+  //! The entries being moved into place by a sort pass.
+  std::vector<entry> sorted_entries;
+  //! The lowest code bit of the current sort pass.
+  size_type radix_shift = 0;
+  //! Indicates whether the current sort pass is moving entries.
+  bool radix_moving = false;
+  //! The code counts of the current sort pass, which
+  //! become the next place of each code when moving.
+  std::vector<size_type> radix_offsets;
+  //! The nodes being built.
+  std::vector<node_type> nodes;
+  //! The breadth first order of the nodes, used to fit them.
+  std::vector<size_type> fit_order;
+  //! Indicates whether or not the nodes are being fit.
+  bool fitting = false;
+};
+
+#ifndef LBVH_NO_THREADS
+
+//! \brief Holds the BVH that is currently in use, while
+//! allowing a new BVH to be swapped in at any time.
+//!
+//! Readers never block. Each reader announces the epoch it
+//! started reading in, and a replaced BVH is only deleted once
+//! every reader that could have seen it has finished reading.
+//!
+//! Each reader thread is given a fixed slot, similar to the
+//! work division index given to threads by a scheduler. A slot
+//! may only be used by one thread at a time, and reads on the
+//! same slot may not be nested.
+//!
+//! \tparam scalar_type The scalar type of the BVH boxes.
+template <typename scalar_type>
+class concurrent_bvh final {
+public:
+  //! A type definition for the BVH being held.
+  using bvh_type = bvh<scalar_type>;
+  //! \brief Keeps a BVH alive while it is being read.
+  class read_guard final {
+    //! The epoch slot of the reader, or null if released.
+    std::atomic<std::uint64_t>* slot;
+    //! The BVH being read. This may be null if no
+    //! BVH has been published yet.
+    const bvh_type* tree;
+  public:
+    //! Constructs a new read guard.
+    //! This is called by @ref concurrent_bvh::read.
+    read_guard(std::atomic<std::uint64_t>* s, const bvh_type* t) noexcept
+      : slot(s), tree(t) {}
+    //! Moves a read guard.
+    read_guard(read_guard&& other) noexcept
+      : slot(other.slot), tree(other.tree) {
+      other.slot = nullptr;
+      other.tree = nullptr;
+    }
+    //! Ends the read, allowing the BVH to be reclaimed.
+    ~read_guard() {
+      if (slot) {
+        slot->store(0);
+      }
+    }
+    //! Indicates if there is a BVH to read.
+    inline operator bool () const noexcept {
+      return tree != nullptr;
+    }
+    //! Accesses the BVH being read.
+    inline const bvh_type& operator * () const noexcept {
+      return *tree;
+    }
+    //! Accesses the BVH being read.
+    inline const bvh_type* operator -> () const noexcept {
+      return tree;
+    }
+
+    read_guard(const read_guard&) = delete;
+    read_guard& operator = (const read_guard&) = delete;
+    read_guard& operator = (read_guard&&) = delete;
+  };
+  //! Constructs a new concurrent BVH, without a BVH to read yet.
+  //!
+  //! \param max_readers The maximum number of threads that may read at a time.
+  concurrent_bvh(size_type max_readers = std::thread::hardware_concurrency())
+    : reader_count(max_readers ? max_readers : 1),
+      readers(new reader_slot[reader_count]) {}
+  //! Deletes the current BVH and all replaced BVHs.
+  //! There should be no readers left at this point.
+  ~concurrent_bvh() {
+    for (const auto& r : retired) {
+      delete r.tree;
+    }
+    delete current.load();
+  }
+  //! Begins reading the current BVH.
+  //! This function does not block and does not allocate memory.
+  //!
+  //! \param reader_index The slot of the calling thread.
+  //! This must be less than the maximum number of readers.
+  //!
+  //! \return A guard that keeps the current BVH alive until it is destroyed.
+  read_guard read(size_type reader_index) noexcept {
+
+    auto& slot = readers[reader_index].epoch;
+
+    slot.store(global_epoch.load());
+
+    return read_guard(&slot, current.load());
+  }
+  //! Replaces the current BVH. The replaced BVH is deleted once all
+  //! readers that may have seen it are done with it.
+  //!
+  //! \param b The BVH to make current.
+  void publish(bvh_type&& b) {
+
+    auto* next = new bvh_type(std::move(b));
+
+    std::lock_guard<std::mutex> lock(writer_mutex);
+
+    auto* prev = current.exchange(next);
+
+    // Any reader announcing this epoch or a later one
+    // is guaranteed to load the new BVH.
+    auto retire_epoch = global_epoch.fetch_add(1) + 1;
+
+    if (prev) {
+      retired.push_back(retired_tree { retire_epoch, prev });
+    }
+
+    reclaim_retired();
+  }
+  //! Deletes the replaced BVHs that are no longer being read.
+  //! This is also done each time a BVH is published.
+  //!
+  //! \return The number of replaced BVHs still waiting for readers to finish.
+  size_type reclaim() {
+
+    std::lock_guard<std::mutex> lock(writer_mutex);
+
+    reclaim_retired();
+
+    return retired.size();
+  }
+
+  concurrent_bvh(const concurrent_bvh&) = delete;
+  concurrent_bvh& operator = (const concurrent_bvh&) = delete;
+protected:
+  //! Deletes retired BVHs that no reader can be holding.
+  //! The writer mutex must be locked by the caller.
+  void reclaim_retired() {
+
+    auto oldest_epoch = std::numeric_limits<std::uint64_t>::max();
+
+    for (size_type i = 0; i < reader_count; i++) {
+      auto reader_epoch = readers[i].epoch.load();
+      if (reader_epoch) {
+        oldest_epoch = std::min(oldest_epoch, reader_epoch);
+      }
+    }
+
+    auto is_unused = [oldest_epoch](const retired_tree& r) {
+      return r.epoch <= oldest_epoch;
+    };
+
+    for (const auto& r : retired) {
+      if (is_unused(r)) {
+        delete r.tree;
+      }
+    }
+
+    retired.erase(std::remove_if(retired.begin(), retired.end(), is_unused), retired.end());
+  }
+private:
+  //! The epoch announced by a reader.
+  //! Aligned to avoid false sharing between readers.
+  struct alignas(64) reader_slot final {
+    //! The epoch at which the read started,
+    //! or zero if the reader isn't reading.
+    std::atomic<std::uint64_t> epoch { 0 };
+  };
+  //! A BVH that was replaced, but may still be read.
+  struct retired_tree final {
+    //! The epoch at which the BVH was replaced.
+    std::uint64_t epoch;
+    //! The replaced BVH.
+    const bvh_type* tree;
+  };
+  //! The BVH given to new readers.
+  std::atomic<const bvh_type*> current { nullptr };
+  //! Incremented each time a BVH is published.
+  //! Starts at one, since zero indicates an inactive reader.
+  std::atomic<std::uint64_t> global_epoch { 1 };
+  //! The maximum number of readers.
+  size_type reader_count;
+  //! The epoch slot of each reader.
+  std::unique_ptr<reader_slot[]> readers;
+  //! Serializes the writers.
+  std::mutex writer_mutex;
+  //! The BVHs waiting for readers to finish.
+  std::vector<retired_tree> retired;
+};
+
+//! \brief Builds BVHs on a background thread,
+//! publishing them into a @ref concurrent_bvh when done.
+//!
+//! This allows a renderer to keep tracing the current
+//! BVH while the next one is being built.
+//!
+//! \tparam scalar_type The scalar type to use for the box vectors.
+//!
+//! \tparam task_scheduler The scheduler used by the background build.
+//! This is usually given fewer threads than the renderer.
+template <typename scalar_type, typename task_scheduler = default_scheduler>
+class async_builder final {
+  //! The scheduler passed to each background build.
+  task_scheduler scheduler;
+public:
+  //! A type definition for the BVH target.
+  using target_type = concurrent_bvh<scalar_type>;
+  //! Constructs a new asynchronous builder.
+  //! \param scheduler_ The scheduler to distribute the build work with.
+  async_builder(task_scheduler scheduler_ = task_scheduler())
+    : scheduler(scheduler_) {}
+  //! Starts building a BVH in the background.
+  //!
+  //! \param primitives The array of primitives to build the BVH for.
+  //! The array must not be modified or freed until the build is done.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \param target The object to publish the BVH to when it's built.
+  //!
+  //! \return A future that becomes ready once the BVH is published.
+  //! Like any future returned by `std::async`, destroying it waits for
+  //! the build to finish, so it should be kept until the build is done.
+  template <typename primitive, typename aabb_converter>
+  std::future<void> operator () (const primitive* primitives, size_type count, aabb_converter converter, target_type& target) {
+    return std::async(std::launch::async, [sched = scheduler, primitives, count, converter, &target]() {
+      builder<scalar_type, task_scheduler> b(sched);
+      target.publish(b(primitives, count, converter));
+    });
+  }
+  //! Starts building a BVH in the background, and then optimizing it.
+  //! The BVH is published once it's built, so it can be traced right
+  //! away, and published again once it's optimized.
+  //!
+  //! \param budget Limits how long the BVH is optimized for.
+  //!
+  //! \return A future that becomes ready once the optimized BVH is published.
+  template <typename primitive, typename aabb_converter>
+  std::future<void> operator () (const primitive* primitives,
+                                 size_type count,
+                                 aabb_converter converter,
+                                 target_type& target,
+                                 const optimize_budget& budget) {
+    return std::async(std::launch::async, [sched = scheduler, primitives, count, converter, &target, budget]() {
+      builder<scalar_type, task_scheduler> b(sched);
+      auto tree = b(primitives, count, converter);
+      auto optimized = tree;
+      target.publish(std::move(tree));
+      b.optimize(optimized, primitives, converter, budget);
+      target.publish(std::move(optimized));
+    });
+  }
+};
+
+#endif // LBVH_NO_THREADS
+
+//! \brief This structure contains basic information
+//! regarding a ray intersection with a BVH. It's not
+//! required to be used. Other intersection structures
+//! can be used as long as they implement the '<' comparison
+//! operator (based on distance) and boolean operator (indicates
+//! whether or not a hit occurred.
+template <typename scalar_type>
+struct intersection final {
+  //! A type definition for an index, used for tracking the intersected primitive.
+  using index = typename associated_types<sizeof(scalar_type)>::uint_type;
+  //! The distance factor between the ray and primitive.
+  scalar_type distance = std::numeric_limits<scalar_type>::infinity();
+  //! The normal at the point of intersection.
+  vec3<scalar_type> normal {};
+  //! The UV coordinates at the point of intersection.
+  vec2<scalar_type> uv {};
+  //! The index of the primitive that the intersection was made with.
+  index primitive = highest_bit<index>();
+  //! Indicates whether or not an intersection was made.
+  //!
+  //! \return True if this intersection has valid intersection data.
+  //! False if it does not and no intersection was made.
+  operator bool () const noexcept {
+    return distance < std::numeric_limits<scalar_type>::infinity();
+  }
+  //! Compares two intersection instances.
+  //!
+  //! \return True if @p a has a distance factor less than @p b.
+  bool operator < (const intersection<scalar_type>& other) const noexcept {
+    return (distance < other.distance);
+  }
+  //! Compares the intersection distance with another distance.
+  //!
+  //! \return True if this intersection is less than @p t.
+  bool operator < (scalar_type t) const noexcept {
+    return distance < t;
+  }
+};
+
+//! \brief Contains data for a single ray.
+//!
+//! \tparam scalar_type The type used for the vector components.
+template <typename scalar_type>
+struct ray final {
+  //! A type definition for vectors used by the ray class.
+  using vec_type = vec3<scalar_type>;
+  //! The starting position of the ray.
+  vec_type pos;
+  //! The direction at which the ray is pointing at.
+  //! Usually, this is not normalized.
+  vec_type dir;
+};
+
+//! \brief Represents a single ray with
+//! precomputed acceleration data.
+//!
+//! \tparam scalar_type The scalar type of the vector components.
+template <typename scalar_type>
+struct accel_ray final {
+  //! A type definition for the ray used by this structure.
+  using ray_type = ray<scalar_type>;
+  //! A type definition for vector types used by this structure.
+  using vec3_type = vec3<scalar_type>;
+  //! The type to use for octant indices.
+  using index_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+  //! The original ray from which the acceleration
+  //! data was computed.
+  ray_type r;
+  //! The reciprocal direction vector.
+  vec3_type rcp_dir;
+  //! The inverse position vector.
+  vec3_type inv_pos;
+  //! The indices for the octant that the ray falls into.
+  index_type octants[3];
+  //! The inverse octant indices.
+  index_type inv_octants[3];
+};
+
+//! \brief A packet of 3D vectors,
+//! arranged for decent alignment.
+//!
+//! \tparam scalar_type The type of the vector components.
+//!
+//! \tparam dimensions The number of dimensions in the vector.
+//!
+//! \tparam count The number of elements per dimension.
+template <typename scalar_type,
+          size_type dimensions,
+          size_type count>
+struct vec_packet final {
+  //! Indicates the total number of scalars in this vector packet.
+  static inline constexpr size_type value_count() noexcept {
+    return dimensions * count;
+  }
+  //! Indicates the number of scalars per dimension.
+  static inline constexpr size_type size() noexcept {
+    return count;
+  }
+  //! Accesses a pointer to a dimension within the vector packet.
+  //!
+  //! \param d The index of the dimension to get the values of.
+  //!
+  //! \return A pointer to the start of the dimension values.
+  inline auto* operator [] (size_type d) noexcept {
+    return &values[d * count];
+  }
+  //! Accesses a pointer to a dimension within the vector packet.
+  //!
+  //! \param d The index of the dimension to get the values of.
+  //!
+  //! \return A pointer to the start of the dimension values.
+  inline const auto* operator [] (size_type d) const noexcept {
+    return &values[d * count];
+  }
+  //! The values of the vector packet.
+  //! Dimensions are non-interleaved in this array.
+  scalar_type values[value_count()] {};
+};
+
+//! This class is used to store a packet of rays.
+//! A packet of rays can be traversed faster than
+//! one ray at a time because it leads to better
+//! caching, auto-vectorization, and better coherency.
+//!
+//! \tparam scalar_type The type to use for vector components.
+//!
+//! \tparam count The maximum number of rays to put into the packet.
+template <typename scalar_type, size_type count>
+struct ray_packet final {
+  //! A type definition for ray indices.
+  using index_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+  //! The position vectors of the rays.
+  vec_packet<scalar_type, 3, count> pos;
+  //! The direction vectors of the rays.
+  vec_packet<scalar_type, 3, count> dir;
+  //! The reciprocal direction vectors.
+  vec_packet<scalar_type, 3, count> rcp_dir;
+  //! These are the indices that each ray corresponds to.
+  //! Since a ray packet may be sorted multiple times
+  //! throughout a BVH traversal, tracking their original
+  //! indices allows them to be reordered after a BVH
+  //! node is exited.
+  index_type indices[count];
+};
+
+//! \brief This class is used for traversing a BVH.
+//!
+//! Defining `LBVH_PREFETCH_DISTANCE` to a positive number enables
+//! software prefetching during traversal. The children of each visited
+//! node are prefetched, as well as the node that's this many entries
+//! deep in the traversal stack.
+//!
+//! \tparam scalar_type The floating point type to use for vector components.
+//!
+//! \tparam primitive_type The type of the primitive being checked for intersection.
+//!
+//! \tparam intersection_type The type used for indicating intersections.
+template <typename scalar_type,
+          typename primitive_type,
+          typename intersection_type = intersection<scalar_type>>
+class traverser final {
+  //! A reference to the BVH being traversed.
+  const bvh<scalar_type>& bvh_;
+  //! The primitives to check for intersection.
+  const primitive_type* primitives;
+  //! The primitive index of each leaf, or null if
+  //! the leaves are primitive indices themselves.
+  //! With a leaf table, these are the primitives of the table.
+  const typename node<scalar_type>::index_type* references = nullptr;
+  //! The offsets of the leaves in a leaf table,
+  //! or null if each leaf has one primitive.
+  const typename node<scalar_type>::index_type* leaf_offsets = nullptr;
+public:
+  //! A type definition for a ray.
+  using ray_type = ray<scalar_type>;
+  //! A type definition for a primitive index.
+  using index_type = typename node<scalar_type>::index_type;
+  //! Constructs a new traverser instance.
+  //! \param b The BVH to be traversed.
+  //! \param p The primitives to check for intersection in each box.
+  constexpr traverser(const bvh<scalar_type>& b, const primitive_type* p) noexcept
+    : bvh_(b), primitives(p) {}
+  //! Constructs a new traverser for a BVH whose leaves are references
+  //! to primitives, such as one made by @ref builder::build_split.
+  //! Primitives with several references are intersected once per ray.
+  //! \param b The BVH to be traversed.
+  //! \param p The primitives to check for intersection in each box.
+  //! \param r The primitive index of each leaf.
+  constexpr traverser(const bvh<scalar_type>& b, const primitive_type* p, const index_type* r) noexcept
+    : bvh_(b), primitives(p), references(r) {}
+  //! Constructs a new traverser for a BVH with multi-primitive leaves,
+  //! such as one made by @ref builder::build_clustered.
+  //! \param b The BVH to be traversed.
+  //! \param p The primitives to check for intersection in each box.
+  //! \param leaves The primitives of each leaf. This has
+  //! to stay alive for as long as the traverser is used.
+  traverser(const bvh<scalar_type>& b, const primitive_type* p, const leaf_table<scalar_type>& leaves) noexcept
+    : bvh_(b), primitives(p), references(leaves.primitives.data()), leaf_offsets(leaves.offsets.data()) {}
+  //! \brief Traverses the BVH, returning the closest intersection that was made.
+  //!
+  //! \tparam intersector_type Defined by the caller as a function object that
+  //! takes a primitive and a ray and returns an instance of @ref intersection_type
+  //! that indicates whether or not a hit was made.
+  //!
+  //! \return The closest intersection. A BVH without nodes, such
+  //! as one built for less than two primitives, is never hit.
+  template <typename intersector_type>
+  intersection_type operator () (const ray_type& ray, const intersector_type& intersector) const noexcept;
+};
+
+//! \brief Traverses BVH nodes that aren't in a @ref bvh, such as
+//! the static array made by @ref build_static. Each leaf is the
+//! index of one primitive.
+//!
+//! \tparam scalar_type The floating point type to use for vector components.
+//!
+//! \tparam primitive_type The type of the primitive being checked for intersection.
+//!
+//! \tparam intersection_type The type used for indicating intersections.
+template <typename scalar_type,
+          typename primitive_type,
+          typename intersection_type = intersection<scalar_type>>
+class node_traverser final {
+  //! The nodes being traversed, with the root first.
+  const node<scalar_type>* nodes;
+  //! The primitives to check for intersection.
+  const primitive_type* primitives;
+public:
+  //! A type definition for a ray.
+  using ray_type = ray<scalar_type>;
+  //! A type definition for a primitive index.
+  using index_type = typename node<scalar_type>::index_type;
+  //! Constructs a new node traverser. The nodes are
+  //! referred to, so they have to outlive the traverser.
+  //! \param n The nodes to be traversed, with the root first.
+  //! \param p The primitives to check for intersection in each box.
+  constexpr node_traverser(const node<scalar_type>* n, const primitive_type* p) noexcept
+    : nodes(n), primitives(p) {}
+  //! \brief Traverses the nodes, returning the closest intersection that was made.
+  //!
+  //! \tparam intersector_type Defined by the caller as a function object that
+  //! takes a primitive and a ray and returns an instance of @ref intersection_type
+  //! that indicates whether or not a hit was made.
+  template <typename intersector_type>
+  intersection_type operator () (const ray_type& ray, const intersector_type& intersector) const noexcept;
+};
+
+//! \brief Runs point and rectangle queries on a 2D BVH.
+//!
+//! The nodes are visited if their boxes contain the point or overlap
+//! the rectangle. Every primitive reached this way is passed to a tester
+//! defined by the caller, which decides whether the primitive is a hit.
+//! A tester that only compares boxes gives the primitives whose boxes
+//! contain the point or overlap the rectangle.
+//!
+//! \tparam scalar_type The scalar type of the BVH rectangles.
+//!
+//! \tparam primitive_type The type of primitive being queried.
+template <typename scalar_type, typename primitive_type>
+class traverser2 final {
+  //! A reference to the BVH being traversed.
+  const bvh2<scalar_type>& bvh_;
+  //! The primitives that the BVH was built for.
+  const primitive_type* primitives;
+public:
+  //! A type definition for a primitive index.
+  using index_type = typename node2<scalar_type>::index_type;
+  //! Constructs a new 2D traverser.
+  //! \param b The BVH to be traversed.
+  //! \param p The primitives that the BVH was built for.
+  constexpr traverser2(const bvh2<scalar_type>& b, const primitive_type* p) noexcept
+    : bvh_(b), primitives(p) {}
+  //! \brief Finds the primitives at a point.
+  //!
+  //! \tparam point_tester Defined by the caller as a function object that
+  //! takes a primitive and a point and returns true if the primitive is hit.
+  //!
+  //! \param hits Receives the index of each primitive that was hit.
+  //! The indices are added to the end of the vector.
+  template <typename point_tester>
+  void operator () (const vec2<scalar_type>& point, const point_tester& tester, std::vector<index_type>& hits) const;
+  //! \brief Finds the primitives within a rectangle.
+  //!
+  //! \tparam rect_tester Defined by the caller as a function object that
+  //! takes a primitive and a rectangle and returns true if the primitive is hit.
+  //!
+  //! \param hits Receives the index of each primitive that was hit.
+  //! The indices are added to the end of the vector.
+  template <typename rect_tester>
+  void operator () (const aabb2<scalar_type>& rect, const rect_tester& tester, std::vector<index_type>& hits) const;
+private:
+  //! Visits the nodes whose boxes pass a box test,
+  //! and passes the primitives of their leaves to a tester.
+  template <typename box_test, typename primitive_test>
+  void query(const box_test& test_box, const primitive_test& test_primitive, std::vector<index_type>& hits) const;
+};
+
+//! \brief Traverses a BVH built over the references of a @ref primitive_set.
+//! Each reference reached by the ray is passed to the intersector overload
+//! for its type, so one traversal covers every primitive type of the scene.
+//!
+//! \tparam scalar_type The scalar type of the BVH boxes.
+//!
+//! \tparam intersection_type The type used for indicating intersections.
+//! The intersector overloads of every type have to return this type.
+//!
+//! \tparam primitive_types The types of primitives in the set.
+template <typename scalar_type, typename intersection_type, typename... primitive_types>
+class tagged_traverser final {
+public:
+  //! A type definition for a ray.
+  using ray_type = ray<scalar_type>;
+  //! A type definition for a primitive index.
+  using index_type = typename node<scalar_type>::index_type;
+  //! A type definition for a primitive reference.
+  using reference_type = tagged_primitive<index_type>;
+  //! A type definition for the set of primitive arrays.
+  using set_type = primitive_set<primitive_types...>;
+private:
+  //! Traverses the BVH over the references.
+  traverser<scalar_type, reference_type, intersection_type> references;
+  //! The primitive arrays that the references point into.
+  const set_type& primitives;
+public:
+  //! Constructs a new tagged traverser.
+  //! \param b The BVH to be traversed.
+  //! \param r The references that the BVH was built for.
+  //! \param p The primitive arrays that the references point into.
+  constexpr tagged_traverser(const bvh<scalar_type>& b, const reference_type* r, const set_type& p) noexcept
+    : references(b, r), primitives(p) {}
+  //! \brief Traverses the BVH, returning the closest intersection that was made.
+  //! The primitive index of the intersection is the position of the
+  //! reference that was hit, which gives both its type and its index.
+  //!
+  //! \tparam intersector_type A function object with an overload for each
+  //! primitive type, that takes the primitive and a ray and returns an
+  //! instance of @ref intersection_type.
+  template <typename intersector_type>
+  intersection_type operator () (const ray_type& ray, const intersector_type& intersector) const noexcept;
+};
+
+//! \brief Traverses a @ref lazy_bvh, building its subtrees as they're reached.
+//!
+//! A group's subtree is only built once a ray hits the box of the group
+//! before hitting anything closer. Rays may be traced from several threads.
+//!
+//! \tparam scalar_type The scalar type of the BVH boxes.
+//!
+//! \tparam primitive_type The type of primitive being checked for intersection.
+//!
+//! \tparam aabb_converter The converter type of the lazy BVH.
+//!
+//! \tparam intersection_type The type used for indicating intersections.
+template <typename scalar_type,
+          typename primitive_type,
+          typename aabb_converter,
+          typename intersection_type = intersection<scalar_type>>
+class lazy_traverser final {
+public:
+  //! A type definition for a ray.
+  using ray_type = ray<scalar_type>;
+  //! A type definition for a primitive index.
+  using index_type = typename node<scalar_type>::index_type;
+  //! A type definition for the BVH being traversed.
+  using lazy_bvh_type = lazy_bvh<scalar_type, primitive_type, aabb_converter>;
+  //! Constructs a new lazy traverser.
+  //! \param b The lazy BVH to be traversed.
+  constexpr lazy_traverser(const lazy_bvh_type& b) noexcept : lazy(b) {}
+  //! \brief Traverses the BVH, returning the closest intersection that was made.
+  //!
+  //! \tparam intersector_type Defined by the caller as a function object that
+  //! takes a primitive and a ray and returns an instance of @ref intersection_type
+  //! that indicates whether or not a hit was made.
+  template <typename intersector_type>
+  intersection_type operator () (const ray_type& ray, const intersector_type& intersector) const;
+private:
+  //! The lazy BVH being traversed.
+  const lazy_bvh_type& lazy;
+};
+
+//! \brief Contains the associated types for 32-bit sizes.
+template <>
+struct associated_types<4> final {
+  //! The unsigned integer type to use for 32-bit types.
+  using uint_type = std::uint32_t;
+  //! The signed integer type to use for 32-bit types.
+  using int_type = std::int32_t;
+  //! The floating point type to use for 32-bit types.
+  using float_type = float;
+};
+
+//! \brief Contains the associated types for 64-bit sizes.
+template <>
+struct associated_types<8> final {
+  //! The unsigned integer type to use for 64-bit types.
+  using uint_type = std::uint64_t;
+  //! The signed integer type to use for 64-bit types.
+  using int_type = std::int64_t;
+  //! The floating point type to use for 64-bit types.
+  using float_type = double;
+};
+
+//! \brief This namespace contains various math routines
+//! for scalar and vector types. It may be useful to the
+//! user when writing intersection functions or primitive
+//! to box conversions.
+namespace math {
+
+//! \brief Calculates the minimum of two scalar values.
+template <typename scalar_type>
+inline constexpr scalar_type min(scalar_type a, scalar_type b) noexcept {
+  return (a < b) ? a : b;
+}
+
+//! \brief Calculates the maximum of two scalar values.
+template <typename scalar_type>
+inline constexpr scalar_type max(scalar_type a, scalar_type b) noexcept {
+  return (a > b) ? a : b;
+}
+
+//! \brief Calculates the Hadamard quotient of two vectors.
+//!
+//! \tparam scalar_type The scalar type of the vector components.
+//!
+//! \return The Hadamard quotient of the two vectors.
+template <typename scalar_type>
+auto hadamard_div(const vec3<scalar_type>& a,
+                  const vec3<scalar_type>& b) noexcept {
+  return vec3<scalar_type> {
+    a.x / b.x,
+    a.y / b.y,
+    a.z / b.z
+  };
+}
+
+//! \brief Calculates the Hadamard product of two vectors.
+//!
+//! \tparam scalar_type The scalar type of the vector components.
+//!
+//! \return The Hadamard product of the two vectors.
+template <typename scalar_type>
+constexpr auto hadamard_mul(const vec3<scalar_type>& a,
+                            const vec3<scalar_type>& b) noexcept {
+  return vec3<scalar_type> {
+    a.x * b.x,
+    a.y * b.y,
+    a.z * b.z
+  };
+}
+
+//! \brief Calculates the cross product between two 3D vectors.
+//!
+//! \return The cross product of @p a and @p b.
+template <typename scalar_type>
+inline constexpr vec3<scalar_type> cross(const vec3<scalar_type>& a,
+                                         const vec3<scalar_type>& b) noexcept {
+  return vec3<scalar_type> {
+    (a.y * b.z) - (a.z * b.y),
+    (a.z * b.x) - (a.x * b.z),
+    (a.x * b.y) - (a.y * b.x)
+  };
+}
+
+//! \brief Calculates the dot product of two 3D vectors.
+//!
+//! \return The dot product of @p a and @p b.
+template <typename scalar_type>
+inline constexpr scalar_type dot(const vec3<scalar_type>& a,
+                                 const vec3<scalar_type>& b) noexcept {
+  scalar_type out = 0;
+  out += a.x * b.x;
+  out += a.y * b.y;
+  out += a.z * b.z;
+  return out;
+}
+
+//! \brief Calculates the minimum between two vectors.
+//! This is used frequently in bounding box calculations.
+//!
+//! \tparam scalar_type The scalar type of the vector components.
+//!
+//! \return A vector containing the minimum components between @p a and @p b.
+template <typename scalar_type>
+constexpr auto min(const vec3<scalar_type>& a,
+                   const vec3<scalar_type>& b) noexcept {
+
+  return vec3<scalar_type> {
+    std::min(a.x, b.x),
+    std::min(a.y, b.y),
+    std::min(a.z, b.z)
+  };
+}
+
+//! \brief Calculates the maximum between two vectors.
+//! This is used frequently in bounding box calculations.
+//!
+//! \tparam scalar_type The scalar type of the vector components.
+//!
+//! \return A vector containing the maximum components between @p a and @p b.
+template <typename scalar_type>
+constexpr auto max(const vec3<scalar_type>& a,
+                   const vec3<scalar_type>& b) noexcept {
+
+  return vec3<scalar_type> {
+    std::max(a.x, b.x),
+    std::max(a.y, b.y),
     std::max(a.z, b.z)
   };
 }
 
-//! \brief Calculates a vector with reciprocal values of another vector.
-//! This is used for ray-box intersection acceleration.
-//!
-//! \tparam scalar_type The type used for vector components.
-//!
-//! \return A vector with reciprocal values of @p in.
-template <typename scalar_type>
-auto reciprocal(const vec3<scalar_type>& in) noexcept {
-  return vec3<scalar_type> {
-    1 / in.x,
-    1 / in.y,
-    1 / in.z
-  };
+//! \brief Calculates a vector with reciprocal values of another vector.
+//! This is used for ray-box intersection acceleration.
+//!
+//! \tparam scalar_type The type used for vector components.
+//!
+//! \return A vector with reciprocal values of @p in.
+template <typename scalar_type>
+auto reciprocal(const vec3<scalar_type>& in) noexcept {
+  return vec3<scalar_type> {
+    1 / in.x,
+    1 / in.y,
+    1 / in.z
+  };
+}
+
+//! \brief Calculates the sum of two vectors.
+//!
+//! \tparam scalar_type The type of the vector components.
+//!
+//! \return The sum of @p a and @p b, as a vector.
+template <typename scalar_type>
+constexpr auto operator + (const vec3<scalar_type>& a,
+                           const vec3<scalar_type>& b) noexcept {
+  return vec3<scalar_type> {
+    a.x + b.x,
+    a.y + b.y,
+    a.z + b.z
+  };
+}
+
+//! \brief Calculates the difference between two vectors.
+//!
+//! \tparam scalar_type The type of the vector components.
+//!
+//! \return The difference between @p a and @p b, as a vector.
+template <typename scalar_type>
+constexpr auto operator - (const vec3<scalar_type>& a,
+                           const vec3<scalar_type>& b) noexcept {
+  return vec3<scalar_type> {
+    a.x - b.x,
+    a.y - b.y,
+    a.z - b.z
+  };
+}
+
+//! \brief Negates a vector.
+//!
+//! \return The negated result of @p in.
+template <typename scalar_type>
+inline auto operator - (const vec3<scalar_type>& in) noexcept {
+  return vec3<scalar_type> {
+    -in.x,
+    -in.y,
+    -in.z
+  };
+}
+
+//! \brief Calculates the product between a vector and a scalar value.
+//!
+//! \tparam scalar_type The scalar type of the vector.
+//!
+//! \return The product between @p a and @p b.
+template <typename scalar_type>
+constexpr auto operator * (const vec3<scalar_type>& a, scalar_type b) noexcept {
+  return vec3<scalar_type> {
+    a.x * b,
+    a.y * b,
+    a.z * b
+  };
+}
+
+//! \brief Normalizes a vector.
+//! This is useful when dealing with trig functions.
+//!
+//! \return The normalized result of @p v.
+template <typename scalar_type>
+vec3<scalar_type> normalize(const vec3<scalar_type>& v) noexcept {
+
+  using std::sqrt;
+
+  auto l_inv = scalar_type(1) / sqrt(dot(v, v));
+
+  return v * l_inv;
+}
+
+//! \brief Multiplies a 2D vector by a scalar value.
+//!
+//! \return The product of @p a and @p b.
+template <typename scalar_type>
+vec2<scalar_type> operator * (const vec2<scalar_type>& a, scalar_type b) noexcept {
+  return vec2<scalar_type> {
+    a.x * b,
+    a.y * b
+  };
+}
+
+//! \brief Computes the sum of two 2D vectors.
+//!
+//! \return The sum of @p a and @p b.
+template <typename scalar_type>
+vec2<scalar_type> operator + (const vec2<scalar_type>& a,
+                              const vec2<scalar_type>& b) noexcept {
+  return vec2<scalar_type> {
+    a.x + b.x,
+    a.y + b.y
+  };
+}
+
+//! \brief Computes the difference between two 2D vectors.
+//!
+//! \return The difference between @p a and @p b.
+template <typename scalar_type>
+vec2<scalar_type> operator - (const vec2<scalar_type>& a,
+                              const vec2<scalar_type>& b) noexcept {
+  return vec2<scalar_type> {
+    a.x - b.x,
+    a.y - b.y
+  };
+}
+
+//! \brief Calculates the minimum between two 2D vectors.
+//!
+//! \return A vector containing the minimum components between @p a and @p b.
+template <typename scalar_type>
+vec2<scalar_type> min(const vec2<scalar_type>& a,
+                      const vec2<scalar_type>& b) noexcept {
+  return vec2<scalar_type> {
+    std::min(a.x, b.x),
+    std::min(a.y, b.y)
+  };
+}
+
+//! \brief Calculates the maximum between two 2D vectors.
+//!
+//! \return A vector containing the maximum components between @p a and @p b.
+template <typename scalar_type>
+vec2<scalar_type> max(const vec2<scalar_type>& a,
+                      const vec2<scalar_type>& b) noexcept {
+  return vec2<scalar_type> {
+    std::max(a.x, b.x),
+    std::max(a.y, b.y)
+  };
+}
+
+//! \brief This structure implements various vector packet operations.
+//! Since these operations require various template parameters, they are
+//! best implemented in a structure where type definitions can make the code
+//! much more readable.
+//!
+//! \tparam scalar_type The scalar type of the vector components.
+//!
+//! \tparam dimensions The number of dimensions the vectors will have.
+//!
+//! \tparam count The number of elements per dimension for each vector.
+template <typename scalar_type,
+          size_type dimensions,
+          size_type count>
+struct vec_packet_ops final {
+  //! A type definition for a vector packet.
+  using vec_packet_type = vec_packet<scalar_type, dimensions, count>;
+  //! The number of values in one vector packet.
+  static inline constexpr auto value_count() noexcept {
+    return dimensions * count;
+  }
+  //! Computes the Hadamard product of two vectors.
+  //!
+  //! \return The Hadamard product of @p a and @p b.
+  static constexpr auto hadamard_mul(const vec_packet_type& a, const vec_packet_type& b) noexcept {
+    vec_packet_type out;
+    for (size_type i = 0; i < value_count(); i++) {
+      out.values[i] = a.values[i] * b.values[i];
+    }
+    return out;
+  }
+  //! Computes the sum of a vector packet and single scalar value.
+  //!
+  //! \param b This value is added to all components of @p a.
+  //!
+  //! \return The sum of @p a and @p b.
+  static constexpr auto add(const vec_packet_type& a, scalar_type b) noexcept {
+    vec_packet_type out;
+    for (size_type i = 0; i < value_count(); i++) {
+      out.values[i] = a.values[i] + b;
+    }
+    return out;
+  }
+  //! Subtracts two vectors.
+  //!
+  //! \return The difference between @p a and @p b.
+  static constexpr auto sub(const vec_packet_type& a, const vec_packet_type& b) noexcept {
+    vec_packet_type out;
+    for (size_type i = 0; i < value_count(); i++) {
+      out.values[i] = a.values[i] - b.values[i];
+    }
+    return out;
+  }
+  //! Multiplies a vector packet by a scalar value.
+  //!
+  //! \return The product of @p a and @p b.
+  static constexpr auto mul(const vec_packet_type& a, scalar_type b) noexcept {
+    vec_packet_type out;
+    for (size_type i = 0; i < value_count(); i++) {
+      out.values[i] = a.values[i] * b;
+    }
+    return out;
+  }
+};
+
+//! Adds a single scalar value to all components of @p a.
+//!
+//! \return The sume of @p a and @p b.
+template <typename scalar_type, size_type dimensions, size_type count>
+constexpr auto operator + (const vec_packet<scalar_type, dimensions, count>& a, scalar_type b) noexcept {
+  return vec_packet_ops<scalar_type, dimensions, count>::add(a, b);
+}
+
+//! Subtracts two vector packets.
+//!
+//! \return The difference of @p a and @p b.
+template <typename scalar_type, size_type dimensions, size_type count>
+constexpr auto operator - (const vec_packet<scalar_type, dimensions, count>& a,
+                           const vec_packet<scalar_type, dimensions, count>& b) noexcept {
+  return vec_packet_ops<scalar_type, dimensions, count>::sub(a, b);
+}
+
+//! Multiplies a vector packet by a single scalar value.
+//!
+//! \return The product of @p a and @p b, as a vector packet.
+template <typename scalar_type, size_type dimensions, size_type count>
+constexpr auto operator * (const vec_packet<scalar_type, dimensions, count>& a, scalar_type b) noexcept {
+  return vec_packet_ops<scalar_type, dimensions, count>::mul(a, b);
+}
+
+//! Multiplies a 3D vector packet by a single 3D vector.
+//!
+//! \tparam scalar_type The scalar type of the vector components.
+//!
+//! \tparam count The number of elements per dimension in the vector packet.
+//!
+//! \return The product of @p a and @p b.
+template <typename scalar_type, size_type count>
+constexpr auto hadamard_mul(const vec_packet<scalar_type, 3, count>& a,
+                            const vec3<scalar_type>& b) noexcept {
+
+  vec_packet<scalar_type, 3, count> out;
+
+  for (size_type i = 0; i < count; i++) {
+    out[0][i] = a[0][i] * b.x;
+    out[1][i] = a[1][i] * b.y;
+    out[2][i] = a[2][i] * b.z;
+  }
+
+  return out;
+}
+
+//! \brief Subtracts a single 3D vector from a 3D vector packet.
+//!
+//! \tparam scalar_type The type used by the vector components.
+//!
+//! \tparam count The number of elements in one dimension.
+//!
+//! \return The difference between @p a and @p b.
+template <typename scalar_type, size_type count>
+constexpr auto operator - (const vec_packet<scalar_type, 3, count>& a,
+                           const vec3<scalar_type>& b) noexcept {
+
+  vec_packet<scalar_type, 3, count> out;
+
+  for (size_type i = 0; i < count; i++) {
+    out[0][i] = a[0][i] - b.x;
+    out[1][i] = a[1][i] - b.y;
+    out[2][i] = a[2][i] - b.z;
+  }
+
+  return out;
+}
+
+} // namespace math
+
+//! \brief This namespaces contains implementation details
+//! of the library. It shouldn't be used by the end-user.
+namespace detail {
+
+using namespace lbvh::math;
+
+//! \brief Counts leading zeroes of an unsigned integer without intrinsics.
+//! This is used where the intrinsics can't be evaluated in constant expressions.
+template <typename uint_type>
+inline constexpr int portable_clz(uint_type n) noexcept {
+
+  constexpr int width = int(sizeof(uint_type) * 8);
+
+  if (!n) {
+    return width;
+  }
+
+  int count = 0;
+
+  for (int shift = width / 2; shift > 0; shift /= 2) {
+    if (!(n >> (width - shift))) {
+      n <<= shift;
+      count += shift;
+    }
+  }
+
+  return count;
+}
+
+//! \brief Counts leading zeroes of a 32-bit integer.
+inline constexpr int clz(std::uint32_t n) noexcept {
+#if defined(_MSC_VER) && defined(__cpp_lib_is_constant_evaluated)
+  return std::is_constant_evaluated() ? portable_clz(n) : int(__lzcnt(n));
+#elif defined(_MSC_VER)
+  return portable_clz(n);
+#else
+  return __builtin_clz(n);
+#endif
+}
+
+//! \brief Counts leading zeroes of a 64-bit integer.
+inline constexpr int clz(std::uint64_t n) noexcept {
+#if defined(_MSC_VER) && defined(__cpp_lib_is_constant_evaluated)
+  return std::is_constant_evaluated() ? portable_clz(n) : int(__lzcnt64(n));
+#elif defined(_MSC_VER)
+  return portable_clz(n);
+#else
+  return __builtin_clzll(n);
+#endif
+}
+
+//! \brief Hints to the processor that the memory
+//! at @p ptr is going to be read soon.
+inline void prefetch(const void* ptr) noexcept {
+#ifdef _MSC_VER
+  _mm_prefetch(static_cast<const char*>(ptr), _MM_HINT_T0);
+#else
+  __builtin_prefetch(ptr);
+#endif
+}
+
+//! \brief Gets the sign of a number, as an integer.
+//!
+//! \return The sign of @p n. If @p n is negative,
+//! then negative one is returned. If @p n is greater
+//! than or equal to positive zero, then positive one
+//! is returned.
+template <typename scalar_type>
+inline constexpr scalar_type sign(scalar_type n) noexcept {
+  return (n < 0) ? -1 : 1;
+}
+
+//! Divides and rounds up to the nearest integer.
+//!
+//! \tparam int_type The integer type to divide with.
+//!
+//! \return The quotient between @p n and @ d, rounded up.
+template <typename int_type>
+inline constexpr int_type ceil_div(int_type n, int_type d) {
+  return (n + (d - 1)) / d;
+}
+
+//! Used for iterating a range of numbers in a for loop.
+struct loop_range final {
+  //! The beginning index of the range.
+  size_type begin;
+  //! The non-inclusive ending index of the range.
+  size_type end;
+  //! Constructs a loop range for an array and work division.
+  //! This makes it easy to divide work required on an array
+  //! into a given work division.
+  //!
+  //! \param div The work division given by the scheduler.
+  //!
+  //! \param array_size The size of the array being worked on.
+  loop_range(const work_division& div, size_type array_size) noexcept {
+
+    auto chunk_size = array_size / div.max;
+
+    begin = chunk_size * div.idx;
+
+    if ((div.idx + 1) == div.max) {
+      end = array_size;
+    } else {
+      end = begin + chunk_size;
+    }
+  }
+};
+
+//! Constructs an accelerated ray structure.
+//!
+//! \param r The ray from which to build the structure from.
+template <typename scalar_type>
+constexpr auto make_accel_ray(const ray<scalar_type>& r) noexcept {
+
+  using index_type = typename accel_ray<scalar_type>::index_type;
+
+  auto rcp_dir = reciprocal(r.dir);
+
+  index_type octants[3] {
+    (r.dir.x > 0) ? index_type(0) : index_type(3),
+    (r.dir.y > 0) ? index_type(1) : index_type(4),
+    (r.dir.z > 0) ? index_type(2) : index_type(5)
+  };
+
+  return accel_ray<scalar_type> {
+    r,
+    rcp_dir,
+    hadamard_mul(-r.pos, rcp_dir),
+    {
+      octants[0],
+      octants[1],
+      octants[2]
+    },
+    {
+      3 - octants[0],
+      5 - octants[1],
+      7 - octants[2]
+    }
+  };
+}
+
+//! Represents a ray intersection with a box.
+//!
+//! \tparam scalar_type The scalar type of the intersection distances.
+template <typename scalar_type>
+struct box_intersection final {
+  //! The minimum distance to intersection.
+  scalar_type tmin = std::numeric_limits<scalar_type>::infinity();
+  //! The maximum distance to intersection.
+  scalar_type tmax = 0;
+  //! Indicates if this is a valid intersection.
+  inline operator bool () const noexcept {
+    return (tmax >= max(scalar_type(0), tmin));
+  }
+  //! Compares two box intersections by proximity.
+  //!
+  //! \return True if this box intersection is closer than @p other.
+  inline bool operator < (const box_intersection& other) const noexcept {
+    return tmin < other.tmin;
+  }
+};
+
+//! Checks for ray intersection with a bounding box.
+//!
+//! \tparam scalar_type The type used for vector components.
+//!
+//! \return A box intersection instance, indicating
+//! if there was a hit or not.
+template <typename scalar_type>
+auto intersect(const aabb<scalar_type>& box, const accel_ray<scalar_type>& accel_r) noexcept {
+
+#ifdef LBVH_ENABLE_SLAB_TEST
+
+  auto tx1 = (box.min.x - accel_r.r.pos.x)*accel_r.rcp_dir.x;
+  auto tx2 = (box.max.x - accel_r.r.pos.x)*accel_r.rcp_dir.x;
+
+  auto tmin = min(tx1, tx2);
+  auto tmax = max(tx1, tx2);
+
+  auto ty1 = (box.min.y - accel_r.r.pos.y)*accel_r.rcp_dir.y;
+  auto ty2 = (box.max.y - accel_r.r.pos.y)*accel_r.rcp_dir.y;
+
+  tmin = max(tmin, min(ty1, ty2));
+  tmax = min(tmax, max(ty1, ty2));
+
+  auto tz1 = (box.min.z - accel_r.r.pos.z)*accel_r.rcp_dir.z;
+  auto tz2 = (box.max.z - accel_r.r.pos.z)*accel_r.rcp_dir.z;
+
+  tmin = max(tmin, min(tz1, tz2));
+  tmax = min(tmax, max(tz1, tz2));
+
+  return box_intersection<scalar_type> { tmin, tmax };
+
+#else // LBVH_ENABLE_SLAB_TEST
+
+  scalar_type bounds[6] {
+    box.min.x,
+    box.min.y,
+    box.min.z,
+    box.max.x,
+    box.max.y,
+    box.max.z
+  };
+
+  // t near
+  scalar_type tn[3] {
+    (bounds[accel_r.octants[0]] * accel_r.rcp_dir.x) + accel_r.inv_pos.x,
+    (bounds[accel_r.octants[1]] * accel_r.rcp_dir.y) + accel_r.inv_pos.y,
+    (bounds[accel_r.octants[2]] * accel_r.rcp_dir.z) + accel_r.inv_pos.z
+  };
+
+  // t far
+  scalar_type tf[3] {
+    (bounds[accel_r.inv_octants[0]] * accel_r.rcp_dir.x) + accel_r.inv_pos.x,
+    (bounds[accel_r.inv_octants[1]] * accel_r.rcp_dir.y) + accel_r.inv_pos.y,
+    (bounds[accel_r.inv_octants[2]] * accel_r.rcp_dir.z) + accel_r.inv_pos.z
+  };
+
+  return box_intersection<scalar_type> {
+    max(max(tn[0], tn[1]), tn[2]),
+    min(min(tf[0], tf[1]), tf[2]),
+  };
+
+#endif // LBVH_ENABLE_SLAB_TEST
+}
+
+//! Orders curve entries by their codes, and entries with equal codes by
+//! their primitive indices. This makes every sort of a curve give the
+//! same order, whether it's sorted in parallel, serially or by radix.
+//!
+//! \return True if @p a comes before @p b along the curve.
+template <typename entry_type>
+inline constexpr bool curve_less(const entry_type& a, const entry_type& b) noexcept {
+  return (a.code < b.code) || ((a.code == b.code) && (a.primitive < b.primitive));
+}
+
+//! \brief This class represents a space filling curve.
+//!
+//! \tparam code_type The type used for units of the curve.
+template <typename code_type>
+class space_filling_curve final {
+public:
+  //! Represents a single entry within the curve table.
+  using entry = curve_entry<code_type>;
+  //! A type definition for a vector of entries.
+  using entry_vec = std::vector<entry>;
+  //! Constructs a space filling curve.
+  //! \param entries_ The entries to assign the curve.
+  space_filling_curve(entry_vec&& entries_) noexcept
+    : entries(std::move(entries_)) {}
+  //! Constructs a curve via move semantics.
+  space_filling_curve(space_filling_curve&& other) noexcept
+    : entries(std::move(other.entries)) {}
+  //! Sorts the space filling curve based on the code of each entry.
+  //! Entries with equal codes are sorted by their primitive indices.
+  void sort() {
+    auto cmp = [](const entry& a, const entry& b) {
+      return curve_less(a, b);
+    };
+#if (__cplusplus >= 201703L) && !(defined LBVH_NO_THREADS)
+    std::sort(std::execution::par_unseq, entries.begin(), entries.end(), cmp);
+#else
+    std::sort(entries.begin(), entries.end(), cmp);
+#endif
+  }
+  //! Sorts the space filling curve, taking advantage of the order it's already in.
+  //! Runs of entries that are already sorted are merged together, which is near
+  //! linear when the curve is nearly sorted. If there is more than one run for
+  //! every sixteen entries, the curve is sorted with @ref sort instead.
+  void sort_presorted() {
+
+    auto cmp = [](const entry& a, const entry& b) {
+      return curve_less(a, b);
+    };
+
+    auto max_runs = (entries.size() / 16) + 1;
+
+    std::vector<size_type> run_bounds { 0 };
+
+    for (size_type i = 1; i < entries.size(); i++) {
+      if (cmp(entries[i], entries[i - 1])) {
+        if (run_bounds.size() >= max_runs) {
+          sort();
+          return;
+        }
+        run_bounds.push_back(i);
+      }
+    }
+
+    run_bounds.push_back(entries.size());
+
+    auto first = entries.begin();
+
+    while (run_bounds.size() > 2) {
+
+      std::vector<size_type> merged_bounds;
+
+      size_type i = 0;
+
+      for (; (i + 2) < run_bounds.size(); i += 2) {
+        std::inplace_merge(first + run_bounds[i], first + run_bounds[i + 1], first + run_bounds[i + 2], cmp);
+        merged_bounds.push_back(run_bounds[i]);
+      }
+
+      if ((i + 1) < run_bounds.size()) {
+        // Odd run out, carried over to the next pass.
+        merged_bounds.push_back(run_bounds[i]);
+      }
+
+      merged_bounds.push_back(run_bounds.back());
+
+      run_bounds = std::move(merged_bounds);
+    }
+  }
+  //! Merges a sorted set of entries into the curve.
+  //! The curve has to be sorted before this is called.
+  //! Entries with equal codes are kept in the current curve first.
+  //!
+  //! \param other The sorted entries to merge into the curve.
+  void merge(const entry_vec& other) {
+    auto cmp = [](const entry& a, const entry& b) {
+      return a.code < b.code;
+    };
+    entry_vec merged(entries.size() + other.size());
+#if (__cplusplus >= 201703L) && !(defined LBVH_NO_THREADS)
+    std::merge(std::execution::par_unseq, entries.begin(), entries.end(), other.begin(), other.end(), merged.begin(), cmp);
+#else
+    std::merge(entries.begin(), entries.end(), other.begin(), other.end(), merged.begin(), cmp);
+#endif
+    entries = std::move(merged);
+  }
+  //! Sorts the space filling curve on the calling thread only.
+  //! This is used when many small curves are sorted at once.
+  void sort_serial() {
+    auto cmp = [](const entry& a, const entry& b) {
+      return curve_less(a, b);
+    };
+    std::sort(entries.begin(), entries.end(), cmp);
+  }
+  //! Moves the entries out of the curve.
+  //! The curve is left empty.
+  entry_vec release() noexcept {
+    return std::move(entries);
+  }
+  //! Indicates the number of entries in the space filling curve.
+  inline auto size() const noexcept {
+    return entries.size();
+  }
+  //! Accesses a specific entry within the space filling curve.
+  //! \param index The index of the entry to access.
+  inline const auto& operator [] (size_type index) const noexcept {
+    return entries[index];
+  }
+
+  space_filling_curve(const space_filling_curve&) = delete;
+  space_filling_curve& operator = (const space_filling_curve&) = delete;
+private:
+  //! The entries of the space filling curve.
+  entry_vec entries;
+};
+
+//! \brief Calculates the center of a floating-point bounding box.
+//!
+//! \tparam scalar_type The type of the box vector components.
+//! In this function, this is a floating point type.
+//!
+//! \param box The box to get the center of.
+//!
+//! \return The center point of the box.
+template <typename scalar_type, std::enable_if_t<std::is_floating_point<scalar_type>::value, int> = 0>
+constexpr auto center_of(const aabb<scalar_type>& box) noexcept {
+  return (box.min + box.max) * scalar_type(0.5);
+}
+
+//! \brief Calculates the exact midpoint of two integers, rounded down.
+//! Unlike adding them first, this can't overflow.
+template <typename scalar_type>
+inline constexpr scalar_type midpoint(scalar_type a, scalar_type b) noexcept {
+  return scalar_type((a & b) + ((a ^ b) >> 1));
+}
+
+//! \brief Calculates the center of an integer bounding box.
+//! The center is rounded down to the nearest integer on each axis.
+//!
+//! \tparam scalar_type The type of the box vector components.
+//! In this function, this is an integer type.
+//!
+//! \param box The box to get the center point of.
+//!
+//! \return The center point of the box.
+template <typename scalar_type, std::enable_if_t<std::is_integral<scalar_type>::value, int> = 0>
+constexpr auto center_of(const aabb<scalar_type>& box) noexcept {
+  return vec3<scalar_type> {
+    midpoint(box.min.x, box.max.x),
+    midpoint(box.min.y, box.max.y),
+    midpoint(box.min.z, box.max.z)
+  };
+}
+
+//! \brief Gets the value that an empty box starts at as its minimum.
+//! This is infinity for floating point types, and the largest
+//! value for integer types, which have no infinity.
+template <typename scalar_type>
+inline constexpr scalar_type empty_min() noexcept {
+  return std::numeric_limits<scalar_type>::has_infinity
+    ?  std::numeric_limits<scalar_type>::infinity()
+    :  std::numeric_limits<scalar_type>::max();
+}
+
+//! \brief Gets the value that an empty box starts at as its maximum.
+template <typename scalar_type>
+inline constexpr scalar_type empty_max() noexcept {
+  return std::numeric_limits<scalar_type>::has_infinity
+    ? -std::numeric_limits<scalar_type>::infinity()
+    :  std::numeric_limits<scalar_type>::lowest();
+}
+
+//! \brief Gets an empty bounding box.
+//! An empty box has the property that any union this
+//! box has with another box is equal to the other box.
+//!
+//! \return An empty box.
+template <typename scalar_type>
+constexpr auto get_empty_aabb() noexcept {
+  return aabb<scalar_type> {
+    {
+      empty_min<scalar_type>(),
+      empty_min<scalar_type>(),
+      empty_min<scalar_type>()
+    },
+    {
+      empty_max<scalar_type>(),
+      empty_max<scalar_type>(),
+      empty_max<scalar_type>()
+    }
+  };
+}
+
+//! \brief Calculates the union of two bounding boxes.
+//! The result is a bounding box that fits both other bounding boxes.
+//!
+//! \tparam scalar_type The type of the bounding box vector components.
+//!
+//! \return A bounding box that fits both boxes passed as parameters.
+template <typename scalar_type>
+constexpr auto union_of(const aabb<scalar_type>& a,
+                        const aabb<scalar_type>& b) noexcept {
+
+  return aabb<scalar_type> {
+    min(a.min, b.min),
+    max(a.max, b.max)
+  };
+}
+
+//! \brief Calculates the union of a bounding box and a 3D vector.
+//!
+//! \return A bounding box fitting both @p a and @p b.
+template <typename scalar_type>
+constexpr auto union_of(const aabb<scalar_type>& a,
+                        const vec3<scalar_type>& b) noexcept {
+
+  return aabb<scalar_type> {
+    min(a.min, b),
+    max(a.max, b)
+  };
+}
+
+//! \brief Calculates the size of a bounding box.
+//! This is considered the change in value from minimum to maximum points.
+//!
+//! \tparam scalar_type The type of the bounding box vector components.
+//!
+//! \param box The box to get the size of.
+//!
+//! \return The size of the given box.
+template <typename scalar_type>
+constexpr auto size_of(const aabb<scalar_type>& box) noexcept {
+  return box.max - box.min;
+}
+
+//! \brief Calculates the surface area of a bounding box.
+//!
+//! \tparam scalar_type The type of the bounding box vector components.
+//!
+//! \param box The box to get the surface area of.
+//!
+//! \return The surface area of @p box, in double precision
+//! so that the areas of many boxes can be summed.
+template <typename scalar_type>
+double surface_area(const aabb<scalar_type>& box) noexcept {
+
+  auto size = size_of(box);
+
+  auto x = double(size.x);
+  auto y = double(size.y);
+  auto z = double(size.z);
+
+  return 2 * ((x * y) + (y * z) + (z * x));
+}
+
+//! \brief Gets an empty bounding rectangle.
+//! Any union with an empty rectangle is equal to the other operand.
+//!
+//! \return An empty rectangle.
+template <typename scalar_type>
+auto get_empty_aabb2() noexcept {
+  return aabb2<scalar_type> {
+    {
+      empty_min<scalar_type>(),
+      empty_min<scalar_type>()
+    },
+    {
+      empty_max<scalar_type>(),
+      empty_max<scalar_type>()
+    }
+  };
+}
+
+//! \brief Calculates the union of two bounding rectangles.
+//!
+//! \return A rectangle fitting both @p a and @p b.
+template <typename scalar_type>
+auto union_of(const aabb2<scalar_type>& a,
+              const aabb2<scalar_type>& b) noexcept {
+
+  return aabb2<scalar_type> {
+    min(a.min, b.min),
+    max(a.max, b.max)
+  };
+}
+
+//! \brief Calculates the union of a bounding rectangle and a 2D vector.
+//!
+//! \return A rectangle fitting both @p a and @p b.
+template <typename scalar_type>
+auto union_of(const aabb2<scalar_type>& a,
+              const vec2<scalar_type>& b) noexcept {
+
+  return aabb2<scalar_type> {
+    min(a.min, b),
+    max(a.max, b)
+  };
+}
+
+//! \brief Calculates the center of a bounding rectangle.
+//!
+//! \return The center point of @p box.
+template <typename scalar_type>
+auto center_of(const aabb2<scalar_type>& box) noexcept {
+  return (box.min + box.max) * scalar_type(0.5);
+}
+
+//! \brief Calculates the size of a bounding rectangle.
+//!
+//! \return The change from the minimum to the maximum point of @p box.
+template <typename scalar_type>
+auto size_of(const aabb2<scalar_type>& box) noexcept {
+  return box.max - box.min;
+}
+
+//! \brief Indicates if a bounding rectangle contains a point.
+//! Points on the edge of the rectangle are contained by it.
+template <typename scalar_type>
+bool contains(const aabb2<scalar_type>& box, const vec2<scalar_type>& point) noexcept {
+  return (point.x >= box.min.x) && (point.x <= box.max.x)
+      && (point.y >= box.min.y) && (point.y <= box.max.y);
+}
+
+//! \brief Indicates if two bounding rectangles overlap.
+//! Rectangles that only touch at their edges overlap.
+template <typename scalar_type>
+bool overlaps(const aabb2<scalar_type>& a, const aabb2<scalar_type>& b) noexcept {
+  return (a.min.x <= b.max.x) && (b.min.x <= a.max.x)
+      && (a.min.y <= b.max.y) && (b.min.y <= a.max.y);
+}
+
+//! \brief This class is used for calculating the centroid boundaries in the scene.
+//!
+//! \tparam scalar_type The scalar type of the bounding box to get.
+//!
+//! \tparam primitive_type The type of primitive in the scene.
+//!
+//! \tparam aabb_converter Calculates the bounding box of a primitive.
+template <typename scalar_type, typename primitive_type, typename aabb_converter>
+class centroid_bounds_kernel final {
+public:
+  //! A type definition for a type returned by this class.
+  using box_type = aabb<scalar_type>;
+  //! Constructs a new centroid bounds kernel.
+  //!
+  //! \param p The primitive of arrays to get the bounds for.
+  //!
+  //! \param c The number of primitives in the array.
+  //!
+  //! \param cvt The primitive to bounding box converter.
+  //!
+  //! \param thb The array of boxes per thread. Each thread
+  //! will find a box for a certain portion of the scene. This
+  //! array should have as many boxes as there are threads.
+  centroid_bounds_kernel(const primitive_type* p, size_type c, const aabb_converter& cvt, box_type* thb)
+    : primitives(p), count(c), converter(cvt), thread_boxes(thb) {
+  }
+  //! Runs the kernel.
+  //! Each thread accumulates its own bounding box
+  //! for the portion of the scene it was assigned.
+  //! When the result is queried, all boxes for each
+  //! of the threads are put into union.
+  //!
+  //! \param div Given by the scheduler to indicate which
+  //! portion of the scene this call should get the bounding box of.
+  void operator () (const work_division& div) noexcept {
+
+    auto range = loop_range(div, count);
+
+    auto box = get_empty_aabb<scalar_type>();
+
+    for (size_type i = range.begin; i < range.end; i++) {
+      box = union_of(box, center_of(converter(primitives[i])));
+    }
+
+    thread_boxes[div.idx] = box;
+  }
+private:
+  //! The array of primitives to get the bounding box of.
+  const primitive_type* primitives;
+  //! The number of primitives in the primitive array.
+  size_type count;
+  //! The primitive to bounding box converter.
+  const aabb_converter& converter;
+  //! The array of boxes, each box allocated
+  //! for a thread.
+  box_type* thread_boxes;
+};
+
+//! \brief Sums the surface areas used by the SAH cost of a BVH.
+//!
+//! \tparam scalar_type The scalar type of the BVH boxes.
+//!
+//! \tparam primitive_type The type of primitive in the scene.
+//!
+//! \tparam aabb_converter Calculates the bounding box of a primitive.
+template <typename scalar_type, typename primitive_type, typename aabb_converter>
+class sah_kernel final {
+public:
+  //! A type definition for a BVH node.
+  using node_type = node<scalar_type>;
+  //! Constructs a new SAH kernel.
+  //!
+  //! \param n The internal nodes of the BVH.
+  //!
+  //! \param nc The number of internal nodes.
+  //!
+  //! \param p The primitives that the BVH was built for.
+  //!
+  //! \param cvt The primitive to bounding box converter.
+  //!
+  //! \param ths The array of sums, one per thread.
+  sah_kernel(const node_type* n, size_type nc, const primitive_type* p, const aabb_converter& cvt, double* ths)
+    : nodes(n), node_count(nc), primitives(p), converter(cvt), thread_sums(ths) {}
+  //! Runs the kernel.
+  //! Each internal node adds its area times the traversal cost,
+  //! and each leaf adds its primitive box area times the intersection cost.
+  //!
+  //! \param div Given by the scheduler to indicate
+  //! which portion of the nodes to sum.
+  void operator () (const work_division& div) noexcept {
+
+    auto range = loop_range(div, node_count);
+
+    double sum = 0;
+
+    for (size_type i = range.begin; i < range.end; i++) {
+
+      const auto& node = nodes[i];
+
+      sum += traversal_cost() * surface_area(node.box);
+
+      if (node.left_is_leaf()) {
+        sum += intersection_cost() * surface_area(converter(primitives[node.left_leaf_index()]));
+      }
+
+      if (node.right_is_leaf()) {
+        sum += intersection_cost() * surface_area(converter(primitives[node.right_leaf_index()]));
+      }
+    }
+
+    thread_sums[div.idx] = sum;
+  }
+  //! The cost of visiting an internal node.
+  static constexpr double traversal_cost() noexcept { return 1; }
+  //! The cost of intersecting a primitive.
+  static constexpr double intersection_cost() noexcept { return 1; }
+private:
+  //! The internal nodes of the BVH.
+  const node_type* nodes;
+  //! The number of internal nodes.
+  size_type node_count;
+  //! The primitives that the BVH was built for.
+  const primitive_type* primitives;
+  //! The primitive to bounding box converter.
+  const aabb_converter& converter;
+  //! The sum of each thread.
+  double* thread_sums;
+};
+
+//! \brief Used to get the domain of Morton coordinates,
+//! based on the size of the type being used.
+template <size_type type_size>
+struct morton_domain final { };
+
+//! \brief Contains the domain of 32-bit Morton codes.
+template <>
+struct morton_domain<4> final {
+  //! Gets the domain of 32-bit Morton codes.
+  static constexpr size_type value() noexcept {
+    return 1024;
+  }
+};
+
+//! \brief Contains the domain of 64-bit Morton codes.
+template <>
+struct morton_domain<8> final {
+  //! Gets the domain of 64-bit Morton codes.
+  static constexpr size_type value() noexcept {
+    return 1048576;
+  }
+};
+
+//! \brief This class is used for encoding Morton values.
+//! This class is specialized based on the size of a code point.
+//!
+//! \tparam type_size The type size of a code point.
+template <size_type type_size>
+class morton_encoder final {};
+
+//! \brief Used for encoding 32-bit Morton codes.
+template <>
+class morton_encoder<4> final {
+public:
+  //! A type definition for a 32-bit Morton code.
+  using code_type = associated_types<4>::uint_type;
+  //! Encodes a 3D 32-bit Morton code.
+  inline constexpr code_type operator () (code_type x, code_type y, code_type z) const noexcept {
+    return (expand(x) << 2)
+         | (expand(y) << 1)
+         | (expand(z) << 0);
+  }
+protected:
+  //! Expands a 10-bit value to 30-bits.
+  inline static constexpr code_type expand(code_type n) noexcept {
+    n = (n | (n << 16)) & 0x030000ff;
+    n = (n | (n << 8)) & 0x0300f00f;
+    n = (n | (n << 4)) & 0x030c30c3;
+    n = (n | (n << 2)) & 0x09249249;
+    return n;
+  }
+};
+
+//! \brief Used for encoding 64-bit Morton codes.
+template <>
+class morton_encoder<8> final {
+public:
+  //! A type definition for a 64-bit Morton code.
+  using code_type = associated_types<8>::uint_type;
+  //! Encodes a 3D 64-bit Morton code.
+  inline constexpr code_type operator () (code_type x, code_type y, code_type z) const noexcept {
+    return (expand(x) << 2)
+         | (expand(y) << 1)
+         | (expand(z) << 0);
+  }
+protected:
+  //! Expands a 20-bit value to 60-bits.
+  inline static constexpr code_type expand(code_type n) noexcept {
+    n = (n | n << 32) & 0x001f00000000ffff;
+    n = (n | n << 16) & 0x001f0000ff0000ff;
+    n = (n | n << 8) & 0x100f00f00f00f00f;
+    n = (n | n << 4) & 0x10c30c30c30c30c3;
+    n = (n | n << 2) & 0x1249249249249249;
+    return n;
+  }
+};
+
+//! \brief Contains the domain of 2D Morton codes.
+//! Each axis gets half of the code bits.
+//!
+//! \tparam type_size The type size of a code point.
+template <size_type type_size>
+struct morton2_domain final {
+  //! Gets the number of cells along each axis.
+  static constexpr size_type value() noexcept {
+    return size_type(1) << (type_size * 4);
+  }
+};
+
+//! \brief This class is used for encoding 2D Morton values.
+//!
+//! \tparam type_size The type size of a code point.
+template <size_type type_size>
+class morton2_encoder final {};
+
+//! \brief Used for encoding 2D 32-bit Morton codes.
+template <>
+class morton2_encoder<4> final {
+public:
+  //! A type definition for a 32-bit Morton code.
+  using code_type = associated_types<4>::uint_type;
+  //! Encodes a 2D 32-bit Morton code.
+  inline constexpr code_type operator () (code_type x, code_type y) const noexcept {
+    return (expand(x) << 1)
+         | (expand(y) << 0);
+  }
+protected:
+  //! Expands a 16-bit value to 32-bits.
+  inline static constexpr code_type expand(code_type n) noexcept {
+    n = (n | (n << 8)) & 0x00ff00ff;
+    n = (n | (n << 4)) & 0x0f0f0f0f;
+    n = (n | (n << 2)) & 0x33333333;
+    n = (n | (n << 1)) & 0x55555555;
+    return n;
+  }
+};
+
+//! \brief Used for encoding 2D 64-bit Morton codes.
+template <>
+class morton2_encoder<8> final {
+public:
+  //! A type definition for a 64-bit Morton code.
+  using code_type = associated_types<8>::uint_type;
+  //! Encodes a 2D 64-bit Morton code.
+  inline constexpr code_type operator () (code_type x, code_type y) const noexcept {
+    return (expand(x) << 1)
+         | (expand(y) << 0);
+  }
+protected:
+  //! Expands a 32-bit value to 64-bits.
+  inline static constexpr code_type expand(code_type n) noexcept {
+    n = (n | (n << 16)) & 0x0000ffff0000ffff;
+    n = (n | (n << 8)) & 0x00ff00ff00ff00ff;
+    n = (n | (n << 4)) & 0x0f0f0f0f0f0f0f0f;
+    n = (n | (n << 2)) & 0x3333333333333333;
+    n = (n | (n << 1)) & 0x5555555555555555;
+    return n;
+  }
+};
+
+//! Calculates the scale at which centroids map to Morton space.
+//! This depends only on the shape of the bounds, so scenes of any
+//! size use the whole domain. Flat axes, where the scale can't be
+//! represented, map to zero.
+//!
+//! \param centroid_bounds The bounds of the centroids being encoded.
+//!
+//! \param domain The number of Morton cells along each axis.
+//!
+//! \param quantization How centroids are mapped to Morton cells.
+//!
+//! \return The scale to multiply centroid offsets by.
+template <typename scalar_type>
+constexpr vec3<scalar_type> morton_scale(const aabb<scalar_type>& centroid_bounds, size_type domain, morton_quantization quantization) noexcept {
+
+  auto scale_of = [domain](scalar_type extent) {
+    auto s = scalar_type(domain) / extent;
+    return (s <= std::numeric_limits<scalar_type>::max()) ? s : scalar_type(0);
+  };
+
+  auto cbounds_size = size_of(centroid_bounds);
+
+  if (quantization == morton_quantization::cube) {
+    auto longest = max(max(cbounds_size.x, cbounds_size.y), cbounds_size.z);
+    return vec3<scalar_type> { scale_of(longest), scale_of(longest), scale_of(longest) };
+  }
+
+  return vec3<scalar_type> { scale_of(cbounds_size.x), scale_of(cbounds_size.y), scale_of(cbounds_size.z) };
+}
+
+//! This class is used for computing part or all
+//! of a Morton curve. It may be called from multiple threads.
+//!
+//! \tparam scalar_type The type of scalar used in the scene primitives.
+//!
+//! \tparam primitive_type The type of primitive in the scene.
+template <typename scalar_type, typename primitive_type>
+class morton_curve_kernel final {
+public:
+  //! A type definition for a code value.
+  using code_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+  //! A type definition for an entry in the space filling curve.
+  using entry = typename space_filling_curve<code_type>::entry;
+  //! Constructs a new Morton curve kernel.
+  //! \param p The primitive array to generate the values from.
+  //! \param e The entry array to receive the values.
+  //! \param c The number of primitives in the array.
+  //! \param q How centroids are mapped to Morton cells.
+  //! \param f If not null, an array with one flag per thread. A thread's flag is
+  //! set if it finds a centroid outside of the centroid bounds it was given.
+  constexpr morton_curve_kernel(const primitive_type* p,
+                                entry* e,
+                                size_type c,
+                                morton_quantization q = morton_quantization::cube,
+                                unsigned char* f = nullptr) noexcept
+    : primitives(p), entries(e), count(c), quantization(q), outside_flags(f) {}
+  //! Calculates the Morton codes of a certain subset of the scene.
+  //! The amount of work that's done depends on the work division.
+  //!
+  //! \param div Passed by the scheduler to indicate the amount of work to do.
+  //!
+  //! \param centroid_bounds The bounding box for all centroids.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  template <typename aabb_converter>
+  void operator () (const work_division& div, const aabb<scalar_type>& centroid_bounds, aabb_converter converter) {
+    encode(div, centroid_bounds, converter, std::is_floating_point<scalar_type>());
+  }
+private:
+  //! Calculates floating point Morton codes, by scaling
+  //! the centroids to the size of the Morton domain.
+  template <typename aabb_converter>
+  void encode(const work_division& div, const aabb<scalar_type>& centroid_bounds, aabb_converter& converter, std::true_type) {
+
+    using entry_index_type = typename entry::index_type;
+
+    //! This is the maximum number of primitives to
+    //! work on per loop iteration.
+    constexpr size_type max_batch_size = 16;
+
+    auto mdomain = code_type(morton_domain<sizeof(scalar_type)>::value());
+
+    // Centroids outside of the bounds are clamped to the edge
+    // of the Morton domain, which can happen when the bounds
+    // are fixed ahead of time by the caller.
+    auto max_coord = scalar_type(mdomain - 1);
+
+    auto scale = morton_scale(centroid_bounds, mdomain, quantization);
+
+    morton_encoder<sizeof(code_type)> encoder;
+
+    auto range = loop_range(div, count);
+
+    vec_packet<scalar_type, 3, max_batch_size> center_packet;
+
+    bool outside = false;
+
+    for (size_type i = range.begin; i < range.end; i += max_batch_size) {
+
+      auto batch_size = min(max_batch_size, range.end - i);
+
+      for (size_type j = 0; j < batch_size; j++) {
+        auto center = center_of(converter(primitives[i + j]));
+        center_packet[0][j] = center.x;
+        center_packet[1][j] = center.y;
+        center_packet[2][j] = center.z;
+      }
+
+      if (outside_flags) {
+        for (size_type j = 0; j < batch_size; j++) {
+          outside |= (center_packet[0][j] < centroid_bounds.min.x) || (center_packet[0][j] > centroid_bounds.max.x)
+                   || (center_packet[1][j] < centroid_bounds.min.y) || (center_packet[1][j] > centroid_bounds.max.y)
+                   || (center_packet[2][j] < centroid_bounds.min.z) || (center_packet[2][j] > centroid_bounds.max.z);
+        }
+      }
+
+      // Scale center points to Morton space [0, 1024)
+
+      center_packet = hadamard_mul(center_packet - centroid_bounds.min, scale);
+
+      // Export Morton codes
+
+      for (size_type j = 0; j < batch_size; j++) {
+
+        auto x_code = code_type(max(min(center_packet[0][j], max_coord), scalar_type(0)));
+        auto y_code = code_type(max(min(center_packet[1][j], max_coord), scalar_type(0)));
+        auto z_code = code_type(max(min(center_packet[2][j], max_coord), scalar_type(0)));
+
+        auto code = encoder(x_code, y_code, z_code);
+
+        entries[i + j] = entry { code, entry_index_type(i + j) };
+      }
+    }
+
+    if (outside_flags) {
+      outside_flags[div.idx] = outside;
+    }
+  }
+  //! Calculates integer Morton codes. The offset of each centroid from
+  //! the bounds is shifted down until the bounds fit into the Morton
+  //! domain, so the codes are exact and involve no floating point math.
+  template <typename aabb_converter>
+  void encode(const work_division& div, const aabb<scalar_type>& centroid_bounds, aabb_converter& converter, std::false_type) {
+
+    using entry_index_type = typename entry::index_type;
+
+    code_type axis_bits = 0;
+
+    for (auto d = morton_domain<sizeof(scalar_type)>::value(); d > 1; d /= 2) {
+      axis_bits++;
+    }
+
+    auto max_cell = code_type(morton_domain<sizeof(scalar_type)>::value() - 1);
+
+    // The distance between two values of the scalar type
+    // always fits into the unsigned type of the same size.
+
+    auto extent_of = [](scalar_type lo, scalar_type hi) {
+      return code_type(code_type(hi) - code_type(lo));
+    };
+
+    auto shift_of = [axis_bits](code_type extent) {
+      auto bits = extent ? code_type((sizeof(code_type) * 8) - size_type(clz(extent))) : code_type(0);
+      return (bits > axis_bits) ? code_type(bits - axis_bits) : code_type(0);
+    };
+
+    vec3<code_type> extent {
+      extent_of(centroid_bounds.min.x, centroid_bounds.max.x),
+      extent_of(centroid_bounds.min.y, centroid_bounds.max.y),
+      extent_of(centroid_bounds.min.z, centroid_bounds.max.z)
+    };
+
+    vec3<code_type> shift { shift_of(extent.x), shift_of(extent.y), shift_of(extent.z) };
+
+    if (quantization == morton_quantization::cube) {
+      auto longest = shift_of(max(max(extent.x, extent.y), extent.z));
+      shift = vec3<code_type> { longest, longest, longest };
+    }
+
+    // Centroids outside of the bounds are clamped to the edge of the
+    // Morton domain, as they are with floating point centroids.
+
+    auto cell_of = [max_cell, &extent_of](scalar_type c, scalar_type lo, code_type s) {
+      return (c > lo) ? min(code_type(extent_of(lo, c) >> s), max_cell) : code_type(0);
+    };
+
+    morton_encoder<sizeof(code_type)> encoder;
+
+    auto range = loop_range(div, count);
+
+    bool outside = false;
+
+    for (auto i = range.begin; i < range.end; i++) {
+
+      auto center = center_of(converter(primitives[i]));
+
+      outside |= (center.x < centroid_bounds.min.x) || (center.x > centroid_bounds.max.x)
+              || (center.y < centroid_bounds.min.y) || (center.y > centroid_bounds.max.y)
+              || (center.z < centroid_bounds.min.z) || (center.z > centroid_bounds.max.z);
+
+      auto x_code = cell_of(center.x, centroid_bounds.min.x, shift.x);
+      auto y_code = cell_of(center.y, centroid_bounds.min.y, shift.y);
+      auto z_code = cell_of(center.z, centroid_bounds.min.z, shift.z);
+
+      entries[i] = entry { encoder(x_code, y_code, z_code), entry_index_type(i) };
+    }
+
+    if (outside_flags) {
+      outside_flags[div.idx] = outside;
+    }
+  }
+  //! The primitives the curve is being generated from.
+  const primitive_type* primitives;
+  //! The entries to receive the calculated values.
+  entry* entries;
+  //! The number of primitives in the scene.
+  //! This is also the number of entries.
+  size_type count;
+  //! How centroids are mapped to Morton cells.
+  morton_quantization quantization;
+  //! The per-thread flags for centroids
+  //! found outside the bounds, which may be null.
+  unsigned char* outside_flags;
+};
+
+//! \brief Reorders the entries of a space filling curve.
+//! Can be called by the scheduler from many threads.
+//!
+//! \tparam entry_type The type of the curve entries.
+//!
+//! \tparam index_type The type of the indices describing the new order.
+template <typename entry_type, typename index_type>
+class curve_gather_kernel final {
+public:
+  //! Constructs a new gather kernel.
+  //! \param i The entries to reorder, indexed by primitive.
+  //! \param o The array to receive the reordered entries.
+  //! \param ord The primitive index to put at each position of the output.
+  //! \param c The number of entries.
+  constexpr curve_gather_kernel(const entry_type* i, entry_type* o, const index_type* ord, size_type c) noexcept
+    : input(i), output(o), order(ord), count(c) {}
+  //! Reorders a portion of the entries.
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) noexcept {
+
+    auto range = loop_range(div, count);
+
+    for (auto i = range.begin; i < range.end; i++) {
+      output[i] = input[order[i]];
+    }
+  }
+private:
+  //! The entries in primitive order.
+  const entry_type* input;
+  //! The entries in the new order.
+  entry_type* output;
+  //! The new order of the entries.
+  const index_type* order;
+  //! The number of entries.
+  size_type count;
+};
+
+//! \brief Calculates the centroid bounds of planar primitives.
+//! Each thread finds the bounds of its portion of the primitives.
+//!
+//! \tparam scalar_type The scalar type of the rectangles.
+//!
+//! \tparam primitive_type The type of primitive in the scene.
+//!
+//! \tparam aabb_converter Calculates the bounding rectangle of a primitive.
+template <typename scalar_type, typename primitive_type, typename aabb_converter>
+class centroid_bounds2_kernel final {
+public:
+  //! A type definition for the rectangles found by this class.
+  using box_type = aabb2<scalar_type>;
+  //! Constructs a new 2D centroid bounds kernel.
+  //! \param p The array of primitives to get the bounds for.
+  //! \param c The number of primitives in the array.
+  //! \param cvt The primitive to bounding rectangle converter.
+  //! \param thb Receives the bounds found by each thread.
+  centroid_bounds2_kernel(const primitive_type* p, size_type c, const aabb_converter& cvt, box_type* thb)
+    : primitives(p), count(c), converter(cvt), thread_boxes(thb) {}
+  //! Finds the centroid bounds of a portion of the primitives.
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) noexcept {
+
+    auto range = loop_range(div, count);
+
+    auto box = get_empty_aabb2<scalar_type>();
+
+    for (size_type i = range.begin; i < range.end; i++) {
+      box = union_of(box, center_of(converter(primitives[i])));
+    }
+
+    thread_boxes[div.idx] = box;
+  }
+private:
+  //! The array of primitives to get the bounds of.
+  const primitive_type* primitives;
+  //! The number of primitives in the primitive array.
+  size_type count;
+  //! The primitive to bounding rectangle converter.
+  const aabb_converter& converter;
+  //! The bounds found by each thread.
+  box_type* thread_boxes;
+};
+
+//! \brief Computes part or all of a 2D Morton curve.
+//! The cells are square, so that the curve splits
+//! both axes at the same spacing, as the cube cells do in 3D.
+//!
+//! \tparam scalar_type The scalar type of the rectangles.
+//!
+//! \tparam primitive_type The type of primitive in the scene.
+template <typename scalar_type, typename primitive_type>
+class morton_curve2_kernel final {
+public:
+  //! A type definition for a code value.
+  using code_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+  //! A type definition for an entry in the space filling curve.
+  using entry = typename space_filling_curve<code_type>::entry;
+  //! Constructs a new 2D Morton curve kernel.
+  //! \param p The primitive array to generate the values from.
+  //! \param e The entry array to receive the values.
+  //! \param c The number of primitives in the array.
+  constexpr morton_curve2_kernel(const primitive_type* p, entry* e, size_type c) noexcept
+    : primitives(p), entries(e), count(c) {}
+  //! Calculates the Morton codes of a portion of the primitives.
+  //!
+  //! \param div The division of work this function call is responsible for.
+  //!
+  //! \param centroid_bounds The bounding rectangle of all centroids.
+  //!
+  //! \param converter The primitive to bounding rectangle converter.
+  template <typename aabb_converter>
+  void operator () (const work_division& div, const aabb2<scalar_type>& centroid_bounds, aabb_converter converter) {
+
+    using entry_index_type = typename entry::index_type;
+
+    auto mdomain = morton2_domain<sizeof(code_type)>::value();
+
+    auto max_coord = scalar_type(mdomain - 1);
+
+    auto cbounds_size = size_of(centroid_bounds);
+
+    auto scale = scalar_type(mdomain) / max(cbounds_size.x, cbounds_size.y);
+
+    scale = (scale <= std::numeric_limits<scalar_type>::max()) ? scale : scalar_type(0);
+
+    morton2_encoder<sizeof(code_type)> encoder;
+
+    auto range = loop_range(div, count);
+
+    for (auto i = range.begin; i < range.end; i++) {
+
+      auto cell = (center_of(converter(primitives[i])) - centroid_bounds.min) * scale;
+
+      auto x_code = code_type(max(min(cell.x, max_coord), scalar_type(0)));
+      auto y_code = code_type(max(min(cell.y, max_coord), scalar_type(0)));
+
+      entries[i] = entry { encoder(x_code, y_code), entry_index_type(i) };
+    }
+  }
+private:
+  //! The primitives the curve is being generated from.
+  const primitive_type* primitives;
+  //! The entries to receive the calculated values.
+  entry* entries;
+  //! The number of primitives, which is also the number of entries.
+  size_type count;
+};
+
+//! \brief Refines the codes of a sorted Morton curve within segments.
+//! A segment is a run of entries that share the top bits of their codes.
+//! The entries of a segment get a 30-bit code relative to the centroid
+//! bounds of the segment, under the shared bits, and are sorted again.
+//! Can be called by the scheduler from many threads.
+//!
+//! \tparam scalar_type The type of scalar used in the scene primitives.
+//!
+//! \tparam primitive_type The type of primitive in the scene.
+template <typename scalar_type, typename primitive_type>
+class morton_refine_kernel final {
+public:
+  //! A type definition for a code of the first curve.
+  using code_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+  //! A type definition for the first curve.
+  using curve_type = space_filling_curve<code_type>;
+  //! A type definition for a refined code.
+  using refined_code_type = associated_types<8>::uint_type;
+  //! A type definition for an entry of the refined curve.
+  using refined_entry = curve_entry<refined_code_type>;
+  //! The number of bits in a code relative to a segment.
+  static constexpr size_type local_bits = 30;
+  //! Constructs a new refine kernel.
+  //! \param p The primitives that the curve was made for.
+  //! \param c The sorted curve to refine.
+  //! \param so The first entry of each segment, followed by the curve size.
+  //! \param sc The number of segments.
+  //! \param sh The number of low code bits that aren't shared within a segment.
+  //! \param q How centroids are mapped to Morton cells.
+  //! \param o The array to receive the refined entries.
+  constexpr morton_refine_kernel(const primitive_type* p,
+                                 const curve_type& c,
+                                 const size_type* so,
+                                 size_type sc,
+                                 size_type sh,
+                                 morton_quantization q,
+                                 refined_entry* o) noexcept
+    : primitives(p), curve(c), segment_offsets(so), segment_count(sc), shift(sh), quantization(q), output(o) {}
+  //! Refines the segments that start in a portion of the curve.
+  //! Dividing the work by curve position instead of by segment
+  //! keeps the threads balanced when the segments vary in size.
+  //!
+  //! \param div The division of work this function call is responsible for.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  template <typename aabb_converter>
+  void operator () (const work_division& div, aabb_converter converter) {
+
+    using entry_index_type = typename refined_entry::index_type;
+
+    using local_code_type = typename morton_encoder<4>::code_type;
+
+    auto range = loop_range(div, curve.size());
+
+    auto* segments_end = segment_offsets + segment_count;
+
+    auto* segment = std::lower_bound(segment_offsets, segments_end, range.begin);
+
+    auto max_coord = scalar_type(morton_domain<4>::value() - 1);
+
+    morton_encoder<4> encoder;
+
+    std::vector<vec3<scalar_type>> centers;
+
+    for (; (segment < segments_end) && (segment[0] < range.end); segment++) {
+
+      auto first = segment[0];
+      auto last = segment[1];
+
+      auto prefix = refined_code_type(curve[first].code >> shift) << local_bits;
+
+      if ((last - first) == 1) {
+        output[first] = refined_entry { prefix, entry_index_type(curve[first].primitive) };
+        continue;
+      }
+
+      centers.resize(last - first);
+
+      auto bounds = get_empty_aabb<scalar_type>();
+
+      for (auto i = first; i < last; i++) {
+        auto center = center_of(converter(primitives[curve[i].primitive]));
+        bounds.min = min(bounds.min, center);
+        bounds.max = max(bounds.max, center);
+        centers[i - first] = center;
+      }
+
+      auto scale = morton_scale(bounds, morton_domain<4>::value(), quantization);
+
+      for (auto i = first; i < last; i++) {
+
+        auto cell = hadamard_mul(centers[i - first] - bounds.min, scale);
+
+        auto x_code = local_code_type(max(min(cell.x, max_coord), scalar_type(0)));
+        auto y_code = local_code_type(max(min(cell.y, max_coord), scalar_type(0)));
+        auto z_code = local_code_type(max(min(cell.z, max_coord), scalar_type(0)));
+
+        output[i] = refined_entry { prefix | encoder(x_code, y_code, z_code), entry_index_type(curve[i].primitive) };
+      }
+
+      std::sort(output + first, output + last, [](const refined_entry& a, const refined_entry& b) {
+        return curve_less(a, b);
+      });
+    }
+  }
+private:
+  //! The primitives that the curve was made for.
+  const primitive_type* primitives;
+  //! The sorted curve being refined.
+  const curve_type& curve;
+  //! The first entry of each segment, followed by the curve size.
+  const size_type* segment_offsets;
+  //! The number of segments.
+  size_type segment_count;
+  //! The number of low code bits that aren't shared within a segment.
+  size_type shift;
+  //! How centroids are mapped to Morton cells.
+  morton_quantization quantization;
+  //! The refined entries, in curve order.
+  refined_entry* output;
+};
+
+//! \brief Converts a primitive index into the bounding box of the primitive.
+//! This is used to build a BVH for a subset of primitives.
+//!
+//! \tparam primitive_iterator A random access iterator or
+//! pointer to the primitives being indexed.
+//!
+//! \tparam aabb_converter The primitive to bounding box converter.
+template <typename primitive_iterator, typename aabb_converter>
+class indirect_converter final {
+public:
+  //! Constructs a new indirect converter.
+  //! \param p The primitives that the indices refer to.
+  //! \param cvt The primitive to bounding box converter.
+  constexpr indirect_converter(primitive_iterator p, const aabb_converter& cvt) noexcept
+    : primitives(p), converter(cvt) {}
+  //! Gets the bounding box of an indexed primitive.
+  template <typename index_type>
+  auto operator () (index_type index) const {
+    return converter(primitives[index]);
+  }
+private:
+  //! The primitives that the indices refer to.
+  primitive_iterator primitives;
+  //! The primitive to bounding box converter.
+  const aabb_converter& converter;
+};
+
+//! \brief This class is used for generating Morton curves.
+//!
+//! \tparam scalar_type The type for the 3D points
+//! that get converted into Morton curves.
+//!
+//! \tparam task_scheduler The task scheduler to pass workers to.
+template <typename scalar_type, typename task_scheduler>
+class morton_curve_builder final {
+  //! A reference to the task scheduler to use.
+  //! This is most likely coming straight from the copy
+  //! used by the BVH builder.
+  task_scheduler& scheduler;
+  //! How centroids are mapped to Morton cells.
+  morton_quantization quantization;
+public:
+  //! A type definition for a Morton curve.
+  using code_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+  //! A type definition for the curve generated by this class.
+  using curve_type = space_filling_curve<code_type>;
+  //! Constructs a new curve builder.
+  //! \param scheduler_ The scheduler to pass work items to.
+  //! \param q How centroids are mapped to Morton cells.
+  morton_curve_builder(task_scheduler& scheduler_, morton_quantization q = morton_quantization::cube)
+    : scheduler(scheduler_), quantization(q) {}
+  //! Converts a set of primitives into a space filling curve.
+  //!
+  //! \param primitives The array of primitives to convert.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \param observer Notified of the centroid bounds and Morton curve phases.
+  //!
+  //! \return A space filling curve with Morton codes.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  curve_type operator () (const primitive* primitives, size_type count, const aabb_converter& converter, build_observer& observer) {
+
+    using entry_vec = typename curve_type::entry_vec;
+
+    observer.begin(build_phase::centroid_bounds);
+
+    auto centroid_bounds = find_centroid_bounds(primitives, count, converter);
+
+    observer.end(build_phase::centroid_bounds);
+
+    observer.begin(build_phase::morton_curve);
+
+    entry_vec entries(count);
+
+    morton_curve_kernel<scalar_type, primitive> curve_kernel(primitives, entries.data(), count, quantization);
+
+    scheduler(curve_kernel, centroid_bounds, converter);
+
+    observer.end(build_phase::morton_curve);
+
+    return curve_type(std::move(entries));
+  }
+  //! Converts a set of primitives into a space filling curve,
+  //! reusing the centroid bounds and curve order of a previous build.
+  //! If the cache doesn't contain an order for @p count primitives,
+  //! the curve is built as it is in a regular build.
+  //!
+  //! \param cache The results of the previous build. The centroid
+  //! bounds and reuse flags of the cache are updated by this function.
+  //!
+  //! \return A space filling curve with Morton codes,
+  //! in the order of the previous sorted curve.
+  template <typename primitive, typename aabb_converter, typename build_observer>
+  curve_type operator () (const primitive* primitives,
+                          size_type count,
+                          const aabb_converter& converter,
+                          build_observer& observer,
+                          rebuild_cache<scalar_type>& cache) {
+
+    using entry_vec = typename curve_type::entry_vec;
+
+    using curve_kernel_type = morton_curve_kernel<scalar_type, primitive>;
+
+    using index_type = typename rebuild_cache<scalar_type>::index_type;
+
+    entry_vec codes(count);
+
+    cache.reused_order = (cache.order.size() == count);
+
+    cache.reused_bounds = false;
+
+    // The previous bounds are tried first, since the Morton codes
+    // of primitives that haven't moved stay the same with them.
+    // The centroids are checked while the codes are computed, so
+    // when the bounds are reused, the codes are computed as part
+    // of the centroid bounds phase.
+
+    observer.begin(build_phase::centroid_bounds);
+
+    if (cache.reused_order) {
+
+      std::vector<unsigned char> outside_flags(scheduler.max_threads(), 0);
+
+      curve_kernel_type checked_kernel(primitives, codes.data(), count, quantization, outside_flags.data());
+
+      scheduler(checked_kernel, cache.centroid_bounds, converter);
+
+      cache.reused_bounds = std::find(outside_flags.begin(), outside_flags.end(), 1) == outside_flags.end();
+    }
+
+    if (!cache.reused_bounds) {
+
+      cache.centroid_bounds = find_centroid_bounds(primitives, count, converter);
+
+      auto margin = size_of(cache.centroid_bounds) * cache.bounds_margin;
+
+      cache.centroid_bounds.min = cache.centroid_bounds.min - margin;
+      cache.centroid_bounds.max = cache.centroid_bounds.max + margin;
+    }
+
+    observer.end(build_phase::centroid_bounds);
+
+    observer.begin(build_phase::morton_curve);
+
+    if (!cache.reused_bounds) {
+
+      curve_kernel_type curve_kernel(primitives, codes.data(), count, quantization);
+
+      scheduler(curve_kernel, cache.centroid_bounds, converter);
+    }
+
+    if (!cache.reused_order) {
+      observer.end(build_phase::morton_curve);
+      return curve_type(std::move(codes));
+    }
+
+    // The codes were computed in primitive order, which reads
+    // the primitives sequentially. They're gathered into the
+    // order of the previous curve afterwards.
+
+    entry_vec entries(count);
+
+    curve_gather_kernel<typename curve_type::entry, index_type> gather_kernel(codes.data(), entries.data(), cache.order.data(), count);
+
+    scheduler(gather_kernel);
+
+    observer.end(build_phase::morton_curve);
+
+    return curve_type(std::move(entries));
+  }
+  //! Calculates the bounding box of all primitive centroids.
+  //!
+  //! \return The centroid bounds of the primitives.
+  template <typename primitive, typename aabb_converter>
+  aabb<scalar_type> find_centroid_bounds(const primitive* primitives, size_type count, const aabb_converter& converter) {
+
+    using box_type = aabb<scalar_type>;
+
+    using centroid_bounds_kernel_type = centroid_bounds_kernel<scalar_type, primitive, aabb_converter>;
+
+    std::vector<box_type> thread_boxes(scheduler.max_threads());
+
+    centroid_bounds_kernel_type scene_bounds_kern(primitives, count, converter, thread_boxes.data());
+
+    scheduler(scene_bounds_kern);
+
+    auto centroid_bounds = get_empty_aabb<scalar_type>();
+
+    for (const auto& th_box : thread_boxes) {
+      centroid_bounds = union_of(centroid_bounds, th_box);
+    }
+
+    return centroid_bounds;
+  }
+};
+
+//! \brief Runs the tasks of a cancellable build in chunks,
+//! checking a @ref build_token between them.
+//!
+//! Each worker of the wrapped scheduler is given several divisions
+//! of the work, one after the other. Kernels that keep results per
+//! division see this in @ref max_threads, which is the number of
+//! divisions rather than the number of threads.
+//!
+//! \tparam task_scheduler The scheduler that runs the chunked tasks.
+template <typename task_scheduler>
+class cancellable_scheduler final {
+  //! The scheduler that runs the chunked tasks.
+  task_scheduler& scheduler;
+  //! The token to check between chunks.
+  build_token& token;
+public:
+  //! The number of chunks that each worker's share of a task is split into.
+  static constexpr size_type chunks_per_thread = 16;
+  //! Constructs a new cancellable scheduler.
+  //! \param s The scheduler to run the tasks on.
+  //! \param t The token to check between chunks.
+  constexpr cancellable_scheduler(task_scheduler& s, build_token& t) noexcept
+    : scheduler(s), token(t) {}
+  //! Runs a task in chunks, until the task is done or the build is cancelled.
+  template <typename task_type, typename... arg_types>
+  void operator () (task_type task, arg_types... args) {
+
+    if (token.cancelled()) {
+      return;
+    }
+
+    token.begin_chunks(max_threads());
+
+    auto chunked_task = [task, t = &token](const work_division& div, arg_types... a) mutable {
+
+      for (size_type i = 0; i < chunks_per_thread; i++) {
+
+        if (t->cancelled()) {
+          return;
+        }
+
+        task(work_division { (div.idx * chunks_per_thread) + i, div.max * chunks_per_thread }, a...);
+
+        t->end_chunk();
+      }
+    };
+
+    scheduler(chunked_task, args...);
+  }
+  //! Indicates the number of divisions that a task is split into.
+  inline size_type max_threads() const noexcept {
+    return scheduler.max_threads() * chunks_per_thread;
+  }
+};
+
+//! \brief Passes the build phases to both a @ref build_token and a build observer.
+//!
+//! \tparam build_observer The type of the observer given by the caller.
+template <typename build_observer>
+class token_observer final {
+  //! The token to report the phases to.
+  build_token& token;
+  //! The observer given by the caller.
+  build_observer& observer;
+public:
+  //! Constructs a new token observer.
+  //! \param t The token to report the phases to.
+  //! \param o The observer given by the caller.
+  constexpr token_observer(build_token& t, build_observer& o) noexcept
+    : token(t), observer(o) {}
+  //! Called before a build phase is started.
+  void begin(build_phase phase) {
+    token.begin(phase);
+    observer.begin(phase);
+  }
+  //! Called after a build phase is completed.
+  void end(build_phase phase) {
+    observer.end(phase);
+    token.end(phase);
+  }
+};
+
+//! \brief Represents a division of an internal LBVH node.
+struct node_division final {
+  //! The first index of the division.
+  size_type index_a;
+  //! The second index of the division.
+  size_type index_b;
+  //! The index at which the division occurs.
+  size_type split;
+  //! Accesses the minimum index of the division.
+  inline constexpr auto min() const noexcept {
+    return (index_a < index_b) ? index_a : index_b;
+  }
+  //! Accesses the maximum index of the division.
+  inline constexpr auto max() const noexcept {
+    return (index_b > index_a) ? index_b : index_a;
+  }
+};
+
+//! This function divides an internal node into two ranges.
+//! It can be evaluated at compile time, when the curve is an array.
+//!
+//! \tparam curve_type The type of the sorted curve. This is either a
+//! @ref space_filling_curve or an array of @ref curve_entry instances.
+//!
+//! \param table The space filling curve, used to determine the indices of the split.
+//!
+//! \param node_index The index of the node being divided.
+//!
+//! \return A division structure instance, which may be used to assign sub nodes.
+template <typename curve_type>
+constexpr node_division divide_node(const curve_type& table, size_type node_index) noexcept {
+
+  // The type used for codes in the space filling curve.
+  using code_type = std::decay_t<decltype(table[0].code)>;
+
+  // Used as the return value of the delta operator.
+  using delta_type = typename associated_types<sizeof(code_type)>::int_type;
+
+  // The type used for offsets.
+  using offset_type = typename associated_types<sizeof(code_type)>::int_type;
+
+  // Calculates upper bits, or returns -1
+  // if 'k' is out of bounds. Appears in the
+  // LBVH paper as 'δ' (lower case delta)
+  auto calc_delta = [&table](offset_type j, offset_type k) -> delta_type {
+
+    if ((k < 0) || (k >= offset_type(table.size()))) {
+      // Suggested by the paper for out of bounds 'k'
+      return -1;
+    }
+
+    auto l_code = table[size_type(j)].code;
+    auto r_code = table[size_type(k)].code;
+
+    using clz_input_type = typename associated_types<sizeof(code_type)>::uint_type;
+
+    if (l_code == r_code) {
+      // Suggested by the paper in
+      // case the code are equal.
+      return clz(clz_input_type(j ^ k)) + delta_type(sizeof(code_type) * 8);
+    } else {
+      return clz(clz_input_type(l_code ^ r_code));
+    }
+  };
+
+  // It's easier in this function to regard
+  // all indices as signed offset types.
+  auto i = offset_type(node_index);
+
+  auto table_size = offset_type(table.size());
+
+  auto d = sign(calc_delta(i, i + 1) - calc_delta(i, i - 1));
+
+  auto delta_min = calc_delta(i, i - d);
+
+  offset_type l_max = 128;
+
+  while (true) {
+
+    auto k = i + (l_max * d);
+
+    if (k >= table_size) {
+      break;
+    }
+
+    if (!(calc_delta(i, k) > delta_min)) {
+      break;
+    }
+
+    l_max *= 4;
+  }
+
+  offset_type l = 0;
+
+  for (offset_type div = 2; true; div *= 2) {
+
+    auto t = l_max / div;
+
+    auto k = i + ((l + t) * d);
+
+    if (calc_delta(i, k) > delta_min) {
+      l += t;
+    }
+
+    if (t == 1) {
+      break;
+    }
+  }
+
+  auto j = i + (l * d);
+
+  auto delta_node = calc_delta(i, j);
+
+  offset_type s = 0;
+
+  for (offset_type div = 2; true; div *= 2) {
+
+    auto t = ceil_div(l, div);
+
+    auto k = i + ((s + t) * d);
+
+    if (calc_delta(i, k) > delta_node) {
+      s += t;
+    }
+
+    if (div >= l) {
+      break;
+    }
+  }
+
+  auto gamma = i + (s * d) + min(d, delta_type(0));
+
+  return node_division {
+    size_type(i),
+    size_type(j),
+    size_type(gamma)
+  };
+}
+
+//! Sorts the entries of a curve as @ref curve_less orders them, in a
+//! way that can be evaluated at compile time. This is a heap sort, since
+//! the standard sort algorithms can't be used in constant expressions
+//! before C++20.
+//!
+//! \param entries The entries to sort.
+template <typename entry_type, size_type count>
+constexpr void constexpr_sort(std::array<entry_type, count>& entries) noexcept {
+
+  auto swap_entries = [&entries](size_type a, size_type b) {
+    auto tmp = entries[a];
+    entries[a] = entries[b];
+    entries[b] = tmp;
+  };
+
+  // Moves an entry down the heap until
+  // neither of its children come after it.
+
+  auto sift_down = [&entries, &swap_entries](size_type root, size_type end) {
+    while (((root * 2) + 1) < end) {
+      auto child = (root * 2) + 1;
+      if (((child + 1) < end) && curve_less(entries[child], entries[child + 1])) {
+        child++;
+      }
+      if (!curve_less(entries[root], entries[child])) {
+        return;
+      }
+      swap_entries(root, child);
+      root = child;
+    }
+  };
+
+  for (size_type i = count / 2; i > 0; i--) {
+    sift_down(i - 1, count);
+  }
+
+  for (size_type end = count; end > 1; end--) {
+    swap_entries(0, end - 1);
+    sift_down(0, end - 1);
+  }
+}
+
+//! Links an internal node to its children, as divided along the curve.
+//!
+//! \param curve The sorted curve that the nodes are built from.
+//!
+//! \param node_index The index of the node to link.
+//!
+//! \param n The node to assign the children of.
+template <typename curve_type, typename node_type>
+constexpr void link_node(const curve_type& curve, size_type node_index, node_type& n) noexcept {
+
+  using index_type = typename node_type::index_type;
+
+  auto node_div = divide_node(curve, node_index);
+
+  auto l_is_leaf = (node_div.min() == (node_div.split + 0));
+  auto r_is_leaf = (node_div.max() == (node_div.split + 1));
+
+  auto l_mask = l_is_leaf ? highest_bit<index_type>() : 0;
+  auto r_mask = r_is_leaf ? highest_bit<index_type>() : 0;
+
+  // Leaves refer to the primitive at their
+  // position in the curve, not the position itself.
+
+  auto l_index = l_is_leaf ? size_type(curve[node_div.split + 0].primitive) : (node_div.split + 0);
+  auto r_index = r_is_leaf ? size_type(curve[node_div.split + 1].primitive) : (node_div.split + 1);
+
+  n.left  = index_type(l_index | l_mask);
+  n.right = index_type(r_index | r_mask);
+}
+
+//! \brief Used for building the BVH nodes.
+//! Can be called by the scheduler from many threads.
+//!
+//! \tparam code_type The type of code contained by the space filling curve.
+//!
+//! \tparam scalar_type The scalar type used by the node boxes.
+//!
+//! \tparam bvh_node The type of node being built.
+template <typename code_type, typename scalar_type, typename bvh_node = node<scalar_type>>
+class builder_kernel final {
+public:
+  //! A type definition for a space filling curve.
+  using curve_type = space_filling_curve<code_type>;
+  //! A type definition for a node type.
+  using node_type = bvh_node;
+  //! Constructs a new builder kernel.
+  //! \param c The curve containing the codes to build the nodes with.
+  //! \param n The allocated node array to put the node data into.
+  constexpr builder_kernel(const curve_type& c, node_type* n) noexcept
+    : curve(c), nodes(n) {}
+  //! Calls the kernel to build a certain portion of the BVH nodes.
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) noexcept {
+
+    auto range = loop_range(div, curve.size() - 1);
+
+    for (auto i = range.begin; i < range.end; i++) {
+      link_node(curve, i, nodes[i]);
+    }
+  }
+private:
+  //! This is the space filling curve used to determine
+  //! the range and split of each node that this kernel will build.
+  const curve_type& curve;
+  //! A pointer to the node array being constructed.
+  node_type* nodes;
+};
+
+//! Fits the box of one node to its children.
+//! The children that are internal nodes have to be fit first.
+//!
+//! \param nodes The internal nodes of the BVH.
+//!
+//! \param node_index The index of the node to fit.
+//!
+//! \param primitives The primitives that the leaves refer to.
+//!
+//! \param converter The primitive to bounding box converter.
+template <typename node_type, typename primitive, typename aabb_converter>
+void fit_node(node_type* nodes,
+              size_type node_index,
+              const primitive* primitives,
+              const aabb_converter& converter) {
+
+  auto& node = nodes[node_index];
+
+  if (node.left_is_leaf()) {
+    node.box = converter(primitives[node.left_leaf_index()]);
+  } else {
+    node.box = nodes[node.left].box;
+  }
+
+  if (node.right_is_leaf()) {
+    node.box = union_of(node.box, converter(primitives[node.right_leaf_index()]));
+  } else {
+    node.box = union_of(node.box, nodes[node.right].box);
+  }
+}
+
+//! Lists the internal nodes of a BVH in breadth first order.
+//! Going through the list in reverse visits children before their parents.
+//!
+//! \param nodes The internal nodes of the BVH.
+//!
+//! \param node_count The number of internal nodes.
+//!
+//! \param indices Receives the node indices, starting with the root.
+template <typename node_type>
+void breadth_first_order(const node_type* nodes, size_type node_count, std::vector<size_type>& indices) {
+
+  indices.clear();
+
+  indices.reserve(node_count);
+
+  indices.push_back(0);
+
+  for (size_type i = 0; i < indices.size(); i++) {
+
+    auto j = indices[i];
+
+    if (!nodes[j].left_is_leaf()) {
+      indices.push_back(nodes[j].left);
+    }
+
+    if (!nodes[j].right_is_leaf()) {
+      indices.push_back(nodes[j].right);
+    }
+  }
+}
+
+//! Fits BVH nodes with their appropriate boxes.
+//! The nodes are visited breadth first from the root,
+//! and then fit in reverse, so that children are fit first.
+//!
+//! \param nodes The internal nodes to fit.
+//!
+//! \param node_count The number of internal nodes.
+//!
+//! \param primitives The primitives that the leaves refer to.
+//!
+//! \param converter The primitive to bounding box converter.
+//!
+//! \param indices Used to store the visiting order of the nodes.
+//! This is passed by the caller so that it can be reused.
+template <typename node_type, typename primitive, typename aabb_converter>
+void fit_boxes(node_type* nodes,
+               size_type node_count,
+               const primitive* primitives,
+               const aabb_converter& converter,
+               std::vector<size_type>& indices) {
+
+  breadth_first_order(nodes, node_count, indices);
+
+  for (size_type i = indices.size(); i > 0; i--) {
+    fit_node(nodes, indices[i - 1], primitives, converter);
+  }
+}
+
+//! \brief Builds many small BVHs at once, with each
+//! BVH being built entirely by one thread.
+//!
+//! \tparam scalar_type The scalar type used by the node boxes.
+//!
+//! \tparam primitive The type of primitive in the scene.
+//!
+//! \tparam aabb_converter Calculates the bounding box of a primitive.
+template <typename scalar_type, typename primitive, typename aabb_converter>
+class batch_build_kernel final {
+public:
+  //! A type definition for a BVH.
+  using bvh_type = bvh<scalar_type>;
+  //! A type definition for a BVH node.
+  using node_type = node<scalar_type>;
+  //! A type definition for a Morton code.
+  using code_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+  //! A type definition for a space filling curve.
+  using curve_type = space_filling_curve<code_type>;
+  //! The memory that a thread reuses between its builds.
+  struct scratch final {
+    //! The entries of the curve being built.
+    typename curve_type::entry_vec entries;
+    //! The visiting order of the nodes being fit.
+    std::vector<size_type> indices;
+  };
+  //! Constructs a new batch build kernel.
+  //!
+  //! \param r The primitive ranges to build the BVHs for.
+  //!
+  //! \param o The indices of the ranges that this kernel builds.
+  //! These are divided between the threads in an interleaved order.
+  //!
+  //! \param oc The number of indices in @p o.
+  //!
+  //! \param cvt The primitive to bounding box converter.
+  //!
+  //! \param b The array of BVHs to receive the results, one per range.
+  //!
+  //! \param s The scratch memory, one per thread.
+  //!
+  //! \param q How centroids are mapped to Morton cells.
+  batch_build_kernel(const build_range<primitive>* r,
+                     const size_type* o,
+                     size_type oc,
+                     const aabb_converter& cvt,
+                     bvh_type* b,
+                     scratch* s,
+                     morton_quantization q) noexcept
+    : ranges(r), order(o), order_count(oc), converter(cvt), bvhs(b), scratches(s), quantization(q) {}
+  //! Builds the BVHs assigned to a thread.
+  //!
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) {
+
+    auto& s = scratches[div.idx];
+
+    for (auto i = div.idx; i < order_count; i += div.max) {
+      build(ranges[order[i]], bvhs[order[i]], s);
+    }
+  }
+protected:
+  //! Builds a single BVH on the calling thread.
+  void build(const build_range<primitive>& range, bvh_type& out, scratch& s) {
+
+    if (range.count < 2) {
+      out = bvh_type(std::vector<node_type>());
+      return;
+    }
+
+    work_division whole { 0, 1 };
+
+    aabb<scalar_type> centroid_bounds;
+
+    centroid_bounds_kernel<scalar_type, primitive, aabb_converter> bounds_kernel(range.primitives, range.count, converter, &centroid_bounds);
+
+    bounds_kernel(whole);
+
+    s.entries.resize(range.count);
+
+    morton_curve_kernel<scalar_type, primitive> curve_kernel(range.primitives, s.entries.data(), range.count, quantization);
+
+    curve_kernel(whole, centroid_bounds, converter);
+
+    curve_type curve(std::move(s.entries));
+
+    curve.sort_serial();
+
+    std::vector<node_type> nodes(range.count - 1);
+
+    builder_kernel<code_type, scalar_type> hierarchy_kernel(curve, nodes.data());
+
+    hierarchy_kernel(whole);
+
+    s.entries = curve.release();
+
+    fit_boxes(nodes.data(), nodes.size(), range.primitives, converter, s.indices);
+
+    out = bvh_type(std::move(nodes));
+  }
+private:
+  //! The primitive ranges to build the BVHs for.
+  const build_range<primitive>* ranges;
+  //! The indices of the ranges built by this kernel.
+  const size_type* order;
+  //! The number of indices in the order array.
+  size_type order_count;
+  //! The primitive to bounding box converter.
+  const aabb_converter& converter;
+  //! The BVHs that receive the results.
+  bvh_type* bvhs;
+  //! The scratch memory of each thread.
+  scratch* scratches;
+  //! How centroids are mapped to Morton cells.
+  morton_quantization quantization;
+};
+
+//! \brief An item that is sorted into the nodes of a binned SAH build.
+//! This is either a primitive or a subtree that was built beforehand.
+//!
+//! \tparam scalar_type The scalar type used by the node boxes.
+template <typename scalar_type>
+struct sah_item final {
+  //! A type definition for a node reference.
+  using index_type = typename node<scalar_type>::index_type;
+  //! The bounding box of the item.
+  aabb<scalar_type> box;
+  //! The center of the bounding box, which is what gets binned.
+  vec3<scalar_type> center;
+  //! The reference that a parent node stores for this item.
+  //! For primitives, this has the highest bit set.
+  index_type ref;
+};
+
+//! Accesses a component of a vector by axis index.
+//!
+//! \param axis Zero for X, one for Y and two for Z.
+template <typename scalar_type>
+inline constexpr scalar_type component(const vec3<scalar_type>& v, size_type axis) noexcept {
+  return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+}
+
+//! \brief Contains the bins along each axis of a binned SAH split.
+//!
+//! \tparam scalar_type The scalar type of the item boxes.
+template <typename scalar_type>
+class sah_bins final {
+public:
+  //! A type definition for an item being binned.
+  using item_type = sah_item<scalar_type>;
+  //! The number of bins along each axis.
+  static constexpr size_type bin_count() noexcept {
+    return 16;
+  }
+  //! Constructs an empty set of bins.
+  sah_bins() noexcept {
+    clear();
+  }
+  //! Empties all of the bins.
+  void clear() noexcept {
+    for (size_type axis = 0; axis < 3; axis++) {
+      for (size_type i = 0; i < bin_count(); i++) {
+        boxes[axis][i] = get_empty_aabb<scalar_type>();
+        counts[axis][i] = 0;
+      }
+    }
+  }
+  //! Calculates the bin that an item goes into.
+  //!
+  //! \param item The item to get the bin of.
+  //!
+  //! \param bounds The bounds of the item centers.
+  //!
+  //! \param scale The number of bins per unit along each axis.
+  //!
+  //! \param axis The axis to get the bin along.
+  static size_type bin_of(const item_type& item,
+                          const aabb<scalar_type>& bounds,
+                          const vec3<scalar_type>& scale,
+                          size_type axis) noexcept {
+
+    auto offset = component(item.center, axis) - component(bounds.min, axis);
+
+    auto bin = size_type(offset * component(scale, axis));
+
+    return (bin < bin_count()) ? bin : (bin_count() - 1);
+  }
+  //! Adds an item to its bin along each axis.
+  void add(const item_type& item, const aabb<scalar_type>& bounds, const vec3<scalar_type>& scale) noexcept {
+    for (size_type axis = 0; axis < 3; axis++) {
+      auto bin = bin_of(item, bounds, scale, axis);
+      boxes[axis][bin] = union_of(boxes[axis][bin], item.box);
+      counts[axis][bin]++;
+    }
+  }
+  //! Adds the contents of another set of bins.
+  void merge(const sah_bins& other) noexcept {
+    for (size_type axis = 0; axis < 3; axis++) {
+      for (size_type i = 0; i < bin_count(); i++) {
+        boxes[axis][i] = union_of(boxes[axis][i], other.boxes[axis][i]);
+        counts[axis][i] += other.counts[axis][i];
+      }
+    }
+  }
+  //! Finds the split between two bins with the lowest SAH cost.
+  //!
+  //! \param axis Receives the axis of the best split.
+  //!
+  //! \param bin Receives the last bin on the left side of the split.
+  //!
+  //! \return True if a split was found, false if
+  //! there's no split with items on both sides.
+  bool find_split(size_type& axis, size_type& bin) const noexcept {
+
+    auto best_cost = std::numeric_limits<double>::infinity();
+
+    for (size_type a = 0; a < 3; a++) {
+
+      aabb<scalar_type> right_boxes[bin_count()];
+
+      size_type right_counts[bin_count()];
+
+      auto box = get_empty_aabb<scalar_type>();
+
+      size_type count = 0;
+
+      for (size_type i = bin_count() - 1; i > 0; i--) {
+        box = union_of(box, boxes[a][i]);
+        count += counts[a][i];
+        right_boxes[i] = box;
+        right_counts[i] = count;
+      }
+
+      box = get_empty_aabb<scalar_type>();
+
+      count = 0;
+
+      for (size_type i = 0; (i + 1) < bin_count(); i++) {
+
+        box = union_of(box, boxes[a][i]);
+
+        count += counts[a][i];
+
+        if (!count || !right_counts[i + 1]) {
+          continue;
+        }
+
+        auto cost = (surface_area(box) * double(count))
+                  + (surface_area(right_boxes[i + 1]) * double(right_counts[i + 1]));
+
+        if (cost < best_cost) {
+          best_cost = cost;
+          axis = a;
+          bin = i;
+        }
+      }
+    }
+
+    return best_cost < std::numeric_limits<double>::infinity();
+  }
+private:
+  //! The union of the item boxes in each bin.
+  aabb<scalar_type> boxes[3][bin_count()];
+  //! The number of items in each bin.
+  size_type counts[3][bin_count()];
+};
+
+//! \brief Calculates the bounds of the SAH item centers.
+//! Can be called by the scheduler from many threads.
+template <typename scalar_type>
+class sah_bounds_kernel final {
+public:
+  //! A type definition for an SAH item.
+  using item_type = sah_item<scalar_type>;
+  //! Constructs a new bounds kernel.
+  //! \param i The items to get the center bounds of.
+  //! \param c The number of items.
+  //! \param thb The array of boxes, one per thread.
+  constexpr sah_bounds_kernel(const item_type* i, size_type c, aabb<scalar_type>* thb) noexcept
+    : items(i), count(c), thread_boxes(thb) {}
+  //! Calculates the center bounds of a portion of the items.
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) noexcept {
+
+    auto range = loop_range(div, count);
+
+    auto box = get_empty_aabb<scalar_type>();
+
+    for (auto i = range.begin; i < range.end; i++) {
+      box = union_of(box, items[i].center);
+    }
+
+    thread_boxes[div.idx] = box;
+  }
+private:
+  //! The items to get the center bounds of.
+  const item_type* items;
+  //! The number of items.
+  size_type count;
+  //! The center bounds of each thread.
+  aabb<scalar_type>* thread_boxes;
+};
+
+//! \brief Bins the SAH items of a node.
+//! Can be called by the scheduler from many threads.
+template <typename scalar_type>
+class sah_bin_kernel final {
+public:
+  //! A type definition for an SAH item.
+  using item_type = sah_item<scalar_type>;
+  //! Constructs a new bin kernel.
+  //! \param i The items to bin.
+  //! \param c The number of items.
+  //! \param b The bounds of the item centers.
+  //! \param s The number of bins per unit along each axis.
+  //! \param thb The array of bins, one per thread.
+  constexpr sah_bin_kernel(const item_type* i,
+                           size_type c,
+                           const aabb<scalar_type>& b,
+                           const vec3<scalar_type>& s,
+                           sah_bins<scalar_type>* thb) noexcept
+    : items(i), count(c), bounds(b), scale(s), thread_bins(thb) {}
+  //! Bins a portion of the items.
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) noexcept {
+
+    auto range = loop_range(div, count);
+
+    auto& bins = thread_bins[div.idx];
+
+    bins.clear();
+
+    for (auto i = range.begin; i < range.end; i++) {
+      bins.add(items[i], bounds, scale);
+    }
+  }
+private:
+  //! The items to bin.
+  const item_type* items;
+  //! The number of items.
+  size_type count;
+  //! The bounds of the item centers.
+  aabb<scalar_type> bounds;
+  //! The number of bins per unit along each axis.
+  vec3<scalar_type> scale;
+  //! The bins of each thread.
+  sah_bins<scalar_type>* thread_bins;
+};
+
+//! \brief Converts primitives to SAH items.
+//! Can be called by the scheduler from many threads.
+template <typename scalar_type, typename primitive, typename aabb_converter>
+class sah_item_kernel final {
+public:
+  //! A type definition for an SAH item.
+  using item_type = sah_item<scalar_type>;
+  //! Constructs a new item kernel.
+  //! \param p The primitives to make items for.
+  //! \param c The number of primitives.
+  //! \param cvt The primitive to bounding box converter.
+  //! \param i The item array to write to.
+  constexpr sah_item_kernel(const primitive* p, size_type c, const aabb_converter& cvt, item_type* i) noexcept
+    : primitives(p), count(c), converter(cvt), items(i) {}
+  //! Converts a portion of the primitives.
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) {
+
+    using index_type = typename item_type::index_type;
+
+    auto range = loop_range(div, count);
+
+    for (auto i = range.begin; i < range.end; i++) {
+
+      auto box = converter(primitives[i]);
+
+      items[i] = item_type { box, center_of(box), index_type(i) | highest_bit<index_type>() };
+    }
+  }
+private:
+  //! The primitives to make items for.
+  const primitive* primitives;
+  //! The number of primitives.
+  size_type count;
+  //! The primitive to bounding box converter.
+  const aabb_converter& converter;
+  //! The item array to write to.
+  item_type* items;
+};
+
+//! \brief Builds a binary tree over a set of items with binned SAH splits.
+//!
+//! The top of the tree is split breadth first, binning large nodes on
+//! all threads, until there is a subtree for every thread to work on.
+//! The subtrees are then built on their own threads.
+//!
+//! The nodes are written to a given set of node slots. A subtree with
+//! N items at slot offset K uses the N - 1 slots starting at K, which
+//! lets the slots of each subtree be known before it's built.
+//!
+//! \tparam scalar_type The scalar type used by the node boxes.
+//!
+//! \tparam task_scheduler The scheduler to distribute the work with.
+template <typename scalar_type, typename task_scheduler>
+class binned_sah_builder final {
+public:
+  //! A type definition for an SAH item.
+  using item_type = sah_item<scalar_type>;
+  //! A type definition for a BVH node.
+  using node_type = node<scalar_type>;
+  //! A type definition for a node index.
+  using index_type = typename node_type::index_type;
+  //! A subtree that still has to be built.
+  struct task final {
+    //! The index of the first item of the subtree.
+    size_type begin;
+    //! The index of one past the last item of the subtree.
+    size_type end;
+    //! The offset of the first slot that the subtree uses.
+    size_type offset;
+  };
+  //! Nodes with at least this many items are binned on all threads.
+  static constexpr size_type parallel_threshold() noexcept {
+    return 65536;
+  }
+  //! Constructs a new binned SAH builder.
+  //!
+  //! \param s The scheduler to distribute the work with.
+  //!
+  //! \param i The items to build the tree over. These are reordered.
+  //!
+  //! \param n The node array to write the tree into.
+  //!
+  //! \param sl The node index of each slot. If this is null, then
+  //! each slot is written to the node with the same index.
+  binned_sah_builder(task_scheduler& s, item_type* i, node_type* n, const index_type* sl) noexcept
+    : scheduler(s), items(i), nodes(n), slots(sl) {}
+  //! Builds the tree. The root is written to the first slot.
+  //!
+  //! \param count The number of items. There must be at least two.
+  void operator () (size_type count);
+  //! Builds a subtree on the calling thread.
+  //!
+  //! \param t The subtree to build.
+  void build_subtree(const task& t);
+protected:
+  //! Records a node that was written, so that its box can be
+  //! finished once the boxes of its children are known.
+  struct visit final {
+    //! The index of the node.
+    index_type slot;
+    //! Whether or not the left child was built as a subtree.
+    bool left_built;
+    //! Whether or not the right child was built as a subtree.
+    bool right_built;
+  };
+  //! Gets the node index of a slot.
+  inline index_type slot_of(size_type offset) const noexcept {
+    return slots ? slots[offset] : index_type(offset);
+  }
+  //! Splits the node of a task and adds tasks for its children.
+  void expand(const task& t, std::vector<task>& tasks, std::vector<visit>& visits, bool parallel);
+  //! Finds where to split a range of items, reordering them.
+  //! \return The index of the first item on the right side.
+  size_type split(size_type begin, size_type end, bool parallel);
+  //! Finishes the boxes of visited nodes, children first.
+  void fit(const std::vector<visit>& visits) noexcept;
+private:
+  //! The scheduler to distribute the work with.
+  task_scheduler& scheduler;
+  //! The items to build the tree over.
+  item_type* items;
+  //! The node array to write the tree into.
+  node_type* nodes;
+  //! The node index of each slot, which may be null.
+  const index_type* slots;
+};
+
+//! \brief Builds the subtrees of a binned SAH build.
+//! Can be called by the scheduler from many threads.
+//!
+//! \tparam sah_builder_type The type of the binned SAH builder.
+template <typename sah_builder_type>
+class sah_subtree_kernel final {
+public:
+  //! A type definition for a subtree task.
+  using task = typename sah_builder_type::task;
+  //! Constructs a new subtree kernel.
+  //! \param b The builder to build the subtrees with.
+  //! \param t The subtrees to build.
+  //! \param c The number of subtrees.
+  constexpr sah_subtree_kernel(sah_builder_type& b, const task* t, size_type c) noexcept
+    : builder(b), tasks(t), count(c) {}
+  //! Builds the subtrees assigned to a thread.
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) {
+    for (auto i = div.idx; i < count; i += div.max) {
+      builder.build_subtree(tasks[i]);
+    }
+  }
+private:
+  //! The builder to build the subtrees with.
+  sah_builder_type& builder;
+  //! The subtrees to build.
+  const task* tasks;
+  //! The number of subtrees.
+  size_type count;
+};
+
+template <typename scalar_type, typename task_scheduler>
+void binned_sah_builder<scalar_type, task_scheduler>::operator () (size_type count) {
+
+  if (count < 2) {
+    return;
+  }
+
+  auto thread_count = scheduler.max_threads();
+
+  std::vector<task> pending { task { 0, count, 0 } };
+
+  std::vector<visit> visits;
+
+  size_type head = 0;
+
+  while ((head < pending.size()) && ((pending.size() - head) < (thread_count * 4))) {
+
+    auto t = pending[head++];
+
+    auto parallel = (thread_count > 1) && ((t.end - t.begin) >= parallel_threshold());
+
+    expand(t, pending, visits, parallel);
+  }
+
+  if (head < pending.size()) {
+
+    // Larger subtrees go first, so that the interleaved
+    // assignment gives each thread a similar amount of work.
+
+    std::sort(pending.begin() + head, pending.end(), [](const task& a, const task& b) {
+      return (a.end - a.begin) > (b.end - b.begin);
+    });
+
+    sah_subtree_kernel<binned_sah_builder> subtree_kernel(*this, pending.data() + head, pending.size() - head);
+
+    scheduler(subtree_kernel);
+  }
+
+  fit(visits);
+}
+
+template <typename scalar_type, typename task_scheduler>
+void binned_sah_builder<scalar_type, task_scheduler>::build_subtree(const task& t) {
+
+  std::vector<task> stack { t };
+
+  std::vector<visit> visits;
+
+  visits.reserve(t.end - t.begin - 1);
+
+  while (!stack.empty()) {
+
+    auto next = stack.back();
+
+    stack.pop_back();
+
+    expand(next, stack, visits, false);
+  }
+
+  fit(visits);
+}
+
+template <typename scalar_type, typename task_scheduler>
+void binned_sah_builder<scalar_type, task_scheduler>::expand(const task& t,
+                                                             std::vector<task>& tasks,
+                                                             std::vector<visit>& visits,
+                                                             bool parallel) {
+
+  auto slot = slot_of(t.offset);
+
+  auto mid = split(t.begin, t.end, parallel);
+
+  auto left_count = mid - t.begin;
+
+  auto right_count = t.end - mid;
+
+  auto& node = nodes[slot];
+
+  node.box = get_empty_aabb<scalar_type>();
+
+  // Children with one item are referred to directly, and their boxes
+  // are added now. The boxes of subtrees are added once they're built.
+
+  if (left_count > 1) {
+    node.left = slot_of(t.offset + 1);
+    tasks.push_back(task { t.begin, mid, t.offset + 1 });
+  } else {
+    node.left = items[t.begin].ref;
+    node.box = union_of(node.box, items[t.begin].box);
+  }
+
+  if (right_count > 1) {
+    node.right = slot_of(t.offset + left_count);
+    tasks.push_back(task { mid, t.end, t.offset + left_count });
+  } else {
+    node.right = items[mid].ref;
+    node.box = union_of(node.box, items[mid].box);
+  }
+
+  visits.push_back(visit { slot, left_count > 1, right_count > 1 });
+}
+
+template <typename scalar_type, typename task_scheduler>
+size_type binned_sah_builder<scalar_type, task_scheduler>::split(size_type begin, size_type end, bool parallel) {
+
+  using bins_type = sah_bins<scalar_type>;
+
+  auto count = end - begin;
+
+  if (count == 2) {
+    return begin + 1;
+  }
+
+  auto bounds = get_empty_aabb<scalar_type>();
+
+  if (parallel) {
+
+    std::vector<aabb<scalar_type>> thread_boxes(scheduler.max_threads(), get_empty_aabb<scalar_type>());
+
+    sah_bounds_kernel<scalar_type> bounds_kernel(items + begin, count, thread_boxes.data());
+
+    scheduler(bounds_kernel);
+
+    for (const auto& box : thread_boxes) {
+      bounds = union_of(bounds, box);
+    }
+
+  } else {
+    for (auto i = begin; i < end; i++) {
+      bounds = union_of(bounds, items[i].center);
+    }
+  }
+
+  auto extent = size_of(bounds);
+
+  auto bin_scale = [](scalar_type e) {
+    return (e > 0) ? (scalar_type(bins_type::bin_count()) / e) : scalar_type(0);
+  };
+
+  vec3<scalar_type> scale { bin_scale(extent.x), bin_scale(extent.y), bin_scale(extent.z) };
+
+  bins_type bins;
+
+  if (parallel) {
+
+    std::vector<bins_type> thread_bins(scheduler.max_threads());
+
+    sah_bin_kernel<scalar_type> bin_kernel(items + begin, count, bounds, scale, thread_bins.data());
+
+    scheduler(bin_kernel);
+
+    for (const auto& th_bins : thread_bins) {
+      bins.merge(th_bins);
+    }
+
+  } else {
+    for (auto i = begin; i < end; i++) {
+      bins.add(items[i], bounds, scale);
+    }
+  }
+
+  size_type axis = 0;
+
+  size_type bin = 0;
+
+  if (!bins.find_split(axis, bin)) {
+
+    // The centers can't be separated by the bins,
+    // so the items are split in half along the longest axis.
+
+    axis = ((extent.x >= extent.y) && (extent.x >= extent.z)) ? 0 : ((extent.y >= extent.z) ? 1 : 2);
+
+    auto mid = begin + (count / 2);
+
+    std::nth_element(items + begin, items + mid, items + end, [axis](const item_type& a, const item_type& b) {
+      return component(a.center, axis) < component(b.center, axis);
+    });
+
+    return mid;
+  }
+
+  auto* first_right = std::partition(items + begin, items + end, [&bounds, &scale, axis, bin](const item_type& item) {
+    return bins_type::bin_of(item, bounds, scale, axis) <= bin;
+  });
+
+  return size_type(first_right - items);
+}
+
+template <typename scalar_type, typename task_scheduler>
+void binned_sah_builder<scalar_type, task_scheduler>::fit(const std::vector<visit>& visits) noexcept {
+  for (size_type i = visits.size(); i > 0; i--) {
+
+    const auto& v = visits[i - 1];
+
+    auto& node = nodes[v.slot];
+
+    if (v.left_built) {
+      node.box = union_of(node.box, nodes[node.left].box);
+    }
+
+    if (v.right_built) {
+      node.box = union_of(node.box, nodes[node.right].box);
+    }
+  }
+}
+
+//! \brief A piece of a primitive that was split before the build.
+//!
+//! \tparam scalar_type The scalar type of the box.
+template <typename scalar_type>
+struct split_reference final {
+  //! A type definition for a primitive index.
+  using index_type = typename node<scalar_type>::index_type;
+  //! The box around this piece of the primitive.
+  aabb<scalar_type> box;
+  //! The index of the primitive.
+  index_type primitive;
+};
+
+//! \brief Clips primitives by only their boxes. This is used when
+//! splitting primitives without a caller provided clipper, so the
+//! pieces are tighter than the whole box only along the split axes.
+//!
+//! \tparam aabb_converter The primitive to bounding box converter.
+template <typename aabb_converter>
+class box_clipper final {
+public:
+  //! Constructs a new box clipper.
+  //! \param c The primitive to bounding box converter.
+  constexpr box_clipper(const aabb_converter& c) noexcept : converter(c) {}
+  //! Gets the part of a primitive's box that is within a region.
+  template <typename primitive, typename scalar_type>
+  auto operator () (const primitive& p, const aabb<scalar_type>& region) const {
+
+    auto box = converter(p);
+
+    return aabb<scalar_type> { math::max(box.min, region.min), math::min(box.max, region.max) };
+  }
+private:
+  //! The primitive to bounding box converter.
+  const aabb_converter& converter;
+};
+
+//! \brief Sums the box areas of a set of primitives.
+//! Can be called by the scheduler from many threads.
+template <typename scalar_type, typename primitive, typename aabb_converter>
+class box_area_kernel final {
+public:
+  //! Constructs a new box area kernel.
+  //! \param p The primitives to sum the box areas of.
+  //! \param c The number of primitives.
+  //! \param cvt The primitive to bounding box converter.
+  //! \param ths The array of sums, one per thread.
+  constexpr box_area_kernel(const primitive* p, size_type c, const aabb_converter& cvt, double* ths) noexcept
+    : primitives(p), count(c), converter(cvt), thread_sums(ths) {}
+  //! Sums the box areas of a portion of the primitives.
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) {
+
+    auto range = loop_range(div, count);
+
+    double sum = 0;
+
+    for (auto i = range.begin; i < range.end; i++) {
+      sum += surface_area(converter(primitives[i]));
+    }
+
+    thread_sums[div.idx] = sum;
+  }
+private:
+  //! The primitives to sum the box areas of.
+  const primitive* primitives;
+  //! The number of primitives.
+  size_type count;
+  //! The primitive to bounding box converter.
+  const aabb_converter& converter;
+  //! The box area sum of each thread.
+  double* thread_sums;
+};
+
+//! \brief Splits oversized primitives into references with tighter boxes.
+//! Can be called by the scheduler from many threads.
+template <typename scalar_type, typename primitive, typename aabb_converter, typename primitive_clipper>
+class split_kernel final {
+public:
+  //! A type definition for a primitive reference.
+  using reference_type = split_reference<scalar_type>;
+  //! A type definition for a primitive index.
+  using index_type = typename reference_type::index_type;
+  //! Constructs a new split kernel.
+  //! \param p The primitives to split.
+  //! \param c The number of primitives.
+  //! \param cvt The primitive to bounding box converter.
+  //! \param clp The primitive clipper.
+  //! \param t The box area above which references are split.
+  //! \param m The maximum number of references per primitive.
+  //! \param thr The array of reference vectors, one per thread.
+  constexpr split_kernel(const primitive* p,
+                         size_type c,
+                         const aabb_converter& cvt,
+                         const primitive_clipper& clp,
+                         double t,
+                         size_type m,
+                         std::vector<reference_type>* thr) noexcept
+    : primitives(p), count(c), converter(cvt), clipper(clp), threshold(t), max_references(m), thread_refs(thr) {}
+  //! Splits a portion of the primitives.
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) {
+
+    auto range = loop_range(div, count);
+
+    auto& refs = thread_refs[div.idx];
+
+    refs.clear();
+
+    std::vector<aabb<scalar_type>> pieces;
+
+    for (auto i = range.begin; i < range.end; i++) {
+
+      auto box = converter(primitives[i]);
+
+      if (!(surface_area(box) > threshold) || (max_references < 2)) {
+        refs.push_back(reference_type { box, index_type(i) });
+        continue;
+      }
+
+      // Pieces are split in half along their longest axis,
+      // and each half is clipped to the part of the primitive
+      // that's within it, until they're small enough.
+
+      size_type emitted = 0;
+
+      pieces.assign(1, box);
+
+      while (!pieces.empty()) {
+
+        auto piece = pieces.back();
+
+        pieces.pop_back();
+
+        if (!(surface_area(piece) > threshold) || ((emitted + pieces.size() + 2) > max_references)) {
+          refs.push_back(reference_type { piece, index_type(i) });
+          emitted++;
+          continue;
+        }
+
+        auto extent = size_of(piece);
+
+        auto axis = ((extent.x >= extent.y) && (extent.x >= extent.z)) ? 0 : ((extent.y >= extent.z) ? 1 : 2);
+
+        auto mid = component(center_of(piece), axis);
+
+        auto left_region = piece;
+        auto right_region = piece;
+
+        if (axis == 0) {
+          left_region.max.x = right_region.min.x = mid;
+        } else if (axis == 1) {
+          left_region.max.y = right_region.min.y = mid;
+        } else {
+          left_region.max.z = right_region.min.z = mid;
+        }
+
+        auto left = clipper(primitives[i], left_region);
+        auto right = clipper(primitives[i], right_region);
+
+        auto left_valid = !is_empty(left);
+        auto right_valid = !is_empty(right);
+
+        if (!left_valid && !right_valid) {
+          refs.push_back(reference_type { piece, index_type(i) });
+          emitted++;
+          continue;
+        }
+
+        if (right_valid) {
+          pieces.push_back(right);
+        }
+
+        if (left_valid) {
+          pieces.push_back(left);
+        }
+      }
+    }
+  }
+private:
+  //! Indicates if a clipped box has nothing in it.
+  static bool is_empty(const aabb<scalar_type>& box) noexcept {
+    return !((box.min.x <= box.max.x) && (box.min.y <= box.max.y) && (box.min.z <= box.max.z));
+  }
+  //! The primitives to split.
+  const primitive* primitives;
+  //! The number of primitives.
+  size_type count;
+  //! The primitive to bounding box converter.
+  const aabb_converter& converter;
+  //! The primitive clipper.
+  const primitive_clipper& clipper;
+  //! The box area above which references are split.
+  double threshold;
+  //! The maximum number of references per primitive.
+  size_type max_references;
+  //! The references made by each thread.
+  std::vector<reference_type>* thread_refs;
+};
+
+//! \brief A move of a subtree to a new place in a BVH.
+//!
+//! \tparam scalar_type The scalar type used by the node boxes.
+template <typename scalar_type>
+struct reinsertion final {
+  //! A type definition for a node reference.
+  using index_type = typename node<scalar_type>::index_type;
+  //! The reference to the subtree being moved.
+  index_type ref;
+  //! The reference to the node that the subtree becomes the sibling of.
+  index_type target;
+  //! The predicted decrease of the summed node areas.
+  double gain;
+};
+
+//! \brief Optimizes a BVH by reinserting its subtrees.
+//!
+//! A node reference is an internal node index, or a primitive index
+//! with the highest bit set. Removing a reference from the tree also
+//! removes its parent, and the slot of the parent is reused for the
+//! node that joins the reference with its new sibling. The root always
+//! stays at index zero, so nodes are moved into and out of it as needed.
+//!
+//! \tparam scalar_type The scalar type used by the node boxes.
+//!
+//! \tparam task_scheduler The scheduler to distribute the searches with.
+template <typename scalar_type, typename task_scheduler>
+class reinsertion_optimizer final {
+public:
+  //! A type definition for a BVH node.
+  using node_type = node<scalar_type>;
+  //! A type definition for a node reference.
+  using index_type = typename node_type::index_type;
+  //! A type definition for a subtree move.
+  using move_type = reinsertion<scalar_type>;
+  //! A node waiting to be visited by the search,
+  //! along with the cost induced on its ancestors.
+  struct queue_entry final {
+    //! The increase in area of the ancestors.
+    double induced;
+    //! The node reference to visit.
+    index_type ref;
+  };
+  //! Constructs a new optimizer.
+  //!
+  //! \param s The scheduler to distribute the searches with.
+  //!
+  //! \param n The nodes of the BVH to optimize.
+  //!
+  //! \param c The number of nodes. There must be at least two.
+  reinsertion_optimizer(task_scheduler& s, node_type* n, size_type c)
+    : scheduler(s), nodes(n), node_count(c),
+      parents(c), leaf_parents(c + 1), leaf_boxes(c + 1), marks(c, 0), settled(c, false) {}
+  //! Links the nodes to their parents and gets the primitive boxes.
+  template <typename primitive, typename aabb_converter>
+  void link(const primitive* primitives, const aabb_converter& converter);
+  //! Runs one pass of the optimization.
+  //!
+  //! \param batch_size The number of nodes to pick for reinsertion.
+  //!
+  //! \param reinsertions Incremented for each subtree that is moved.
+  //!
+  //! \return The number of nodes that were picked. This is zero once
+  //! every node has been tried since the tree around it last changed.
+  size_type pass(size_type batch_size, size_type& reinsertions);
+  //! Finds the best place to move one of the children of a node.
+  //! This only reads the tree, so it can be called from many threads.
+  //!
+  //! \param candidate The internal node to find a move for.
+  //!
+  //! \param queue The memory to use for the search queue.
+  move_type search(index_type candidate, std::vector<queue_entry>& queue) const;
+protected:
+  //! Indicates if a reference is to a primitive.
+  static constexpr bool is_leaf(index_type ref) noexcept {
+    return ref & highest_bit<index_type>();
+  }
+  //! Accesses the box of a node reference.
+  inline const aabb<scalar_type>& box_of(index_type ref) const noexcept {
+    return is_leaf(ref) ? leaf_boxes[ref & (highest_bit<index_type>() - 1)] : nodes[ref].box;
+  }
+  //! Accesses the parent of a node reference.
+  inline index_type& parent_of(index_type ref) noexcept {
+    return is_leaf(ref) ? leaf_parents[ref & (highest_bit<index_type>() - 1)] : parents[ref];
+  }
+  //! Accesses the parent of a node reference.
+  inline index_type parent_of(index_type ref) const noexcept {
+    return is_leaf(ref) ? leaf_parents[ref & (highest_bit<index_type>() - 1)] : parents[ref];
+  }
+  //! Gets the other child of a reference's parent.
+  inline index_type sibling_of(index_type ref) const noexcept {
+    const auto& parent = nodes[parent_of(ref)];
+    return (parent.left == ref) ? parent.right : parent.left;
+  }
+  //! Indicates if a reference was changed by a move in this pass.
+  inline bool is_marked(index_type ref) const noexcept {
+    return !is_leaf(ref) && (marks[ref] == stamp);
+  }
+  //! Marks a reference as changed by a move in this pass.
+  inline void mark(index_type ref) noexcept {
+    if (!is_leaf(ref)) {
+      marks[ref] = stamp;
+      settled[ref] = false;
+    }
+  }
+  //! Indicates if a reference is within the subtree of another.
+  bool is_within(index_type ref, index_type subtree) const noexcept;
+  //! Calculates how much the summed node areas
+  //! would decrease if a reference was removed.
+  double removal_gain(index_type ref) const noexcept;
+  //! Calculates how much the summed node areas would
+  //! increase if a box was inserted next to a reference.
+  double insertion_cost(const aabb<scalar_type>& box, index_type target) const noexcept;
+  //! Removes a reference and its parent from the tree.
+  //!
+  //! \param sibling Receives the new reference of the former sibling,
+  //! which only changes if the sibling had to be moved into the root.
+  //!
+  //! \return The node slot that was freed.
+  index_type remove(index_type ref, index_type& sibling) noexcept;
+  //! Inserts a reference as the sibling of a target reference.
+  //!
+  //! \param slot The free node slot to join the two with.
+  void insert(index_type ref, index_type target, index_type slot) noexcept;
+  //! Moves a node to another slot, updating the parents of its children.
+  void relocate(index_type from, index_type to) noexcept;
+  //! Refits the boxes of a node and its ancestors.
+  void refit_from(index_type index) noexcept;
+private:
+  //! The scheduler to distribute the searches with.
+  task_scheduler& scheduler;
+  //! The nodes of the BVH being optimized.
+  node_type* nodes;
+  //! The number of nodes in the BVH.
+  size_type node_count;
+  //! The parent of each internal node.
+  //! The root node is its own parent.
+  std::vector<index_type> parents;
+  //! The parent of each leaf, indexed by primitive.
+  std::vector<index_type> leaf_parents;
+  //! The box of each primitive.
+  std::vector<aabb<scalar_type>> leaf_boxes;
+  //! The pass that each node was last changed in.
+  std::vector<size_type> marks;
+  //! Whether or not each node was tried without being moved,
+  //! and hasn't changed since.
+  std::vector<bool> settled;
+  //! The number of the current pass.
+  size_type stamp = 0;
+};
+
+//! \brief Searches for reinsertion moves.
+//! Can be called by the scheduler from many threads.
+//!
+//! \tparam optimizer_type The type of the reinsertion optimizer.
+template <typename optimizer_type>
+class reinsertion_search_kernel final {
+public:
+  //! A type definition for a node reference.
+  using index_type = typename optimizer_type::index_type;
+  //! A type definition for a subtree move.
+  using move_type = typename optimizer_type::move_type;
+  //! Constructs a new search kernel.
+  //! \param o The optimizer to search with.
+  //! \param c The nodes to find moves for.
+  //! \param n The number of nodes to find moves for.
+  //! \param m The move array to write to.
+  constexpr reinsertion_search_kernel(const optimizer_type& o, const index_type* c, size_type n, move_type* m) noexcept
+    : optimizer(o), candidates(c), count(n), moves(m) {}
+  //! Searches for the moves of a portion of the nodes.
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) {
+
+    auto range = loop_range(div, count);
+
+    std::vector<typename optimizer_type::queue_entry> queue;
+
+    for (auto i = range.begin; i < range.end; i++) {
+      moves[i] = optimizer.search(candidates[i], queue);
+    }
+  }
+private:
+  //! The optimizer to search with.
+  const optimizer_type& optimizer;
+  //! The nodes to find moves for.
+  const index_type* candidates;
+  //! The number of nodes to find moves for.
+  size_type count;
+  //! The move array to write to.
+  move_type* moves;
+};
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+void reinsertion_optimizer<scalar_type, task_scheduler>::link(const primitive* primitives, const aabb_converter& converter) {
+
+  parents[0] = 0;
+
+  for (size_type i = 0; i < node_count; i++) {
+
+    for (auto child : { nodes[i].left, nodes[i].right }) {
+
+      parent_of(child) = index_type(i);
+
+      if (is_leaf(child)) {
+        auto leaf_index = child & (highest_bit<index_type>() - 1);
+        leaf_boxes[leaf_index] = converter(primitives[leaf_index]);
+      }
+    }
+  }
+}
+
+template <typename scalar_type, typename task_scheduler>
+size_type reinsertion_optimizer<scalar_type, task_scheduler>::pass(size_type batch_size, size_type& reinsertions) {
+
+  stamp++;
+
+  // Nodes are picked by how much larger they are than their children,
+  // weighted by their own area. A node that encloses two small children
+  // that are far apart is one that most rays enter for nothing.
+
+  std::vector<double> inefficiency(node_count, 0.0);
+
+  std::vector<index_type> candidates;
+
+  for (size_type i = 1; i < node_count; i++) {
+
+    if (settled[i]) {
+      continue;
+    }
+
+    const auto& node = nodes[i];
+
+    auto area = surface_area(node.box);
+
+    auto child_area = surface_area(box_of(node.left)) + surface_area(box_of(node.right));
+
+    inefficiency[i] = (area * area) / (child_area + std::numeric_limits<double>::min());
+
+    candidates.push_back(index_type(i));
+  }
+
+  if (candidates.size() > batch_size) {
+
+    auto by_inefficiency = [&inefficiency](index_type a, index_type b) {
+      return inefficiency[a] > inefficiency[b];
+    };
+
+    std::nth_element(candidates.begin(), candidates.begin() + batch_size, candidates.end(), by_inefficiency);
+
+    candidates.resize(batch_size);
+  }
+
+  std::vector<move_type> moves(candidates.size());
+
+  reinsertion_search_kernel<reinsertion_optimizer> search_kernel(*this, candidates.data(), candidates.size(), moves.data());
+
+  scheduler(search_kernel);
+
+  for (auto candidate : candidates) {
+    settled[candidate] = true;
+  }
+
+  std::sort(moves.begin(), moves.end(), [](const move_type& a, const move_type& b) {
+    return a.gain > b.gain;
+  });
+
+  for (const auto& m : moves) {
+
+    if (!(m.gain > 0)) {
+      break;
+    }
+
+    // Moves that touch nodes changed earlier in this pass were found
+    // on a tree that no longer exists, so they're left for the next pass.
+
+    auto parent = parent_of(m.ref);
+
+    auto sibling = sibling_of(m.ref);
+
+    auto grandparent = parents[parent];
+
+    auto target_parent = (m.target == 0) ? index_type(0) : parent_of(m.target);
+
+    if (is_marked(m.ref) || is_marked(parent) || is_marked(sibling) || is_marked(grandparent)
+     || is_marked(m.target) || is_marked(target_parent)) {
+      settled[parent] = false;
+      continue;
+    }
+
+    if ((m.target == m.ref) || (m.target == parent) || (m.target == sibling) || is_within(m.target, m.ref)) {
+      continue;
+    }
+
+    if ((parent == 0) && is_leaf(sibling)) {
+      continue;
+    }
+
+    auto gain = removal_gain(m.ref);
+
+    auto slot = remove(m.ref, sibling);
+
+    auto cost = insertion_cost(box_of(m.ref), m.target);
+
+    if (cost < gain) {
+
+      insert(m.ref, m.target, slot);
+
+      for (auto ref : { m.ref, parent, sibling, grandparent, m.target, target_parent, slot }) {
+        mark(ref);
+      }
+
+      reinsertions++;
+
+    } else {
+      // The move turned out not to pay off once the
+      // tree was updated, so the subtree is put back.
+      insert(m.ref, sibling, slot);
+    }
+  }
+
+  return candidates.size();
+}
+
+template <typename scalar_type, typename task_scheduler>
+auto reinsertion_optimizer<scalar_type, task_scheduler>::search(index_type candidate,
+                                                                std::vector<queue_entry>& queue) const -> move_type {
+
+  auto by_induced = [](const queue_entry& a, const queue_entry& b) {
+    return a.induced > b.induced;
+  };
+
+  move_type best { 0, 0, 0 };
+
+  for (auto ref : { nodes[candidate].left, nodes[candidate].right }) {
+
+    const auto& box = box_of(ref);
+
+    auto area = surface_area(box);
+
+    auto gain = removal_gain(ref);
+
+    auto parent = parent_of(ref);
+
+    auto sibling = sibling_of(ref);
+
+    // This is a branch and bound search, where the cost of a target
+    // is the area of the node that would join it with the subtree, plus
+    // the areas that its ancestors would grow by. A subtree can't be
+    // cheaper to insert than its own area, which bounds the search.
+
+    auto best_cost = gain - best.gain;
+
+    index_type best_target = 0;
+
+    bool found = false;
+
+    queue.clear();
+
+    queue.push_back(queue_entry { 0.0, 0 });
+
+    while (!queue.empty()) {
+
+      std::pop_heap(queue.begin(), queue.end(), by_induced);
+
+      auto entry = queue.back();
+
+      queue.pop_back();
+
+      if ((entry.induced + area) >= best_cost) {
+        break;
+      }
+
+      if (entry.ref == ref) {
+        continue;
+      }
+
+      const auto& target_box = box_of(entry.ref);
+
+      auto cost = entry.induced + surface_area(union_of(target_box, box));
+
+      if ((cost < best_cost) && (entry.ref != parent) && (entry.ref != sibling)) {
+        best_cost = cost;
+        best_target = entry.ref;
+        found = true;
+      }
+
+      if (is_leaf(entry.ref)) {
+        continue;
+      }
+
+      auto induced = cost - surface_area(target_box);
+
+      if ((induced + area) < best_cost) {
+
+        for (auto child : { nodes[entry.ref].left, nodes[entry.ref].right }) {
+          queue.push_back(queue_entry { induced, child });
+          std::push_heap(queue.begin(), queue.end(), by_induced);
+        }
+      }
+    }
+
+    if (found) {
+      best = move_type { ref, best_target, gain - best_cost };
+    }
+  }
+
+  return best;
+}
+
+template <typename scalar_type, typename task_scheduler>
+bool reinsertion_optimizer<scalar_type, task_scheduler>::is_within(index_type ref, index_type subtree) const noexcept {
+
+  if (is_leaf(subtree)) {
+    return ref == subtree;
+  }
+
+  for (auto i = is_leaf(ref) ? parent_of(ref) : ref; true; i = parents[i]) {
+    if (i == subtree) {
+      return true;
+    } else if (i == 0) {
+      return false;
+    }
+  }
+}
+
+template <typename scalar_type, typename task_scheduler>
+double reinsertion_optimizer<scalar_type, task_scheduler>::removal_gain(index_type ref) const noexcept {
+
+  auto parent = parent_of(ref);
+
+  auto gain = surface_area(nodes[parent].box);
+
+  auto child = parent;
+
+  auto box = box_of(sibling_of(ref));
+
+  while (child != 0) {
+
+    auto i = parents[child];
+
+    const auto& node = nodes[i];
+
+    box = union_of(box, box_of((node.left == child) ? node.right : node.left));
+
+    auto shrink = surface_area(node.box) - surface_area(box);
+
+    if (!(shrink > 0)) {
+      // Nothing above this node shrinks either.
+      break;
+    }
+
+    gain += shrink;
+
+    child = i;
+  }
+
+  return gain;
+}
+
+template <typename scalar_type, typename task_scheduler>
+double reinsertion_optimizer<scalar_type, task_scheduler>::insertion_cost(const aabb<scalar_type>& box,
+                                                                         index_type target) const noexcept {
+
+  auto cost = surface_area(union_of(box_of(target), box));
+
+  for (auto i = target; i != 0; ) {
+
+    i = parent_of(i);
+
+    const auto& node_box = nodes[i].box;
+
+    auto growth = surface_area(union_of(node_box, box)) - surface_area(node_box);
+
+    if (!(growth > 0)) {
+      break;
+    }
+
+    cost += growth;
+  }
+
+  return cost;
+}
+
+template <typename scalar_type, typename task_scheduler>
+auto reinsertion_optimizer<scalar_type, task_scheduler>::remove(index_type ref, index_type& sibling) noexcept -> index_type {
+
+  auto parent = parent_of(ref);
+
+  sibling = sibling_of(ref);
+
+  if (parent == 0) {
+    // The sibling becomes the root, and its old slot is freed.
+    auto slot = sibling;
+    relocate(slot, 0);
+    sibling = 0;
+    return slot;
+  }
+
+  auto grandparent = parents[parent];
+
+  auto& node = nodes[grandparent];
+
+  if (node.left == parent) {
+    node.left = sibling;
+  } else {
+    node.right = sibling;
+  }
+
+  parent_of(sibling) = grandparent;
+
+  refit_from(grandparent);
+
+  return parent;
+}
+
+template <typename scalar_type, typename task_scheduler>
+void reinsertion_optimizer<scalar_type, task_scheduler>::insert(index_type ref, index_type target, index_type slot) noexcept {
+
+  if (target == 0) {
+    // The root is moved out of the way, so that
+    // the new node can take its place at index zero.
+    relocate(0, slot);
+    parents[slot] = 0;
+    nodes[0].left = slot;
+    nodes[0].right = ref;
+    parent_of(ref) = 0;
+    refit_from(0);
+    return;
+  }
+
+  auto target_parent = parent_of(target);
+
+  auto& parent_node = nodes[target_parent];
+
+  if (parent_node.left == target) {
+    parent_node.left = slot;
+  } else {
+    parent_node.right = slot;
+  }
+
+  parents[slot] = target_parent;
+
+  nodes[slot].left = target;
+  nodes[slot].right = ref;
+
+  parent_of(target) = slot;
+  parent_of(ref) = slot;
+
+  refit_from(slot);
+}
+
+template <typename scalar_type, typename task_scheduler>
+void reinsertion_optimizer<scalar_type, task_scheduler>::relocate(index_type from, index_type to) noexcept {
+
+  nodes[to] = nodes[from];
+
+  parent_of(nodes[to].left) = to;
+  parent_of(nodes[to].right) = to;
+}
+
+template <typename scalar_type, typename task_scheduler>
+void reinsertion_optimizer<scalar_type, task_scheduler>::refit_from(index_type index) noexcept {
+  for (auto i = index; true; i = parents[i]) {
+
+    auto& node = nodes[i];
+
+    node.box = union_of(box_of(node.left), box_of(node.right));
+
+    if (i == 0) {
+      break;
+    }
+  }
+}
+
+//! Used for traversing the BVH.
+//!
+//! \tparam scalar_type The floating point type to use in the traversal.
+//!
+//! \tparam max The maximum number of entries to allocate on the stack.
+template <typename scalar_type, size_type max>
+class traversal_stack final {
+public:
+  //! The type to be used for a node index.
+  using node_index_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+  //! Contains information regarding a ndoe
+  //! to be traversed.
+  struct entry final {
+    //! The index of the node to traverse.
+    node_index_type node_index;
+    //! The minimum scale at which the ray
+    //! hits this node.
+    scalar_type tmin;
+  };
+  //! Indicates the number of entries remaining
+  //! in the stack.
+  inline size_type remaining() const noexcept {
+    return pos;
+  }
+  //! Removes an entry from the stack.
+  auto pop() noexcept {
+    if (!pos) {
+      return entry { 0, std::numeric_limits<scalar_type>::infinity() };
+    }
+    return entries[--pos];
+  }
+  //! Accesses an entry without removing it from the stack.
+  //!
+  //! \param n The depth of the entry, where zero is the top of the stack.
+  //!
+  //! \return A pointer to the entry, or null if the stack isn't that deep.
+  inline const entry* peek(size_type n) const noexcept {
+    return (n < pos) ? &entries[pos - n - 1] : nullptr;
+  }
+  //! Pushes an item to the stack.
+  //! \param i The index of the node.
+  //! \param t The scale at which the ray intersects this node.
+  void push(size_type i, scalar_type t) noexcept {
+    if (pos < max) {
+      entries[pos++] = entry { node_index_type(i), t };
+    }
+  }
+private:
+  //! The position of the "stack pointer."
+  size_type pos = 0;
+  //! The array of entries to be filled.
+  entry entries[max];
+};
+
+//! \brief Remembers the last few primitives that a ray was tested
+//! against, so that primitives with several references in a BVH are
+//! only intersected once. The references of a primitive are close
+//! together in the tree, so a few entries catch nearly all repeats.
+//! A repeat that is missed only costs an extra intersection test.
+//!
+//! \tparam index_type The type of a primitive index.
+//!
+//! \tparam max The number of primitives to remember.
+template <typename index_type, size_type max>
+class mailbox final {
+public:
+  //! Adds a primitive to the mailbox.
+  //!
+  //! \param index The index of the primitive.
+  //!
+  //! \return False if the primitive was already in
+  //! the mailbox, in which case it shouldn't be tested.
+  bool insert(index_type index) noexcept {
+
+    for (size_type i = 0; i < used; i++) {
+      if (entries[i] == index) {
+        return false;
+      }
+    }
+
+    entries[next] = index;
+
+    next = (next + 1) % max;
+
+    used = (used < max) ? (used + 1) : max;
+
+    return true;
+  }
+private:
+  //! The primitives that were tested.
+  index_type entries[max];
+  //! The entry to replace next.
+  size_type next = 0;
+  //! The number of entries in use.
+  size_type used = 0;
+};
+
+//! \brief Traverses BVH nodes from the root, nearest child first.
+//! Each leaf that the ray reaches is passed to a leaf visitor,
+//! which updates the closest intersection.
+//!
+//! \param nodes The nodes to traverse, with the root first.
+//!
+//! \param ray The ray to traverse the nodes with.
+//!
+//! \param closest The closest intersection so far. Nodes that
+//! are farther away than this are skipped.
+//!
+//! \param visit_leaf Called with the index of each leaf that is reached.
+template <typename scalar_type, typename intersection_type, typename leaf_visitor>
+void traverse_nodes(const node<scalar_type>* nodes,
+                    const ray<scalar_type>& ray,
+                    const intersection_type& closest,
+                    leaf_visitor& visit_leaf) noexcept {
+
+  using box_intersection_type = box_intersection<scalar_type>;
+
+  traversal_stack<scalar_type, 128> stack;
+
+  stack.push(0, std::numeric_limits<scalar_type>::infinity());
+
+  auto accel_r = make_accel_ray(ray);
+
+  while (stack.remaining()) {
+
+    auto entry = stack.pop();
+
+    if (closest < entry.tmin) {
+      // We've already got a closer intersection than
+      // what can be found at this node, we can skip this.
+      continue;
+    }
+
+    const auto& node = nodes[entry.node_index];
+
+#ifdef LBVH_PREFETCH_DISTANCE
+
+    // Start loading the node that's going to be popped
+    // a few iterations from now, as well as the child boxes
+    // that are about to be tested against the ray.
+
+    if (const auto* next_entry = stack.peek(LBVH_PREFETCH_DISTANCE - 1)) {
+      prefetch(&nodes[next_entry->node_index]);
+    }
+
+    if (!node.left_is_leaf()) {
+      prefetch(&nodes[node.left]);
+    }
+
+    if (!node.right_is_leaf()) {
+      prefetch(&nodes[node.right]);
+    }
+
+#endif // LBVH_PREFETCH_DISTANCE
+
+    box_intersection_type left_box_isect;
+
+    if (node.left_is_leaf()) {
+      visit_leaf(node.left_leaf_index());
+    } else {
+      left_box_isect = intersect(nodes[node.left].box, accel_r);
+    }
+
+    box_intersection_type right_box_isect;
+
+    if (node.right_is_leaf()) {
+      visit_leaf(node.right_leaf_index());
+    } else {
+      right_box_isect = intersect(nodes[node.right].box, accel_r);
+    }
+
+    if (left_box_isect && right_box_isect) {
+      if (left_box_isect < right_box_isect) {
+        stack.push(node.right, right_box_isect.tmin);
+        stack.push(node.left,   left_box_isect.tmin);
+      } else {
+        stack.push(node.left,   left_box_isect.tmin);
+        stack.push(node.right, right_box_isect.tmin);
+      }
+    } else if (left_box_isect) {
+      stack.push(node.left, left_box_isect.tmin);
+    } else if (right_box_isect) {
+      stack.push(node.right, right_box_isect.tmin);
+    }
+  }
+}
+
+} // namespace detail
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::operator () (const primitive* primitives, size_type count, const aabb_converter& converter) -> bvh_type {
+
+  null_build_observer observer;
+
+  return (*this)(primitives, count, converter, observer);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename build_observer>
+auto builder<scalar_type, task_scheduler>::operator () (const primitive* primitives,
+                                                         size_type count,
+                                                         const aabb_converter& converter,
+                                                         build_observer& observer) -> bvh_type {
+
+  using curve_builder_type = detail::morton_curve_builder<scalar_type, task_scheduler>;
+
+  curve_builder_type curve_builder(scheduler, quantization);
+
+  auto curve = curve_builder(primitives, count, converter, observer);
+
+  observer.begin(build_phase::sort);
+
+  curve.sort();
+
+  observer.end(build_phase::sort);
+
+  return build_nodes(curve, primitives, converter, observer);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::operator () (const primitive* primitives,
+                                                         size_type count,
+                                                         const aabb_converter& converter,
+                                                         build_token& token) -> bvh_type {
+
+  null_build_observer observer;
+
+  return (*this)(primitives, count, converter, token, observer);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename build_observer>
+auto builder<scalar_type, task_scheduler>::operator () (const primitive* primitives,
+                                                         size_type count,
+                                                         const aabb_converter& converter,
+                                                         build_token& token,
+                                                         build_observer& observer) -> bvh_type {
+
+  using scheduler_type = detail::cancellable_scheduler<task_scheduler>;
+
+  using curve_builder_type = detail::morton_curve_builder<scalar_type, scheduler_type>;
+
+  using code_type = typename curve_builder_type::code_type;
+
+  scheduler_type cancellable(scheduler, token);
+
+  detail::token_observer<build_observer> phases(token, observer);
+
+  curve_builder_type curve_builder(cancellable, quantization);
+
+  auto curve = curve_builder(primitives, count, converter, phases);
+
+  if (token.cancelled()) {
+    return bvh_type(node_vec());
+  }
+
+  phases.begin(build_phase::sort);
+
+  curve.sort();
+
+  phases.end(build_phase::sort);
+
+  if (token.cancelled() || (curve.size() < 2)) {
+    return bvh_type(node_vec());
+  }
+
+  phases.begin(build_phase::hierarchy);
+
+  node_vec nodes(curve.size() - 1);
+
+  detail::builder_kernel<code_type, scalar_type> builder_kern(curve, nodes.data());
+
+  cancellable(builder_kern);
+
+  phases.end(build_phase::hierarchy);
+
+  if (token.cancelled()) {
+    return bvh_type(node_vec());
+  }
+
+  // The boxes are fit on this thread, as in a regular build,
+  // but in chunks so that the token is still checked.
+
+  phases.begin(build_phase::fit_boxes);
+
+  std::vector<size_type> indices;
+
+  detail::breadth_first_order(nodes.data(), nodes.size(), indices);
+
+  auto chunk_count = cancellable.max_threads();
+
+  token.begin_chunks(chunk_count);
+
+  for (size_type chunk = 0; chunk < chunk_count; chunk++) {
+
+    if (token.cancelled()) {
+      return bvh_type(node_vec());
+    }
+
+    auto range = detail::loop_range(work_division { chunk, chunk_count }, indices.size());
+
+    for (auto i = range.begin; i < range.end; i++) {
+      detail::fit_node(nodes.data(), indices[indices.size() - i - 1], primitives, converter);
+    }
+
+    token.end_chunk();
+  }
+
+  phases.end(build_phase::fit_boxes);
+
+  return bvh_type(std::move(nodes));
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename index_type, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::operator () (const primitive* primitives,
+                                                         const index_type* indices,
+                                                         size_type count,
+                                                         const aabb_converter& converter) -> bvh_type {
+
+  using node_index_type = typename node_type::index_type;
+
+  detail::indirect_converter<const primitive*, aabb_converter> index_converter(primitives, converter);
+
+  auto b = (*this)(indices, count, index_converter);
+
+  // The leaves refer to positions in the index array,
+  // so they're changed to the indices at those positions.
+
+  auto* nodes = b.data();
+
+  for (size_type i = 0; i < b.size(); i++) {
+
+    if (nodes[i].left_is_leaf()) {
+      nodes[i].left = node_index_type(indices[nodes[i].left_leaf_index()]) | highest_bit<node_index_type>();
+    }
+
+    if (nodes[i].right_is_leaf()) {
+      nodes[i].right = node_index_type(indices[nodes[i].right_leaf_index()]) | highest_bit<node_index_type>();
+    }
+  }
+
+  return b;
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive_iterator, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::operator () (primitive_iterator first,
+                                                         primitive_iterator last,
+                                                         const aabb_converter& converter) -> bvh_type {
+
+  using node_index_type = typename node_type::index_type;
+
+  // The primitives are reached through their offset from the
+  // first iterator, so that the build kernels only see an array.
+
+  std::vector<node_index_type> offsets(size_type(last - first));
+
+  for (size_type i = 0; i < offsets.size(); i++) {
+    offsets[i] = node_index_type(i);
+  }
+
+  detail::indirect_converter<primitive_iterator, aabb_converter> offset_converter(first, converter);
+
+  return (*this)(offsets.data(), offsets.size(), offset_converter);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::rebuild(const primitive* primitives,
+                                                    size_type count,
+                                                    const aabb_converter& converter,
+                                                    rebuild_cache<scalar_type>& cache) -> bvh_type {
+
+  null_build_observer observer;
+
+  return rebuild(primitives, count, converter, cache, observer);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename build_observer>
+auto builder<scalar_type, task_scheduler>::rebuild(const primitive* primitives,
+                                                    size_type count,
+                                                    const aabb_converter& converter,
+                                                    rebuild_cache<scalar_type>& cache,
+                                                    build_observer& observer) -> bvh_type {
+
+  using curve_builder_type = detail::morton_curve_builder<scalar_type, task_scheduler>;
+
+  curve_builder_type curve_builder(scheduler, quantization);
+
+  auto curve = curve_builder(primitives, count, converter, observer, cache);
+
+  observer.begin(build_phase::sort);
+
+  if (cache.reused_order) {
+    curve.sort_presorted();
+  } else {
+    curve.sort();
+  }
+
+  cache.order.resize(count);
+
+  for (size_type i = 0; i < count; i++) {
+    cache.order[i] = curve[i].primitive;
+  }
+
+  observer.end(build_phase::sort);
+
+  return build_nodes(curve, primitives, converter, observer);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename curve_type, typename primitive, typename aabb_converter, typename build_observer>
+auto builder<scalar_type, task_scheduler>::build_nodes(const curve_type& curve,
+                                                        const primitive* primitives,
+                                                        const aabb_converter& converter,
+                                                        build_observer& observer) -> bvh_type {
+
+  using code_type = decltype(curve_type::entry::code);
+
+  if (curve.size() < 2) {
+    // There are no internal nodes for less than two primitives.
+    return bvh_type(node_vec());
+  }
+
+  observer.begin(build_phase::hierarchy);
+
+  std::vector<node_type> node_vec(curve.size() - 1);
+
+  detail::builder_kernel<code_type, scalar_type> builder_kern(curve, node_vec.data());
+
+  scheduler(builder_kern);
+
+  observer.end(build_phase::hierarchy);
+
+  observer.begin(build_phase::fit_boxes);
+
+  fit_boxes(node_vec.data(), node_vec.size(), primitives, converter);
+
+  observer.end(build_phase::fit_boxes);
+
+  return bvh_type(std::move(node_vec));
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+void builder<scalar_type, task_scheduler>::refit(bvh_type& b, const primitive* primitives, const aabb_converter& converter) {
+
+  null_build_observer observer;
+
+  refit(b, primitives, converter, observer);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename build_observer>
+void builder<scalar_type, task_scheduler>::refit(bvh_type& b,
+                                                  const primitive* primitives,
+                                                  const aabb_converter& converter,
+                                                  build_observer& observer) {
+
+  if (!b.size()) {
+    return;
+  }
+
+  observer.begin(build_phase::fit_boxes);
+
+  fit_boxes(b.data(), b.size(), primitives, converter);
+
+  observer.end(build_phase::fit_boxes);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::build_hlbvh(const primitive* primitives,
+                                                        size_type count,
+                                                        const aabb_converter& converter,
+                                                        size_type sah_bits) -> bvh_type {
+
+  null_build_observer observer;
+
+  return build_hlbvh(primitives, count, converter, sah_bits, observer);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename build_observer>
+auto builder<scalar_type, task_scheduler>::build_hlbvh(const primitive* primitives,
+                                                        size_type count,
+                                                        const aabb_converter& converter,
+                                                        size_type sah_bits,
+                                                        build_observer& observer) -> bvh_type {
+
+  using curve_builder_type = detail::morton_curve_builder<scalar_type, task_scheduler>;
+
+  using item_type = detail::sah_item<scalar_type>;
+
+  using index_type = typename node_type::index_type;
+
+  curve_builder_type curve_builder(scheduler, quantization);
+
+  auto curve = curve_builder(primitives, count, converter, observer);
+
+  observer.begin(build_phase::sort);
+
+  curve.sort();
+
+  observer.end(build_phase::sort);
+
+  if ((count < 3) || !sah_bits) {
+    return build_nodes(curve, primitives, converter, observer);
+  }
+
+  size_type axis_bits = 0;
+
+  for (auto d = detail::morton_domain<sizeof(scalar_type)>::value(); d > 1; d /= 2) {
+    axis_bits++;
+  }
+
+  auto code_bits = axis_bits * 3;
+
+  auto shift = code_bits - std::min(sah_bits, code_bits);
+
+  auto prefix = [&curve, shift](size_type i) {
+    return curve[i].code >> shift;
+  };
+
+  // The boxes of the LBVH are fit within the hierarchy phase,
+  // since the SAH splits are made over the boxes of the clusters.
+
+  observer.begin(build_phase::hierarchy);
+
+  bvh_type b(node_vec(count - 1));
+
+  detail::builder_kernel<decltype(curve[0].code), scalar_type> builder_kern(curve, b.data());
+
+  scheduler(builder_kern);
+
+  fit_boxes(b.data(), b.size(), primitives, converter);
+
+  // The LBVH is walked from the root with the curve range of each node.
+  // A node whose range shares a code prefix is the root of a cluster.
+  // The nodes above the clusters are the slots of the SAH tree.
+
+  struct node_range final {
+    index_type node;
+    size_type lo;
+    size_type hi;
+  };
+
+  std::vector<node_range> stack { node_range { 0, 0, count - 1 } };
+
+  std::vector<item_type> clusters;
+
+  std::vector<index_type> top_slots;
+
+  while (!stack.empty()) {
+
+    auto r = stack.back();
+
+    stack.pop_back();
+
+    const auto& node = b[r.node];
+
+    if (prefix(r.lo) == prefix(r.hi)) {
+      clusters.push_back(item_type { node.box, detail::center_of(node.box), r.node });
+      continue;
+    }
+
+    top_slots.push_back(r.node);
+
+    auto split = node.left_is_leaf() ? r.lo : size_type(node.left);
+
+    if (node.left_is_leaf()) {
+      auto box = converter(primitives[node.left_leaf_index()]);
+      clusters.push_back(item_type { box, detail::center_of(box), node.left });
+    } else {
+      stack.push_back(node_range { node.left, r.lo, split });
+    }
+
+    if (node.right_is_leaf()) {
+      auto box = converter(primitives[node.right_leaf_index()]);
+      clusters.push_back(item_type { box, detail::center_of(box), node.right });
+    } else {
+      stack.push_back(node_range { node.right, split + 1, r.hi });
+    }
+  }
+
+  if (clusters.size() >= 2) {
+
+    detail::binned_sah_builder<scalar_type, task_scheduler> sah_builder(scheduler, clusters.data(), b.data(), top_slots.data());
+
+    sah_builder(clusters.size());
+  }
+
+  observer.end(build_phase::hierarchy);
+
+  return b;
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::build_sah(const primitive* primitives,
+                                                      size_type count,
+                                                      const aabb_converter& converter) -> bvh_type {
+
+  null_build_observer observer;
+
+  return build_sah(primitives, count, converter, observer);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename build_observer>
+auto builder<scalar_type, task_scheduler>::build_sah(const primitive* primitives,
+                                                      size_type count,
+                                                      const aabb_converter& converter,
+                                                      build_observer& observer) -> bvh_type {
+
+  using item_type = detail::sah_item<scalar_type>;
+
+  if (count < 2) {
+    // There are no internal nodes for less than two primitives.
+    return bvh_type(node_vec());
+  }
+
+  observer.begin(build_phase::centroid_bounds);
+
+  std::vector<item_type> items(count);
+
+  detail::sah_item_kernel<scalar_type, primitive, aabb_converter> item_kernel(primitives, count, converter, items.data());
+
+  scheduler(item_kernel);
+
+  observer.end(build_phase::centroid_bounds);
+
+  observer.begin(build_phase::hierarchy);
+
+  std::vector<node_type> nodes(count - 1);
+
+  detail::binned_sah_builder<scalar_type, task_scheduler> sah_builder(scheduler, items.data(), nodes.data(), nullptr);
+
+  sah_builder(count);
+
+  observer.end(build_phase::hierarchy);
+
+  return bvh_type(std::move(nodes));
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::build_split(const primitive* primitives,
+                                                        size_type count,
+                                                        const aabb_converter& converter,
+                                                        std::vector<typename node_type::index_type>& references,
+                                                        const split_options& options) -> bvh_type {
+
+  detail::box_clipper<aabb_converter> clipper(converter);
+
+  return build_split(primitives, count, converter, clipper, references, options);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename primitive_clipper>
+auto builder<scalar_type, task_scheduler>::build_split(const primitive* primitives,
+                                                        size_type count,
+                                                        const aabb_converter& converter,
+                                                        const primitive_clipper& clipper,
+                                                        std::vector<typename node_type::index_type>& references,
+                                                        const split_options& options) -> bvh_type {
+
+  using reference_type = detail::split_reference<scalar_type>;
+
+  references.clear();
+
+  if (!count) {
+    return bvh_type(node_vec());
+  }
+
+  auto thread_count = scheduler.max_threads();
+
+  std::vector<double> thread_sums(thread_count, 0.0);
+
+  detail::box_area_kernel<scalar_type, primitive, aabb_converter> area_kernel(primitives, count, converter, thread_sums.data());
+
+  scheduler(area_kernel);
+
+  double area_sum = 0;
+
+  for (auto th_sum : thread_sums) {
+    area_sum += th_sum;
+  }
+
+  auto threshold = (area_sum / double(count)) * options.area_factor;
+
+  std::vector<std::vector<reference_type>> thread_refs(thread_count);
+
+  detail::split_kernel<scalar_type, primitive, aabb_converter, primitive_clipper> split_kern(primitives,
+                                                                                             count,
+                                                                                             converter,
+                                                                                             clipper,
+                                                                                             threshold,
+                                                                                             options.max_references,
+                                                                                             thread_refs.data());
+
+  scheduler(split_kern);
+
+  // Each thread split a contiguous range of the primitives,
+  // so joining the ranges in thread order keeps the build
+  // independent of the thread count.
+
+  std::vector<reference_type> refs;
+
+  for (auto& th_refs : thread_refs) {
+    refs.insert(refs.end(), th_refs.begin(), th_refs.end());
+  }
+
+  references.resize(refs.size());
+
+  for (size_type i = 0; i < refs.size(); i++) {
+    references[i] = refs[i].primitive;
+  }
+
+  auto reference_converter = [](const reference_type& ref) {
+    return ref.box;
+  };
+
+  return (*this)(refs.data(), refs.size(), reference_converter);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::build_clustered(const primitive* primitives,
+                                                            size_type count,
+                                                            const aabb_converter& converter,
+                                                            leaf_table<scalar_type>& leaves,
+                                                            size_type max_leaf_size) -> bvh_type {
+
+  null_build_observer observer;
+
+  return build_clustered(primitives, count, converter, leaves, max_leaf_size, observer);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename build_observer>
+auto builder<scalar_type, task_scheduler>::build_clustered(const primitive* primitives,
+                                                            size_type count,
+                                                            const aabb_converter& converter,
+                                                            leaf_table<scalar_type>& leaves,
+                                                            size_type max_leaf_size,
+                                                            build_observer& observer) -> bvh_type {
+
+  using curve_builder_type = detail::morton_curve_builder<scalar_type, task_scheduler>;
+
+  using code_type = typename curve_builder_type::code_type;
+
+  using entry_type = curve_entry<code_type>;
+
+  using index_type = typename leaf_table<scalar_type>::index_type;
+
+  curve_builder_type curve_builder(scheduler, quantization);
+
+  auto curve = curve_builder(primitives, count, converter, observer);
+
+  observer.begin(build_phase::sort);
+
+  curve.sort();
+
+  max_leaf_size = (max_leaf_size > 0) ? max_leaf_size : 1;
+
+  leaves.offsets.assign(1, 0);
+
+  leaves.primitives.resize(count);
+
+  std::vector<entry_type> leaf_entries;
+
+  std::vector<aabb<scalar_type>> leaf_boxes;
+
+  // The curve is already sorted, so a leaf is started at
+  // every change of code, and whenever the current leaf is full.
+
+  for (size_type i = 0; i < count; i++) {
+
+    auto leaf_size = i - leaves.offsets.back();
+
+    if ((i == 0) || (curve[i].code != curve[i - 1].code) || (leaf_size >= max_leaf_size)) {
+
+      if (i > 0) {
+        leaves.offsets.push_back(index_type(i));
+      }
+
+      leaf_entries.push_back(entry_type { curve[i].code, typename entry_type::index_type(leaf_entries.size()) });
+
+      leaf_boxes.push_back(detail::get_empty_aabb<scalar_type>());
+    }
+
+    leaves.primitives[i] = index_type(curve[i].primitive);
+
+    leaf_boxes.back() = detail::union_of(leaf_boxes.back(), converter(primitives[curve[i].primitive]));
+  }
+
+  if ((leaf_entries.size() == 1) && (count > 1)) {
+
+    // The root node needs two leaves, so a single leaf, such as
+    // one of coincident points, is split into two halves.
+
+    auto half = count / 2;
+
+    leaves.offsets.push_back(index_type(half));
+
+    leaf_entries.push_back(entry_type { leaf_entries[0].code, 1 });
+
+    leaf_boxes.assign(2, detail::get_empty_aabb<scalar_type>());
+
+    for (size_type i = 0; i < count; i++) {
+      auto& box = leaf_boxes[(i < half) ? 0 : 1];
+      box = detail::union_of(box, converter(primitives[leaves.primitives[i]]));
+    }
+  }
+
+  leaves.offsets.push_back(index_type(count));
+
+  detail::space_filling_curve<code_type> leaf_curve(std::move(leaf_entries));
+
+  observer.end(build_phase::sort);
+
+  auto box_converter = [](const aabb<scalar_type>& box) {
+    return box;
+  };
+
+  return build_nodes(leaf_curve, leaf_boxes.data(), box_converter, observer);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::build_refined(const primitive* primitives,
+                                                          size_type count,
+                                                          const aabb_converter& converter,
+                                                          size_type segment_bits) -> bvh_type {
+
+  null_build_observer observer;
+
+  return build_refined(primitives, count, converter, segment_bits, observer);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename build_observer>
+auto builder<scalar_type, task_scheduler>::build_refined(const primitive* primitives,
+                                                          size_type count,
+                                                          const aabb_converter& converter,
+                                                          size_type segment_bits,
+                                                          build_observer& observer) -> bvh_type {
+
+  using curve_builder_type = detail::morton_curve_builder<scalar_type, task_scheduler>;
+
+  using refine_kernel_type = detail::morton_refine_kernel<scalar_type, primitive>;
+
+  using refined_entry = typename refine_kernel_type::refined_entry;
+
+  curve_builder_type curve_builder(scheduler, quantization);
+
+  auto curve = curve_builder(primitives, count, converter, observer);
+
+  observer.begin(build_phase::sort);
+
+  curve.sort();
+
+  size_type axis_bits = 0;
+
+  for (auto d = detail::morton_domain<sizeof(scalar_type)>::value(); d > 1; d /= 2) {
+    axis_bits++;
+  }
+
+  auto code_bits = axis_bits * 3;
+
+  // The shared bits go above the refined bits, so
+  // together they have to fit into a 64-bit code.
+
+  auto max_segment_bits = (sizeof(typename refine_kernel_type::refined_code_type) * 8) - refine_kernel_type::local_bits;
+
+  auto shift = code_bits - std::min(std::min(segment_bits, max_segment_bits), code_bits);
+
+  std::vector<size_type> segment_offsets;
+
+  for (size_type i = 0; i < count; i++) {
+    if ((i == 0) || ((curve[i].code >> shift) != (curve[i - 1].code >> shift))) {
+      segment_offsets.push_back(i);
+    }
+  }
+
+  auto segment_count = segment_offsets.size();
+
+  segment_offsets.push_back(count);
+
+  std::vector<refined_entry> refined_entries(count);
+
+  refine_kernel_type refine_kernel(primitives,
+                                   curve,
+                                   segment_offsets.data(),
+                                   segment_count,
+                                   shift,
+                                   quantization,
+                                   refined_entries.data());
+
+  scheduler(refine_kernel, converter);
+
+  detail::space_filling_curve<typename refine_kernel_type::refined_code_type> refined_curve(std::move(refined_entries));
+
+  observer.end(build_phase::sort);
+
+  return build_nodes(refined_curve, primitives, converter, observer);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::build_lazy(const primitive* primitives,
+                                                       size_type count,
+                                                       const aabb_converter& converter,
+                                                       size_type top_bits) -> lazy_bvh<scalar_type, primitive, aabb_converter> {
+
+  null_build_observer observer;
+
+  return build_lazy(primitives, count, converter, top_bits, observer);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename build_observer>
+auto builder<scalar_type, task_scheduler>::build_lazy(const primitive* primitives,
+                                                       size_type count,
+                                                       const aabb_converter& converter,
+                                                       size_type top_bits,
+                                                       build_observer& observer) -> lazy_bvh<scalar_type, primitive, aabb_converter> {
+
+  using curve_builder_type = detail::morton_curve_builder<scalar_type, task_scheduler>;
+
+  using code_type = typename curve_builder_type::code_type;
+
+  using entry = typename curve_builder_type::curve_type::entry;
+
+  using box_type = aabb<scalar_type>;
+
+  curve_builder_type curve_builder(scheduler, quantization);
+
+  auto curve = curve_builder(primitives, count, converter, observer);
+
+  observer.begin(build_phase::sort);
+
+  size_type axis_bits = 0;
+
+  for (auto d = detail::morton_domain<sizeof(scalar_type)>::value(); d > 1; d /= 2) {
+    axis_bits++;
+  }
+
+  auto code_bits = axis_bits * 3;
+
+  auto bits = std::min(std::min(top_bits, size_type(16)), code_bits);
+
+  auto shift = code_bits - bits;
+
+  // The entries are only grouped by their top bits, which takes
+  // a counting sort instead of a full sort. The entries within a
+  // group are sorted when the subtree of the group is built.
+
+  std::vector<size_type> bucket_offsets((size_type(1) << bits) + 1, 0);
+
+  for (size_type i = 0; i < count; i++) {
+    bucket_offsets[(curve[i].code >> shift) + 1]++;
+  }
+
+  for (size_type i = 1; i < bucket_offsets.size(); i++) {
+    bucket_offsets[i] += bucket_offsets[i - 1];
+  }
+
+  std::vector<entry> entries(count);
+
+  std::vector<box_type> bucket_boxes(size_type(1) << bits, detail::get_empty_aabb<scalar_type>());
+
+  auto next_entry = bucket_offsets;
+
+  for (size_type i = 0; i < count; i++) {
+
+    auto bucket = curve[i].code >> shift;
+
+    entries[next_entry[bucket]++] = curve[i];
+
+    bucket_boxes[bucket] = detail::union_of(bucket_boxes[bucket], converter(primitives[curve[i].primitive]));
+  }
+
+  std::vector<size_type> offsets;
+
+  std::vector<box_type> boxes;
+
+  std::vector<entry> top_entries;
+
+  for (size_type i = 0; (i + 1) < bucket_offsets.size(); i++) {
+
+    if (bucket_offsets[i] == bucket_offsets[i + 1]) {
+      continue;
+    }
+
+    top_entries.push_back(entry { code_type(i), typename entry::index_type(boxes.size()) });
+
+    offsets.push_back(bucket_offsets[i]);
+
+    boxes.push_back(bucket_boxes[i]);
+  }
+
+  offsets.push_back(count);
+
+  detail::space_filling_curve<code_type> top_curve(std::move(top_entries));
+
+  observer.end(build_phase::sort);
+
+  auto box_converter = [](const box_type& box) {
+    return box;
+  };
+
+  auto top = build_nodes(top_curve, boxes.data(), box_converter, observer);
+
+  return lazy_bvh<scalar_type, primitive, aabb_converter>(primitives, converter, std::move(entries), offsets, boxes, std::move(top));
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+optimize_report builder<scalar_type, task_scheduler>::optimize(bvh_type& b,
+                                                               const primitive* primitives,
+                                                               const aabb_converter& converter,
+                                                               const optimize_budget& budget) {
+
+  using clock_type = std::chrono::steady_clock;
+
+  optimize_report report;
+
+  if (b.size() < 2) {
+    return report;
+  }
+
+  auto start = clock_type::now();
+
+  detail::reinsertion_optimizer<scalar_type, task_scheduler> optimizer(scheduler, b.data(), b.size());
+
+  optimizer.link(primitives, converter);
+
+  auto batch_size = size_type(double(b.size()) * budget.batch_fraction);
+
+  batch_size = (batch_size > 0) ? batch_size : 1;
+
+  while (report.passes < budget.passes) {
+
+    if (budget.seconds > 0) {
+
+      auto elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+
+      if (elapsed >= budget.seconds) {
+        break;
+      }
+    }
+
+    if (!optimizer.pass(batch_size, report.reinsertions)) {
+      break;
+    }
+
+    report.passes++;
+  }
+
+  return report;
 }
 
-//! \brief Calculates the sum of two vectors.
-//!
-//! \tparam scalar_type The type of the vector components.
-//!
-//! \return The sum of @p a and @p b, as a vector.
-template <typename scalar_type>
-auto operator + (const vec3<scalar_type>& a,
-                 const vec3<scalar_type>& b) noexcept {
-  return vec3<scalar_type> {
-    a.x + b.x,
-    a.y + b.y,
-    a.z + b.z
-  };
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::build_batch(const build_range<primitive>* ranges,
+                                                        size_type range_count,
+                                                        const aabb_converter& converter) -> std::vector<bvh_type> {
+
+  using kernel_type = detail::batch_build_kernel<scalar_type, primitive, aabb_converter>;
+
+  std::vector<bvh_type> bvhs;
+
+  bvhs.reserve(range_count);
+
+  size_type total = 0;
+
+  for (size_type i = 0; i < range_count; i++) {
+    bvhs.emplace_back(node_vec());
+    total += ranges[i].count;
+  }
+
+  auto thread_count = scheduler.max_threads();
+
+  std::vector<size_type> small_ranges;
+
+  for (size_type i = 0; i < range_count; i++) {
+    if ((ranges[i].count * thread_count) >= total) {
+      bvhs[i] = (*this)(ranges[i].primitives, ranges[i].count, converter);
+    } else {
+      small_ranges.push_back(i);
+    }
+  }
+
+  // Larger ranges go first, so that the interleaved
+  // assignment gives each thread a similar amount of work.
+
+  std::sort(small_ranges.begin(), small_ranges.end(), [ranges](size_type a, size_type b) {
+    return ranges[a].count > ranges[b].count;
+  });
+
+  if (small_ranges.empty()) {
+    return bvhs;
+  }
+
+  std::vector<typename kernel_type::scratch> scratches(thread_count);
+
+  kernel_type kernel(ranges, small_ranges.data(), small_ranges.size(), converter, bvhs.data(), scratches.data(), quantization);
+
+  scheduler(kernel);
+
+  return bvhs;
 }
 
-//! \brief Calculates the difference between two vectors.
-//!
-//! \tparam scalar_type The type of the vector components.
-//!
-//! \return The difference between @p a and @p b, as a vector.
-template <typename scalar_type>
-auto operator - (const vec3<scalar_type>& a,
-                 const vec3<scalar_type>& b) noexcept {
-  return vec3<scalar_type> {
-    a.x - b.x,
-    a.y - b.y,
-    a.z - b.z
-  };
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::build_mergeable(const primitive* primitives,
+                                                            size_type count,
+                                                            const aabb_converter& converter,
+                                                            const aabb<scalar_type>& domain,
+                                                            morton_curve<scalar_type>& curve) -> bvh_type {
+
+  null_build_observer observer;
+
+  return build_mergeable(primitives, count, converter, domain, curve, observer);
 }
 
-//! \brief Negates a vector.
-//!
-//! \return The negated result of @p in.
-template <typename scalar_type>
-inline auto operator - (const vec3<scalar_type>& in) noexcept {
-  return vec3<scalar_type> {
-    -in.x,
-    -in.y,
-    -in.z
-  };
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename build_observer>
+auto builder<scalar_type, task_scheduler>::build_mergeable(const primitive* primitives,
+                                                            size_type count,
+                                                            const aabb_converter& converter,
+                                                            const aabb<scalar_type>& domain,
+                                                            morton_curve<scalar_type>& curve,
+                                                            build_observer& observer) -> bvh_type {
+
+  using code_type = typename morton_curve<scalar_type>::code_type;
+
+  using curve_type = detail::space_filling_curve<code_type>;
+
+  observer.begin(build_phase::morton_curve);
+
+  typename curve_type::entry_vec entries(count);
+
+  detail::morton_curve_kernel<scalar_type, primitive> curve_kernel(primitives, entries.data(), count, quantization);
+
+  scheduler(curve_kernel, domain, converter);
+
+  observer.end(build_phase::morton_curve);
+
+  curve_type sorted_curve(std::move(entries));
+
+  observer.begin(build_phase::sort);
+
+  sorted_curve.sort();
+
+  observer.end(build_phase::sort);
+
+  auto b = build_nodes(sorted_curve, primitives, converter, observer);
+
+  curve.domain = domain;
+  curve.entries = sorted_curve.release();
+
+  return b;
 }
 
-//! \brief Calculates the product between a vector and a scalar value.
-//!
-//! \tparam scalar_type The scalar type of the vector.
-//!
-//! \return The product between @p a and @p b.
-template <typename scalar_type>
-auto operator * (const vec3<scalar_type>& a, scalar_type b) noexcept {
-  return vec3<scalar_type> {
-    a.x * b,
-    a.y * b,
-    a.z * b
-  };
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::merge(const primitive* primitives,
+                                                  const aabb_converter& converter,
+                                                  const morton_curve<scalar_type>& a,
+                                                  const morton_curve<scalar_type>& b,
+                                                  morton_curve<scalar_type>& merged) -> bvh_type {
+
+  null_build_observer observer;
+
+  return merge(primitives, converter, a, b, merged, observer);
 }
 
-//! \brief Normalizes a vector.
-//! This is useful when dealing with trig functions.
-//!
-//! \return The normalized result of @p v.
-template <typename scalar_type>
-vec3<scalar_type> normalize(const vec3<scalar_type>& v) noexcept {
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename build_observer>
+auto builder<scalar_type, task_scheduler>::merge(const primitive* primitives,
+                                                  const aabb_converter& converter,
+                                                  const morton_curve<scalar_type>& a,
+                                                  const morton_curve<scalar_type>& b,
+                                                  morton_curve<scalar_type>& merged,
+                                                  build_observer& observer) -> bvh_type {
 
-  using std::sqrt;
+  using code_type = typename morton_curve<scalar_type>::code_type;
 
-  auto l_inv = scalar_type(1) / sqrt(dot(v, v));
+  using curve_type = detail::space_filling_curve<code_type>;
 
-  return v * l_inv;
+  using index_type = typename curve_type::entry::index_type;
+
+  observer.begin(build_phase::sort);
+
+  // The primitives of the second curve come
+  // after the primitives of the first curve.
+
+  auto offset = index_type(a.entries.size());
+
+  auto shifted = b.entries;
+
+  for (auto& e : shifted) {
+    e.primitive += offset;
+  }
+
+  auto domain = a.domain;
+
+  curve_type merged_curve(typename curve_type::entry_vec(a.entries));
+
+  merged_curve.merge(shifted);
+
+  observer.end(build_phase::sort);
+
+  auto merged_bvh = build_nodes(merged_curve, primitives, converter, observer);
+
+  merged.domain = domain;
+  merged.entries = merged_curve.release();
+
+  return merged_bvh;
 }
 
-//! \brief Multiplies a 2D vector by a scalar value.
-//!
-//! \return The product of @p a and @p b.
-template <typename scalar_type>
-vec2<scalar_type> operator * (const vec2<scalar_type>& a, scalar_type b) noexcept {
-  return vec2<scalar_type> {
-    a.x * b,
-    a.y * b
-  };
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::erase(const primitive* primitives,
+                                                  const aabb_converter& converter,
+                                                  const morton_curve<scalar_type>& curve,
+                                                  size_type first,
+                                                  size_type count,
+                                                  morton_curve<scalar_type>& remaining) -> bvh_type {
+
+  null_build_observer observer;
+
+  return erase(primitives, converter, curve, first, count, remaining, observer);
 }
 
-//! \brief Computes the sum of two 2D vectors.
-//!
-//! \return The sum of @p a and @p b.
-template <typename scalar_type>
-vec2<scalar_type> operator + (const vec2<scalar_type>& a,
-                              const vec2<scalar_type>& b) noexcept {
-  return vec2<scalar_type> {
-    a.x + b.x,
-    a.y + b.y
-  };
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename build_observer>
+auto builder<scalar_type, task_scheduler>::erase(const primitive* primitives,
+                                                  const aabb_converter& converter,
+                                                  const morton_curve<scalar_type>& curve,
+                                                  size_type first,
+                                                  size_type count,
+                                                  morton_curve<scalar_type>& remaining,
+                                                  build_observer& observer) -> bvh_type {
+
+  using code_type = typename morton_curve<scalar_type>::code_type;
+
+  using curve_type = detail::space_filling_curve<code_type>;
+
+  using index_type = typename curve_type::entry::index_type;
+
+  observer.begin(build_phase::sort);
+
+  typename curve_type::entry_vec entries;
+
+  entries.reserve(curve.entries.size() - std::min(count, curve.entries.size()));
+
+  for (const auto& e : curve.entries) {
+    if (e.primitive < first) {
+      entries.push_back(e);
+    } else if (e.primitive >= (first + count)) {
+      entries.push_back({ e.code, index_type(e.primitive - count) });
+    }
+  }
+
+  auto domain = curve.domain;
+
+  curve_type remaining_curve(std::move(entries));
+
+  observer.end(build_phase::sort);
+
+  auto remaining_bvh = build_nodes(remaining_curve, primitives, converter, observer);
+
+  remaining.domain = domain;
+  remaining.entries = remaining_curve.release();
+
+  return remaining_bvh;
 }
 
-//! \brief This structure implements various vector packet operations.
-//! Since these operations require various template parameters, they are
-//! best implemented in a structure where type definitions can make the code
-//! much more readable.
-//!
-//! \tparam scalar_type The scalar type of the vector components.
-//!
-//! \tparam dimensions The number of dimensions the vectors will have.
-//!
-//! \tparam count The number of elements per dimension for each vector.
-template <typename scalar_type,
-          size_type dimensions,
-          size_type count>
-struct vec_packet_ops final {
-  //! A type definition for a vector packet.
-  using vec_packet_type = vec_packet<scalar_type, dimensions, count>;
-  //! The number of values in one vector packet.
-  static inline constexpr auto value_count() noexcept {
-    return dimensions * count;
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+void builder<scalar_type, task_scheduler>::rebuild_subtrees(bvh_type& b,
+                                                             const primitive* primitives,
+                                                             const aabb_converter& converter,
+                                                             const typename subtree_cache<scalar_type>::index_type* dirty,
+                                                             size_type dirty_count,
+                                                             subtree_cache<scalar_type>& cache) {
+
+  using index_type = typename subtree_cache<scalar_type>::index_type;
+
+  cache.rebuilt_subtrees = 0;
+  cache.rebuilt_primitives = 0;
+
+  if (!b.size()) {
+    return;
   }
-  //! Computes the Hadamard product of two vectors.
-  //!
-  //! \return The Hadamard product of @p a and @p b.
-  static constexpr auto hadamard_mul(const vec_packet_type& a, const vec_packet_type& b) noexcept {
-    vec_packet_type out;
-    for (size_type i = 0; i < value_count(); i++) {
-      out.values[i] = a.values[i] * b.values[i];
+
+  if (cache.parents.size() != b.size()) {
+    link_nodes(b, cache);
+  }
+
+  auto* nodes = b.data();
+
+  // Count the changed primitives under each node.
+
+  for (size_type i = 0; i < dirty_count; i++) {
+    for (auto j = cache.leaf_parents[dirty[i]]; true; j = cache.parents[j]) {
+      cache.dirty_counts[j]++;
+      if (!j) {
+        break;
+      }
     }
-    return out;
   }
-  //! Computes the sum of a vector packet and single scalar value.
-  //!
-  //! \param b This value is added to all components of @p a.
-  //!
-  //! \return The sum of @p a and @p b.
-  static constexpr auto add(const vec_packet_type& a, scalar_type b) noexcept {
-    vec_packet_type out;
-    for (size_type i = 0; i < value_count(); i++) {
-      out.values[i] = a.values[i] + b;
+
+  // Find the largest subtrees that are mostly changed.
+
+  std::vector<index_type> pending { 0 };
+
+  std::vector<index_type> roots;
+
+  while (!pending.empty()) {
+
+    auto j = pending.back();
+
+    pending.pop_back();
+
+    if (cache.leaf_counts[j] <= (cache.dirty_counts[j] * cache.max_spread)) {
+      roots.push_back(j);
+      continue;
+    }
+
+    if (!nodes[j].left_is_leaf() && cache.dirty_counts[nodes[j].left]) {
+      pending.push_back(nodes[j].left);
+    }
+
+    if (!nodes[j].right_is_leaf() && cache.dirty_counts[nodes[j].right]) {
+      pending.push_back(nodes[j].right);
     }
-    return out;
   }
-  //! Subtracts two vectors.
-  //!
-  //! \return The difference between @p a and @p b.
-  static constexpr auto sub(const vec_packet_type& a, const vec_packet_type& b) noexcept {
-    vec_packet_type out;
-    for (size_type i = 0; i < value_count(); i++) {
-      out.values[i] = a.values[i] - b.values[i];
+
+  // An ancestor with a count of zero has already
+  // had its own ancestors cleared by another path.
+
+  for (size_type i = 0; i < dirty_count; i++) {
+    for (auto j = cache.leaf_parents[dirty[i]]; cache.dirty_counts[j]; j = cache.parents[j]) {
+      cache.dirty_counts[j] = 0;
     }
-    return out;
   }
-  //! Multiplies a vector packet by a scalar value.
-  //!
-  //! \return The product of @p a and @p b.
-  static constexpr auto mul(const vec_packet_type& a, scalar_type b) noexcept {
-    vec_packet_type out;
-    for (size_type i = 0; i < value_count(); i++) {
-      out.values[i] = a.values[i] * b;
+
+  for (auto root : roots) {
+    rebuild_subtree(b, root, primitives, converter, cache);
+  }
+
+  // Refit the ancestors of each rebuilt subtree and changed primitive.
+
+  auto refit_path = [nodes, &cache, primitives, &converter](index_type j) {
+    while (true) {
+
+      auto& node = nodes[j];
+
+      if (node.left_is_leaf()) {
+        node.box = converter(primitives[node.left_leaf_index()]);
+      } else {
+        node.box = nodes[node.left].box;
+      }
+
+      if (node.right_is_leaf()) {
+        node.box = detail::union_of(node.box, converter(primitives[node.right_leaf_index()]));
+      } else {
+        node.box = detail::union_of(node.box, nodes[node.right].box);
+      }
+
+      if (!j) {
+        break;
+      }
+
+      j = cache.parents[j];
     }
-    return out;
+  };
+
+  for (auto root : roots) {
+    refit_path(cache.parents[root]);
   }
-};
 
-//! Adds a single scalar value to all components of @p a.
-//!
-//! \return The sume of @p a and @p b.
-template <typename scalar_type, size_type dimensions, size_type count>
-constexpr auto operator + (const vec_packet<scalar_type, dimensions, count>& a, scalar_type b) noexcept {
-  return vec_packet_ops<scalar_type, dimensions, count>::add(a, b);
+  for (size_type i = 0; i < dirty_count; i++) {
+    refit_path(cache.leaf_parents[dirty[i]]);
+  }
 }
 
-//! Subtracts two vector packets.
-//!
-//! \return The difference of @p a and @p b.
-template <typename scalar_type, size_type dimensions, size_type count>
-constexpr auto operator - (const vec_packet<scalar_type, dimensions, count>& a,
-                           const vec_packet<scalar_type, dimensions, count>& b) noexcept {
-  return vec_packet_ops<scalar_type, dimensions, count>::sub(a, b);
-}
+template <typename scalar_type, typename task_scheduler>
+void builder<scalar_type, task_scheduler>::link_nodes(const bvh_type& b, subtree_cache<scalar_type>& cache) {
 
-//! Multiplies a vector packet by a single scalar value.
-//!
-//! \return The product of @p a and @p b, as a vector packet.
-template <typename scalar_type, size_type dimensions, size_type count>
-constexpr auto operator * (const vec_packet<scalar_type, dimensions, count>& a, scalar_type b) noexcept {
-  return vec_packet_ops<scalar_type, dimensions, count>::mul(a, b);
-}
+  using index_type = typename subtree_cache<scalar_type>::index_type;
 
-//! Multiplies a 3D vector packet by a single 3D vector.
-//!
-//! \tparam scalar_type The scalar type of the vector components.
-//!
-//! \tparam count The number of elements per dimension in the vector packet.
-//!
-//! \return The product of @p a and @p b.
-template <typename scalar_type, size_type count>
-constexpr auto hadamard_mul(const vec_packet<scalar_type, 3, count>& a,
-                            const vec3<scalar_type>& b) noexcept {
+  auto node_count = b.size();
 
-  vec_packet<scalar_type, 3, count> out;
+  cache.parents.resize(node_count);
+  cache.leaf_parents.resize(node_count + 1);
+  cache.leaf_counts.resize(node_count);
+  cache.dirty_counts.assign(node_count, 0);
 
-  for (size_type i = 0; i < count; i++) {
-    out[0][i] = a[0][i] * b.x;
-    out[1][i] = a[1][i] * b.y;
-    out[2][i] = a[2][i] * b.z;
+  cache.parents[0] = 0;
+
+  std::vector<index_type> indices { 0 };
+
+  indices.reserve(node_count);
+
+  for (size_type i = 0; i < indices.size(); i++) {
+
+    auto j = indices[i];
+
+    const auto& node = b[j];
+
+    if (node.left_is_leaf()) {
+      cache.leaf_parents[node.left_leaf_index()] = j;
+    } else {
+      cache.parents[node.left] = j;
+      indices.push_back(node.left);
+    }
+
+    if (node.right_is_leaf()) {
+      cache.leaf_parents[node.right_leaf_index()] = j;
+    } else {
+      cache.parents[node.right] = j;
+      indices.push_back(node.right);
+    }
   }
 
-  return out;
+  for (size_type i = indices.size(); i > 0; i--) {
+
+    auto j = indices[i - 1];
+
+    const auto& node = b[j];
+
+    cache.leaf_counts[j] = (node.left_is_leaf() ? 1 : cache.leaf_counts[node.left])
+                         + (node.right_is_leaf() ? 1 : cache.leaf_counts[node.right]);
+  }
 }
 
-//! \brief Subtracts a single 3D vector from a 3D vector packet.
-//!
-//! \tparam scalar_type The type used by the vector components.
-//!
-//! \tparam count The number of elements in one dimension.
-//!
-//! \return The difference between @p a and @p b.
-template <typename scalar_type, size_type count>
-constexpr auto operator - (const vec_packet<scalar_type, 3, count>& a,
-                           const vec3<scalar_type>& b) noexcept {
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+void builder<scalar_type, task_scheduler>::rebuild_subtree(bvh_type& b,
+                                                            size_type root,
+                                                            const primitive* primitives,
+                                                            const aabb_converter& converter,
+                                                            subtree_cache<scalar_type>& cache) {
 
-  vec_packet<scalar_type, 3, count> out;
+  using index_type = typename subtree_cache<scalar_type>::index_type;
 
-  for (size_type i = 0; i < count; i++) {
-    out[0][i] = a[0][i] - b.x;
-    out[1][i] = a[1][i] - b.y;
-    out[2][i] = a[2][i] - b.z;
+  auto* nodes = b.data();
+
+  // Gather the node slots and primitives of the subtree.
+  // The slots are in breadth first order, so the root comes first.
+
+  std::vector<index_type> slots { index_type(root) };
+  std::vector<index_type> leaves;
+
+  slots.reserve(cache.leaf_counts[root] - 1);
+  leaves.reserve(cache.leaf_counts[root]);
+
+  for (size_type i = 0; i < slots.size(); i++) {
+
+    const auto& node = nodes[slots[i]];
+
+    if (node.left_is_leaf()) {
+      leaves.push_back(node.left_leaf_index());
+    } else {
+      slots.push_back(node.left);
+    }
+
+    if (node.right_is_leaf()) {
+      leaves.push_back(node.right_leaf_index());
+    } else {
+      slots.push_back(node.right);
+    }
   }
 
-  return out;
-}
+  detail::indirect_converter<const primitive*, aabb_converter> leaf_converter(primitives, converter);
 
-} // namespace math
+  auto subtree = (*this)(leaves.data(), leaves.size(), leaf_converter);
 
-//! \brief This namespaces contains implementation details
-//! of the library. It shouldn't be used by the end-user.
-namespace detail {
+  // The subtree root is at zero, which maps to the root slot.
+  // The other nodes of the subtree can take any of the other slots.
 
-using namespace lbvh::math;
+  std::vector<index_type> order { 0 };
 
-//! \brief Counts leading zeroes of a 32-bit integer.
-inline auto clz(std::uint32_t n) noexcept {
-#ifdef _MSC_VER
-  return __lzcnt(n);
-#else
-  return __builtin_clz(n);
-#endif
-}
+  order.reserve(subtree.size());
 
-//! \brief Counts leading zeroes of a 64-bit integer.
-inline auto clz(std::uint64_t n) noexcept {
-#ifdef _MSC_VER
-  return __lzcnt64(n);
-#else
-  return __builtin_clzll(n);
-#endif
-}
+  for (size_type i = 0; i < order.size(); i++) {
 
-//! \brief Gets the sign of a number, as an integer.
-//!
-//! \return The sign of @p n. If @p n is negative,
-//! then negative one is returned. If @p n is greater
-//! than or equal to positive zero, then positive one
-//! is returned.
-template <typename scalar_type>
-inline constexpr scalar_type sign(scalar_type n) noexcept {
-  return (n < 0) ? -1 : 1;
-}
+    const auto& local = subtree[order[i]];
 
-//! Divides and rounds up to the nearest integer.
-//!
-//! \tparam int_type The integer type to divide with.
-//!
-//! \return The quotient between @p n and @ d, rounded up.
-template <typename int_type>
-inline constexpr int_type ceil_div(int_type n, int_type d) {
-  return (n + (d - 1)) / d;
-}
+    auto slot = slots[order[i]];
 
-//! Used for iterating a range of numbers in a for loop.
-struct loop_range final {
-  //! The beginning index of the range.
-  size_type begin;
-  //! The non-inclusive ending index of the range.
-  size_type end;
-  //! Constructs a loop range for an array and work division.
-  //! This makes it easy to divide work required on an array
-  //! into a given work division.
-  //!
-  //! \param div The work division given by the scheduler.
-  //!
-  //! \param array_size The size of the array being worked on.
-  loop_range(const work_division& div, size_type array_size) noexcept {
+    auto& node = nodes[slot];
 
-    auto chunk_size = array_size / div.max;
+    node.box = local.box;
 
-    begin = chunk_size * div.idx;
+    if (local.left_is_leaf()) {
+      node.left = leaves[local.left_leaf_index()] | highest_bit<index_type>();
+      cache.leaf_parents[node.left_leaf_index()] = slot;
+    } else {
+      node.left = slots[local.left];
+      cache.parents[node.left] = slot;
+      order.push_back(local.left);
+    }
 
-    if ((div.idx + 1) == div.max) {
-      end = array_size;
+    if (local.right_is_leaf()) {
+      node.right = leaves[local.right_leaf_index()] | highest_bit<index_type>();
+      cache.leaf_parents[node.right_leaf_index()] = slot;
     } else {
-      end = begin + chunk_size;
+      node.right = slots[local.right];
+      cache.parents[node.right] = slot;
+      order.push_back(local.right);
     }
   }
-};
 
-//! Constructs an accelerated ray structure.
-//!
-//! \param r The ray from which to build the structure from.
-template <typename scalar_type>
-constexpr auto make_accel_ray(const ray<scalar_type>& r) noexcept {
+  for (size_type i = order.size(); i > 0; i--) {
 
-  using index_type = typename accel_ray<scalar_type>::index_type;
+    const auto& node = nodes[slots[order[i - 1]]];
 
-  auto rcp_dir = reciprocal(r.dir);
+    cache.leaf_counts[slots[order[i - 1]]] = (node.left_is_leaf() ? 1 : cache.leaf_counts[node.left])
+                                           + (node.right_is_leaf() ? 1 : cache.leaf_counts[node.right]);
+  }
 
-  index_type octants[3] {
-    (r.dir.x > 0) ? index_type(0) : index_type(3),
-    (r.dir.y > 0) ? index_type(1) : index_type(4),
-    (r.dir.z > 0) ? index_type(2) : index_type(5)
-  };
+  cache.rebuilt_subtrees++;
+  cache.rebuilt_primitives += leaves.size();
+}
 
-  return accel_ray<scalar_type> {
-    r,
-    rcp_dir,
-    hadamard_mul(-r.pos, rcp_dir),
-    {
-      octants[0],
-      octants[1],
-      octants[2]
-    },
-    {
-      3 - octants[0],
-      5 - octants[1],
-      7 - octants[2]
-    }
-  };
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+void builder<scalar_type, task_scheduler>::fit_boxes(node_type* nodes,
+                                                      size_type node_count,
+                                                      const primitive* primitives,
+                                                      const aabb_converter& converter) {
+
+  std::vector<size_type> indices;
+
+  detail::fit_boxes(nodes, node_count, primitives, converter, indices);
 }
 
-//! Represents a ray intersection with a box.
-//!
-//! \tparam scalar_type The scalar type of the intersection distances.
-template <typename scalar_type>
-struct box_intersection final {
-  //! The minimum distance to intersection.
-  scalar_type tmin = std::numeric_limits<scalar_type>::infinity();
-  //! The maximum distance to intersection.
-  scalar_type tmax = 0;
-  //! Indicates if this is a valid intersection.
-  inline operator bool () const noexcept {
-    return (tmax >= max(scalar_type(0), tmin));
-  }
-  //! Compares two box intersections by proximity.
-  //!
-  //! \return True if this box intersection is closer than @p other.
-  inline bool operator < (const box_intersection& other) const noexcept {
-    return tmin < other.tmin;
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder2<scalar_type, task_scheduler>::operator () (const primitive* primitives, size_type count, const aabb_converter& converter) -> bvh_type {
+
+  null_build_observer observer;
+
+  return (*this)(primitives, count, converter, observer);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename build_observer>
+auto builder2<scalar_type, task_scheduler>::operator () (const primitive* primitives,
+                                                          size_type count,
+                                                          const aabb_converter& converter,
+                                                          build_observer& observer) -> bvh_type {
+
+  using box_type = aabb2<scalar_type>;
+
+  using curve_kernel_type = detail::morton_curve2_kernel<scalar_type, primitive>;
+
+  using code_type = typename curve_kernel_type::code_type;
+
+  using curve_type = detail::space_filling_curve<code_type>;
+
+  observer.begin(build_phase::centroid_bounds);
+
+  std::vector<box_type> thread_boxes(scheduler.max_threads());
+
+  detail::centroid_bounds2_kernel<scalar_type, primitive, aabb_converter> bounds_kernel(primitives, count, converter, thread_boxes.data());
+
+  scheduler(bounds_kernel);
+
+  auto centroid_bounds = detail::get_empty_aabb2<scalar_type>();
+
+  for (const auto& th_box : thread_boxes) {
+    centroid_bounds = detail::union_of(centroid_bounds, th_box);
   }
-};
 
-//! Checks for ray intersection with a bounding box.
-//!
-//! \tparam scalar_type The type used for vector components.
-//!
-//! \return A box intersection instance, indicating
-//! if there was a hit or not.
-template <typename scalar_type>
-auto intersect(const aabb<scalar_type>& box, const accel_ray<scalar_type>& accel_r) noexcept {
+  observer.end(build_phase::centroid_bounds);
 
-#ifdef LBVH_ENABLE_SLAB_TEST
+  observer.begin(build_phase::morton_curve);
 
-  auto tx1 = (box.min.x - accel_r.r.pos.x)*accel_r.rcp_dir.x;
-  auto tx2 = (box.max.x - accel_r.r.pos.x)*accel_r.rcp_dir.x;
+  typename curve_type::entry_vec entries(count);
 
-  auto tmin = min(tx1, tx2);
-  auto tmax = max(tx1, tx2);
+  curve_kernel_type curve_kernel(primitives, entries.data(), count);
 
-  auto ty1 = (box.min.y - accel_r.r.pos.y)*accel_r.rcp_dir.y;
-  auto ty2 = (box.max.y - accel_r.r.pos.y)*accel_r.rcp_dir.y;
+  scheduler(curve_kernel, centroid_bounds, converter);
 
-  tmin = max(tmin, min(ty1, ty2));
-  tmax = min(tmax, max(ty1, ty2));
+  curve_type curve(std::move(entries));
 
-  auto tz1 = (box.min.z - accel_r.r.pos.z)*accel_r.rcp_dir.z;
-  auto tz2 = (box.max.z - accel_r.r.pos.z)*accel_r.rcp_dir.z;
+  observer.end(build_phase::morton_curve);
 
-  tmin = max(tmin, min(tz1, tz2));
-  tmax = min(tmax, max(tz1, tz2));
+  observer.begin(build_phase::sort);
 
-  return box_intersection<scalar_type> { tmin, tmax };
+  curve.sort();
 
-#else // LBVH_ENABLE_SLAB_TEST
+  observer.end(build_phase::sort);
 
-  scalar_type bounds[6] {
-    box.min.x,
-    box.min.y,
-    box.min.z,
-    box.max.x,
-    box.max.y,
-    box.max.z
-  };
+  if (count < 2) {
+    // There are no internal nodes for less than two primitives.
+    return bvh_type(std::vector<node_type>());
+  }
 
-  // t near
-  scalar_type tn[3] {
-    (bounds[accel_r.octants[0]] * accel_r.rcp_dir.x) + accel_r.inv_pos.x,
-    (bounds[accel_r.octants[1]] * accel_r.rcp_dir.y) + accel_r.inv_pos.y,
-    (bounds[accel_r.octants[2]] * accel_r.rcp_dir.z) + accel_r.inv_pos.z
-  };
+  observer.begin(build_phase::hierarchy);
 
-  // t far
-  scalar_type tf[3] {
-    (bounds[accel_r.inv_octants[0]] * accel_r.rcp_dir.x) + accel_r.inv_pos.x,
-    (bounds[accel_r.inv_octants[1]] * accel_r.rcp_dir.y) + accel_r.inv_pos.y,
-    (bounds[accel_r.inv_octants[2]] * accel_r.rcp_dir.z) + accel_r.inv_pos.z
-  };
+  std::vector<node_type> nodes(count - 1);
 
-  return box_intersection<scalar_type> {
-    max(max(tn[0], tn[1]), tn[2]),
-    min(min(tf[0], tf[1]), tf[2]),
-  };
+  detail::builder_kernel<code_type, scalar_type, node_type> hierarchy_kernel(curve, nodes.data());
 
-#endif // LBVH_ENABLE_SLAB_TEST
+  scheduler(hierarchy_kernel);
+
+  observer.end(build_phase::hierarchy);
+
+  observer.begin(build_phase::fit_boxes);
+
+  std::vector<size_type> indices;
+
+  detail::fit_boxes(nodes.data(), nodes.size(), primitives, converter, indices);
+
+  observer.end(build_phase::fit_boxes);
+
+  return bvh_type(std::move(nodes));
 }
 
-//! \brief This class represents a space filling curve.
-//!
-//! \tparam code_type The type used for units of the curve.
-template <typename code_type>
-class space_filling_curve final {
-public:
-  //! Represents a single entry within the curve table.
-  struct entry final {
-    //! Let's make the code and the primitive index the same size
-    //! by using this type definition.
-    using index_type = typename associated_types<sizeof(code_type)>::uint_type;
-    //! The code at this point along the curve.
-    code_type code;
-    //! The index to the primitive associated with this point.
-    index_type primitive;
-  };
-  //! A type definition for a vector of entries.
-  using entry_vec = std::vector<entry>;
-  //! Constructs a space filling curve.
-  //! \param entries_ The entries to assign the curve.
-  space_filling_curve(entry_vec&& entries_) noexcept
-    : entries(std::move(entries_)) {}
-  //! Constructs a curve via move semantics.
-  space_filling_curve(space_filling_curve&& other) noexcept
-    : entries(std::move(other.entries)) {}
-  //! Sorts the space filling curve based on the code of each entry.
-  void sort() {
-    auto cmp = [](const entry& a, const entry& b) {
-      return a.code < b.code;
-    };
-#if (__cplusplus >= 201703L) && !(defined LBVH_NO_THREADS)
-    std::sort(std::execution::par_unseq, entries.begin(), entries.end(), cmp);
-#else
-    std::sort(entries.begin(), entries.end(), cmp);
-#endif
-  }
-  //! Indicates the number of entries in the space filling curve.
-  inline auto size() const noexcept {
-    return entries.size();
+template <typename scalar_type, typename primitive, typename aabb_converter, typename task_scheduler>
+double sah_cost(const bvh<scalar_type>& b,
+                const primitive* primitives,
+                const aabb_converter& converter,
+                task_scheduler scheduler) {
+
+  if (!b.size()) {
+    return 0;
   }
-  //! Accesses a specific entry within the space filling curve.
-  //! \param index The index of the entry to access.
-  inline const auto& operator [] (size_type index) const noexcept {
-    return entries[index];
+
+  using kernel_type = detail::sah_kernel<scalar_type, primitive, aabb_converter>;
+
+  std::vector<double> thread_sums(scheduler.max_threads(), 0.0);
+
+  kernel_type kernel(b.data(), b.size(), primitives, converter, thread_sums.data());
+
+  scheduler(kernel);
+
+  double sum = 0;
+
+  for (auto th_sum : thread_sums) {
+    sum += th_sum;
   }
 
-  space_filling_curve(const space_filling_curve&) = delete;
-  space_filling_curve& operator = (const space_filling_curve&) = delete;
-private:
-  //! The entries of the space filling curve.
-  entry_vec entries;
-};
+  auto root_area = detail::surface_area(b[0].box);
 
-//! \brief Calculates the center of a floating-point bounding box.
-//!
-//! \tparam scalar_type The type of the box vector components.
-//! In this function, this is a floating point type.
-//!
-//! \param box The box to get the center of.
-//!
-//! \return The center point of the box.
-template <typename scalar_type, typename = std::enable_if_t<std::is_floating_point<scalar_type>::value>>
-auto center_of(const aabb<scalar_type>& box) noexcept {
-  return (box.min + box.max) * scalar_type(0.5);
+  return (root_area > 0) ? (sum / root_area) : sum;
 }
 
-//! \brief Calculates the center of a non-floating-point bounding box.
-//!
-//! \tparam scalar_type The type of the box vector components.
-//! In this function, this type would not be a floating point type.
-//!
-//! \param box The box to get the center point of.
-//!
-//! \return The center point of the box.
-template <typename scalar_type, std::enable_if_t<!std::is_floating_point<scalar_type>::value>>
-auto center_of(const aabb<scalar_type>& box) noexcept {
-  return (box.min + box.max) / 2;
-}
+template <typename scalar_type, typename primitive, size_type count, typename aabb_converter>
+constexpr std::array<node<scalar_type>, count - 1> build_static(const std::array<primitive, count>& primitives,
+                                                                const aabb_converter& converter) noexcept {
 
-//! \brief Gets an empty bounding box.
-//! An empty box has the property that any union this
-//! box has with another box is equal to the other box.
-//!
-//! \return An empty box.
-template <typename scalar_type>
-auto get_empty_aabb() noexcept {
-  return aabb<scalar_type> {
-    {
-      std::numeric_limits<scalar_type>::infinity(),
-      std::numeric_limits<scalar_type>::infinity(),
-      std::numeric_limits<scalar_type>::infinity()
-    },
-    {
-      -std::numeric_limits<scalar_type>::infinity(),
-      -std::numeric_limits<scalar_type>::infinity(),
-      -std::numeric_limits<scalar_type>::infinity()
-    }
-  };
-}
+  static_assert(count >= 2, "A BVH needs at least two primitives to have internal nodes.");
 
-//! \brief Calculates the union of two bounding boxes.
-//! The result is a bounding box that fits both other bounding boxes.
-//!
-//! \tparam scalar_type The type of the bounding box vector components.
-//!
-//! \return A bounding box that fits both boxes passed as parameters.
-template <typename scalar_type>
-auto union_of(const aabb<scalar_type>& a,
-              const aabb<scalar_type>& b) noexcept {
+  using node_type = node<scalar_type>;
 
-  return aabb<scalar_type> {
-    min(a.min, b.min),
-    max(a.max, b.max)
-  };
-}
+  using code_type = typename associated_types<sizeof(scalar_type)>::uint_type;
 
-//! \brief Calculates the union of a bounding box and a 3D vector.
-//!
-//! \return A bounding box fitting both @p a and @p b.
-template <typename scalar_type>
-auto union_of(const aabb<scalar_type>& a,
-              const vec3<scalar_type>& b) noexcept {
+  using entry_type = curve_entry<code_type>;
 
-  return aabb<scalar_type> {
-    min(a.min, b),
-    max(a.max, b)
-  };
-}
+  using entry_index_type = typename entry_type::index_type;
 
-//! \brief Calculates the size of a bounding box.
-//! This is considered the change in value from minimum to maximum points.
-//!
-//! \tparam scalar_type The type of the bounding box vector components.
-//!
-//! \param box The box to get the size of.
-//!
-//! \return The size of the given box.
-template <typename scalar_type>
-auto size_of(const aabb<scalar_type>& box) noexcept {
-  return box.max - box.min;
-}
+  auto centroid_bounds = detail::get_empty_aabb<scalar_type>();
 
-//! \brief This class is used for calculating the centroid boundaries in the scene.
-//!
-//! \tparam scalar_type The scalar type of the bounding box to get.
-//!
-//! \tparam primitive_type The type of primitive in the scene.
-//!
-//! \tparam aabb_converter Calculates the bounding box of a primitive.
-template <typename scalar_type, typename primitive_type, typename aabb_converter>
-class centroid_bounds_kernel final {
-public:
-  //! A type definition for a type returned by this class.
-  using box_type = aabb<scalar_type>;
-  //! Constructs a new centroid bounds kernel.
-  //!
-  //! \param p The primitive of arrays to get the bounds for.
-  //!
-  //! \param c The number of primitives in the array.
-  //!
-  //! \param cvt The primitive to bounding box converter.
-  //!
-  //! \param thb The array of boxes per thread. Each thread
-  //! will find a box for a certain portion of the scene. This
-  //! array should have as many boxes as there are threads.
-  centroid_bounds_kernel(const primitive_type* p, size_type c, const aabb_converter& cvt, box_type* thb)
-    : primitives(p), count(c), converter(cvt), thread_boxes(thb) {
+  for (size_type i = 0; i < count; i++) {
+    centroid_bounds = detail::union_of(centroid_bounds, detail::center_of(converter(primitives[i])));
   }
-  //! Runs the kernel.
-  //! Each thread accumulates its own bounding box
-  //! for the portion of the scene it was assigned.
-  //! When the result is queried, all boxes for each
-  //! of the threads are put into union.
-  //!
-  //! \param div Given by the scheduler to indicate which
-  //! portion of the scene this call should get the bounding box of.
-  void operator () (const work_division& div) noexcept {
 
-    auto range = loop_range(div, count);
+  auto mdomain = detail::morton_domain<sizeof(scalar_type)>::value();
 
-    auto box = get_empty_aabb<scalar_type>();
+  auto max_coord = scalar_type(mdomain - 1);
 
-    for (size_type i = range.begin; i < range.end; i++) {
-      box = union_of(box, center_of(converter(primitives[i])));
-    }
+  auto scale = detail::morton_scale(centroid_bounds, mdomain, morton_quantization::cube);
 
-    thread_boxes[div.idx] = box;
+  detail::morton_encoder<sizeof(code_type)> encoder;
+
+  std::array<entry_type, count> curve {};
+
+  for (size_type i = 0; i < count; i++) {
+
+    using namespace math;
+
+    auto cell = hadamard_mul(detail::center_of(converter(primitives[i])) - centroid_bounds.min, scale);
+
+    auto x_code = code_type(max(min(cell.x, max_coord), scalar_type(0)));
+    auto y_code = code_type(max(min(cell.y, max_coord), scalar_type(0)));
+    auto z_code = code_type(max(min(cell.z, max_coord), scalar_type(0)));
+
+    curve[i] = entry_type { encoder(x_code, y_code, z_code), entry_index_type(i) };
   }
-private:
-  //! The array of primitives to get the bounding box of.
-  const primitive_type* primitives;
-  //! The number of primitives in the primitive array.
-  size_type count;
-  //! The primitive to bounding box converter.
-  const aabb_converter& converter;
-  //! The array of boxes, each box allocated
-  //! for a thread.
-  box_type* thread_boxes;
-};
 
-//! \brief Used to get the domain of Morton coordinates,
-//! based on the size of the type being used.
-template <size_type type_size>
-struct morton_domain final { };
+  detail::constexpr_sort(curve);
 
-//! \brief Contains the domain of 32-bit Morton codes.
-template <>
-struct morton_domain<4> final {
-  //! Gets the domain of 32-bit Morton codes.
-  static constexpr size_type value() noexcept {
-    return 1024;
+  std::array<node_type, count - 1> nodes {};
+
+  for (size_type i = 0; i < (count - 1); i++) {
+    detail::link_node(curve, i, nodes[i]);
   }
-};
 
-//! \brief Contains the domain of 64-bit Morton codes.
-template <>
-struct morton_domain<8> final {
-  //! Gets the domain of 64-bit Morton codes.
-  static constexpr size_type value() noexcept {
-    return 1048576;
+  // The nodes are fit in the reverse of a breadth first
+  // order from the root, so that children are fit first.
+
+  std::array<size_type, count - 1> order {};
+
+  size_type order_size = 1;
+
+  for (size_type i = 0; i < order_size; i++) {
+
+    const auto& n = nodes[order[i]];
+
+    if (!n.left_is_leaf()) {
+      order[order_size++] = n.left;
+    }
+
+    if (!n.right_is_leaf()) {
+      order[order_size++] = n.right;
+    }
   }
-};
 
-//! \brief This class is used for encoding Morton values.
-//! This class is specialized based on the size of a code point.
-//!
-//! \tparam type_size The type size of a code point.
-template <size_type type_size>
-class morton_encoder final {};
+  for (size_type i = order_size; i > 0; i--) {
 
-//! \brief Used for encoding 32-bit Morton codes.
-template <>
-class morton_encoder<4> final {
-public:
-  //! A type definition for a 32-bit Morton code.
-  using code_type = associated_types<4>::uint_type;
-  //! Encodes a 3D 32-bit Morton code.
-  inline code_type operator () (code_type x, code_type y, code_type z) noexcept {
-    return (expand(x) << 2)
-         | (expand(y) << 1)
-         | (expand(z) << 0);
-  }
-protected:
-  //! Expands a 10-bit value to 30-bits.
-  inline static code_type expand(code_type n) noexcept {
-    n = (n | (n << 16)) & 0x030000ff;
-    n = (n | (n << 8)) & 0x0300f00f;
-    n = (n | (n << 4)) & 0x030c30c3;
-    n = (n | (n << 2)) & 0x09249249;
-    return n;
-  }
-};
+    auto& n = nodes[order[i - 1]];
 
-//! \brief Used for encoding 64-bit Morton codes.
-template <>
-class morton_encoder<8> final {
-public:
-  //! A type definition for a 64-bit Morton code.
-  using code_type = associated_types<8>::uint_type;
-  //! Encodes a 3D 64-bit Morton code.
-  inline code_type operator () (code_type x, code_type y, code_type z) noexcept {
-    return (expand(x) << 2)
-         | (expand(y) << 1)
-         | (expand(z) << 0);
+    auto left_box = n.left_is_leaf() ? converter(primitives[n.left_leaf_index()]) : nodes[n.left].box;
+
+    auto right_box = n.right_is_leaf() ? converter(primitives[n.right_leaf_index()]) : nodes[n.right].box;
+
+    n.box = detail::union_of(left_box, right_box);
   }
-protected:
-  //! Expands a 20-bit value to 60-bits.
-  inline static code_type expand(code_type n) noexcept {
-    n = (n | n << 32) & 0x001f00000000ffff;
-    n = (n | n << 16) & 0x001f0000ff0000ff;
-    n = (n | n << 8) & 0x100f00f00f00f00f;
-    n = (n | n << 4) & 0x10c30c30c30c30c3;
-    n = (n | n << 2) & 0x1249249249249249;
-    return n;
+
+  return nodes;
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+update_decision dynamic_bvh<scalar_type, task_scheduler>::update(const primitive* primitives, size_type count, const aabb_converter& converter) {
+
+  null_build_observer observer;
+
+  return update(primitives, count, converter, observer);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename build_observer>
+update_decision dynamic_bvh<scalar_type, task_scheduler>::update(const primitive* primitives,
+                                                                   size_type count,
+                                                                   const aabb_converter& converter,
+                                                                   build_observer& observer) {
+
+  if ((count != primitive_count) || !tree.size()) {
+    rebuild(primitives, count, converter, observer);
+    last_report.decision = update_decision::initial_build;
+    last_report.sah_ratio = 1;
+    return last_report.decision;
   }
-};
 
-//! This class is used for computing part or all
-//! of a Morton curve. It may be called from multiple threads.
-//!
-//! \tparam scalar_type The type of scalar used in the scene primitives.
-//!
-//! \tparam primitive_type The type of primitive in the scene.
-template <typename scalar_type, typename primitive_type>
-class morton_curve_kernel final {
-public:
-  //! A type definition for a code value.
-  using code_type = typename associated_types<sizeof(scalar_type)>::uint_type;
-  //! A type definition for an entry in the space filling curve.
-  using entry = typename space_filling_curve<code_type>::entry;
-  //! Constructs a new Morton curve kernel.
-  //! \param p The primitive array to generate the values from.
-  //! \param e The entry array to receive the values.
-  //! \param c The number of primitives in the array.
-  constexpr morton_curve_kernel(const primitive_type* p, entry* e, size_type c) noexcept
-    : primitives(p), entries(e), count(c) {}
-  //! Calculates the Morton codes of a certain subset of the scene.
-  //! The amount of work that's done depends on the work division.
-  //!
-  //! \param div Passed by the scheduler to indicate the amount of work to do.
-  //!
-  //! \param centroid_bounds The bounding box for all centroids.
-  //!
-  //! \param converter The primitive to bounding box converter.
-  template <typename aabb_converter>
-  void operator () (const work_division& div, const aabb<scalar_type>& centroid_bounds, aabb_converter converter) {
+  auto refit_start = std::chrono::steady_clock::now();
 
-    using entry_index_type = typename entry::index_type;
+  bvh_builder.refit(tree, primitives, converter, observer);
 
-    //! This is the maximum number of primitives to
-    //! work on per loop iteration.
-    constexpr size_type max_batch_size = 16;
+  auto refit_stop = std::chrono::steady_clock::now();
 
-    auto mdomain = code_type(morton_domain<sizeof(scalar_type)>::value());
+  last_report.refit_seconds = std::chrono::duration<double>(refit_stop - refit_start).count();
 
-    auto cbounds_size = size_of(centroid_bounds);
+  auto cost = sah_cost(tree, primitives, converter, scheduler);
 
-    // The scale at which the centroids map to Morton space.
-    vec3<scalar_type> scale {
-      mdomain / (cbounds_size.x + scalar_type(1)),
-      mdomain / (cbounds_size.y + scalar_type(1)),
-      mdomain / (cbounds_size.z + scalar_type(1)),
-    };
+  auto ratio = (built_sah > 0) ? (cost / built_sah) : 1.0;
 
-    morton_encoder<sizeof(code_type)> encoder;
+  auto rebuild_gain = last_report.rebuild_seconds - last_report.refit_seconds;
 
-    auto range = loop_range(div, count);
+  if (ratio > policy.max_sah_ratio) {
+    rebuild(primitives, count, converter, observer);
+    last_report.decision = update_decision::rebuild_sah_ratio;
+  } else if (policy.use_break_even && (last_report.excess_seconds > rebuild_gain)) {
+    rebuild(primitives, count, converter, observer);
+    last_report.decision = update_decision::rebuild_break_even;
+  } else {
+    current_ratio = ratio;
+    last_report.decision = update_decision::refit;
+    last_report.refit_count++;
+  }
 
-    vec_packet<scalar_type, 3, max_batch_size> center_packet;
+  last_report.sah_ratio = ratio;
 
-    for (size_type i = range.begin; i < range.end; i += max_batch_size) {
+  return last_report.decision;
+}
 
-      auto batch_size = min(max_batch_size, range.end - i);
+template <typename scalar_type, typename task_scheduler>
+void dynamic_bvh<scalar_type, task_scheduler>::report_trace_time(double seconds) noexcept {
 
-      for (size_type j = 0; j < batch_size; j++) {
-        auto center = center_of(converter(primitives[i + j]));
-        center_packet[0][j] = center.x;
-        center_packet[1][j] = center.y;
-        center_packet[2][j] = center.z;
-      }
+  // The trace time of an unrefit BVH is about
+  // the reported time divided by the SAH ratio.
 
-      // Scale center points to Morton space [0, 1024)
+  if (current_ratio > 1) {
+    last_report.excess_seconds += seconds * (1 - (1 / current_ratio));
+  }
+}
 
-      center_packet = hadamard_mul(center_packet - centroid_bounds.min, scale);
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename build_observer>
+void dynamic_bvh<scalar_type, task_scheduler>::rebuild(const primitive* primitives,
+                                                        size_type count,
+                                                        const aabb_converter& converter,
+                                                        build_observer& observer) {
 
-      // Export Morton codes
+  auto build_start = std::chrono::steady_clock::now();
 
-      for (size_type j = 0; j < batch_size; j++) {
+  tree = bvh_builder.rebuild(primitives, count, converter, cache, observer);
 
-        auto x_code = code_type(center_packet[0][j]);
-        auto y_code = code_type(center_packet[1][j]);
-        auto z_code = code_type(center_packet[2][j]);
+  auto build_stop = std::chrono::steady_clock::now();
 
-        auto code = encoder(x_code, y_code, z_code);
+  built_sah = sah_cost(tree, primitives, converter, scheduler);
 
-        entries[i + j] = entry { code, entry_index_type(i + j) };
-      }
-    }
+  current_ratio = 1;
+
+  primitive_count = count;
+
+  last_report.rebuild_seconds = std::chrono::duration<double>(build_stop - build_start).count();
+  last_report.excess_seconds = 0;
+  last_report.refit_count = 0;
+  last_report.rebuild_count++;
+}
+
+template <typename scalar_type, typename primitive, typename aabb_converter>
+lazy_bvh<scalar_type, primitive, aabb_converter>::lazy_bvh(const primitive* p,
+                                                           const aabb_converter& c,
+                                                           std::vector<entry>&& e,
+                                                           const std::vector<size_type>& offsets,
+                                                           const std::vector<box_type>& boxes,
+                                                           bvh<scalar_type>&& t)
+  : primitives(p), converter(c), entries(std::move(e)), clusters(boxes.size()), top_tree(std::move(t)) {
+
+  for (size_type i = 0; i < clusters.size(); i++) {
+    clusters[i].box = boxes[i];
+    clusters[i].first = offsets[i];
+    clusters[i].count = offsets[i + 1] - offsets[i];
   }
-private:
-  //! The primitives the curve is being generated from.
-  const primitive_type* primitives;
-  //! The entries to receive the calculated values.
-  entry* entries;
-  //! The number of primitives in the scene.
-  //! This is also the number of entries.
-  size_type count;
-};
+}
 
-//! \brief This class is used for generating Morton curves.
-//!
-//! \tparam scalar_type The type for the 3D points
-//! that get converted into Morton curves.
-//!
-//! \tparam task_scheduler The task scheduler to pass workers to.
-template <typename scalar_type, typename task_scheduler>
-class morton_curve_builder final {
-  //! A reference to the task scheduler to use.
-  //! This is most likely coming straight from the copy
-  //! used by the BVH builder.
-  task_scheduler& scheduler;
-public:
-  //! A type definition for a Morton curve.
-  using code_type = typename associated_types<sizeof(scalar_type)>::uint_type;
-  //! A type definition for the curve generated by this class.
-  using curve_type = space_filling_curve<code_type>;
-  //! Constructs a new curve builder.
-  //! \param scheduler_ The scheduler to pass work items to.
-  morton_curve_builder(task_scheduler& scheduler_)
-    : scheduler(scheduler_) {}
-  //! Converts a set of primitives into a space filling curve.
-  //!
-  //! \param primitives The array of primitives to convert.
-  //!
-  //! \param count The number of primitives in the primitive array.
-  //!
-  //! \param converter The primitive to bounding box converter.
-  //!
-  //! \return A space filling curve with Morton codes.
-  template <typename primitive, typename aabb_converter>
-  curve_type operator () (const primitive* primitives, size_type count, const aabb_converter& converter) {
+template <typename scalar_type, typename primitive, typename aabb_converter>
+auto lazy_bvh<scalar_type, primitive, aabb_converter>::subtree(size_type c) const -> const std::vector<node_type>& {
 
-    using entry_vec = typename curve_type::entry_vec;
+  auto& cl = clusters[c];
 
-    using box_type = aabb<scalar_type>;
+#ifndef LBVH_NO_THREADS
+  std::call_once(cl.once, [this, &cl]() { build_subtree(cl); });
+#else
+  if (!cl.built) {
+    build_subtree(cl);
+  }
+#endif
 
-    using centroid_bounds_kernel_type = centroid_bounds_kernel<scalar_type, primitive, aabb_converter>;
+  return cl.nodes;
+}
 
-    std::vector<box_type> thread_boxes(scheduler.max_threads());
+template <typename scalar_type, typename primitive, typename aabb_converter>
+size_type lazy_bvh<scalar_type, primitive, aabb_converter>::built_count() const noexcept {
 
-    centroid_bounds_kernel_type scene_bounds_kern(primitives, count, converter, thread_boxes.data());
+  size_type count = 0;
 
-    scheduler(scene_bounds_kern);
+  for (const auto& cl : clusters) {
+    count += cl.built ? 1 : 0;
+  }
 
-    auto centroid_bounds = get_empty_aabb<scalar_type>();
+  return count;
+}
 
-    for (const auto& th_box : thread_boxes) {
-      centroid_bounds = union_of(centroid_bounds, th_box);
-    }
+template <typename scalar_type, typename primitive, typename aabb_converter>
+void lazy_bvh<scalar_type, primitive, aabb_converter>::build_subtree(cluster& cl) const {
 
-    entry_vec entries(count);
+  if (cl.count > 1) {
 
-    morton_curve_kernel<scalar_type, primitive> curve_kernel(primitives, entries.data(), count);
+    auto first = entries.begin() + cl.first;
 
-    scheduler(curve_kernel, centroid_bounds, converter);
+    detail::space_filling_curve<code_type> curve(std::vector<entry>(first, first + cl.count));
 
-    return curve_type(std::move(entries));
+    curve.sort_serial();
+
+    std::vector<node_type> nodes(cl.count - 1);
+
+    detail::builder_kernel<code_type, scalar_type> builder_kern(curve, nodes.data());
+
+    builder_kern(work_division { 0, 1 });
+
+    std::vector<size_type> indices;
+
+    detail::fit_boxes(nodes.data(), nodes.size(), primitives, converter, indices);
+
+    cl.nodes = std::move(nodes);
   }
-};
 
-//! \brief Represents a division of an internal LBVH node.
-struct node_division final {
-  //! The first index of the division.
-  size_type index_a;
-  //! The second index of the division.
-  size_type index_b;
-  //! The index at which the division occurs.
-  size_type split;
-  //! Accesses the minimum index of the division.
-  inline constexpr auto min() const noexcept {
-    return (index_a < index_b) ? index_a : index_b;
+  cl.built = true;
+}
+
+template <typename scalar_type, typename primitive, typename aabb_converter>
+incremental_builder<scalar_type, primitive, aabb_converter>::incremental_builder(const primitive* p,
+                                                                                 size_type c,
+                                                                                 const aabb_converter& cvt,
+                                                                                 size_type s,
+                                                                                 morton_quantization q)
+  : primitives(p), count(c), converter(cvt), quantization(q), slice_count(std::max(c / std::max(s, size_type(1)), size_type(1))) {
+
+  for (auto d = detail::morton_domain<sizeof(scalar_type)>::value(); d > 1; d /= 2) {
+    code_bits += 3;
   }
-  //! Accesses the maximum index of the division.
-  inline constexpr auto max() const noexcept {
-    return (index_b > index_a) ? index_b : index_a;
+
+  // There are no internal nodes for less than two primitives.
+  finished = (count < 2);
+}
+
+template <typename scalar_type, typename primitive, typename aabb_converter>
+bool incremental_builder<scalar_type, primitive, aabb_converter>::run(std::chrono::microseconds budget) {
+
+  auto start = std::chrono::steady_clock::now();
+
+  while (!step()) {
+    if ((std::chrono::steady_clock::now() - start) >= budget) {
+      return false;
+    }
   }
-};
 
-//! This function divides an internal node into two ranges.
-//!
-//! \tparam code_type The type used for codes in the space filling curve.
-//!
-//! \param table The space filling curve, used to determine the indices of the split.
-//!
-//! \param node_index The index of the node being divided.
-//!
-//! \return A division structure instance, which may be used to assign sub nodes.
-template <typename code_type>
-node_division divide_node(const space_filling_curve<code_type>& table, size_type node_index) noexcept {
+  return true;
+}
 
-  // Used as the return value of the delta operator.
-  using delta_type = typename associated_types<sizeof(code_type)>::int_type;
+template <typename scalar_type, typename primitive, typename aabb_converter>
+bool incremental_builder<scalar_type, primitive, aabb_converter>::step() {
 
-  // The type used for offsets.
-  using offset_type = typename associated_types<sizeof(code_type)>::int_type;
+  if (finished) {
+    return true;
+  }
 
-  // Calculates upper bits, or returns -1
-  // if 'k' is out of bounds. Appears in the
-  // LBVH paper as 'δ' (lower case delta)
-  auto calc_delta = [&table](offset_type j, offset_type k) -> delta_type {
+  // The kernels of a regular build are reused by giving
+  // each slice the work division of one thread out of many.
 
-    if ((k < 0) || (k >= offset_type(table.size()))) {
-      // Suggested by the paper for out of bounds 'k'
-      return -1;
+  work_division div { slice, slice_count };
+
+  switch (current_phase) {
+    case build_phase::centroid_bounds:
+      if (!slice) {
+        slice_boxes.resize(slice_count);
+      }
+      detail::centroid_bounds_kernel<scalar_type, primitive, aabb_converter>(primitives, count, converter, slice_boxes.data())(div);
+      if (++slice == slice_count) {
+        centroid_bounds = detail::get_empty_aabb<scalar_type>();
+        for (const auto& box : slice_boxes) {
+          centroid_bounds = detail::union_of(centroid_bounds, box);
+        }
+        begin(build_phase::morton_curve);
+      }
+      break;
+    case build_phase::morton_curve:
+      if (!slice) {
+        entries.resize(count);
+      }
+      detail::morton_curve_kernel<scalar_type, primitive>(primitives, entries.data(), count, quantization)(div, centroid_bounds, converter);
+      if (++slice == slice_count) {
+        begin(build_phase::sort);
+      }
+      break;
+    case build_phase::sort:
+      sort_slice();
+      break;
+    case build_phase::hierarchy: {
+      if (!slice) {
+        nodes.resize(count - 1);
+      }
+      auto range = detail::loop_range(div, count - 1);
+      for (auto i = range.begin; i < range.end; i++) {
+        detail::link_node(entries, i, nodes[i]);
+      }
+      if (++slice == slice_count) {
+        entries = std::vector<entry>();
+        begin(build_phase::fit_boxes);
+      }
+      break;
     }
+    case build_phase::fit_boxes:
+      fit_slice();
+      break;
+  }
 
-    auto l_code = table[size_type(j)].code;
-    auto r_code = table[size_type(k)].code;
+  slice_total++;
 
-    using clz_input_type = typename associated_types<sizeof(code_type)>::uint_type;
+  return finished;
+}
 
-    if (l_code == r_code) {
-      // Suggested by the paper in
-      // case the code are equal.
-      return clz(clz_input_type(j ^ k)) + delta_type(sizeof(code_type) * 8);
-    } else {
-      return clz(clz_input_type(l_code ^ r_code));
-    }
-  };
+template <typename scalar_type, typename primitive, typename aabb_converter>
+void incremental_builder<scalar_type, primitive, aabb_converter>::begin(build_phase p) {
+  current_phase = p;
+  slice = 0;
+}
 
-  // It's easier in this function to regard
-  // all indices as signed offset types.
-  auto i = offset_type(node_index);
+template <typename scalar_type, typename primitive, typename aabb_converter>
+void incremental_builder<scalar_type, primitive, aabb_converter>::sort_slice() {
 
-  auto table_size = offset_type(table.size());
+  constexpr size_type radix_mask = (size_type(1) << radix_bits) - 1;
 
-  auto d = sign(calc_delta(i, i + 1) - calc_delta(i, i - 1));
+  if (!slice && !radix_moving) {
+    radix_offsets.assign(size_type(1) << radix_bits, 0);
+    sorted_entries.resize(count);
+  }
 
-  auto delta_min = calc_delta(i, i - d);
+  auto range = detail::loop_range(work_division { slice, slice_count }, count);
 
-  offset_type l_max = 128;
+  if (!radix_moving) {
+    for (auto i = range.begin; i < range.end; i++) {
+      radix_offsets[(entries[i].code >> radix_shift) & radix_mask]++;
+    }
+  } else {
+    // The slices are moved in order, which keeps the sort stable.
+    for (auto i = range.begin; i < range.end; i++) {
+      sorted_entries[radix_offsets[(entries[i].code >> radix_shift) & radix_mask]++] = entries[i];
+    }
+  }
 
-  while (true) {
+  if (++slice < slice_count) {
+    return;
+  }
 
-    auto k = i + (l_max * d);
+  slice = 0;
 
-    if (k >= table_size) {
-      break;
-    }
+  if (!radix_moving) {
 
-    if (!(calc_delta(i, k) > delta_min)) {
-      break;
+    size_type offset = 0;
+
+    for (auto& o : radix_offsets) {
+      auto digit_count = o;
+      o = offset;
+      offset += digit_count;
     }
 
-    l_max *= 4;
+    radix_moving = true;
+
+    return;
   }
 
-  offset_type l = 0;
+  entries.swap(sorted_entries);
 
-  for (offset_type div = 2; true; div *= 2) {
+  radix_moving = false;
 
-    auto t = l_max / div;
+  radix_shift += radix_bits;
 
-    auto k = i + ((l + t) * d);
+  if (radix_shift >= code_bits) {
+    sorted_entries = std::vector<entry>();
+    begin(build_phase::hierarchy);
+  }
+}
 
-    if (calc_delta(i, k) > delta_min) {
-      l += t;
-    }
+template <typename scalar_type, typename primitive, typename aabb_converter>
+void incremental_builder<scalar_type, primitive, aabb_converter>::fit_slice() {
 
-    if (t == 1) {
-      break;
-    }
-  }
+  auto slice_size = std::max(count / slice_count, size_type(1));
 
-  auto j = i + (l * d);
+  if (!fitting) {
 
-  auto delta_node = calc_delta(i, j);
+    if (fit_order.empty()) {
+      fit_order.reserve(nodes.size());
+      fit_order.push_back(0);
+    }
 
-  offset_type s = 0;
+    auto end = std::min(slice + slice_size, fit_order.size());
 
-  for (offset_type div = 2; true; div *= 2) {
+    for (; slice < end; slice++) {
 
-    auto t = ceil_div(l, div);
+      const auto& node = nodes[fit_order[slice]];
 
-    auto k = i + ((s + t) * d);
+      if (!node.left_is_leaf()) {
+        fit_order.push_back(node.left);
+      }
 
-    if (calc_delta(i, k) > delta_node) {
-      s += t;
+      if (!node.right_is_leaf()) {
+        fit_order.push_back(node.right);
+      }
     }
 
-    if (div >= l) {
-      break;
+    if (slice == fit_order.size()) {
+      fitting = true;
+      slice = 0;
     }
+
+    return;
   }
 
-  auto gamma = i + (s * d) + min(d, delta_type(0));
+  auto end = std::min(slice + slice_size, fit_order.size());
 
-  return node_division {
-    size_type(i),
-    size_type(j),
-    size_type(gamma)
-  };
+  for (; slice < end; slice++) {
+    detail::fit_node(nodes.data(), fit_order[fit_order.size() - slice - 1], primitives, converter);
+  }
+
+  if (slice == fit_order.size()) {
+    fit_order = std::vector<size_type>();
+    finished = true;
+  }
 }
 
-//! \brief Used for building the BVH nodes.
-//! Can be called by the scheduler from many threads.
-//!
-//! \tparam code_type The type of code contained by the space filling curve.
-//!
-//! \tparam scalar_type The scalar type used by the node boxes.
-template <typename code_type, typename scalar_type>
-class builder_kernel final {
-public:
-  //! A type definition for a space filling curve.
-  using curve_type = space_filling_curve<code_type>;
-  //! A type definition for a node type.
-  using node_type = node<scalar_type>;
-  //! Constructs a new builder kernel.
-  //! \param c The curve containing the codes to build the nodes with.
-  //! \param n The allocated node array to put the node data into.
-  constexpr builder_kernel(const curve_type& c, node_type* n) noexcept
-    : curve(c), nodes(n) {}
-  //! Calls the kernel to build a certain portion of the BVH nodes.
-  //! \param div The division of work this function call is responsible for.
-  void operator () (const work_division& div) noexcept {
+template <typename scalar_type, typename primitive_type, typename intersection_type>
+template <typename intersector_type>
+intersection_type traverser<scalar_type, primitive_type, intersection_type>::operator () (const ray_type& ray, const intersector_type& intersector) const noexcept {
 
-    using index_type = typename node_type::index_type;
+  intersection_type closest;
 
-    auto range = loop_range(div, curve.size() - 1);
+  // A BVH of less than two primitives has no nodes, not even a root.
 
-    for (auto i = range.begin; i < range.end; i++) {
+  if (!bvh_.size()) {
+    return closest;
+  }
 
-      auto node_div = divide_node(curve, i);
+  detail::mailbox<index_type, 8> mailbox;
 
-      auto l_is_leaf = (node_div.min() == (node_div.split + 0));
-      auto r_is_leaf = (node_div.max() == (node_div.split + 1));
+  auto intersect_primitive = [this, &intersector, &ray, &closest](index_type index) {
 
-      auto l_mask = l_is_leaf ? highest_bit<index_type>() : 0;
-      auto r_mask = r_is_leaf ? highest_bit<index_type>() : 0;
+    auto isect = intersector(primitives[index], ray);
 
-      nodes[i].left  = index_type((node_div.split + 0) | l_mask);
-      nodes[i].right = index_type((node_div.split + 1) | r_mask);
-    }
-  }
-private:
-  //! This is the space filling curve used to determine
-  //! the range and split of each node that this kernel will build.
-  const curve_type& curve;
-  //! A pointer to the node array being constructed.
-  node_type* nodes;
-};
+    isect.primitive = index;
 
-//! Used for traversing the BVH.
-//!
-//! \tparam scalar_type The floating point type to use in the traversal.
-//!
-//! \tparam max The maximum number of entries to allocate on the stack.
-template <typename scalar_type, size_type max>
-class traversal_stack final {
-public:
-  //! The type to be used for a node index.
-  using node_index_type = typename associated_types<sizeof(scalar_type)>::uint_type;
-  //! Contains information regarding a ndoe
-  //! to be traversed.
-  struct entry final {
-    //! The index of the node to traverse.
-    node_index_type node_index;
-    //! The minimum scale at which the ray
-    //! hits this node.
-    scalar_type tmin;
-  };
-  //! Indicates the number of entries remaining
-  //! in the stack.
-  inline size_type remaining() const noexcept {
-    return pos;
-  }
-  //! Removes an entry from the stack.
-  auto pop() noexcept {
-    if (!pos) {
-      return entry { 0, std::numeric_limits<scalar_type>::infinity() };
-    }
-    return entries[--pos];
-  }
-  //! Pushes an item to the stack.
-  //! \param i The index of the node.
-  //! \param t The scale at which the ray intersects this node.
-  void push(size_type i, scalar_type t) noexcept {
-    if (pos < max) {
-      entries[pos++] = entry { node_index_type(i), t };
+    if (isect < closest) {
+      closest = isect;
     }
-  }
-private:
-  //! The position of the "stack pointer."
-  size_type pos = 0;
-  //! The array of entries to be filled.
-  entry entries[max];
-};
+  };
 
-} // namespace detail
+  auto intersect_leaf = [this, &intersect_primitive, &mailbox](index_type leaf_index) {
 
-template <typename scalar_type, typename task_scheduler>
-template <typename primitive, typename aabb_converter>
-auto builder<scalar_type, task_scheduler>::operator () (const primitive* primitives, size_type count, const aabb_converter& converter) -> bvh_type {
+    if (leaf_offsets) {
+      for (auto i = leaf_offsets[leaf_index]; i < leaf_offsets[leaf_index + 1]; i++) {
+        intersect_primitive(references[i]);
+      }
+    } else if (!references) {
+      intersect_primitive(leaf_index);
+    } else if (mailbox.insert(references[leaf_index])) {
+      intersect_primitive(references[leaf_index]);
+    }
+  };
 
-  using curve_builder_type = detail::morton_curve_builder<scalar_type, task_scheduler>;
+  detail::traverse_nodes(bvh_.data(), ray, closest, intersect_leaf);
 
-  using code_type = typename curve_builder_type::code_type;
+  return closest;
+}
 
-  curve_builder_type curve_builder(scheduler);
+template <typename scalar_type, typename primitive_type, typename intersection_type>
+template <typename intersector_type>
+intersection_type node_traverser<scalar_type, primitive_type, intersection_type>::operator () (const ray_type& ray, const intersector_type& intersector) const noexcept {
 
-  auto curve = curve_builder(primitives, count, converter);
+  intersection_type closest;
 
-  curve.sort();
+  auto intersect_primitive = [this, &intersector, &ray, &closest](index_type index) {
 
-  std::vector<node_type> node_vec(curve.size() - 1);
+    auto isect = intersector(primitives[index], ray);
 
-  detail::builder_kernel<code_type, scalar_type> builder_kern(curve, node_vec.data());
+    isect.primitive = index;
 
-  scheduler(builder_kern);
+    if (isect < closest) {
+      closest = isect;
+    }
+  };
 
-  fit_boxes(node_vec, primitives, converter);
+  detail::traverse_nodes(nodes, ray, closest, intersect_primitive);
 
-  return bvh_type(std::move(node_vec));
+  return closest;
 }
 
-template <typename scalar_type, typename task_scheduler>
-template <typename primitive, typename aabb_converter>
-void builder<scalar_type, task_scheduler>::fit_boxes(node_vec& nodes, const primitive* primitives, const aabb_converter& converter) {
+template <typename scalar_type, typename primitive_type>
+template <typename point_tester>
+void traverser2<scalar_type, primitive_type>::operator () (const vec2<scalar_type>& point,
+                                                           const point_tester& tester,
+                                                           std::vector<index_type>& hits) const {
 
-  std::vector<size_type> indices;
+  auto test_box = [&point](const aabb2<scalar_type>& box) {
+    return detail::contains(box, point);
+  };
 
-  indices.reserve(nodes.size());
+  auto test_primitive = [&point, &tester](const primitive_type& primitive) {
+    return tester(primitive, point);
+  };
 
-  indices.push_back(0);
+  query(test_box, test_primitive, hits);
+}
 
-  for (size_type i = 0; i < indices.size(); i++) {
+template <typename scalar_type, typename primitive_type>
+template <typename rect_tester>
+void traverser2<scalar_type, primitive_type>::operator () (const aabb2<scalar_type>& rect,
+                                                           const rect_tester& tester,
+                                                           std::vector<index_type>& hits) const {
 
-    auto j = indices[i];
+  auto test_box = [&rect](const aabb2<scalar_type>& box) {
+    return detail::overlaps(box, rect);
+  };
 
-    if (!nodes[j].left_is_leaf()) {
-      indices.push_back(nodes[j].left);
-    }
+  auto test_primitive = [&rect, &tester](const primitive_type& primitive) {
+    return tester(primitive, rect);
+  };
 
-    if (!nodes[j].right_is_leaf()) {
-      indices.push_back(nodes[j].right);
-    }
+  query(test_box, test_primitive, hits);
+}
+
+template <typename scalar_type, typename primitive_type>
+template <typename box_test, typename primitive_test>
+void traverser2<scalar_type, primitive_type>::query(const box_test& test_box,
+                                                    const primitive_test& test_primitive,
+                                                    std::vector<index_type>& hits) const {
+
+  if (!bvh_.size() || !test_box(bvh_[0].box)) {
+    return;
   }
 
-  for (size_type i = indices.size(); i > 0; i--) {
+  // There's no ordering of the children here, since
+  // every hit is wanted and not only the closest one.
 
-    auto j = indices[i - 1];
+  index_type stack[128];
 
-    auto& node = nodes[j];
+  size_type stack_size = 0;
 
-    if (node.left_is_leaf()) {
-      node.box = converter(primitives[node.left_leaf_index()]);
-    } else {
-      node.box = nodes[node.left].box;
-    }
+  stack[stack_size++] = 0;
 
-    if (node.right_is_leaf()) {
-      node.box = detail::union_of(node.box, converter(primitives[node.right_leaf_index()]));
-    } else {
-      node.box = detail::union_of(node.box, nodes[node.right].box);
+  auto visit = [this, &test_box, &test_primitive, &hits, &stack, &stack_size](index_type child, bool is_leaf) {
+    if (is_leaf) {
+      if (test_primitive(primitives[child])) {
+        hits.push_back(child);
+      }
+    } else if (test_box(bvh_[child].box)) {
+      stack[stack_size++] = child;
     }
+  };
+
+  while (stack_size > 0) {
+
+    const auto& node = bvh_[stack[--stack_size]];
+
+    visit(node.left_is_leaf() ? node.left_leaf_index() : node.left, node.left_is_leaf());
+
+    visit(node.right_is_leaf() ? node.right_leaf_index() : node.right, node.right_is_leaf());
   }
 }
 
-template <typename scalar_type, typename primitive_type, typename intersection_type>
+template <typename scalar_type, typename intersection_type, typename... primitive_types>
 template <typename intersector_type>
-intersection_type traverser<scalar_type, primitive_type, intersection_type>::operator () (const ray_type& ray, const intersector_type& intersector) const noexcept {
+intersection_type tagged_traverser<scalar_type, intersection_type, primitive_types...>::operator () (const ray_type& ray, const intersector_type& intersector) const noexcept {
 
-  using box_intersection_type = detail::box_intersection<scalar_type>;
+  auto intersect_reference = [this, &intersector](const reference_type& ref, const ray_type& r) {
 
-  detail::traversal_stack<scalar_type, 128> stack;
+    auto intersect_primitive = [&intersector, &r](const auto& primitive) -> intersection_type {
+      return intersector(primitive, r);
+    };
 
-  stack.push(0, std::numeric_limits<scalar_type>::infinity());
+    return primitives.visit(ref, intersect_primitive);
+  };
 
-  auto accel_r = detail::make_accel_ray(ray);
+  return references(ray, intersect_reference);
+}
 
-  auto intersect_primitive = [](const auto& intersector_, const auto* p, auto index, const auto& r) {
-    auto isect = intersector_(p[index], r);
-    isect.primitive = index;
-    return isect;
-  };
+template <typename scalar_type, typename primitive_type, typename aabb_converter, typename intersection_type>
+template <typename intersector_type>
+intersection_type lazy_traverser<scalar_type, primitive_type, aabb_converter, intersection_type>::operator () (const ray_type& ray, const intersector_type& intersector) const {
+
+  auto accel_r = detail::make_accel_ray(ray);
 
   intersection_type closest;
 
-  while (stack.remaining()) {
+  auto visit_cluster = [this, &intersector, &ray, &accel_r, &closest](index_type c) {
 
-    auto entry = stack.pop();
+    auto box_isect = detail::intersect(lazy.cluster_box(c), accel_r);
 
-    if (closest < entry.tmin) {
-      // We've already got a closer intersection than
-      // what can be found at this node, we can skip this.
-      continue;
+    if (!box_isect || (closest < box_isect.tmin)) {
+      // The subtree isn't built unless it can have a closer hit.
+      return;
     }
 
-    const auto& node = bvh_[entry.node_index];
+    intersection_type isect;
 
-    box_intersection_type left_box_isect;
-
-    if (node.left_is_leaf()) {
-      auto left_isect = intersect_primitive(intersector, primitives, node.left_leaf_index(), ray);
-      if (left_isect < closest) {
-        closest = left_isect;
-      }
+    if (lazy.cluster_size(c) == 1) {
+      isect = intersector(lazy.primitive_data()[lazy.cluster_primitive(c, 0)], ray);
+      isect.primitive = lazy.cluster_primitive(c, 0);
     } else {
-      left_box_isect = detail::intersect(bvh_[node.left].box, accel_r);
+      node_traverser<scalar_type, primitive_type, intersection_type> subtree_traverser(lazy.subtree(c).data(), lazy.primitive_data());
+      isect = subtree_traverser(ray, intersector);
     }
 
-    box_intersection_type right_box_isect;
-
-    if (node.right_is_leaf()) {
-      auto right_isect = intersect_primitive(intersector, primitives, node.right_leaf_index(), ray);
-      if (right_isect < closest) {
-        closest = right_isect;
-      }
-    } else {
-      right_box_isect = detail::intersect(bvh_[node.right].box, accel_r);
+    if (isect < closest) {
+      closest = isect;
     }
+  };
 
-    if (left_box_isect && right_box_isect) {
-      if (left_box_isect < right_box_isect) {
-        stack.push(node.right, right_box_isect.tmin);
-        stack.push(node.left,   left_box_isect.tmin);
-      } else {
-        stack.push(node.left,   left_box_isect.tmin);
-        stack.push(node.right, right_box_isect.tmin);
-      }
-    } else if (left_box_isect) {
-      stack.push(node.left, left_box_isect.tmin);
-    } else if (right_box_isect) {
-      stack.push(node.right, right_box_isect.tmin);
+  const auto& top = lazy.top();
+
+  if (!top.size()) {
+    for (size_type c = 0; c < lazy.cluster_count(); c++) {
+      visit_cluster(index_type(c));
     }
+    return closest;
   }
 
+  detail::traverse_nodes(top.data(), ray, closest, visit_cluster);
+
   return closest;
 }
 
@@ -1,8 +1,14 @@
+#ifdef __linux__
+#define LBVH_ENABLE_PERF_COUNTERS 1
+#endif
+
 #include <lbvh.h>
 
 #include "third-party/stb_image_write.h"
 
+#include <atomic>
 #include <chrono>
+#include <numeric>
 
 #include <cstdio>
 #include <cstdlib>
@@ -23,6 +29,19 @@ inline constexpr size_type image_height() noexcept {
   return 720;
 }
 
+//! The width and height of a single render tile, in pixels.
+inline constexpr size_type tile_size() noexcept {
+  return 16;
+}
+
+//! The number of primitives in each range of the batch build test.
+inline constexpr size_type batch_range_size() noexcept {
+  return 4096;
+}
+
+//! A type definition for the clock used to time the tests.
+using clock_type = std::chrono::high_resolution_clock;
+
 //! Used for getting traits from type.
 template <typename scalar_type>
 struct type_traits final {};
@@ -91,6 +110,124 @@ public:
   }
 };
 
+//! Used for converting triangles in the model to bounding
+//! rectangles on the floor plan, which is the XZ plane.
+//!
+//! \tparam scalar_type The scalar type of the rectangle vectors to make.
+template <typename scalar_type>
+class triangle_footprint_converter final {
+public:
+  //! A type definition for a floor plan rectangle.
+  using box_type = lbvh::aabb2<scalar_type>;
+  //! A type definition for a triangle.
+  using triangle_type = triangle<scalar_type>;
+  //! Gets the floor plan rectangle of a triangle in the model.
+  //!
+  //! \param t The triangle to get the rectangle for.
+  //!
+  //! \return The rectangle covered by the triangle, seen from above.
+  box_type operator () (const triangle_type& t) const noexcept {
+
+    auto box = triangle_aabb_converter<scalar_type>()(t);
+
+    return box_type {
+      { box.min.x, box.min.z },
+      { box.max.x, box.max.z }
+    };
+  }
+};
+
+//! Used for clipping triangles to boxes,
+//! when oversized triangles are split before a build.
+//!
+//! \tparam scalar_type The scalar type of the triangle vector components.
+template <typename scalar_type>
+class triangle_clipper final {
+public:
+  //! A type definition for a bounding box.
+  using box_type = lbvh::aabb<scalar_type>;
+  //! A type definition for a triangle.
+  using triangle_type = triangle<scalar_type>;
+  //! A type definition for a 3D vector.
+  using vec3_type = lbvh::vec3<scalar_type>;
+  //! Gets the box around the part of a triangle that's within a region.
+  //!
+  //! \param t The triangle to clip.
+  //!
+  //! \param region The box to clip the triangle to.
+  //!
+  //! \return The box of the clipped triangle. If the triangle
+  //! isn't within the region, the minimum of the box is greater
+  //! than its maximum.
+  box_type operator () (const triangle_type& t, const box_type& region) const noexcept {
+
+    using namespace lbvh::math;
+
+    // Each of the six planes of the region can add at most
+    // one vertex to the polygon, so nine vertices are enough.
+
+    vec3_type poly[9] { t.pos[0], t.pos[1], t.pos[2] };
+
+    size_type count = 3;
+
+    for (int axis = 0; axis < 3; axis++) {
+      count = clip(poly, count, axis, component(region.min, axis), scalar_type(1));
+      count = clip(poly, count, axis, component(region.max, axis), scalar_type(-1));
+    }
+
+    auto inf = std::numeric_limits<scalar_type>::infinity();
+
+    box_type box { vec3_type { inf, inf, inf }, vec3_type { -inf, -inf, -inf } };
+
+    for (size_type i = 0; i < count; i++) {
+      box.min = min(box.min, poly[i]);
+      box.max = max(box.max, poly[i]);
+    }
+
+    return box_type { max(box.min, region.min), min(box.max, region.max) };
+  }
+protected:
+  //! Gets a component of a vector by axis.
+  static scalar_type component(const vec3_type& v, int axis) noexcept {
+    return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+  }
+  //! Clips a polygon by a plane, keeping the side where
+  //! the axis component times @p side is at least the bound.
+  //!
+  //! \return The number of vertices left in the polygon.
+  static size_type clip(vec3_type* poly, size_type count, int axis, scalar_type bound, scalar_type side) noexcept {
+
+    using namespace lbvh::math;
+
+    vec3_type out[9];
+
+    size_type out_count = 0;
+
+    for (size_type i = 0; i < count; i++) {
+
+      const auto& a = poly[i];
+      const auto& b = poly[(i + 1) % count];
+
+      auto da = (component(a, axis) - bound) * side;
+      auto db = (component(b, axis) - bound) * side;
+
+      if (da >= 0) {
+        out[out_count++] = a;
+      }
+
+      if ((da >= 0) != (db >= 0)) {
+        out[out_count++] = a + ((b - a) * (da / (da - db)));
+      }
+    }
+
+    for (size_type i = 0; i < out_count; i++) {
+      poly[i] = out[i];
+    }
+
+    return out_count;
+  }
+};
+
 //! Used to detect intersections between rays and triangles.
 //!
 //! \tparam scalar_type The scalar type of the triangle vector components.
@@ -157,6 +294,157 @@ public:
   }
 };
 
+//! A sphere, used with the triangles of the
+//! model to test scenes with mixed primitives.
+//!
+//! \tparam scalar_type The scalar type of the sphere.
+template <typename scalar_type>
+struct sphere final {
+  //! The center of the sphere.
+  lbvh::vec3<scalar_type> center;
+  //! The radius of the sphere.
+  scalar_type radius;
+};
+
+//! Converts either triangles or spheres to bounding boxes.
+//!
+//! \tparam scalar_type The scalar type of the bounding box vectors to make.
+template <typename scalar_type>
+class mixed_aabb_converter final {
+public:
+  //! A type definition for a bounding box.
+  using box_type = lbvh::aabb<scalar_type>;
+  //! Gets the bounding box of a triangle.
+  box_type operator () (const triangle<scalar_type>& t) const noexcept {
+    return triangle_aabb_converter<scalar_type>()(t);
+  }
+  //! Gets the bounding box of a sphere.
+  box_type operator () (const sphere<scalar_type>& s) const noexcept {
+    using namespace lbvh::math;
+    lbvh::vec3<scalar_type> r { s.radius, s.radius, s.radius };
+    return box_type { s.center - r, s.center + r };
+  }
+};
+
+//! Intersects rays with either triangles or spheres.
+//!
+//! \tparam scalar_type The scalar type of the ray and primitives.
+template <typename scalar_type>
+class mixed_intersector final {
+public:
+  //! A type definition for an intersection.
+  using intersection_type = lbvh::intersection<scalar_type>;
+  //! A type definition for a ray.
+  using ray_type = lbvh::ray<scalar_type>;
+  //! Detects intersection between a ray and a triangle.
+  intersection_type operator () (const triangle<scalar_type>& tri, const ray_type& r) const noexcept {
+    return triangle_intersector<scalar_type>()(tri, r);
+  }
+  //! Detects the nearest intersection between a ray and a sphere,
+  //! in front of the ray origin.
+  intersection_type operator () (const sphere<scalar_type>& s, const ray_type& r) const noexcept {
+
+    using namespace lbvh::math;
+
+    auto oc = r.pos - s.center;
+
+    auto a = dot(r.dir, r.dir);
+    auto b = dot(oc, r.dir);
+    auto c = dot(oc, oc) - (s.radius * s.radius);
+
+    auto discriminant = (b * b) - (a * c);
+
+    if (discriminant < 0) {
+      return intersection_type{};
+    }
+
+    auto root = std::sqrt(discriminant);
+
+    auto t = (-b - root) / a;
+
+    if (t < std::numeric_limits<scalar_type>::epsilon()) {
+      t = (-b + root) / a;
+    }
+
+    if (t < std::numeric_limits<scalar_type>::epsilon()) {
+      return intersection_type{};
+    }
+
+    auto normal = normalize((r.pos + (r.dir * t)) - s.center);
+
+    return intersection_type {
+      t, normal, { 0, 0 }, 0
+    };
+  }
+};
+
+//! Counts how many times each build phase is started,
+//! to check that a build doesn't go back to a phase.
+class phase_counter final {
+  //! The number of times each phase was started.
+  size_type counts[lbvh::build_phase_count()] {};
+public:
+  //! Counts the start of a phase.
+  void begin(lbvh::build_phase phase) noexcept {
+    counts[size_type(phase)]++;
+  }
+  //! Called after each build phase.
+  void end(lbvh::build_phase) noexcept {}
+  //! Gets the number of times a phase was started.
+  size_type operator [] (lbvh::build_phase phase) const noexcept {
+    return counts[size_type(phase)];
+  }
+};
+
+//! Cancels a build as soon as it starts a certain phase.
+class cancelling_observer final {
+  //! The token of the build to cancel.
+  lbvh::build_token& token;
+  //! The phase to cancel the build at.
+  lbvh::build_phase cancel_phase;
+public:
+  //! Constructs a new cancelling observer.
+  //! \param t The token of the build to cancel.
+  //! \param p The phase to cancel the build at.
+  cancelling_observer(lbvh::build_token& t, lbvh::build_phase p) noexcept
+    : token(t), cancel_phase(p) {}
+  //! Cancels the build if it's starting the chosen phase.
+  void begin(lbvh::build_phase phase) noexcept {
+    if (phase == cancel_phase) {
+      token.cancel();
+    }
+  }
+  //! Called after each build phase.
+  void end(lbvh::build_phase) noexcept {}
+};
+
+//! Converts triangles to boxes, and cancels the build
+//! when it gets to a certain triangle. This stands in for
+//! a scene that is changed by the user part of the way
+//! through a build.
+//!
+//! \tparam scalar_type The scalar type of the triangles.
+template <typename scalar_type>
+class cancelling_converter final {
+  //! The triangle to cancel the build at.
+  const triangle<scalar_type>* cancel_at;
+  //! The token of the build to cancel.
+  lbvh::build_token& token;
+public:
+  //! Constructs a new cancelling converter.
+  //! \param c The triangle to cancel the build at.
+  //! \param t The token of the build to cancel.
+  cancelling_converter(const triangle<scalar_type>* c, lbvh::build_token& t) noexcept
+    : cancel_at(c), token(t) {}
+  //! Converts a triangle to a box.
+  lbvh::aabb<scalar_type> operator () (const triangle<scalar_type>& t) const noexcept {
+    if (&t == cancel_at) {
+      token.cancel();
+    }
+    return triangle_aabb_converter<scalar_type>()(t);
+  }
+};
+
 //! A simplified scene model.
 //! Internally is a flat array of triangles.
 //!
@@ -250,6 +538,124 @@ struct color final {
   scalar_type b;
 };
 
+//! Interleaves the bits of two 16-bit tile coordinates.
+//! Used to order tiles along a 2D Morton curve.
+inline std::uint32_t tile_code(std::uint32_t x, std::uint32_t y) noexcept {
+
+  auto expand = [](std::uint32_t n) {
+    n = (n | (n << 8)) & 0x00ff00ff;
+    n = (n | (n << 4)) & 0x0f0f0f0f;
+    n = (n | (n << 2)) & 0x33333333;
+    n = (n | (n << 1)) & 0x55555555;
+    return n;
+  };
+
+  return (expand(x) << 1) | expand(y);
+}
+
+//! A rectangular region of the image.
+struct tile final {
+  //! The first column of the tile.
+  size_type x_min;
+  //! The first row of the tile.
+  size_type y_min;
+  //! The non-inclusive last column of the tile.
+  size_type x_max;
+  //! The non-inclusive last row of the tile.
+  size_type y_max;
+};
+
+//! \brief Hands out image tiles to render threads.
+//! It also records when each thread runs out of work,
+//! so that the tail of the frame can be measured.
+//!
+//! Threads keep pulling tiles from an atomic counter until
+//! none are left, so that threads which land on cheap tiles
+//! (such as the sky) pick up more work instead of idling.
+//! Tiles are handed out in Morton order, to keep the rays
+//! traced by neighboring requests coherent.
+class tile_dispatcher final {
+  //! The tiles to be rendered, in Morton order.
+  std::vector<tile> tiles;
+  //! The index of the next tile to hand out.
+  std::atomic<size_type> next_tile { 0 };
+  //! The time at which each thread ran out of tiles.
+  std::vector<clock_type::time_point> finish_times;
+public:
+  //! Constructs a new tile dispatcher.
+  //!
+  //! \param width The width of the image, in pixels.
+  //!
+  //! \param height The height of the image, in pixels.
+  //!
+  //! \param max_threads The maximum number of render threads.
+  tile_dispatcher(size_type width, size_type height, size_type max_threads)
+    : finish_times(max_threads) {
+
+    auto x_tiles = lbvh::detail::ceil_div(width, tile_size());
+    auto y_tiles = lbvh::detail::ceil_div(height, tile_size());
+
+    std::vector<std::pair<std::uint32_t, tile>> coded_tiles;
+
+    coded_tiles.reserve(x_tiles * y_tiles);
+
+    for (size_type y = 0; y < y_tiles; y++) {
+      for (size_type x = 0; x < x_tiles; x++) {
+        tile t {
+          x * tile_size(),
+          y * tile_size(),
+          std::min((x + 1) * tile_size(), width),
+          std::min((y + 1) * tile_size(), height)
+        };
+        coded_tiles.emplace_back(tile_code(std::uint32_t(x), std::uint32_t(y)), t);
+      }
+    }
+
+    std::sort(coded_tiles.begin(), coded_tiles.end(), [](const auto& a, const auto& b) {
+      return a.first < b.first;
+    });
+
+    for (const auto& coded_tile : coded_tiles) {
+      tiles.push_back(coded_tile.second);
+    }
+  }
+  //! Gets the next tile to be rendered.
+  //!
+  //! \param t Receives the tile, if there is one left.
+  //!
+  //! \return True if a tile was assigned, false if all tiles are taken.
+  bool pop(tile& t) noexcept {
+
+    auto i = next_tile.fetch_add(1, std::memory_order_relaxed);
+    if (i >= tiles.size()) {
+      return false;
+    }
+
+    t = tiles[i];
+
+    return true;
+  }
+  //! Records the time at which a thread finished its work.
+  //!
+  //! \param thread_idx The index of the thread, as given by the scheduler.
+  void finish(size_type thread_idx) {
+    finish_times.at(thread_idx) = clock_type::now();
+  }
+  //! Indicates the time between the first and the last thread finishing.
+  //! This is the amount of time that threads spend idle at the end of a frame.
+  //!
+  //! \return The tail time, in seconds.
+  double tail_time() const noexcept {
+
+    auto first = *std::min_element(finish_times.begin(), finish_times.end());
+    auto last  = *std::max_element(finish_times.begin(), finish_times.end());
+
+    auto tail_usecs = std::chrono::duration_cast<std::chrono::microseconds>(last - first).count();
+
+    return tail_usecs / 1'000'000.0;
+  }
+};
+
 //! \brief This class is used for generating rays for the
 //! test traversal.
 template <typename scalar_type>
@@ -264,6 +670,11 @@ class ray_scheduler final {
   size_type y_res;
   //! The image buffer to render the samples to.
   unsigned char* image_buf;
+  //! Assigns tiles to threads and records when they finish.
+  tile_dispatcher& dispatcher;
+  //! If true, rows are statically interleaved
+  //! between threads instead of dispatching tiles.
+  bool row_interleave;
   //! The position of the camera.
   vec3_type cam_pos { scalar_type(1.6), scalar_type(1.3), scalar_type(1.6) };
   //! The direction of "up".
@@ -272,8 +683,8 @@ class ray_scheduler final {
   vec3_type cam_target { 0, 0, 0 };
 public:
   //! Constructs a new instance of the ray scheduler.
-  ray_scheduler(size_type width, size_type height, unsigned char* buf) noexcept
-    : x_res(width), y_res(height), image_buf(buf) { }
+  ray_scheduler(size_type width, size_type height, unsigned char* buf, tile_dispatcher& d, bool interleave = false) noexcept
+    : x_res(width), y_res(height), image_buf(buf), dispatcher(d), row_interleave(interleave) { }
   //! Moves the camera to a new location.
   void move_cam(const vec3_type& v) {
     cam_pos = v;
@@ -284,6 +695,36 @@ public:
   template <typename trace_kernel, typename... arg_types>
   void operator () (const lbvh::work_division& div, const trace_kernel& kern, const arg_types&... args) {
 
+    if (row_interleave) {
+      for (size_type y = div.idx; y < y_res; y += div.max) {
+        trace_row(y, 0, x_res, kern, args...);
+      }
+    } else {
+
+      tile t;
+
+      while (dispatcher.pop(t)) {
+        for (size_type y = t.y_min; y < t.y_max; y++) {
+          trace_row(y, t.x_min, t.x_max, kern, args...);
+        }
+      }
+    }
+
+    dispatcher.finish(div.idx);
+  }
+protected:
+  //! Traces a horizontal span of pixels.
+  //!
+  //! \param y The row of the pixels to trace.
+  //!
+  //! \param x_min The first column to trace.
+  //!
+  //! \param x_max The non-inclusive last column to trace.
+  //!
+  //! \param kern The ray tracing kernel to pass the rays to.
+  template <typename trace_kernel, typename... arg_types>
+  void trace_row(size_type y, size_type x_min, size_type x_max, const trace_kernel& kern, const arg_types&... args) {
+
     using namespace lbvh::math;
 
     using channel_type = unsigned char;
@@ -296,28 +737,25 @@ public:
 
     auto fov = scalar_type(0.75);
 
-    for (size_type y = div.idx; y < y_res; y += div.max) {
+    auto* pixels = image_buf + (((y * x_res) + x_min) * 3);
 
-      auto* pixels = image_buf + (y * x_res * 3);
+    for (size_type x = x_min; x < x_max; x++) {
 
-      for (size_type x = 0; x < x_res; x++) {
+      auto x_ndc =  (2 * (x + scalar_type(0.5)) / scalar_type(x_res)) - 1;
+      auto y_ndc = -(2 * (y + scalar_type(0.5)) / scalar_type(y_res)) + 1;
 
-        auto x_ndc =  (2 * (x + scalar_type(0.5)) / scalar_type(x_res)) - 1;
-        auto y_ndc = -(2 * (y + scalar_type(0.5)) / scalar_type(y_res)) + 1;
-
-        ray_type r {
-          cam_pos,
-          normalize((cam_u * x_ndc) + (cam_v * y_ndc) + (cam_dir * fov * aspect_ratio))
-        };
+      ray_type r {
+        cam_pos,
+        normalize((cam_u * x_ndc) + (cam_v * y_ndc) + (cam_dir * fov * aspect_ratio))
+      };
 
-        auto color = kern(r, args...);
+      auto color = kern(r, args...);
 
-        pixels[0] = channel_type(color.r * 255);
-        pixels[1] = channel_type(color.g * 255);
-        pixels[2] = channel_type(color.b * 255);
+      pixels[0] = channel_type(color.r * 255);
+      pixels[1] = channel_type(color.g * 255);
+      pixels[2] = channel_type(color.b * 255);
 
-        pixels += 3;
-      }
+      pixels += 3;
     }
   }
 };
@@ -326,8 +764,22 @@ public:
 struct test_results final {
   //! The number of seconds it took to build the BVH.
   double build_time = 0;
+  //! The number of seconds it took to rebuild the BVH,
+  //! reusing the results of the previous build.
+  double rebuild_time = 0;
+  //! The SAH cost of the BVH.
+  double sah_cost = 0;
   //! The number of seconds it took to render the BVH.
   double render_time = 0;
+  //! The number of seconds between the first and
+  //! the last render thread running out of work.
+  double render_tail_time = 0;
+  //! The number of primitives in the scene.
+  size_type primitive_count = 0;
+  //! The measurements of each build phase.
+  lbvh::build_report build_report = {};
+  //! The hardware event counts of the render.
+  lbvh::perf_counts render_counts = {};
   //! The generated image buffer.
   std::vector<unsigned char> image_buf = {};
 };
@@ -339,6 +791,31 @@ struct test_options final {
   bool errors_fatal = false;
   //! Whether or not rendering should be skipped.
   bool skip_rendering = false;
+  //! Whether or not rows should be statically interleaved
+  //! between render threads, instead of dispatching tiles.
+  bool row_interleave = false;
+  //! If not zero, the BVH is built as an HLBVH
+  //! with this many Morton bits of SAH splits.
+  size_type sah_bits = 0;
+  //! Whether or not the BVH is built with binned SAH
+  //! splits over all primitives, as a quality reference.
+  bool sah_build = false;
+  //! If not zero, the BVH is optimized with this many
+  //! reinsertion passes, as part of the build time.
+  size_type optimize_passes = 0;
+  //! Whether or not oversized triangles are split before the
+  //! BVH is built. The BVH is then not optimized, since that
+  //! would refit the pieces to the whole triangle boxes.
+  bool split_clipping = false;
+  //! Whether or not triangles with the same
+  //! Morton code are put into shared leaves.
+  bool cluster_leaves = false;
+  //! If not zero, the Morton codes are refined within
+  //! runs of primitives that share this many code bits.
+  size_type refine_bits = 0;
+  //! If not zero, the BVH is built in slices of
+  //! work that take about this many microseconds.
+  size_type frame_budget = 0;
 };
 
 //! A function object that tests the BVH build
@@ -359,12 +836,18 @@ class test final {
   using primitive_type = triangle<scalar_type>;
   //! A type definition for the class that converts primitives to bounding boxes.
   using converter_type = triangle_aabb_converter<scalar_type>;
+  //! A type definition for the class that clips primitives to boxes.
+  using clipper_type = triangle_clipper<scalar_type>;
+  //! A type definition for a primitive index.
+  using index_type = typename lbvh::node<scalar_type>::index_type;
   //! A type definition for the type used to detect primitive intersections.
   using intersector_type = triangle_intersector<scalar_type>;
   //! A type definition for a BVH traverser.
   using traverser_type = lbvh::traverser<scalar_type, primitive_type>;
   //! A type definition for aray.
   using ray_type = lbvh::ray<scalar_type>;
+  //! A type definition for a ray intersection.
+  using intersection_type = lbvh::intersection<scalar_type>;
 public:
   //! Runs the test.
   //!
@@ -389,17 +872,57 @@ public:
 
     converter_type converter;
 
-    builder_type builder;
+    lbvh::load_stats stats;
+
+    lbvh::default_scheduler scheduler;
+
+    scheduler.set_load_stats(&stats);
+
+    builder_type builder(scheduler);
+
+    test_results results;
+
+    lbvh::build_profiler profiler(results.build_report, &stats);
+
+    auto build_start = clock_type::now();
+
+    std::vector<index_type> references;
 
-    auto build_start = std::chrono::high_resolution_clock::now();
+    lbvh::leaf_table<scalar_type> leaves;
 
-    auto bvh = builder(s.data(), s.size(), converter);
+    auto build = [&]() {
+      if (opts.cluster_leaves) {
+        return builder.build_clustered(s.data(), s.size(), converter, leaves, 4, profiler);
+      } else if (opts.split_clipping) {
+        return builder.build_split(s.data(), s.size(), converter, clipper_type(), references);
+      } else if (opts.sah_build) {
+        return builder.build_sah(s.data(), s.size(), converter, profiler);
+      } else if (opts.refine_bits) {
+        return builder.build_refined(s.data(), s.size(), converter, opts.refine_bits, profiler);
+      } else if (opts.frame_budget) {
+        return build_sliced(s.data(), s.size(), std::chrono::microseconds(opts.frame_budget));
+      } else if (opts.sah_bits) {
+        return builder.build_hlbvh(s.data(), s.size(), converter, opts.sah_bits, profiler);
+      } else {
+        return builder(s.data(), s.size(), converter, profiler);
+      }
+    };
+
+    auto bvh = build();
+
+    if (opts.optimize_passes && !opts.split_clipping && !opts.cluster_leaves) {
+      lbvh::optimize_budget budget;
+      budget.passes = opts.optimize_passes;
+      builder.optimize(bvh, s.data(), converter, budget);
+    }
 
-    auto build_stop = std::chrono::high_resolution_clock::now();
+    auto build_stop = clock_type::now();
 
     auto build_usecs = std::chrono::duration_cast<std::chrono::microseconds>(build_stop - build_start).count();
 
-    auto build_secs = build_usecs / 1'000'000.0;
+    results.build_time = build_usecs / 1'000'000.0;
+
+    results.primitive_count = s.size();
 
     std::printf("  Validating BVH\n");
 
@@ -407,85 +930,1683 @@ public:
       return test_results{};
     }
 
-    if (opts.skip_rendering) {
-      return test_results {
-        build_secs
-      };
-    }
+    std::printf("  Rebuilding BVH\n");
 
-    std::printf("  Rendering test image.\n");
+    lbvh::rebuild_cache<scalar_type> cache;
 
-    auto render_result = render(bvh, s);
+    builder.rebuild(s.data(), s.size(), converter, cache);
 
-    save_image(render_result.first, type_traits<scalar_type>::image_name());
+    auto rebuild_start = clock_type::now();
 
-    return test_results {
-      build_secs,
-      render_result.second,
-      std::move(render_result.first)
-    };
-  }
-protected:
-  //! Saves the rendered image to a file.
-  //!
-  //! \param image The image data to save.
-  //!
-  //! \param filename The path to save the data to.
-  //!
-  //! \return True on success, false on failure.
-  static bool save_image(const std::vector<unsigned char>& image, const char* filename) {
+    auto rebuilt_bvh = builder.rebuild(s.data(), s.size(), converter, cache);
 
-    // This means RGB format.
-    int comp = 3;
+    auto rebuild_stop = clock_type::now();
 
-    int w = int(image_width());
-    int h = int(image_height());
+    auto rebuild_usecs = std::chrono::duration_cast<std::chrono::microseconds>(rebuild_stop - rebuild_start).count();
 
-    int stride = w * 3;
+    results.rebuild_time = rebuild_usecs / 1'000'000.0;
 
-    int ret = stbi_write_png(filename, w, h, comp, image.data(), stride);
+    std::printf("  Validating rebuilt BVH\n");
 
-    return ret == 0;
-  }
-  //! Renders the model with the built BVH.
-  //!
-  //! \return An image buffer for the rendered image.
-  static auto render(const bvh_type& bvh, const scene_type& s) {
+    if (!check_bvh(rebuilt_bvh, false)) {
+      return test_results{};
+    }
 
-    intersector_type intersector;
+    std::printf("  Rebuilding BVH of moved triangles\n");
 
-    traverser_type traverser(bvh, s.data());
+    if (!check_cached_rebuild(builder, s.data(), s.size())) {
+      return test_results{};
+    }
 
-    auto tracer_kern = [&traverser, &intersector](const ray_type& r) {
+    std::printf("  Refitting BVH\n");
 
-      auto isect = traverser(r, intersector);
+    auto rebuilt_sah = lbvh::sah_cost(rebuilt_bvh, s.data(), converter, scheduler);
 
-      return color<scalar_type> {
-        isect.uv.x,
-        isect.uv.y,
-        0.5
-      };
-    };
+    builder.refit(rebuilt_bvh, s.data(), converter);
 
-    std::vector<unsigned char> image(image_width() * image_height() * 3);
+    if (!check_bvh(rebuilt_bvh, false)) {
+      return test_results{};
+    }
 
-    ray_scheduler<scalar_type> r_scheduler(image_width(), image_height(), image.data());
+    // None of the triangles moved, so the refit
+    // boxes should be the boxes that were built.
 
-    r_scheduler.move_cam({ -1000, 1000, 0 });
+    auto refit_sah = lbvh::sah_cost(rebuilt_bvh, s.data(), converter, scheduler);
 
-    lbvh::default_scheduler thread_scheduler;
+    std::printf("    SAH cost %.3f, refit %.3f\n", rebuilt_sah, refit_sah);
 
-    auto trace_start = std::chrono::high_resolution_clock::now();
+    if (refit_sah != rebuilt_sah) {
+      std::printf("%s:%d: Refitting unmoved triangles changed the SAH cost.\n", __FILE__, __LINE__);
+      return test_results{};
+    }
 
-    thread_scheduler(r_scheduler, tracer_kern);
+    std::printf("  Updating BVH of moving triangles\n");
 
-    auto trace_stop = std::chrono::high_resolution_clock::now();
+    if (!check_dynamic_updates(s.data(), s.size())) {
+      return test_results{};
+    }
 
-    auto trace_usecs = std::chrono::duration_cast<std::chrono::microseconds>(trace_stop - trace_start).count();
+    std::printf("  Rebuilding BVH subtrees\n");
 
-    auto trace_time = trace_usecs / 1'000'000.0;
+    if (!check_subtree_rebuild(builder, rebuilt_bvh, s.data(), s.size())) {
+      return test_results{};
+    }
 
-    return std::pair<decltype(image), double>(std::move(image), trace_time);
+    std::printf("  Merging BVH halves\n");
+
+    lbvh::morton_curve<scalar_type> first_half;
+    lbvh::morton_curve<scalar_type> second_half;
+
+    auto half_count = s.size() / 2;
+
+    builder.build_mergeable(s.data(), half_count, converter, bvh[0].box, first_half);
+
+    builder.build_mergeable(s.data() + half_count, s.size() - half_count, converter, bvh[0].box, second_half);
+
+    auto merged_bvh = builder.merge(s.data(), converter, first_half, second_half, first_half);
+
+    if (!check_bvh(merged_bvh, false)) {
+      return test_results{};
+    }
+
+    std::printf("  Erasing BVH half\n");
+
+    // Without the first half, the merged curve is the curve of
+    // the second half, and the leaves are moved down to match.
+
+    lbvh::morton_curve<scalar_type> remaining_half;
+
+    auto remaining_bvh = builder.erase(s.data() + half_count, converter, first_half, 0, half_count, remaining_half);
+
+    auto second_bvh = builder.build_mergeable(s.data() + half_count, s.size() - half_count, converter, bvh[0].box, second_half);
+
+    if (!check_bvh(remaining_bvh, false) || !same_nodes(remaining_bvh, second_bvh)) {
+      std::printf("%s:%d: Erasing the first half didn't leave the BVH of the second half.\n", __FILE__, __LINE__);
+      return test_results{};
+    }
+
+    // Erasing all but one triangle leaves a BVH without nodes.
+
+    auto last_bvh = builder.erase(s.data() + s.size() - 1, converter, remaining_half, 0, remaining_half.entries.size() - 1, remaining_half);
+
+    ray_type last_ray { { 0, 0, 0 }, { 1, 1, 1 } };
+
+    if (last_bvh.size() || traverser_type(last_bvh, s.data() + s.size() - 1)(last_ray, intersector_type())) {
+      std::printf("%s:%d: BVH of one triangle has %lu nodes.\n", __FILE__, __LINE__, last_bvh.size());
+      return test_results{};
+    }
+
+    std::printf("  Optimizing BVH\n");
+
+    if (!check_optimize(builder, merged_bvh, s.data())) {
+      return test_results{};
+    }
+
+    std::printf("  Building BVH with split clipping\n");
+
+    if (!check_split_build(builder, s.data(), s.size())) {
+      return test_results{};
+    }
+
+    std::printf("  Building BVH with clustered leaves\n");
+
+    lbvh::leaf_table<scalar_type> cluster_leaves;
+
+    auto cluster_bvh = builder.build_clustered(s.data(), s.size(), converter, cluster_leaves);
+
+    if (!check_bvh(cluster_bvh, false) || !check_leaf_table(cluster_bvh, cluster_leaves, s.size())) {
+      return test_results{};
+    }
+
+    if (!check_coincident_leaves(builder, s.data())) {
+      return test_results{};
+    }
+
+    std::printf("  Building BVH with refined Morton codes\n");
+
+    auto refined_bvh = builder.build_refined(s.data(), s.size(), converter);
+
+    if (!check_bvh(refined_bvh, false)) {
+      return test_results{};
+    }
+
+    auto regular_bvh = builder(s.data(), s.size(), converter);
+
+    auto unrefined_sah = lbvh::sah_cost(regular_bvh, s.data(), converter, scheduler);
+
+    std::printf("    SAH cost %.3f, unrefined %.3f\n", lbvh::sah_cost(refined_bvh, s.data(), converter, scheduler), unrefined_sah);
+
+    std::printf("  Building hybrid BVH\n");
+
+    phase_counter hybrid_phases;
+
+    auto hybrid_bvh = builder.build_hlbvh(s.data(), s.size(), converter, 15, hybrid_phases);
+
+    if (!check_bvh(hybrid_bvh, false)) {
+      return test_results{};
+    }
+
+    for (size_type i = 0; i < lbvh::build_phase_count(); i++) {
+      if (hybrid_phases[lbvh::build_phase(i)] > 1) {
+        std::printf("%s:%d: Hybrid build started phase '%s' %lu times.\n", __FILE__, __LINE__,
+                    lbvh::to_string(lbvh::build_phase(i)), hybrid_phases[lbvh::build_phase(i)]);
+        return test_results{};
+      }
+    }
+
+    auto hybrid_sah = lbvh::sah_cost(hybrid_bvh, s.data(), converter, scheduler);
+
+    std::printf("    SAH cost %.3f, LBVH %.3f\n", hybrid_sah, unrefined_sah);
+
+    if (hybrid_sah > unrefined_sah) {
+      std::printf("%s:%d: SAH splits at the top of the hybrid BVH made it worse.\n", __FILE__, __LINE__);
+      return test_results{};
+    }
+
+    std::printf("  Building BVH with binned SAH splits\n");
+
+    auto sah_bvh = builder.build_sah(s.data(), s.size(), converter);
+
+    if (!check_bvh(sah_bvh, false)) {
+      return test_results{};
+    }
+
+    auto binned_sah = lbvh::sah_cost(sah_bvh, s.data(), converter, scheduler);
+
+    std::printf("    SAH cost %.3f, hybrid %.3f\n", binned_sah, hybrid_sah);
+
+    if (binned_sah > hybrid_sah) {
+      std::printf("%s:%d: SAH splits over every triangle did worse than over clusters.\n", __FILE__, __LINE__);
+      return test_results{};
+    }
+
+    std::printf("  Building BVH at compile time\n");
+
+    if (!check_static_build()) {
+      return test_results{};
+    }
+
+    std::printf("  Building BVH with integer coordinates\n");
+
+    // The model is moved onto a fixed point grid, with a thousand steps
+    // per unit in single precision and a million in double precision.
+
+    using fixed_type = typename lbvh::associated_types<sizeof(scalar_type)>::int_type;
+
+    auto fixed_scale = scalar_type((sizeof(scalar_type) == 4) ? 1000 : 1000000);
+
+    auto fixed_converter = [&converter, fixed_scale](const primitive_type& t) {
+      using std::floor;
+      using std::ceil;
+      auto box = converter(t);
+      return lbvh::aabb<fixed_type> {
+        { fixed_type(floor(box.min.x * fixed_scale)), fixed_type(floor(box.min.y * fixed_scale)), fixed_type(floor(box.min.z * fixed_scale)) },
+        { fixed_type(ceil(box.max.x * fixed_scale)), fixed_type(ceil(box.max.y * fixed_scale)), fixed_type(ceil(box.max.z * fixed_scale)) }
+      };
+    };
+
+    auto fixed_bvh = lbvh::builder<fixed_type>(scheduler)(s.data(), s.size(), fixed_converter);
+
+    if (!check_bvh(fixed_bvh, false)) {
+      return test_results{};
+    }
+
+    std::printf("    SAH cost %.3f\n", lbvh::sah_cost(fixed_bvh, s.data(), fixed_converter, scheduler));
+
+    std::printf("  Tracing a mixed scene\n");
+
+    if (!check_mixed_scene(builder, s.data(), s.size())) {
+      return test_results{};
+    }
+
+    std::printf("  Tracing a lazily built BVH\n");
+
+    if (!check_lazy_build(builder, s.data(), s.size())) {
+      return test_results{};
+    }
+
+    std::printf("  Building BVH in time slices\n");
+
+    auto sliced_bvh = build_sliced(s.data(), s.size(), std::chrono::microseconds(1000));
+
+    if (!check_bvh(sliced_bvh, false) || !same_nodes(sliced_bvh, regular_bvh)) {
+      std::printf("%s:%d: BVH built in time slices differs from the regular build.\n", __FILE__, __LINE__);
+      return test_results{};
+    }
+
+#ifndef LBVH_NO_THREADS
+
+    std::printf("  Publishing BVHs while reading\n");
+
+    if (!check_concurrent_publish(s.data(), s.size())) {
+      return test_results{};
+    }
+
+#endif // LBVH_NO_THREADS
+
+    std::printf("  Cancelling builds\n");
+
+    if (!check_cancellation(builder, s.data(), s.size())) {
+      return test_results{};
+    }
+
+    std::printf("  Building 2D BVH of the floor plan\n");
+
+    triangle_footprint_converter<scalar_type> footprint_converter;
+
+    auto plan_bvh = lbvh::builder2<scalar_type>(scheduler)(s.data(), s.size(), footprint_converter);
+
+    if (!check_plan_queries(plan_bvh, s.data(), s.size())) {
+      return test_results{};
+    }
+
+    std::printf("    %lu nodes of %lu bytes\n", plan_bvh.size(), sizeof(plan_bvh[0]));
+
+    std::printf("  Comparing Morton quantizations\n");
+
+    if (!check_quantizations(s.data(), s.size())) {
+      return test_results{};
+    }
+
+    std::printf("  Building BVH for a primitive range\n");
+
+    auto range_bvh = builder(s.data(), s.data() + (s.size() / 2), converter);
+
+    if (!check_bvh(range_bvh, false)) {
+      return test_results{};
+    }
+
+    std::printf("  Building BVH for a primitive subset\n");
+
+    if (!check_index_subset(builder, s.data(), s.size())) {
+      return test_results{};
+    }
+
+    std::printf("  Building BVH batch\n");
+
+    std::vector<lbvh::build_range<primitive_type>> ranges;
+
+    for (size_type i = 0; i < s.size(); i += batch_range_size()) {
+      ranges.push_back({ s.data() + i, std::min(batch_range_size(), s.size() - i) });
+    }
+
+    auto batch_bvhs = builder.build_batch(ranges.data(), ranges.size(), converter);
+
+    if (batch_bvhs.size() != ranges.size()) {
+      std::printf("%s:%d: Batch build made %lu BVHs for %lu ranges.\n", __FILE__, __LINE__, batch_bvhs.size(), ranges.size());
+      return test_results{};
+    }
+
+    for (size_type i = 0; i < ranges.size(); i++) {
+      if (!same_nodes(batch_bvhs[i], builder(ranges[i].primitives, ranges[i].count, converter))) {
+        std::printf("%s:%d: Batch BVH %lu differs from a build of its range.\n", __FILE__, __LINE__, i);
+        return test_results{};
+      }
+    }
+
+    if (opts.split_clipping) {
+
+      // The leaf areas are of whole triangles instead of
+      // their pieces, but the node areas are still exact.
+
+      auto reference_converter = [&s, &converter](index_type ref) {
+        return converter(s.data()[ref]);
+      };
+
+      results.sah_cost = lbvh::sah_cost(bvh, references.data(), reference_converter, scheduler);
+
+    } else if (opts.cluster_leaves) {
+
+      results.sah_cost = leaf_table_sah(bvh, leaves, s.data());
+
+    } else {
+      results.sah_cost = lbvh::sah_cost(bvh, s.data(), converter, scheduler);
+    }
+
+    if (opts.skip_rendering) {
+      return results;
+    }
+
+    std::printf("  Rendering test image.\n");
+
+    if (opts.cluster_leaves) {
+      render(traverser_type(bvh, s.data(), leaves), opts, results);
+    } else {
+      render(traverser_type(bvh, s.data(), references.empty() ? nullptr : references.data()), opts, results);
+    }
+
+    save_image(results.image_buf, type_traits<scalar_type>::image_name());
+
+    return results;
+  }
+protected:
+  //! Saves the rendered image to a file.
+  //!
+  //! \param image The image data to save.
+  //!
+  //! \param filename The path to save the data to.
+  //!
+  //! \return True on success, false on failure.
+  static bool save_image(const std::vector<unsigned char>& image, const char* filename) {
+
+    // This means RGB format.
+    int comp = 3;
+
+    int w = int(image_width());
+    int h = int(image_height());
+
+    int stride = w * 3;
+
+    int ret = stbi_write_png(filename, w, h, comp, image.data(), stride);
+
+    return ret == 0;
+  }
+  //! Renders the model with the built BVH.
+  //!
+  //! \param traverser The traverser of the built BVH.
+  //!
+  //! \param results Receives the rendered image and the render measurements.
+  static void render(const traverser_type& traverser, const test_options& opts, test_results& results) {
+
+    intersector_type intersector;
+
+    auto tracer_kern = [&traverser, &intersector](const ray_type& r) {
+
+      auto isect = traverser(r, intersector);
+
+      return color<scalar_type> {
+        isect.uv.x,
+        isect.uv.y,
+        0.5
+      };
+    };
+
+    results.image_buf.resize(image_width() * image_height() * 3);
+
+    lbvh::default_scheduler thread_scheduler;
+
+    tile_dispatcher dispatcher(image_width(), image_height(), thread_scheduler.max_threads());
+
+    ray_scheduler<scalar_type> r_scheduler(image_width(), image_height(), results.image_buf.data(), dispatcher, opts.row_interleave);
+
+    r_scheduler.move_cam({ -1000, 1000, 0 });
+
+#ifdef LBVH_ENABLE_PERF_COUNTERS
+    lbvh::perf_counters counters;
+
+    counters.start();
+#endif
+
+    auto trace_start = clock_type::now();
+
+    thread_scheduler(r_scheduler, tracer_kern);
+
+    auto trace_stop = clock_type::now();
+
+#ifdef LBVH_ENABLE_PERF_COUNTERS
+    results.render_counts = counters.stop();
+#endif
+
+    auto trace_usecs = std::chrono::duration_cast<std::chrono::microseconds>(trace_stop - trace_start).count();
+
+    results.render_time = trace_usecs / 1'000'000.0;
+
+    results.render_tail_time = dispatcher.tail_time();
+  }
+  //! Validates the leaf table of a BVH with multi-primitive leaves,
+  //! ensuring that there is one entry per leaf and that every
+  //! triangle is in exactly one leaf.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_leaf_table(const bvh_type& bvh, const lbvh::leaf_table<scalar_type>& leaves, size_type count) {
+
+    if (leaves.offsets.size() != (bvh.size() + 2)) {
+      std::printf("%s:%d: Leaf table has %lu offsets for %lu leaves.\n", __FILE__, __LINE__, leaves.offsets.size(), bvh.size() + 1);
+      return false;
+    }
+
+    std::vector<size_type> counts(count);
+
+    for (auto i : leaves.primitives) {
+      counts.at(i)++;
+    }
+
+    for (size_type i = 0; i < count; i++) {
+      if (counts[i] != 1) {
+        std::printf("%s:%d: Triangle %lu is in %lu leaves.\n", __FILE__, __LINE__, i, counts[i]);
+        return false;
+      }
+    }
+
+    return true;
+  }
+  //! Builds a BVH with split clipping and checks its references, then
+  //! traces it against a BVH of the whole triangles. Triangles that are
+  //! split are referenced by several leaves, so the rays also go through
+  //! the mailbox that skips the triangles they've already been tested against.
+  //!
+  //! \param builder The builder to build the BVHs with.
+  //!
+  //! \param triangles The triangles of the model.
+  //!
+  //! \param count The number of triangles.
+  //!
+  //! \return True if every triangle is referenced, no node is bigger than
+  //! the triangles below it, and every ray hits at the unsplit distance.
+  static bool check_split_build(builder_type& builder, const primitive_type* triangles, size_type count) {
+
+    using namespace lbvh::math;
+
+    converter_type converter;
+
+    std::vector<index_type> references;
+
+    auto split_bvh = builder.build_split(triangles, count, converter, clipper_type(), references);
+
+    if (!check_bvh(split_bvh, false)) {
+      return false;
+    }
+
+    std::vector<size_type> ref_counts(count);
+
+    for (auto ref : references) {
+      ref_counts.at(ref)++;
+    }
+
+    auto unreferenced = std::find(ref_counts.begin(), ref_counts.end(), 0);
+
+    if ((references.size() < count) || (unreferenced != ref_counts.end())) {
+      std::printf("%s:%d: %lu references left triangle %ld out.\n", __FILE__, __LINE__, references.size(), long(unreferenced - ref_counts.begin()));
+      return false;
+    }
+
+    std::printf("    %lu references for %lu triangles\n", references.size(), count);
+
+    // The boxes of the references aren't kept, but a reference that
+    // went past its triangle would make a node box go past the boxes
+    // of the triangles below it.
+
+    auto bounds = split_bounds(split_bvh, references.data(), triangles, 0);
+
+    if (bounds.min.x > bounds.max.x) {
+      return false;
+    }
+
+    auto whole_bvh = builder(triangles, count, converter);
+
+    traverser_type split_traverser(split_bvh, triangles, references.data());
+
+    traverser_type whole_traverser(whole_bvh, triangles);
+
+    auto trace_split = [&split_traverser](const ray_type& ray) {
+      return split_traverser(ray, intersector_type());
+    };
+
+    auto trace_whole = [&whole_traverser](const ray_type& ray) {
+      return whole_traverser(ray, intersector_type());
+    };
+
+    return compare_traces((bounds.min + bounds.max) * scalar_type(0.5), 256, trace_split, trace_whole);
+  }
+  //! Gets the union of the triangle boxes below a node of a split BVH,
+  //! printing an error if a node box goes past the triangle boxes.
+  //!
+  //! \param references The triangle index of each leaf.
+  //!
+  //! \param node_index The index of the node to start at.
+  //!
+  //! \return The union of the triangle boxes. If there was an error,
+  //! the minimum of the box is greater than its maximum.
+  static box_type split_bounds(const bvh_type& bvh, const index_type* references, const primitive_type* triangles, index_type node_index) {
+
+    using namespace lbvh::math;
+
+    converter_type converter;
+
+    const auto& node = bvh[node_index];
+
+    auto left = node.left_is_leaf()
+              ? converter(triangles[references[node.left_leaf_index()]])
+              : split_bounds(bvh, references, triangles, node.left);
+
+    auto right = node.right_is_leaf()
+               ? converter(triangles[references[node.right_leaf_index()]])
+               : split_bounds(bvh, references, triangles, node.right);
+
+    box_type bounds { min(left.min, right.min), max(left.max, right.max) };
+
+    auto error = box_type { { 1, 1, 1 }, { 0, 0, 0 } };
+
+    if ((left.min.x > left.max.x) || (right.min.x > right.max.x)) {
+      return error;
+    }
+
+    if ((node.box.min.x < bounds.min.x) || (node.box.min.y < bounds.min.y) || (node.box.min.z < bounds.min.z)
+     || (node.box.max.x > bounds.max.x) || (node.box.max.y > bounds.max.y) || (node.box.max.z > bounds.max.z)) {
+      std::printf("%s:%d: Split BVH node %lu goes past the boxes of its triangles.\n", __FILE__, __LINE__, size_type(node_index));
+      return error;
+    }
+
+    return bounds;
+  }
+  //! Makes a ray in one of a number of directions
+  //! spread evenly over the unit sphere.
+  //!
+  //! \param center The point that the ray starts from.
+  //!
+  //! \param i The index of the ray.
+  //!
+  //! \param ray_count The number of directions.
+  //!
+  //! \return The ray in the Fibonacci sphere direction of @p i.
+  static ray_type fibonacci_ray(const lbvh::vec3<scalar_type>& center, size_type i, size_type ray_count) noexcept {
+
+    auto z = scalar_type(1) - (scalar_type(2 * i + 1) / ray_count);
+    auto r = std::sqrt(scalar_type(1) - (z * z));
+    auto phi = scalar_type(2.399963229728653) * scalar_type(i);
+
+    return ray_type { center, { r * std::cos(phi), r * std::sin(phi), z } };
+  }
+  //! Compares the distance of a hit to the distance of an expected hit.
+  //!
+  //! \param i The index of the ray, used for the error message.
+  //!
+  //! \return True if the distances are the same.
+  static bool same_distance(const intersection_type& isect, const intersection_type& expected, size_type i) {
+
+    // The intersectors may be compiled with different contractions
+    // of their floating point math, so the distances can differ in
+    // their last bits.
+
+    auto tolerance = expected.distance * scalar_type(1.0e-5);
+
+    if ((isect.distance != expected.distance) && !(std::fabs(isect.distance - expected.distance) <= tolerance)) {
+      std::printf("%s:%d: Ray %lu hit at %f instead of %f.\n", __FILE__, __LINE__, i, double(isect.distance), double(expected.distance));
+      return false;
+    }
+
+    return true;
+  }
+  //! Traces rays from a point in directions spread evenly over the
+  //! unit sphere, and compares the distance of each hit to the
+  //! distance of an expected hit.
+  //!
+  //! \param center The point that the rays start from.
+  //!
+  //! \param ray_count The number of rays to trace.
+  //!
+  //! \param trace Traces a ray, returning the hit to check.
+  //!
+  //! \param expect Traces a ray, returning the expected hit.
+  //!
+  //! \return True if every ray hit at the expected distance.
+  template <typename tracer, typename expected_tracer>
+  static bool compare_traces(const lbvh::vec3<scalar_type>& center, size_type ray_count, const tracer& trace, const expected_tracer& expect) {
+
+    for (size_type i = 0; i < ray_count; i++) {
+
+      auto ray = fibonacci_ray(center, i, ray_count);
+
+      if (!same_distance(trace(ray), expect(ray), i)) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+  //! Gets the SAH cost of a BVH with multi-primitive leaves.
+  //! Each leaf is counted once, with the box around all of its
+  //! triangles, even though it costs one test per triangle.
+  //!
+  //! \param bvh The BVH to get the cost of.
+  //!
+  //! \param leaves The triangles of each leaf.
+  //!
+  //! \param triangles The triangles that the BVH was built for.
+  //!
+  //! \return The SAH cost of the BVH.
+  static double leaf_table_sah(const bvh_type& bvh, const lbvh::leaf_table<scalar_type>& leaves, const primitive_type* triangles) {
+
+    converter_type converter;
+
+    std::vector<index_type> leaf_indices(leaves.offsets.size() - 1);
+
+    std::iota(leaf_indices.begin(), leaf_indices.end(), 0);
+
+    auto leaf_converter = [triangles, &converter, &leaves](index_type leaf) {
+
+      auto box = converter(triangles[leaves.primitives[leaves.offsets[leaf]]]);
+
+      for (auto i = leaves.offsets[leaf] + 1; i < leaves.offsets[leaf + 1]; i++) {
+        auto tri_box = converter(triangles[leaves.primitives[i]]);
+        box.min = lbvh::math::min(box.min, tri_box.min);
+        box.max = lbvh::math::max(box.max, tri_box.max);
+      }
+
+      return box;
+    };
+
+    return lbvh::sah_cost(bvh, leaf_indices.data(), leaf_converter, lbvh::default_scheduler());
+  }
+  //! Compares the Morton code quantizations, with the model in meters
+  //! and again in kilometers. Each build puts all triangles that share
+  //! a code into one leaf, which gives both the number of collisions
+  //! and a BVH over the distinct codes, in one build per quantization
+  //! and scale.
+  //!
+  //! \param triangles The triangles of the model.
+  //!
+  //! \param count The number of triangles.
+  //!
+  //! \return True if neither quantization depends on the scale of the model.
+  static bool check_quantizations(const primitive_type* triangles, size_type count) {
+
+    using namespace lbvh::math;
+
+    converter_type converter;
+
+    std::vector<primitive_type> small_scene(triangles, triangles + count);
+
+    for (auto& tri : small_scene) {
+      for (auto& pos : tri.pos) {
+        pos = pos * scalar_type(0.001);
+      }
+    }
+
+    for (auto q : { lbvh::morton_quantization::cube, lbvh::morton_quantization::per_axis }) {
+
+      builder_type q_builder;
+
+      q_builder.set_quantization(q);
+
+      size_type collisions[2] {};
+
+      double costs[2] {};
+
+      const primitive_type* scenes[2] { triangles, small_scene.data() };
+
+      for (size_type i = 0; i < 2; i++) {
+
+        lbvh::leaf_table<scalar_type> code_runs;
+
+        auto runs_bvh = q_builder.build_clustered(scenes[i], count, converter, code_runs, count);
+
+        collisions[i] = count - (code_runs.offsets.size() - 1);
+
+        costs[i] = leaf_table_sah(runs_bvh, code_runs, scenes[i]);
+
+        std::printf("    %-8s (%s): %8lu collisions, SAH cost %.3f\n", lbvh::to_string(q), i ? "km" : "m", collisions[i], costs[i]);
+      }
+
+      // Scaling the model changes the rounding of some centroids,
+      // which can move a few of them into a neighboring cell.
+
+      auto collision_change = (collisions[0] > collisions[1]) ? (collisions[0] - collisions[1]) : (collisions[1] - collisions[0]);
+
+      if ((collision_change > (count / 1000)) || (std::fabs(costs[0] - costs[1]) > (costs[0] * 0.001))) {
+        std::printf("%s:%d: Quantization '%s' depends on the scale of the model.\n", __FILE__, __LINE__, lbvh::to_string(q));
+        return false;
+      }
+    }
+
+    return true;
+  }
+  //! Optimizes a copy of a BVH with a few passes of reinsertions,
+  //! and traces the optimized copy against the original.
+  //!
+  //! \param builder The builder to optimize the BVH with.
+  //!
+  //! \param original The BVH to optimize a copy of.
+  //!
+  //! \param triangles The triangles that the BVH was built for.
+  //!
+  //! \return True if subtrees were moved, the SAH cost didn't go up,
+  //! and the node boxes still enclose the triangles below them.
+  static bool check_optimize(builder_type& builder, const bvh_type& original, const primitive_type* triangles) {
+
+    using namespace lbvh::math;
+
+    converter_type converter;
+
+    auto optimized_bvh = original;
+
+    lbvh::optimize_budget budget;
+
+    budget.passes = 4;
+
+    auto report = builder.optimize(optimized_bvh, triangles, converter, budget);
+
+    if (!check_bvh(optimized_bvh, false)) {
+      return false;
+    }
+
+    lbvh::default_scheduler scheduler;
+
+    auto original_sah = lbvh::sah_cost(original, triangles, converter, scheduler);
+
+    auto optimized_sah = lbvh::sah_cost(optimized_bvh, triangles, converter, scheduler);
+
+    std::printf("    %lu reinsertions in %lu passes, SAH cost %.3f from %.3f\n", report.reinsertions, report.passes, optimized_sah, original_sah);
+
+    if (!report.reinsertions || (optimized_sah > original_sah)) {
+      std::printf("%s:%d: Optimizing didn't lower the SAH cost.\n", __FILE__, __LINE__);
+      return false;
+    }
+
+    // A node box that was left behind by a moved subtree
+    // would make some of the rays miss its triangles.
+
+    traverser_type optimized_traverser(optimized_bvh, triangles);
+
+    traverser_type original_traverser(original, triangles);
+
+    auto trace_optimized = [&optimized_traverser](const ray_type& ray) {
+      return optimized_traverser(ray, intersector_type());
+    };
+
+    auto trace_original = [&original_traverser](const ray_type& ray) {
+      return original_traverser(ray, intersector_type());
+    };
+
+    const auto& bounds = original[0].box;
+
+    return compare_traces((bounds.min + bounds.max) * scalar_type(0.5), 1024, trace_optimized, trace_original);
+  }
+  //! Builds a BVH for every third triangle, by index into the whole model.
+  //!
+  //! \param builder The builder to build the BVH with.
+  //!
+  //! \param triangles The triangles of the model.
+  //!
+  //! \param count The number of triangles.
+  //!
+  //! \return True if the leaves are exactly the indices that were
+  //! passed and the root box is the box of the indexed triangles.
+  static bool check_index_subset(builder_type& builder, const primitive_type* triangles, size_type count) {
+
+    converter_type converter;
+
+    std::vector<index_type> indices;
+
+    auto expected_box = converter(triangles[0]);
+
+    for (size_type i = 0; i < count; i += 3) {
+
+      indices.push_back(index_type(i));
+
+      auto box = converter(triangles[i]);
+
+      expected_box.min = lbvh::math::min(expected_box.min, box.min);
+      expected_box.max = lbvh::math::max(expected_box.max, box.max);
+    }
+
+    auto subset_bvh = builder(triangles, indices.data(), indices.size(), converter);
+
+    std::vector<index_type> leaves;
+
+    for (size_type i = 0; i < subset_bvh.size(); i++) {
+
+      if (subset_bvh[i].left_is_leaf()) {
+        leaves.push_back(subset_bvh[i].left_leaf_index());
+      }
+
+      if (subset_bvh[i].right_is_leaf()) {
+        leaves.push_back(subset_bvh[i].right_leaf_index());
+      }
+    }
+
+    std::sort(leaves.begin(), leaves.end());
+
+    if (leaves != indices) {
+      std::printf("%s:%d: Subset BVH has %lu leaves that aren't the %lu indices.\n", __FILE__, __LINE__, leaves.size(), indices.size());
+      return false;
+    }
+
+    if (!same_box(subset_bvh[0].box, expected_box)) {
+      std::printf("%s:%d: Subset BVH root box isn't the box of the indexed triangles.\n", __FILE__, __LINE__);
+      return false;
+    }
+
+    return true;
+  }
+  //! Moves the first hundredth of the triangles, which are mostly in
+  //! the same part of the model, and rebuilds the subtrees of a BVH
+  //! that contain them.
+  //!
+  //! \param builder The builder to rebuild the subtrees with.
+  //!
+  //! \param b The BVH to update. It is built for @p triangles.
+  //!
+  //! \param triangles The triangles of the model.
+  //!
+  //! \param count The number of triangles.
+  //!
+  //! \return True if subtrees were rebuilt, and the updated BVH has
+  //! the bounds and hits of a BVH built for the moved triangles.
+  static bool check_subtree_rebuild(builder_type& builder, bvh_type& b, const primitive_type* triangles, size_type count) {
+
+    using namespace lbvh::math;
+
+    using dirty_index_type = typename lbvh::subtree_cache<scalar_type>::index_type;
+
+    converter_type converter;
+
+    std::vector<primitive_type> moving(triangles, triangles + count);
+
+    std::vector<dirty_index_type> dirty(count / 100);
+
+    std::iota(dirty.begin(), dirty.end(), 0);
+
+    auto step = (b[0].box.max.x - b[0].box.min.x) * scalar_type(0.01);
+
+    for (auto i : dirty) {
+      for (auto& pos : moving[i].pos) {
+        pos.x += step;
+      }
+    }
+
+    lbvh::subtree_cache<scalar_type> subtrees;
+
+    builder.rebuild_subtrees(b, moving.data(), converter, dirty.data(), dirty.size(), subtrees);
+
+    if (!check_bvh(b, false)) {
+      return false;
+    }
+
+    std::printf("    %lu subtrees of %lu triangles rebuilt\n", subtrees.rebuilt_subtrees, subtrees.rebuilt_primitives);
+
+    auto fresh_bvh = builder(moving.data(), count, converter);
+
+    if (!subtrees.rebuilt_subtrees || !same_box(b[0].box, fresh_bvh[0].box)) {
+      std::printf("%s:%d: Rebuilt subtrees don't cover the moved triangles.\n", __FILE__, __LINE__);
+      return false;
+    }
+
+    traverser_type updated_traverser(b, moving.data());
+
+    traverser_type fresh_traverser(fresh_bvh, moving.data());
+
+    auto trace_updated = [&updated_traverser](const ray_type& ray) {
+      return updated_traverser(ray, intersector_type());
+    };
+
+    auto trace_fresh = [&fresh_traverser](const ray_type& ray) {
+      return fresh_traverser(ray, intersector_type());
+    };
+
+    const auto& bounds = fresh_bvh[0].box;
+
+    return compare_traces((bounds.min + bounds.max) * scalar_type(0.5), 1024, trace_updated, trace_fresh);
+  }
+  //! Moves some of the triangles and rebuilds their BVH with a cache,
+  //! once within the cached centroid bounds and once outside of them.
+  //! Each rebuild starts from the previous order, and is compared to a
+  //! BVH built from scratch with the same centroid bounds.
+  //!
+  //! \param builder The builder to build the BVHs with.
+  //!
+  //! \param triangles The triangles of the model.
+  //!
+  //! \param count The number of triangles.
+  //!
+  //! \return True if the rebuilt BVHs are the same as the fresh builds.
+  static bool check_cached_rebuild(builder_type& builder, const primitive_type* triangles, size_type count) {
+
+    converter_type converter;
+
+    std::vector<primitive_type> moving(triangles, triangles + count);
+
+    lbvh::rebuild_cache<scalar_type> cache;
+
+    builder.rebuild(moving.data(), count, converter, cache);
+
+    auto width = cache.centroid_bounds.max.x - cache.centroid_bounds.min.x;
+
+    // The first move stays within the margin of the cached bounds,
+    // and the second takes the triangles past the side of the bounds.
+
+    for (auto step : { width * scalar_type(0.001), width }) {
+
+      for (size_type i = 0; i < count; i += 64) {
+        for (auto& pos : moving[i].pos) {
+          pos.x += step;
+        }
+      }
+
+      phase_counter phases;
+
+      auto rebuilt_bvh = builder.rebuild(moving.data(), count, converter, cache, phases);
+
+      auto expect_reused_bounds = (step < width);
+
+      if (!cache.reused_order || (cache.reused_bounds != expect_reused_bounds)) {
+        std::printf("%s:%d: Rebuild reused order %d and bounds %d.\n", __FILE__, __LINE__, int(cache.reused_order), int(cache.reused_bounds));
+        return false;
+      }
+
+      for (size_type i = 0; i < lbvh::build_phase_count(); i++) {
+        if (phases[lbvh::build_phase(i)] != 1) {
+          std::printf("%s:%d: Rebuild started phase '%s' %lu times.\n", __FILE__, __LINE__,
+                      lbvh::to_string(lbvh::build_phase(i)), phases[lbvh::build_phase(i)]);
+          return false;
+        }
+      }
+
+      if (!check_bvh(rebuilt_bvh, false)) {
+        return false;
+      }
+
+      lbvh::morton_curve<scalar_type> curve;
+
+      auto fresh_bvh = builder.build_mergeable(moving.data(), count, converter, cache.centroid_bounds, curve);
+
+      if (!same_nodes(rebuilt_bvh, fresh_bvh)) {
+        std::printf("%s:%d: Rebuilt BVH differs from the BVH built from scratch.\n", __FILE__, __LINE__);
+        return false;
+      }
+    }
+
+    return true;
+  }
+  //! Moves some of the triangles a little further each frame and
+  //! updates a dynamic BVH for them, checking that it's refit until
+  //! the SAH ratio passes the limit and rebuilt once it does.
+  //!
+  //! \param triangles The triangles of the model.
+  //!
+  //! \param count The number of triangles.
+  //!
+  //! \return True if each update made the expected decision.
+  static bool check_dynamic_updates(const primitive_type* triangles, size_type count) {
+
+    using decision = lbvh::update_decision;
+
+    converter_type converter;
+
+    std::vector<primitive_type> moving(triangles, triangles + count);
+
+    lbvh::rebuild_policy policy;
+
+    // Trace times are only reported at the end, so that
+    // the decisions don't depend on how long a build takes.
+
+    policy.use_break_even = false;
+
+    lbvh::dynamic_bvh<scalar_type> dynamic(policy);
+
+    auto update = [&dynamic, &moving, &converter](decision expected, int line) {
+
+      auto actual = dynamic.update(moving.data(), moving.size(), converter);
+
+      if (actual != expected) {
+        std::printf("%s:%d: Update made decision %d instead of %d (SAH ratio %.3f).\n",
+                    __FILE__, line, int(actual), int(expected), dynamic.report().sah_ratio);
+        return false;
+      }
+
+      return true;
+    };
+
+    if (!update(decision::initial_build, __LINE__) || !update(decision::refit, __LINE__)) {
+      return false;
+    }
+
+    if (dynamic.report().sah_ratio != 1) {
+      std::printf("%s:%d: Refit of unmoved triangles has SAH ratio %f.\n", __FILE__, __LINE__, dynamic.report().sah_ratio);
+      return false;
+    }
+
+    // Every 64th triangle moves along the X axis by
+    // a fiftieth of the width of the scene each frame.
+
+    const auto& root_box = dynamic.get()[0].box;
+
+    auto step = (root_box.max.x - root_box.min.x) * scalar_type(0.02);
+
+    auto move = [&moving, step]() {
+      for (size_type i = 0; i < moving.size(); i += 64) {
+        for (auto& pos : moving[i].pos) {
+          pos.x += step;
+        }
+      }
+    };
+
+    double last_ratio = 1;
+
+    size_type frame = 0;
+
+    for (; frame < 50; frame++) {
+
+      move();
+
+      auto actual = dynamic.update(moving.data(), moving.size(), converter);
+
+      if (actual == decision::rebuild_sah_ratio) {
+        break;
+      }
+
+      if ((actual != decision::refit) || (dynamic.report().sah_ratio < last_ratio)) {
+        std::printf("%s:%d: Frame %lu made decision %d with SAH ratio %.3f after %.3f.\n",
+                    __FILE__, __LINE__, frame, int(actual), dynamic.report().sah_ratio, last_ratio);
+        return false;
+      }
+
+      last_ratio = dynamic.report().sah_ratio;
+    }
+
+    const auto& report = dynamic.report();
+
+    std::printf("    Rebuilt after %lu refits, SAH ratio %.3f\n", frame, report.sah_ratio);
+
+    if ((frame == 50) || (report.sah_ratio <= policy.max_sah_ratio) || (report.rebuild_count != 2) || report.refit_count) {
+      std::printf("%s:%d: BVH was not rebuilt for the SAH ratio (%lu rebuilds, %lu refits).\n",
+                  __FILE__, __LINE__, report.rebuild_count, report.refit_count);
+      return false;
+    }
+
+    if (!check_bvh(dynamic.get(), false) || !update(decision::refit, __LINE__)) {
+      return false;
+    }
+
+    // With the trace time lost to refitting reported, the
+    // BVH is rebuilt long before the SAH ratio gets too high.
+
+    dynamic.get_policy().use_break_even = true;
+
+    move();
+
+    if (!update(decision::refit, __LINE__)) {
+      return false;
+    }
+
+    dynamic.report_trace_time(1'000'000.0);
+
+    if (!update(decision::rebuild_break_even, __LINE__)) {
+      return false;
+    }
+
+    moving.pop_back();
+
+    return update(decision::initial_build, __LINE__) && check_bvh(dynamic.get(), false);
+  }
+#ifndef LBVH_NO_THREADS
+
+  //! Builds and optimizes a BVH in the background while a reader holds
+  //! the BVH published before it. The build publishes twice, once built
+  //! and once optimized, and neither replaced BVH may be deleted until
+  //! the reader is done with the first.
+  //!
+  //! \param triangles The triangles of the model.
+  //!
+  //! \param count The number of triangles.
+  //!
+  //! \return True if the BVH being read stayed intact until it
+  //! was released, and both replaced BVHs were reclaimed after.
+  static bool check_concurrent_publish(const primitive_type* triangles, size_type count) {
+
+    converter_type converter;
+
+    lbvh::concurrent_bvh<scalar_type> target(2);
+
+    lbvh::async_builder<scalar_type> async;
+
+    async(triangles, count / 2, converter, target).get();
+
+    {
+      auto guard = target.read(0);
+
+      if (!guard || !check_bvh(*guard, false)) {
+        std::printf("%s:%d: First BVH was not published.\n", __FILE__, __LINE__);
+        return false;
+      }
+
+      auto first_bvh = *guard;
+
+      lbvh::optimize_budget budget;
+
+      budget.passes = 1;
+
+      async(triangles, count, converter, target, budget).get();
+
+      auto retired_count = target.reclaim();
+
+      if (retired_count != 2) {
+        std::printf("%s:%d: %lu BVHs are waiting to be reclaimed instead of 2.\n", __FILE__, __LINE__, retired_count);
+        return false;
+      }
+
+      if (!same_nodes(*guard, first_bvh)) {
+        std::printf("%s:%d: BVH changed while it was being read.\n", __FILE__, __LINE__);
+        return false;
+      }
+
+      auto latest = target.read(1);
+
+      if ((latest->size() != (count - 1)) || !check_bvh(*latest, false)) {
+        std::printf("%s:%d: Latest BVH has %lu nodes instead of %lu.\n", __FILE__, __LINE__, latest->size(), count - 1);
+        return false;
+      }
+    }
+
+    auto retired_count = target.reclaim();
+
+    if (retired_count != 0) {
+      std::printf("%s:%d: %lu BVHs were not reclaimed after the reads ended.\n", __FILE__, __LINE__, retired_count);
+      return false;
+    }
+
+    return true;
+  }
+
+#endif // LBVH_NO_THREADS
+
+  //! Builds a BVH with clustered leaves for copies of one triangle,
+  //! which all share a Morton code and would fit into a single leaf.
+  //!
+  //! \param builder The builder to build the BVH with.
+  //!
+  //! \param tri The triangle to copy.
+  //!
+  //! \return True if the BVH has a root node and a ray finds the triangle.
+  static bool check_coincident_leaves(builder_type& builder, const primitive_type* tri) {
+
+    using namespace lbvh::math;
+
+    constexpr size_type copy_count = 4;
+
+    std::vector<primitive_type> copies(copy_count, *tri);
+
+    converter_type converter;
+
+    lbvh::leaf_table<scalar_type> leaves;
+
+    auto bvh = builder.build_clustered(copies.data(), copy_count, converter, leaves, copy_count);
+
+    if ((bvh.size() != 1) || !check_bvh(bvh, false) || !check_leaf_table(bvh, leaves, copy_count)) {
+      std::printf("%s:%d: Coincident triangles got %lu nodes.\n", __FILE__, __LINE__, bvh.size());
+      return false;
+    }
+
+    auto center = (tri->pos[0] + tri->pos[1] + tri->pos[2]) * scalar_type(1.0 / 3.0);
+
+    auto normal = cross(tri->pos[1] - tri->pos[0], tri->pos[2] - tri->pos[0]);
+
+    ray_type ray { center + normal, { -normal.x, -normal.y, -normal.z } };
+
+    auto isect = traverser_type(bvh, copies.data(), leaves)(ray, triangle_intersector<scalar_type>());
+
+    if (!isect) {
+      std::printf("%s:%d: Ray missed the coincident triangles.\n", __FILE__, __LINE__);
+      return false;
+    }
+
+    return true;
+  }
+  //! Makes a grid of unit boxes, with a gap between each box.
+  //! The grid is small enough to be built in a constant expression.
+  static constexpr std::array<box_type, 64> static_grid() noexcept {
+
+    std::array<box_type, 64> boxes {};
+
+    for (size_type i = 0; i < boxes.size(); i++) {
+
+      lbvh::vec3<scalar_type> pos {
+        scalar_type(((i / 1) % 4) * 2),
+        scalar_type(((i / 4) % 4) * 2),
+        scalar_type(((i / 16) % 4) * 2)
+      };
+
+      boxes[i] = box_type { pos, { pos.x + 1, pos.y + 1, pos.z + 1 } };
+    }
+
+    return boxes;
+  }
+  //! Compares the corners of two boxes.
+  //!
+  //! \return True if the boxes have the same corners.
+  static constexpr bool same_box(const box_type& a, const box_type& b) noexcept {
+    return (a.min.x == b.min.x) && (a.min.y == b.min.y) && (a.min.z == b.min.z)
+        && (a.max.x == b.max.x) && (a.max.y == b.max.y) && (a.max.z == b.max.z);
+  }
+  //! Compares two BVHs node by node.
+  //!
+  //! \return True if both BVHs have the same nodes, with the same boxes.
+  static bool same_nodes(const bvh_type& a, const bvh_type& b) noexcept {
+
+    if (a.size() != b.size()) {
+      return false;
+    }
+
+    for (size_type i = 0; i < a.size(); i++) {
+      if ((a[i].left != b[i].left) || (a[i].right != b[i].right) || !same_box(a[i].box, b[i].box)) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+  //! Checks a BVH built at compile time against one built at run
+  //! time for the same boxes. The builds use the same steps, so
+  //! the nodes are expected to be identical.
+  //!
+  //! \return True if the nodes are the same.
+  static bool check_static_build() {
+
+    auto box_converter = [](const box_type& box) {
+      return box;
+    };
+
+    static constexpr auto boxes = static_grid();
+
+    static constexpr auto static_nodes = lbvh::build_static<scalar_type>(boxes, box_converter);
+
+    auto runtime_bvh = builder_type()(boxes.data(), boxes.size(), box_converter);
+
+    if (runtime_bvh.size() != static_nodes.size()) {
+      std::printf("%s:%d: Static BVH has %lu nodes instead of %lu.\n", __FILE__, __LINE__, static_nodes.size(), runtime_bvh.size());
+      return false;
+    }
+
+    for (size_type i = 0; i < static_nodes.size(); i++) {
+
+      const auto& a = static_nodes[i];
+      const auto& b = runtime_bvh[i];
+
+      if ((a.left != b.left) || (a.right != b.right) || !same_box(a.box, b.box)) {
+        std::printf("%s:%d: Static BVH node %lu differs from the run time build.\n", __FILE__, __LINE__, i);
+        return false;
+      }
+    }
+
+    return true;
+  }
+  //! Checks one traversal of a BVH over triangles and spheres against
+  //! a traversal of the triangles and a test of every sphere. The spheres
+  //! are put at a sample of the triangles, and the rays start from the
+  //! center of the model in directions spread over the unit sphere.
+  //!
+  //! \param builder The builder to build the BVHs with.
+  //!
+  //! \param triangles The triangles of the model.
+  //!
+  //! \param count The number of triangles.
+  //!
+  //! \return True if every ray found the same closest distance.
+  static bool check_mixed_scene(builder_type& builder, const primitive_type* triangles, size_type count) {
+
+    using namespace lbvh::math;
+
+    using sphere_type = sphere<scalar_type>;
+
+    using set_type = lbvh::primitive_set<primitive_type, sphere_type>;
+
+    converter_type converter;
+
+    auto triangle_bvh = builder(triangles, count, converter);
+
+    const auto& bounds = triangle_bvh.at(0).box;
+
+    auto center = (bounds.min + bounds.max) * scalar_type(0.5);
+
+    auto radius = lbvh::detail::size_of(bounds).x * scalar_type(0.01);
+
+    std::vector<sphere_type> spheres;
+
+    for (size_type i = 0; i < count; i += 1024) {
+      const auto& tri = triangles[i];
+      spheres.push_back(sphere_type { (tri.pos[0] + tri.pos[1] + tri.pos[2]) * scalar_type(1.0 / 3.0), radius });
+    }
+
+    set_type set({ triangles, count }, { spheres.data(), spheres.size() });
+
+    auto references = set.template references<index_type>();
+
+    mixed_aabb_converter<scalar_type> mixed_converter;
+
+    auto mixed_bvh = builder(references.data(), references.size(), set.tagged_converter(mixed_converter));
+
+    if (!check_bvh(mixed_bvh, false)) {
+      return false;
+    }
+
+    mixed_intersector<scalar_type> intersector;
+
+    lbvh::tagged_traverser<scalar_type, lbvh::intersection<scalar_type>, primitive_type, sphere_type> mixed_traverser(mixed_bvh, references.data(), set);
+
+    traverser_type triangle_traverser(triangle_bvh, triangles);
+
+    constexpr size_type ray_count = 256;
+
+    size_type sphere_hits = 0;
+
+    auto trace_mixed = [&mixed_traverser, &intersector, &references, &sphere_hits](const ray_type& ray) {
+
+      auto isect = mixed_traverser(ray, intersector);
+
+      if (isect && (references.at(isect.primitive).type == 1)) {
+        sphere_hits++;
+      }
+
+      return isect;
+    };
+
+    auto trace_separately = [&triangle_traverser, &intersector, &spheres](const ray_type& ray) {
+
+      auto expected = triangle_traverser(ray, triangle_intersector<scalar_type>());
+
+      for (const auto& sph : spheres) {
+        auto isect = intersector(sph, ray);
+        if (isect < expected) {
+          expected = isect;
+        }
+      }
+
+      return expected;
+    };
+
+    if (!compare_traces(center, ray_count, trace_mixed, trace_separately)) {
+      return false;
+    }
+
+    std::printf("    %lu of %lu rays hit a sphere first\n", sphere_hits, ray_count);
+
+    return true;
+  }
+  //! Builds a BVH a slice at a time, as an interactive application
+  //! would between frames, and prints how many frames it took.
+  //!
+  //! \param triangles The triangles to build the BVH for.
+  //!
+  //! \param count The number of triangles.
+  //!
+  //! \param budget The build time given to each frame.
+  //!
+  //! \return The BVH that was built.
+  static bvh_type build_sliced(const primitive_type* triangles, size_type count, std::chrono::microseconds budget) {
+
+    lbvh::incremental_builder<scalar_type, primitive_type, converter_type> sliced_builder(triangles, count, converter_type());
+
+    size_type frames = 1;
+
+    while (!sliced_builder.run(budget)) {
+      frames++;
+    }
+
+    std::printf("    %lu frames of %ld us, %lu slices\n", frames, long(budget.count()), sliced_builder.slices_done());
+
+    return sliced_builder.release();
+  }
+  //! Cancels a build at the start of each phase and part of the way
+  //! through the first phase, and then builds with the same token.
+  //!
+  //! \param builder The builder to build the BVHs with.
+  //!
+  //! \param triangles The triangles of the model.
+  //!
+  //! \param count The number of triangles.
+  //!
+  //! \return True if every cancelled build stopped where it was cancelled,
+  //! and the builder and token could be used for a complete build afterwards.
+  static bool check_cancellation(builder_type& builder, const primitive_type* triangles, size_type count) {
+
+    using phase_type = lbvh::build_phase;
+
+    converter_type converter;
+
+    lbvh::build_token token;
+
+    phase_type phases[] = {
+      phase_type::centroid_bounds,
+      phase_type::morton_curve,
+      phase_type::sort,
+      phase_type::hierarchy,
+      phase_type::fit_boxes
+    };
+
+    for (auto phase : phases) {
+
+      token.reset();
+
+      cancelling_observer observer(token, phase);
+
+      auto cancelled_bvh = builder(triangles, count, converter, token, observer);
+
+      // None of the cancelled phase should be counted.
+
+      auto max_progress = double(size_type(phase)) / 5.0;
+
+      if (cancelled_bvh.size() || (token.progress() > max_progress)) {
+        std::printf("%s:%d: Build cancelled at '%s' wasn't stopped (progress %.3f).\n",
+                    __FILE__, __LINE__, lbvh::to_string(phase), token.progress());
+        return false;
+      }
+    }
+
+    token.reset();
+
+    cancelling_converter<scalar_type> midway_converter(triangles + (count / 2), token);
+
+    auto midway_bvh = builder(triangles, count, midway_converter, token);
+
+    if (midway_bvh.size() || (token.progress() >= 0.2)) {
+      std::printf("%s:%d: Build cancelled in the first phase wasn't stopped (progress %.3f).\n",
+                  __FILE__, __LINE__, token.progress());
+      return false;
+    }
+
+    std::printf("    Cancelled part way through the first phase at %.1f%% progress\n", token.progress() * 100);
+
+    token.reset();
+
+    auto bvh = builder(triangles, count, converter, token);
+
+    if ((token.progress() != 1.0) || !check_bvh(bvh, false)) {
+      std::printf("%s:%d: Build after cancellation failed (progress %.3f).\n", __FILE__, __LINE__, token.progress());
+      return false;
+    }
+
+    return true;
+  }
+  //! Checks that a lazy BVH finds the same closest hits as a regular BVH.
+  //! The rays start from the center of the model, first in a narrow cone
+  //! and then in directions spread over the unit sphere, and the number
+  //! of subtrees built after each set of rays is printed. The spread rays
+  //! are also traced through a second lazy BVH from several threads at once.
+  //!
+  //! \param builder The builder to build the BVHs with.
+  //!
+  //! \param triangles The triangles of the model.
+  //!
+  //! \param count The number of triangles.
+  //!
+  //! \return True if every ray found the same closest distance.
+  static bool check_lazy_build(builder_type& builder, const primitive_type* triangles, size_type count) {
+
+    using namespace lbvh::math;
+
+    converter_type converter;
+
+    auto triangle_bvh = builder(triangles, count, converter);
+
+    auto lazy = builder.build_lazy(triangles, count, converter);
+
+    if (lazy.built_count() != 0) {
+      std::printf("%s:%d: Subtrees were built before tracing.\n", __FILE__, __LINE__);
+      return false;
+    }
+
+    const auto& bounds = triangle_bvh.at(0).box;
+
+    auto center = (bounds.min + bounds.max) * scalar_type(0.5);
+
+    traverser_type triangle_traverser(triangle_bvh, triangles);
+
+    lbvh::lazy_traverser<scalar_type, primitive_type, converter_type> tracer(lazy);
+
+    triangle_intersector<scalar_type> intersector;
+
+    auto trace_lazy = [&tracer, &intersector](const ray_type& ray) {
+      return tracer(ray, intersector);
+    };
+
+    auto trace_whole = [&triangle_traverser, &intersector](const ray_type& ray) {
+      return triangle_traverser(ray, intersector);
+    };
+
+    constexpr size_type ray_count = 256;
+
+    for (size_type i = 0; i < ray_count; i++) {
+
+      // A grid of directions around the X axis, about ten degrees wide.
+
+      auto u = (scalar_type(i % 16) / 15) - scalar_type(0.5);
+      auto v = (scalar_type(i / 16) / 15) - scalar_type(0.5);
+
+      ray_type ray { center, { 1, u * scalar_type(0.2), v * scalar_type(0.2) } };
+
+      if (!same_distance(trace_lazy(ray), trace_whole(ray), i)) {
+        return false;
+      }
+    }
+
+    std::printf("    %lu of %lu subtrees built for a narrow view\n", lazy.built_count(), lazy.cluster_count());
+
+    if (!compare_traces(center, ray_count, trace_lazy, trace_whole)) {
+      return false;
+    }
+
+    std::printf("    %lu of %lu subtrees built for all directions\n", lazy.built_count(), lazy.cluster_count());
+
+#ifndef LBVH_NO_THREADS
+
+    // The rays are interleaved between the threads, so that
+    // neighboring rays ask for the same subtrees at the same time.
+
+    auto shared_lazy = builder.build_lazy(triangles, count, converter);
+
+    lbvh::lazy_traverser<scalar_type, primitive_type, converter_type> shared_tracer(shared_lazy);
+
+    lbvh::default_scheduler threads(4);
+
+    std::vector<unsigned char> thread_errors(threads.max_threads(), 0);
+
+    auto trace_kernel = [&](const lbvh::work_division& div) {
+      for (size_type i = div.idx; i < ray_count; i += div.max) {
+        auto ray = fibonacci_ray(center, i, ray_count);
+        if (!same_distance(shared_tracer(ray, intersector), trace_whole(ray), i)) {
+          thread_errors[div.idx] = 1;
+        }
+      }
+    };
+
+    threads(trace_kernel);
+
+    if (std::find(thread_errors.begin(), thread_errors.end(), 1) != thread_errors.end()) {
+      return false;
+    }
+
+    // Tracing the same rays again shouldn't build anything, since every
+    // subtree the threads needed was built by one of them and marked as built.
+
+    auto threaded_count = shared_lazy.built_count();
+
+    auto trace_shared = [&shared_tracer, &intersector](const ray_type& ray) {
+      return shared_tracer(ray, intersector);
+    };
+
+    if (!compare_traces(center, ray_count, trace_shared, trace_whole)) {
+      return false;
+    }
+
+    if (shared_lazy.built_count() != threaded_count) {
+      std::printf("%s:%d: Retracing built %lu more subtrees.\n", __FILE__, __LINE__, shared_lazy.built_count() - threaded_count);
+      return false;
+    }
+
+    std::printf("    %lu of %lu subtrees built from %lu threads\n", threaded_count, shared_lazy.cluster_count(), threads.max_threads());
+
+#endif // LBVH_NO_THREADS
+
+    return true;
+  }
+  //! Checks point and rectangle queries on a 2D BVH of the floor plan
+  //! against a test of every triangle. The queries are spread over a grid.
+  //!
+  //! \param plan_bvh The 2D BVH to check.
+  //!
+  //! \param triangles The triangles that the BVH was built for.
+  //!
+  //! \param count The number of triangles.
+  //!
+  //! \return True if every query found the same triangles.
+  static bool check_plan_queries(const lbvh::bvh2<scalar_type>& plan_bvh, const primitive_type* triangles, size_type count) {
+
+    using plan_box_type = lbvh::aabb2<scalar_type>;
+
+    using plan_point_type = lbvh::vec2<scalar_type>;
+
+    triangle_footprint_converter<scalar_type> converter;
+
+    auto point_tester = [&converter](const primitive_type& t, const plan_point_type& p) {
+      auto box = converter(t);
+      return (p.x >= box.min.x) && (p.x <= box.max.x) && (p.y >= box.min.y) && (p.y <= box.max.y);
+    };
+
+    auto rect_tester = [&converter](const primitive_type& t, const plan_box_type& r) {
+      auto box = converter(t);
+      return (box.min.x <= r.max.x) && (r.min.x <= box.max.x) && (box.min.y <= r.max.y) && (r.min.y <= box.max.y);
+    };
+
+    lbvh::traverser2<scalar_type, primitive_type> traverser(plan_bvh, triangles);
+
+    const auto& bounds = plan_bvh.at(0).box;
+
+    constexpr size_type grid_size = 8;
+
+    std::vector<index_type> hits;
+
+    for (size_type i = 0; i < (grid_size * grid_size); i++) {
+
+      auto u = scalar_type((i % grid_size) + 0.5) / grid_size;
+      auto v = scalar_type((i / grid_size) + 0.5) / grid_size;
+
+      plan_point_type point {
+        bounds.min.x + ((bounds.max.x - bounds.min.x) * u),
+        bounds.min.y + ((bounds.max.y - bounds.min.y) * v)
+      };
+
+      auto rect_size = (bounds.max.x - bounds.min.x) / (grid_size * 4);
+
+      plan_box_type rect { point, { point.x + rect_size, point.y + rect_size } };
+
+      hits.clear();
+
+      traverser(point, point_tester, hits);
+
+      auto point_hits = hits.size();
+
+      hits.clear();
+
+      traverser(rect, rect_tester, hits);
+
+      auto rect_hits = hits.size();
+
+      size_type expected_point_hits = 0;
+      size_type expected_rect_hits = 0;
+
+      for (size_type j = 0; j < count; j++) {
+        expected_point_hits += point_tester(triangles[j], point) ? 1 : 0;
+        expected_rect_hits += rect_tester(triangles[j], rect) ? 1 : 0;
+      }
+
+      if ((point_hits != expected_point_hits) || (rect_hits != expected_rect_hits)) {
+        std::printf("%s:%d: Query %lu found %lu and %lu triangles instead of %lu and %lu.\n",
+                    __FILE__, __LINE__, i, point_hits, rect_hits, expected_point_hits, expected_rect_hits);
+        return false;
+      }
+    }
+
+    return true;
   }
   //! \brief This function validates the BVH that was built,
   //! ensuring that all leafs get referenced once and all nodes
@@ -497,7 +2618,8 @@ protected:
   //! the function to return.
   //!
   //! \return True on success, false on failure.
-  static bool check_bvh(const bvh_type& bvh, bool errors_fatal) {
+  template <typename bvh_scalar>
+  static bool check_bvh(const lbvh::bvh<bvh_scalar>& bvh, bool errors_fatal) {
 
     int errors = 0;
 
@@ -576,7 +2698,8 @@ protected:
   //! a recursive function, this parameter is only set on recursive calls.
   //!
   //! \return True on success, false on failure.
-  static bool check_volumes(const bvh_type& bvh, bool errors_fatal, size_type index = 0) {
+  template <typename bvh_scalar>
+  static bool check_volumes(const lbvh::bvh<bvh_scalar>& bvh, bool errors_fatal, size_type index = 0) {
 
     const auto& node = bvh.at(index);
 
@@ -633,12 +2756,97 @@ protected:
   //! \brief Calculates the volume of a bounding box.
   //! This is used to compare the volume of bounding
   //! boxes, between the parent and sub nodes.
-  static scalar_type volume_of(const box_type& box) noexcept {
+  template <typename box_scalar>
+  static double volume_of(const lbvh::aabb<box_scalar>& box) noexcept {
     auto size = lbvh::detail::size_of(box);
-    return size.x * size.y * size.z;
+    return double(size.x) * double(size.y) * double(size.z);
   }
 };
 
+//! Prints a row of the phase measurement table.
+//!
+//! \param name The name of the measured region.
+//!
+//! \param seconds The number of seconds the region took.
+//!
+//! \param imbalance The ratio of the slowest to the average worker,
+//! or zero if it wasn't measured.
+//!
+//! \param idle The average number of seconds a worker was idle.
+//!
+//! \param counts The hardware event counts of the region.
+//!
+//! \param n The number of items to divide the misses by.
+void print_phase_row(const char* name,
+                     double seconds,
+                     double imbalance,
+                     double idle,
+                     const lbvh::perf_counts& counts,
+                     size_type n) {
+
+  std::printf("| %-15s | %10.06f ", name, seconds);
+
+  if (imbalance > 0) {
+    std::printf("| %9.03f | %10.06f ", imbalance, idle);
+  } else {
+    std::printf("| %9s | %10s ", "n/a", "n/a");
+  }
+
+  if (!counts.available || !n) {
+    std::printf("| %5s | %11s | %11s | %11s |\n", "n/a", "n/a", "n/a", "n/a");
+    return;
+  }
+
+  std::printf("| %5.02f | %11.04f | %11.04f | %11.04f |\n",
+              counts.ipc(),
+              double(counts.llc_misses) / double(n),
+              double(counts.branch_misses) / double(n),
+              double(counts.dtlb_misses) / double(n));
+}
+
+//! Prints the measurements of each build phase and of the render.
+//! The imbalance is the busy time of the slowest scheduler worker divided by
+//! that of the average worker. Misses are given per primitive for the build
+//! phases and per ray for the render.
+//!
+//! \param type_name The name of the scalar type the test ran with.
+//!
+//! \param results The results of the test.
+//!
+//! \param skip_rendering Whether or not rendering was skipped.
+void print_counters(const char* type_name, const test_results& results, bool skip_rendering) {
+
+  std::printf("Phase measurements for type '%s':\n", type_name);
+  std::printf("\n");
+  std::printf("| Phase           | Time       | Imbalance | Idle       | IPC   | LLC Misses  | Br. Misses  | dTLB Misses |\n");
+  std::printf("|-----------------|------------|-----------|------------|-------|-------------|-------------|-------------|\n");
+
+  for (size_type i = 0; i < lbvh::build_phase_count(); i++) {
+
+    auto phase = lbvh::build_phase(i);
+
+    const auto& entry = results.build_report[phase];
+
+    print_phase_row(lbvh::to_string(phase),
+                    entry.seconds,
+                    entry.imbalance(),
+                    entry.mean_idle,
+                    entry.counts,
+                    results.primitive_count);
+  }
+
+  if (!skip_rendering) {
+    print_phase_row("render",
+                    results.render_time,
+                    0.0,
+                    0.0,
+                    results.render_counts,
+                    image_width() * image_height());
+  }
+
+  std::printf("\n");
+}
+
 } // namespace
 
 #ifndef MODEL_PATH
@@ -654,6 +2862,22 @@ int main(int argc, char** argv) {
       options.errors_fatal = true;
     } else if (std::strcmp(argv[i], "--skip-rendering") == 0) {
       options.skip_rendering = true;
+    } else if (std::strcmp(argv[i], "--row-interleave") == 0) {
+      options.row_interleave = true;
+    } else if ((std::strcmp(argv[i], "--sah-bits") == 0) && ((i + 1) < argc)) {
+      options.sah_bits = size_type(std::strtoul(argv[++i], nullptr, 10));
+    } else if (std::strcmp(argv[i], "--sah-build") == 0) {
+      options.sah_build = true;
+    } else if ((std::strcmp(argv[i], "--optimize-passes") == 0) && ((i + 1) < argc)) {
+      options.optimize_passes = size_type(std::strtoul(argv[++i], nullptr, 10));
+    } else if (std::strcmp(argv[i], "--split-clipping") == 0) {
+      options.split_clipping = true;
+    } else if (std::strcmp(argv[i], "--cluster-leaves") == 0) {
+      options.cluster_leaves = true;
+    } else if ((std::strcmp(argv[i], "--refine-bits") == 0) && ((i + 1) < argc)) {
+      options.refine_bits = size_type(std::strtoul(argv[++i], nullptr, 10));
+    } else if ((std::strcmp(argv[i], "--frame-budget") == 0) && ((i + 1) < argc)) {
+      options.frame_budget = size_type(std::strtoul(argv[++i], nullptr, 10));
     }
   }
 
@@ -673,18 +2897,30 @@ int main(int argc, char** argv) {
 
   std::printf("Summary of test results:\n");
   std::printf("\n");
-  std::printf("| Scalar Type | Build Time | Render Time |\n");
-  std::printf("|-------------|------------|-------------|\n");
+  std::printf("| Scalar Type | Build Time | Rebuild Time | SAH Cost   | Render Time | Render Tail |\n");
+  std::printf("|-------------|------------|--------------|------------|-------------|-------------|\n");
 
   for (size_type i = 0; i < results.size(); i++) {
-    std::printf("| %s | %9.08f | %10.09f |\n",
+    std::printf("| %s | %9.08f | %11.08f | %10.03f | %10.09f | %10.09f |\n",
                 type_names[i],
                 double(results[i].build_time),
-                double(results[i].render_time));
+                double(results[i].rebuild_time),
+                double(results[i].sah_cost),
+                double(results[i].render_time),
+                double(results[i].render_tail_time));
   }
 
   std::printf("\n");
 
+  const char* scalar_names[] = {
+    "float",
+    "double"
+  };
+
+  for (size_type i = 0; i < results.size(); i++) {
+    print_counters(scalar_names[i], results[i], options.skip_rendering);
+  }
+
   for (size_type i = 1; (i < results.size()) && !options.skip_rendering; i++) {
 
     long total_diff = 0;